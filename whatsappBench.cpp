@@ -0,0 +1,827 @@
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+#include "whatsappio.h"
+#include "whatsappEventLoop.h"
+#include "whatsappFrame.h"
+#include "whatsappProtocol.h"
+#include "whatsappHistogram.h"
+
+using namespace std;
+
+
+/**
+ * The program's minimal number of arguments (the options that follow the port are optional).
+ */
+#define BENCH_NUM_OF_ARGS 3
+
+/**
+ * The indices of the server address, the port number and the first option in 'argv'.
+ */
+#define SERVER_ADDRESS_INDEX 1
+#define PORT_NUM_INDEX 2
+#define FIRST_OPTION_INDEX 3
+
+/**
+ * The exit code in case of a success.
+ */
+#define SUCCESS 0
+
+/**
+ * The exit code in case of a failure.
+ */
+#define FAILURE 1
+
+/**
+ * The base that is normally used to represent a number - used in 'strtol' function.
+ */
+#define DECIMAL_BASE 10
+
+/**
+ * The defaults of the options (see print_bench_usage).
+ */
+#define DEFAULT_NUM_OF_CLIENTS 1000
+#define DEFAULT_GROUP_SIZE 10
+#define DEFAULT_WINDOW 1
+#define DEFAULT_MESSAGE_SIZE 64
+#define DEFAULT_DURATION_SECONDS 10
+#define DEFAULT_CONNECT_WINDOW 8
+
+/**
+ * How long the requests that are in flight when the measurement ends are waited for.
+ */
+#define DRAIN_TIMEOUT_NS (5 * NS_PER_SECOND)
+
+/**
+ * How long the event loop waits for events before it checks the clock.
+ */
+#define WAIT_TIMEOUT_MS 10
+
+#define NS_PER_SECOND 1000000000ull
+#define NS_PER_US 1000.0
+
+/**
+ * The events a simulated client is watched for (see CLIENT_EVENTS of the server).
+ */
+#define BENCH_CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ * The percentiles of the latencies that are reported.
+ */
+#define P50 50.0
+#define P99 99.0
+#define P999 99.9
+
+
+/*
+ * The workloads the simulated clients run:
+ * WORKLOAD_DIRECT: every client sends messages to randomly chosen clients.
+ * WORKLOAD_GROUP: the clients are split into groups, and every client sends messages to its
+ *                 group - every message is delivered to the other members.
+ * WORKLOAD_WHO: every client polls the list of the connected clients.
+ * WORKLOAD_CHURN: every client connects, exits and reconnects, over and over.
+ */
+enum workload_type {WORKLOAD_DIRECT, WORKLOAD_GROUP, WORKLOAD_WHO, WORKLOAD_CHURN};
+
+/*
+ * The phases of a run: the clients connect, the groups are created (WORKLOAD_GROUP only),
+ * the workload is measured for the configured duration, and the requests that are still in
+ * flight are waited for.
+ */
+enum bench_phase {PHASE_CONNECT, PHASE_SETUP, PHASE_MEASURE, PHASE_DRAIN, PHASE_DONE};
+
+/*
+ * The connection of a simulated client:
+ * CLIENT_DISCONNECTED: no connection (yet, or any more).
+ * CLIENT_CONNECTING: a non-blocking connect is in progress.
+ * CLIENT_HANDSHAKING: the hello was sent, and its acknowledgement is awaited.
+ * CLIENT_READY: registered by the server.
+ */
+enum client_status {CLIENT_DISCONNECTED, CLIENT_CONNECTING, CLIENT_HANDSHAKING, CLIENT_READY};
+
+/*
+ * Description: The configuration of a run, as given by the command-line options.
+*/
+struct BenchConfig {
+	workload_type workload = WORKLOAD_DIRECT;
+	size_t numOfClients = DEFAULT_NUM_OF_CLIENTS;
+	size_t groupSize = DEFAULT_GROUP_SIZE;
+	size_t window = DEFAULT_WINDOW;             // Requests in flight per client.
+	size_t messageSize = DEFAULT_MESSAGE_SIZE;
+	size_t durationSeconds = DEFAULT_DURATION_SECONDS;
+	size_t connectWindow = DEFAULT_CONNECT_WINDOW;  // Connections being set up at once.
+	size_t whoLimit = 0;                        // The names a "who" lists (0 lists all).
+	string statsSocketPath;                     // The server's metrics socket (none if empty).
+};
+
+/*
+ * Description: The counters of the server that its cost per request is measured by, as read
+ *              from its metrics socket (see --stats-socket).
+*/
+struct ServerCosts {
+	double cpuSeconds = 0;          // User and system.
+	double loopTurns = 0;
+	double readCalls = 0;
+	double writeCalls = 0;
+};
+
+/*
+ * Description: A request that was sent and was not answered yet.
+*/
+struct InFlightRequest {
+	uint64_t requestId;
+	uint64_t sentNs;
+};
+
+/*
+ * Description: A simulated client: a non-blocking connection that speaks protocol v2.
+*/
+struct SimulatedClient {
+	int fd = -1;
+	client_status status = CLIENT_DISCONNECTED;
+	size_t generation = 0;          // The number of times it has reconnected (churn).
+	FrameReader reader{PROTOCOL_V2};
+	string outgoing;                // Requests that were not written to the server yet.
+	size_t outgoingOffset = 0;
+	uint64_t nextRequestId = 1;
+	deque<InFlightRequest> inFlight;    // The server answers a client's requests in order.
+	uint64_t connectStartNs = 0;
+};
+
+
+// Global Variables:
+BenchConfig config;
+struct sockaddr_in serverAddress;
+string namePrefix;                  // Unique to this run, so runs do not collide.
+vector<SimulatedClient> clients;
+vector<size_t> clientOfFD;          // Maps the file descriptors to indices of 'clients'.
+deque<size_t> connectQueue;         // The clients that are waiting to connect.
+size_t numOfConnecting = 0;         // Clients that are connecting or handshaking.
+size_t numOfReady = 0;
+size_t numOfConnectFailures = 0;
+size_t numOfGroups = 0;
+EventLoop eventLoop;
+mt19937_64 randomGenerator;
+bench_phase phase = PHASE_CONNECT;
+uint64_t measureStartNs = 0;
+uint64_t measureEndNs = 0;
+
+// Measurements, taken while the workload is measured:
+LatencyHistogram latencies;         // Of deliveries, "who" replies, or connections (churn).
+uint64_t numOfCompletedRequests = 0;
+uint64_t numOfFailedRequests = 0;
+uint64_t numOfDeliveries = 0;
+ServerCosts serverCostsBefore;      // When the measurement started (with --stats-socket).
+ServerCosts serverCostsAfter;       // Once the requests of the measurement were answered.
+
+
+
+uint64_t nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
+
+void print_bench_usage() {
+	printf("Usage: whatsappBench serverAddress serverPort [--workload=direct|group|who|churn] "
+	       "[--clients=N] [--group-size=N] [--window=N] [--message-size=BYTES] "
+	       "[--duration=SECONDS] [--connect-window=N] [--who-limit=N] [--stats-socket=PATH]\n");
+}
+
+string clientName(size_t index) {
+	string name = namePrefix + "c" + to_string(index);
+	if (clients[index].generation > 0) {
+		name += "r" + to_string(clients[index].generation);
+	}
+	return name;
+}
+
+string groupName(size_t group) {
+	return namePrefix + "g" + to_string(group);
+}
+
+/*
+ * Description: Returns the index of the group of a client (WORKLOAD_GROUP), which is
+ *              numOfGroups for the clients that are left out of the groups.
+*/
+size_t groupOf(size_t index) {
+	return min(index / config.groupSize, numOfGroups);
+}
+
+/*
+ * Description: Writes as much of a client's buffered requests as its socket accepts.
+ * Returns false iff the connection has failed.
+*/
+bool flushClient(SimulatedClient& client) {
+	while (client.outgoingOffset < client.outgoing.size()) {
+		ssize_t bytesWritten = write(client.fd, client.outgoing.data() + client.outgoingOffset,
+		                             client.outgoing.size() - client.outgoingOffset);
+		if (bytesWritten > 0) {
+			client.outgoingOffset += (size_t) bytesWritten;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;    // the rest is written once the socket is writable again.
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	client.outgoing.clear();
+	client.outgoingOffset = 0;
+	return true;
+}
+
+void disconnectClient(size_t index) {
+	SimulatedClient& client = clients[index];
+	if (client.status == CLIENT_CONNECTING || client.status == CLIENT_HANDSHAKING) {
+		numOfConnecting--;
+	} else if (client.status == CLIENT_READY) {
+		numOfReady--;
+	}
+	eventLoop.remove(client.fd);
+	close(client.fd);
+	client.fd = -1;
+	client.status = CLIENT_DISCONNECTED;
+	client.reader = FrameReader(PROTOCOL_V2);
+	client.outgoing.clear();
+	client.outgoingOffset = 0;
+	client.inFlight.clear();
+}
+
+/*
+ * Description: Starts a non-blocking connect of a client to the server.
+*/
+void startConnect(size_t index) {
+	SimulatedClient& client = clients[index];
+	client.connectStartNs = nowNs();
+	client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (client.fd < 0) {
+		print_error("socket", errno);
+		numOfConnectFailures++;
+		return;
+	}
+	int isEnabled = 1;
+	setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &isEnabled, sizeof(isEnabled));
+	if ((connect(client.fd, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) < 0 &&
+	     errno != EINPROGRESS) || eventLoop.add(client.fd, BENCH_CLIENT_EVENTS) < 0) {
+		print_error("connect", errno);
+		close(client.fd);
+		client.fd = -1;
+		numOfConnectFailures++;
+		return;
+	}
+	if ((size_t) client.fd >= clientOfFD.size()) {
+		clientOfFD.resize((size_t) client.fd + 1);
+	}
+	clientOfFD[(size_t) client.fd] = index;
+	client.status = CLIENT_CONNECTING;
+	numOfConnecting++;
+}
+
+/*
+ * Description: Starts connecting the clients that wait to connect, as long as fewer than
+ *              connectWindow connections are being set up - the server's listen queue is
+ *              short, and a connection it drops is only retried after a second.
+*/
+void startConnects() {
+	while (numOfConnecting < config.connectWindow && !connectQueue.empty()) {
+		size_t index = connectQueue.front();
+		connectQueue.pop_front();
+		startConnect(index);
+	}
+}
+
+/*
+ * Description: Sends the hello of a client whose connect has completed.
+*/
+void sendHello(size_t index) {
+	SimulatedClient& client = clients[index];
+	int error = 0;
+	socklen_t errorLength = sizeof(error);
+	if (getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0) {
+		disconnectClient(index);
+		numOfConnectFailures++;
+		return;
+	}
+	FrameRef hello = encodeHello(clientName(index), client.nextRequestId++);
+	client.outgoing.push_back(WA_V2_PREFACE);
+	client.outgoing.append(hello->data(), hello->size());
+	client.status = CLIENT_HANDSHAKING;
+	if (!flushClient(client)) {
+		disconnectClient(index);
+		numOfConnectFailures++;
+	}
+}
+
+/*
+ * Description: Queues a request of a client, to be written by flushClient.
+*/
+void queueRequest(SimulatedClient& client, const CommandView& command) {
+	uint64_t requestId = client.nextRequestId++;
+	FrameRef request = encodeRequest(command, requestId);
+	client.outgoing.append(request->data(), request->size());
+	if (command.type != EXIT) {     // the server does not reply to "exit".
+		client.inFlight.push_back({requestId, nowNs()});
+	}
+}
+
+/*
+ * Description: Exits a client: it is unregistered by the server, so it leaves nothing behind.
+*/
+void exitClient(size_t index) {
+	CommandView command = {};
+	command.type = EXIT;
+	queueRequest(clients[index], command);
+	flushClient(clients[index]);
+	disconnectClient(index);
+}
+
+/*
+ * Description: Sends the requests of the workload of a client, until it has 'window' of them
+ *              in flight. A message starts with the time it was sent, which its recipients
+ *              subtract from the time it arrived.
+*/
+void sendRequests(size_t index) {
+	SimulatedClient& client = clients[index];
+	if (phase != PHASE_MEASURE || client.status != CLIENT_READY ||
+	    (config.workload == WORKLOAD_GROUP && groupOf(index) == numOfGroups)) {
+		return;
+	}
+	while (client.inFlight.size() < config.window) {
+		CommandView command = {};
+		string target;
+		string message;
+		if (config.workload == WORKLOAD_WHO) {
+			command.type = WHO;
+			command.limit = config.whoLimit;
+			command.offset = 0;
+		} else {
+			if (config.workload == WORKLOAD_GROUP) {
+				target = groupName(groupOf(index));
+			} else {
+				// Any client but itself.
+				size_t recipient = randomGenerator() % (config.numOfClients - 1);
+				target = clientName(recipient >= index ? recipient + 1 : recipient);
+			}
+			message = to_string(nowNs()) + " ";
+			message.resize(max(message.size(), config.messageSize), 'x');
+			command.type = SEND;
+			command.name = target;
+			command.message = message;
+		}
+		queueRequest(client, command);
+	}
+	if (!flushClient(client)) {
+		disconnectClient(index);
+	}
+}
+
+/*
+ * Description: Handles the acknowledgement of a client's hello.
+*/
+void handleHelloReply(size_t index, const ServerMessage& reply) {
+	SimulatedClient& client = clients[index];
+	if (reply.opcode != OP_ACK || reply.status != STATUS_SUCCESS) {
+		disconnectClient(index);
+		numOfConnectFailures++;
+		return;
+	}
+	client.status = CLIENT_READY;
+	numOfConnecting--;
+	numOfReady++;
+	if (config.workload == WORKLOAD_CHURN && phase == PHASE_MEASURE) {
+		latencies.record(nowNs() - client.connectStartNs);
+		numOfCompletedRequests++;
+		// The next connection is under a new name, so it never races the exit of this one.
+		exitClient(index);
+		client.generation++;
+		connectQueue.push_back(index);
+	}
+}
+
+/*
+ * Description: Handles a frame the server has sent to a client.
+ * Returns false iff the server has shut down.
+*/
+bool handleFrame(size_t index, string_view frame) {
+	SimulatedClient& client = clients[index];
+	ServerMessage message;
+	if (!decodeServerMessage(frame, message)) {
+		return true;
+	}
+	if (message.opcode == OP_SERVER_EXIT) {
+		return false;
+	}
+	if (message.opcode == OP_DELIVER) {
+		uint64_t sentNs = strtoull(string(message.message.substr(0, message.message.find(' '))).c_str(),
+		                           nullptr, DECIMAL_BASE);
+		if (sentNs >= measureStartNs && phase >= PHASE_MEASURE) {
+			latencies.record(nowNs() - sentNs);
+			// The throughput counts only what arrived while it was measured.
+			numOfDeliveries += phase == PHASE_MEASURE;
+		}
+		return true;
+	}
+	if (client.status == CLIENT_HANDSHAKING) {
+		handleHelloReply(index, message);
+		return true;
+	}
+	if (client.inFlight.empty() || client.inFlight.front().requestId != message.requestId) {
+		return true;
+	}
+	InFlightRequest request = client.inFlight.front();
+	client.inFlight.pop_front();
+	bool isSuccess = message.opcode == OP_WHO_REPLY ||
+	                 (message.opcode == OP_ACK && message.status == STATUS_SUCCESS);
+	if (phase == PHASE_MEASURE || phase == PHASE_DRAIN) {
+		if (!isSuccess) {
+			numOfFailedRequests++;
+		} else if (request.sentNs >= measureStartNs) {
+			numOfCompletedRequests += phase == PHASE_MEASURE;
+			if (message.opcode == OP_WHO_REPLY) {
+				latencies.record(nowNs() - request.sentNs);
+			}
+		}
+	} else if (!isSuccess) {
+		numOfFailedRequests++;      // the creation of a group.
+	}
+	sendRequests(index);
+	return true;
+}
+
+/*
+ * Description: Handles the events of a client's socket.
+ * Returns false iff the server has shut down.
+*/
+bool handleClientEvent(size_t index, uint32_t events) {
+	SimulatedClient& client = clients[index];
+	if (client.status == CLIENT_CONNECTING) {
+		if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) {
+			return true;
+		}
+		sendHello(index);
+		if (client.status != CLIENT_HANDSHAKING) {
+			return true;
+		}
+	} else if ((events & EPOLLOUT) && !flushClient(client)) {
+		disconnectClient(index);
+		return true;
+	}
+	receive_status status = RECEIVE_BUFFER_FULL;
+	while (client.status != CLIENT_DISCONNECTED && status == RECEIVE_BUFFER_FULL) {
+		status = client.reader.readFrom(client.fd);
+		string_view frame;
+		while (client.status != CLIENT_DISCONNECTED && client.reader.nextFrame(frame)) {
+			if (!handleFrame(index, frame)) {
+				return false;
+			}
+		}
+		if (client.status != CLIENT_DISCONNECTED &&
+		    (status == RECEIVE_CLOSED || client.reader.isCorrupted())) {
+			if (client.status != CLIENT_READY) {
+				numOfConnectFailures++;
+			}
+			disconnectClient(index);
+		}
+	}
+	return true;
+}
+
+/*
+ * Description: Runs the event loop until the current phase is over.
+ * isPhaseOver: tells (given the current time) whether the phase is over.
+ * Returns false iff the server has shut down, or the event loop failed.
+*/
+template <typename Predicate>
+bool runUntil(Predicate isPhaseOver) {
+	while (!isPhaseOver(nowNs())) {
+		startConnects();
+		int numOfReadyEvents = eventLoop.wait(WAIT_TIMEOUT_MS);
+		if (numOfReadyEvents < 0 && errno != EINTR) {
+			print_error("epoll_wait", errno);
+			return false;
+		}
+		for (int i = 0; i < numOfReadyEvents; i++) {
+			const struct epoll_event& event = eventLoop.event(i);
+			if (!handleClientEvent(clientOfFD[(size_t) event.data.fd], event.events)) {
+				printf("The server has shut down.\n");
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+size_t numOfRequestsInFlight() {
+	size_t inFlight = 0;
+	for (const SimulatedClient &client : clients) {
+		inFlight += client.inFlight.size();
+	}
+	return inFlight;
+}
+
+/*
+ * Description: Creates the groups of WORKLOAD_GROUP: the first client of every group creates
+ *              it with the rest of the group.
+ * Returns false iff a group could not be created.
+*/
+bool createGroups() {
+	for (size_t group = 0; group < numOfGroups; group++) {
+		size_t creator = group * config.groupSize;
+		vector<string> members;
+		CommandView command = {};
+		command.type = CREATE_GROUP;
+		string name = groupName(group);
+		command.name = name;
+		for (size_t member = creator + 1; member < creator + config.groupSize; member++) {
+			members.push_back(clientName(member));
+		}
+		command.numOfClients = members.size();
+		for (size_t i = 0; i < members.size(); i++) {
+			command.clients[i] = members[i];
+		}
+		queueRequest(clients[creator], command);
+		flushClient(clients[creator]);
+	}
+	return runUntil([](uint64_t) { return numOfRequestsInFlight() == 0; }) &&
+	       numOfFailedRequests == 0;
+}
+
+/*
+ * Description: Parses a single "--name=value" option whose value is a non-negative number.
+ * Returns false iff the option is not the given one or its value is not a number.
+*/
+bool parseNumericOption(const string& option, const string& name, size_t& value) {
+	string prefix = "--" + name + "=";
+	if (option.compare(0, prefix.size(), prefix) != 0 || option.size() == prefix.size()) {
+		return false;
+	}
+	char* end;
+	unsigned long long parsed = strtoull(option.c_str() + prefix.size(), &end, DECIMAL_BASE);
+	if (*end != '\0') {
+		return false;
+	}
+	value = (size_t) parsed;
+	return true;
+}
+
+/*
+ * Description: Parses a single "--name=value" option whose value is a non-empty string.
+ * Returns false iff the option is not the given one or its value is empty.
+*/
+bool parseStringOption(const string& option, const string& name, string& value) {
+	string prefix = "--" + name + "=";
+	if (option.compare(0, prefix.size(), prefix) != 0 || option.size() == prefix.size()) {
+		return false;
+	}
+	value = option.substr(prefix.size());
+	return true;
+}
+
+bool parseWorkloadOption(const string& option, workload_type& workload) {
+	const char* names[] = {"direct", "group", "who", "churn"};
+	const workload_type workloads[] = {WORKLOAD_DIRECT, WORKLOAD_GROUP, WORKLOAD_WHO,
+	                                   WORKLOAD_CHURN};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (option == string("--workload=") + names[i]) {
+			workload = workloads[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Description: Parses the options that follow the server's address and port.
+ * Returns false iff an option is unknown or invalid.
+*/
+bool parseBenchOptions(int argc, char *argv[]) {
+	for (int i = FIRST_OPTION_INDEX; i < argc; i++) {
+		string option = argv[i];
+		if (!parseWorkloadOption(option, config.workload) &&
+		    !parseNumericOption(option, "clients", config.numOfClients) &&
+		    !parseNumericOption(option, "group-size", config.groupSize) &&
+		    !parseNumericOption(option, "window", config.window) &&
+		    !parseNumericOption(option, "message-size", config.messageSize) &&
+		    !parseNumericOption(option, "duration", config.durationSeconds) &&
+		    !parseNumericOption(option, "connect-window", config.connectWindow) &&
+		    !parseNumericOption(option, "who-limit", config.whoLimit) &&
+		    !parseStringOption(option, "stats-socket", config.statsSocketPath)) {
+			return false;
+		}
+	}
+	return config.numOfClients >= 2 && config.window > 0 && config.connectWindow > 0 &&
+	       config.durationSeconds > 0 && config.groupSize >= 2 &&
+	       config.groupSize <= WA_MAX_GROUP + 1 && config.numOfClients >= config.groupSize;
+}
+
+/*
+ * Description: Raises the limit of open file-descriptors as far as allowed, since every
+ *              simulated client takes one.
+*/
+void raiseFileDescriptorsLimit() {
+	struct rlimit limit = {0};
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/*
+ * Description: Reads the server's costs from its metrics socket (a blocking read of a small
+ *              snapshot, done outside of the measured work).
+ * Returns false iff the metrics could not be read.
+*/
+bool readServerCosts(ServerCosts& costs) {
+	struct sockaddr_un statsAddress = {0};
+	if (config.statsSocketPath.size() >= sizeof(statsAddress.sun_path)) {
+		print_error("connect", ENAMETOOLONG);
+		return false;
+	}
+	statsAddress.sun_family = AF_UNIX;
+	memcpy(statsAddress.sun_path, config.statsSocketPath.c_str(),
+	       config.statsSocketPath.size() + 1);
+	int statsFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (statsFD < 0 || connect(statsFD, (struct sockaddr*) &statsAddress,
+	                           sizeof(statsAddress)) < 0) {
+		print_error("connect", errno);
+		if (statsFD >= 0) {
+			close(statsFD);
+		}
+		return false;
+	}
+	string exposition;
+	char chunk[4096];
+	ssize_t bytesRead;
+	while ((bytesRead = read(statsFD, chunk, sizeof(chunk))) > 0) {
+		exposition.append(chunk, (size_t) bytesRead);
+	}
+	close(statsFD);
+
+	costs = ServerCosts();
+	size_t lineStart = 0;
+	while (lineStart < exposition.size()) {
+		size_t lineEnd = exposition.find('\n', lineStart);
+		if (lineEnd == string::npos) {
+			lineEnd = exposition.size();
+		}
+		string line = exposition.substr(lineStart, lineEnd - lineStart);
+		size_t separator = line.rfind(' ');
+		if (separator != string::npos) {
+			string name = line.substr(0, separator);
+			double value = strtod(line.c_str() + separator + 1, nullptr);
+			if (name.compare(0, strlen("whatsapp_cpu_seconds_total"),
+			                 "whatsapp_cpu_seconds_total") == 0) {
+				costs.cpuSeconds += value;
+			} else if (name == "whatsapp_loop_turns_total") {
+				costs.loopTurns = value;
+			} else if (name == "whatsapp_read_calls_total") {
+				costs.readCalls = value;
+			} else if (name == "whatsapp_write_calls_total") {
+				costs.writeCalls = value;
+			}
+		}
+		lineStart = lineEnd + 1;
+	}
+	return true;
+}
+
+void printReport(uint64_t connectNs) {
+	const char* workloadNames[] = {"direct", "group", "who", "churn"};
+	const char* latencyNames[] = {"delivery", "delivery", "round trip", "connect"};
+	double seconds = (double) (measureEndNs - measureStartNs) / NS_PER_SECOND;
+	printf("workload: %s, clients: %zu", workloadNames[config.workload], config.numOfClients);
+	if (config.workload == WORKLOAD_GROUP) {
+		printf(", groups: %zu of %zu", numOfGroups, config.groupSize);
+	}
+	printf(", window: %zu, message: %zu bytes, duration: %.1f s\n", config.window,
+	       config.messageSize, seconds);
+	printf("connected in: %.3f s\n", (double) connectNs / NS_PER_SECOND);
+	const char* completedName = config.workload == WORKLOAD_CHURN ? "connections" : "requests";
+	printf("%s: %" PRIu64 " (%.1f/s), failed: %" PRIu64 "\n", completedName,
+	       numOfCompletedRequests, (double) numOfCompletedRequests / seconds, numOfFailedRequests);
+	if (config.workload == WORKLOAD_DIRECT || config.workload == WORKLOAD_GROUP) {
+		printf("deliveries: %" PRIu64 " (%.1f/s)\n", numOfDeliveries,
+		       (double) numOfDeliveries / seconds);
+	}
+	printf("%s latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f\n",
+	       latencyNames[config.workload], (double) latencies.percentile(P50) / NS_PER_US,
+	       (double) latencies.percentile(P99) / NS_PER_US,
+	       (double) latencies.percentile(P999) / NS_PER_US,
+	       (double) latencies.max() / NS_PER_US, latencies.mean() / NS_PER_US);
+	if (!config.statsSocketPath.empty() && numOfCompletedRequests > 0) {
+		// The read and write calls do not include those io_uring makes on the server's behalf.
+		auto perRequest = [](double before, double after) {
+			return (after - before) / (double) numOfCompletedRequests;
+		};
+		double loopTurns = perRequest(serverCostsBefore.loopTurns, serverCostsAfter.loopTurns);
+		double readCalls = perRequest(serverCostsBefore.readCalls, serverCostsAfter.readCalls);
+		double writeCalls = perRequest(serverCostsBefore.writeCalls, serverCostsAfter.writeCalls);
+		printf("server per %s: %.2f us cpu, %.2f system calls (%.2f loop turns, %.2f reads, "
+		       "%.2f writes)\n", config.workload == WORKLOAD_CHURN ? "connection" : "request",
+		       perRequest(serverCostsBefore.cpuSeconds, serverCostsAfter.cpuSeconds) * 1e6,
+		       loopTurns + readCalls + writeCalls, loopTurns, readCalls, writeCalls);
+	}
+}
+
+
+int main(int argc, char *argv[]) {
+	if (argc < BENCH_NUM_OF_ARGS || !parseBenchOptions(argc, argv)) {
+		print_bench_usage();
+		return FAILURE;
+	}
+	struct hostent *hostEntry = gethostbyname(argv[SERVER_ADDRESS_INDEX]);
+	if (hostEntry == nullptr) {
+		print_error("gethostbyname", h_errno);
+		return FAILURE;
+	}
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	memcpy(&serverAddress.sin_addr, hostEntry->h_addr, (unsigned short) hostEntry->h_length);
+	serverAddress.sin_family = (unsigned short) hostEntry->h_addrtype;
+	serverAddress.sin_port = htons((unsigned short) strtol(argv[PORT_NUM_INDEX], nullptr,
+	                                                       DECIMAL_BASE));
+	if (!eventLoop.isValid()) {
+		print_error("epoll_create1", errno);
+		return FAILURE;
+	}
+	raiseFileDescriptorsLimit();
+	namePrefix = "b" + to_string(getpid());
+	if (config.workload == WORKLOAD_GROUP) {
+		numOfGroups = config.numOfClients / config.groupSize;
+	}
+
+	// All the clients connect before anything is measured.
+	clients.resize(config.numOfClients);
+	for (size_t i = 0; i < clients.size(); i++) {
+		connectQueue.push_back(i);
+	}
+	uint64_t connectStartNs = nowNs();
+	if (!runUntil([](uint64_t) {
+		return numOfReady + numOfConnectFailures == config.numOfClients;
+	})) {
+		return FAILURE;
+	}
+	uint64_t connectNs = nowNs() - connectStartNs;
+	if (numOfConnectFailures > 0) {
+		printf("%zu of the clients could not connect.\n", numOfConnectFailures);
+		return FAILURE;
+	}
+	phase = PHASE_SETUP;
+	if (config.workload == WORKLOAD_GROUP && !createGroups()) {
+		printf("The groups could not be created.\n");
+		return FAILURE;
+	}
+
+	if (!config.statsSocketPath.empty() && !readServerCosts(serverCostsBefore)) {
+		return FAILURE;
+	}
+	phase = PHASE_MEASURE;
+	measureStartNs = nowNs();
+	uint64_t deadlineNs = measureStartNs + config.durationSeconds * NS_PER_SECOND;
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (config.workload == WORKLOAD_CHURN) {
+			exitClient(i);
+			clients[i].generation++;
+			connectQueue.push_back(i);
+		} else {
+			sendRequests(i);
+		}
+	}
+	if (!runUntil([deadlineNs](uint64_t now) { return now >= deadlineNs; })) {
+		return FAILURE;
+	}
+	measureEndNs = nowNs();
+
+	// No new requests are sent; the answers to those in flight still count.
+	phase = PHASE_DRAIN;
+	connectQueue.clear();
+	uint64_t drainDeadlineNs = measureEndNs + DRAIN_TIMEOUT_NS;
+	if (!runUntil([drainDeadlineNs](uint64_t now) {
+		return now >= drainDeadlineNs || (numOfRequestsInFlight() == 0 && numOfConnecting == 0);
+	})) {
+		return FAILURE;
+	}
+	if (!config.statsSocketPath.empty() && !readServerCosts(serverCostsAfter)) {
+		return FAILURE;
+	}
+	phase = PHASE_DONE;
+	for (size_t i = 0; i < clients.size(); i++) {
+		if (clients[i].status == CLIENT_READY) {
+			exitClient(i);
+		} else if (clients[i].status != CLIENT_DISCONNECTED) {
+			disconnectClient(i);
+		}
+	}
+	printReport(connectNs);
+	return SUCCESS;
+}
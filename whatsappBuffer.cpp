@@ -0,0 +1,46 @@
+#include "whatsappBuffer.h"
+
+
+BufferPool::~BufferPool() {
+	for (std::vector<char*> &buffers : idleBuffers) {
+		for (char* buffer : buffers) {
+			delete[] buffer;
+		}
+	}
+}
+
+char* BufferPool::acquire(size_t minimumSize, size_t& capacity) {
+	capacity = MIN_POOLED_BUFFER_SIZE;
+	for (int sizeIndex = 0; sizeIndex < NUM_OF_BUFFER_SIZES; sizeIndex++) {
+		if (capacity >= minimumSize) {
+			if (idleBuffers[sizeIndex].empty()) {
+				return new char[capacity];
+			}
+			char* buffer = idleBuffers[sizeIndex].back();
+			idleBuffers[sizeIndex].pop_back();
+			return buffer;
+		}
+		capacity *= 2;
+	}
+	return nullptr;
+}
+
+void BufferPool::release(char* buffer, size_t capacity) {
+	size_t sizeOfIndex = MIN_POOLED_BUFFER_SIZE;
+	for (int sizeIndex = 0; sizeIndex < NUM_OF_BUFFER_SIZES; sizeIndex++) {
+		if (sizeOfIndex == capacity) {
+			if (idleBuffers[sizeIndex].size() < MAX_IDLE_BUFFERS_PER_SIZE) {
+				idleBuffers[sizeIndex].push_back(buffer);
+				return;
+			}
+			break;
+		}
+		sizeOfIndex *= 2;
+	}
+	delete[] buffer;
+}
+
+BufferPool& BufferPool::local() {
+	static thread_local BufferPool pool;
+	return pool;
+}
@@ -0,0 +1,65 @@
+#ifndef _WHATSAPPBUFFER_H
+#define _WHATSAPPBUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * The size of the smallest pooled buffer - large enough for any text frame, and for the
+ * frames of a v2 client under normal load.
+ */
+#define MIN_POOLED_BUFFER_SIZE 16384
+
+/**
+ * The number of buffer sizes that are pooled: MIN_POOLED_BUFFER_SIZE, twice that, and so on.
+ * The largest (2MB) fits the largest v2 frame.
+ */
+#define NUM_OF_BUFFER_SIZES 8
+
+/**
+ * The size of the largest pooled buffer.
+ */
+#define MAX_POOLED_BUFFER_SIZE (MIN_POOLED_BUFFER_SIZE << (NUM_OF_BUFFER_SIZES - 1))
+
+/**
+ * The maximal number of idle buffers kept of every size - the rest are freed.
+ */
+#define MAX_IDLE_BUFFERS_PER_SIZE 1024
+
+/*
+ * Description: A pool of reusable buffers of power-of-two sizes. A buffer that is released
+ *              is kept for the next 'acquire' of that size, so in the steady state acquiring a
+ *              buffer involves no heap allocation. The pool is not thread-safe - every thread
+ *              uses its own pool (see 'local').
+*/
+class BufferPool {
+public:
+	BufferPool() = default;
+	~BufferPool();
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/*
+	 * Description: Returns a buffer of at least the given size.
+	 * minimumSize: the minimal size of the buffer (up to the largest pooled size).
+	 * capacity: output - the actual size of the buffer, to be passed back to 'release'.
+	 * Returns nullptr if the requested size is larger than the largest pooled size.
+	*/
+	char* acquire(size_t minimumSize, size_t& capacity);
+
+	/*
+	 * Description: Returns a buffer, acquired from this pool, to the pool.
+	*/
+	void release(char* buffer, size_t capacity);
+
+	/*
+	 * Description: Returns the pool of the calling thread.
+	*/
+	static BufferPool& local();
+
+private:
+	std::vector<char*> idleBuffers[NUM_OF_BUFFER_SIZES];
+};
+
+#endif
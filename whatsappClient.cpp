@@ -1,317 +1,563 @@
-#include <netdb.h>
-#include <unistd.h>
-#include <iostream>
-#include "whatsappio.h"
-
-using namespace std;
-
-
-/**
- * The program's valid number of arguments.
- */
-#define CLIENT_NUM_OF_ARGS 4
-
-/**
- * The exit code in case of a success.
- */
-#define SUCCESS 0
-
-/**
- * The exit code in case of a failure.
- */
-#define FAILURE 1
-
-/**
- * The index of the client name in 'argv'.
- */
-#define CLIENT_NAME_INDEX 1
-
-/**
- * The index of the server address in 'argv'.
- */
-#define SERVER_ADDRESS_INDEX 2
-
-/**
- * The index of the port number in 'argv'.
- */
-#define PORT_NUM_INDEX 3
-
-/**
- * The base that is normally used to represent a number - used in 'strtol' function.
- */
-#define DECIMAL_BASE 10
-
-/**
- * When this constant is used as the third argument of socket, the default protocol
- * will be chosen - which in our case will be TCP, since we use SOCK_STREAM.
- */
-#define DEFAULT_PROTOCOL 0
-
-/**
- * The string that is sent to a client who tries to connect
- * with a name that is already in use in the server.
- */
-#define DUP_CONNECTION "dupConnection"
-
-/**
- * The create group message that is sent from a client to the server - which in turn
- * should create a group with the groupName and clientName sent by the client, in case
- * the group creation request is valid.
- */
-#define CREATE_GROUP_MSG "create_group"
-
-/**
- * The send message that is sent from a client to the server - which in turn
- * should send the message the to given client or group.
- */
-#define SEND_MSG "send"
-
-/**
- * The who message that is sent from a client to the server - which in turn
- * should send back to the client a list of currently connected client name
- * (alphabetically order), seperated by comma without spaces.
- */
-#define WHO_MSG "who"
-
-/**
- * The exit message that is sent from a client to the server - which in turn
- * should unregister the client from the server.
- */
-#define EXIT_MSG "exit"
-
-/**
- * The exit message that is sent from the server to a client - which informs
- * the client it should exit (with exit code 1 (FAILURE) ).
- */
-#define SERVER_EXIT "serverEXIT"
-
-
-// Global Variables:
-string clientName;
-int communicationSocketFD;
-
-
-
-void freeResources() {
-	close(communicationSocketFD);
-}
-
-bool nameIsAlphaNumeric(const string& name) {
-	for (const char &ch : name) {
-		if (! ((bool) isalnum(ch))) {
-			return false;
-		}
-	}
-	return true;
-}
-
-bool sendClientNameToServer(string &clientName) {
-	bool toExit = false;
-	writeData(communicationSocketFD, clientName);
-	string serverResponse = readData(communicationSocketFD);
-	if (serverResponse == DUP_CONNECTION) {
-		print_dup_connection();
-		freeResources();
-		toExit = true;
-	} else {
-		print_connection();
-	}
-	return toExit;
-}
-
-/*
- * Description: Checks that clients contains at least one name other than us (this client).
- * Also, checks that groupName and all client names in clients are alphanumeric.
-*/
-bool isGroupValid(string& groupName, vector<string>& clients) {
-	if (!nameIsAlphaNumeric(groupName)) {
-        return false;
-    }
-    if (clients.empty()) {
-		return false;
-	}
-	bool isValid = false;
-	for (const string &client : clients) {
-		if (!nameIsAlphaNumeric(client)) {
-			return false;
-		}
-        if (client == groupName) {
-            return false;
-        }
-		if (client != clientName) {
-			isValid = true;
-		}
-	}
-	return isValid;
-}
-
-void createGroupCommand(string& groupName, vector<string>& clients) {
-	if (!isGroupValid(groupName, clients)) {
-		print_create_group(false, false, clientName, groupName);
-		return;
-	}
-	string messageToServer(CREATE_GROUP_MSG);
-	messageToServer += (" " + groupName + " ");
-	for (const string& clientName : clients) {
-		messageToServer += (clientName + ",");
-	}
-	messageToServer.pop_back();     // deletes last redundant comma.
-	writeData(communicationSocketFD, messageToServer);
-	string serverResponse = readData(communicationSocketFD);
-	print_create_group(false, serverResponse == (to_string(SUCCESS)), clientName, groupName);
-}
-
-void sendCommand(string& name, string& message) {
-	if ((!nameIsAlphaNumeric(name)) || (name == clientName)) {
-		print_send(false, true, false, clientName, name, message);
-		return;
-	}
-	string messageToServer(SEND_MSG);
-	messageToServer += (" " + name + " " + message);
-	writeData(communicationSocketFD, messageToServer);
-	string serverResponse = readData(communicationSocketFD);
-	print_send(false, true, serverResponse == (to_string(SUCCESS)), clientName, name, message);
-}
-
-void whoCommand() {
-	string messageToServer = WHO_MSG;
-	writeData(communicationSocketFD, messageToServer);
-	string connectedClients = readData(communicationSocketFD);
-	print_who_client(connectedClients);
-}
-
-bool exitCommand() {
-	string messageToServer = EXIT_MSG;
-	writeData(communicationSocketFD, messageToServer);
-	freeResources();
-	print_exit(false, clientName);
-	return true;
-}
-
-bool sendCommandsToServer() {
-	bool toExit = false;
-	string clientInput, name, message;
-	command_type commandType;
-	vector<string> clients;
-	clients.clear();
-
-	getline(cin, clientInput);
-    if (clientInput.empty()) {
-        return toExit;
-    }
-	parse_command(clientInput, commandType, name, message, clients);
-	if (commandType == CREATE_GROUP) {
-		createGroupCommand(name, clients);
-	} else if (commandType == SEND) {
-		sendCommand(name, message);
-	} else if (commandType == WHO) {
-		whoCommand();
-	} else if (commandType == EXIT) {
-		toExit = exitCommand();
-	} else if (commandType == INVALID) {
-		print_invalid_input();
-	}
-	return toExit;
-}
-
-bool handleInputFromServer() {
-	bool toExit = false;
-	string serverMessage = readData(communicationSocketFD);
-	if (serverMessage == SERVER_EXIT) {
-		freeResources();
-		toExit = true;
-	} else {    // it means a message was sent from another client through the server.
-		string senderClientName, message;
-		command_type commandType;
-		vector<string> clients;
-		clients.clear();
-		// According to the communication protocol between the server and the client,
-		// the commandType is necessarily "send", when 'name' is the name of the
-		// message sender, and 'message' is the content of the message.
-		parse_command(serverMessage, commandType, senderClientName, message, clients);
-
-		// "" is given as the (destination) 'name' arg, which is irrelevant for this print.
-		print_send(false, false, true, senderClientName, "", message);
-	}
-	return toExit;
-}
-
-
-int main(int argc, char *argv[]) {
-
-	clientName = argv[CLIENT_NAME_INDEX];
-
-	if (argc != CLIENT_NUM_OF_ARGS ||
-		(!nameIsAlphaNumeric(clientName = argv[CLIENT_NAME_INDEX]))) {
-		print_client_usage();
-		return FAILURE;
-	}
-
-	struct sockaddr_in clientSocketAddress = {0};
-	struct hostent *hostEntry;
-	bool toExit;
-	fd_set serverAndStdInputFdSet, readyToReadFdSet;
-
-	hostEntry = gethostbyname(argv[SERVER_ADDRESS_INDEX]);
-	if (hostEntry == nullptr) {
-		print_error("gethostbyname", h_errno);
-		return FAILURE;
-	}
-	auto portNum = (unsigned short) strtol(argv[PORT_NUM_INDEX], nullptr, DECIMAL_BASE);
-
-	memset(&clientSocketAddress, 0, sizeof(clientSocketAddress));
-	memcpy(&clientSocketAddress.sin_addr, hostEntry->h_addr,
-		   (unsigned short) hostEntry->h_length);
-	clientSocketAddress.sin_family = (unsigned short) hostEntry->h_addrtype;
-	clientSocketAddress.sin_port = htons(portNum);
-
-	// We use TCP, and therefore we use SOCK_STREAM
-	communicationSocketFD = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
-	if (communicationSocketFD < 0) {
-		print_error("socket", errno);
-		return FAILURE;
-	}
-
-	if ( connect(communicationSocketFD, (struct sockaddr*) &clientSocketAddress,
-				 sizeof(clientSocketAddress)) < 0) {
-		close(communicationSocketFD);
-		print_fail_connection();
-		print_error("connect", errno);
-		return FAILURE;
-	}
-
-	toExit = sendClientNameToServer(clientName);
-	if (toExit) {
-		return FAILURE; // when client name is already in use.
-	}
-
-	FD_ZERO(&serverAndStdInputFdSet);
-	FD_SET(STDIN_FILENO, &serverAndStdInputFdSet);
-	FD_SET(communicationSocketFD, &serverAndStdInputFdSet);
-	FD_ZERO(&readyToReadFdSet);
-
-	while (!toExit) {
-		readyToReadFdSet = serverAndStdInputFdSet;
-
-		if ( select(communicationSocketFD + 1,
-					&readyToReadFdSet, nullptr, nullptr, nullptr) < 0) {
-			print_error("select", errno);
-			freeResources();
-			return FAILURE;
-
-		}
-		if (FD_ISSET(STDIN_FILENO, &readyToReadFdSet)) {
-			toExit = sendCommandsToServer();
-			if (toExit) {
-				return SUCCESS; // when client exited before server.
-			}
-		}
-		if (FD_ISSET(communicationSocketFD, &readyToReadFdSet)) {
-			toExit = handleInputFromServer();
-			if (toExit) {
-				return FAILURE; // when server exited before client.
-			}
-		}
-	}
-	return SUCCESS;
-}
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include "whatsappio.h"
+#include "whatsappFrame.h"
+#include "whatsappProtocol.h"
+
+using namespace std;
+
+
+/**
+ * The program's valid number of arguments.
+ */
+#define CLIENT_NUM_OF_ARGS 4
+
+/**
+ * The exit code in case of a success.
+ */
+#define SUCCESS 0
+
+/**
+ * The exit code in case of a failure.
+ */
+#define FAILURE 1
+
+/**
+ * The index of the client name in 'argv'.
+ */
+#define CLIENT_NAME_INDEX 1
+
+/**
+ * The index of the server address in 'argv'.
+ */
+#define SERVER_ADDRESS_INDEX 2
+
+/**
+ * The index of the port number in 'argv'.
+ */
+#define PORT_NUM_INDEX 3
+
+/**
+ * The base that is normally used to represent a number - used in 'strtol' function.
+ */
+#define DECIMAL_BASE 10
+
+/**
+ * When this constant is used as the third argument of socket, the default protocol
+ * will be chosen - which in our case will be TCP, since we use SOCK_STREAM.
+ */
+#define DEFAULT_PROTOCOL 0
+
+/**
+ * The maximal number of requests that may wait for their replies at once. Beyond that,
+ * the standard input is not read until some of the replies arrive.
+ */
+#define MAX_REQUESTS_IN_FLIGHT 1024
+
+/**
+ * The number of bytes of requests that may wait to be written to the server before the
+ * standard input stops being read.
+ */
+#define MAX_BUFFERED_OUTPUT (1 << 20)
+
+/**
+ * The number of bytes that are read from the standard input at once.
+ */
+#define STDIN_CHUNK_SIZE 65536
+
+/**
+ * The maximal number of consecutive "send" commands that are sent in a single batch.
+ */
+#define MAX_MESSAGES_PER_BATCH 256
+
+/**
+ * An upper bound of the bytes a batch takes for every message, besides the name and the
+ * message themselves (their length-prefixes), and for its opcode and request id.
+ */
+#define BATCHED_MESSAGE_OVERHEAD (2 * MAX_VARINT_LENGTH)
+#define BATCH_HEADER_LENGTH (1 + MAX_VARINT_LENGTH)
+
+
+/*
+ * Description: A message of a "send" command.
+*/
+struct SentMessage {
+	string name;
+	string message;
+};
+
+/*
+ * Description: A request that was sent to the server and was not answered yet - what is
+ *              needed in order to print the result once its reply arrives.
+*/
+struct PendingRequest {
+	command_type type;
+	string name;
+	string message;
+	vector<SentMessage> batch;      // The messages of a SEND_BATCH request.
+};
+
+
+// Global Variables:
+string clientName;
+int communicationSocketFD;
+FrameReader serverReader(PROTOCOL_V2);
+uint64_t nextRequestId = 1;
+unordered_map<uint64_t, PendingRequest> pendingRequests;    // Maps request ids to requests.
+string outgoing;                // Encoded requests that were not written to the server yet.
+size_t outgoingOffset = 0;      // The number of bytes of 'outgoing' that were written.
+string stdinLines;              // Input that was read, but is not a complete line yet.
+vector<SentMessage> batch;      // Consecutive "send" commands that were not sent yet.
+size_t batchLength = 0;         // An upper bound of the payload length of the batch.
+bool isStdinOpen = true;
+bool isExiting = false;         // True once "exit" was sent.
+
+
+
+void freeResources() {
+	close(communicationSocketFD);
+	// The reader's buffer goes back to this thread's pool while the pool still exists - the
+	// pool is gone by the time the globals are destroyed.
+	serverReader = FrameReader(PROTOCOL_V2);
+}
+
+bool nameIsAlphaNumeric(string_view name) {
+	for (const char &ch : name) {
+		if (! ((bool) isalnum(ch))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Description: Waits (blocking) until a complete frame arrives from the server.
+ * Returns false iff the server has disconnected or violated the protocol.
+*/
+bool receiveFrame(string_view& frame) {
+	struct pollfd readable = {communicationSocketFD, POLLIN, 0};
+	while (!serverReader.nextFrame(frame)) {
+		if (serverReader.isCorrupted()) {
+			return false;
+		}
+		if (poll(&readable, 1, -1) < 0 && errno != EINTR) {
+			return false;
+		}
+		if (serverReader.readFrom(communicationSocketFD) == RECEIVE_CLOSED) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool sendClientNameToServer(string &clientName) {
+	bool toExit = false;
+	FrameRef hello = encodeHello(clientName, nextRequestId++);
+	string helloWithPreface(1, WA_V2_PREFACE);
+	helloWithPreface.append(hello->data(), hello->size());
+	string_view frame;
+	ServerMessage serverResponse = {};
+	if (writeBytes(communicationSocketFD, helloWithPreface.data(), helloWithPreface.size()) < 0 ||
+	    !receiveFrame(frame) || !decodeServerMessage(frame, serverResponse) ||
+	    serverResponse.opcode != OP_ACK) {
+		print_fail_connection();
+		freeResources();
+		toExit = true;
+	} else if (serverResponse.status == STATUS_NAME_IN_USE) {
+		print_dup_connection();
+		freeResources();
+		toExit = true;
+	} else {
+		print_connection();
+	}
+	return toExit;
+}
+
+/*
+ * Description: Checks that clients contains at least one name other than us (this client).
+ * Also, checks that groupName and all client names in clients are alphanumeric.
+*/
+bool isGroupValid(const CommandView& command) {
+	if (!nameIsAlphaNumeric(command.name)) {
+        return false;
+    }
+    if (command.numOfClients == 0) {
+		return false;
+	}
+	bool isValid = false;
+	for (size_t i = 0; i < command.numOfClients; i++) {
+		string_view client = command.clients[i];
+		if (!nameIsAlphaNumeric(client)) {
+			return false;
+		}
+        if (client == command.name) {
+            return false;
+        }
+		if (client != clientName) {
+			isValid = true;
+		}
+	}
+	return isValid;
+}
+
+/*
+ * Description: Writes as much of the buffered requests as the server's socket accepts.
+ * Returns false iff the connection has failed.
+*/
+bool flushOutgoing() {
+	while (outgoingOffset < outgoing.size()) {
+		ssize_t bytesWritten = write(communicationSocketFD, outgoing.data() + outgoingOffset,
+		                             outgoing.size() - outgoingOffset);
+		if (bytesWritten > 0) {
+			outgoingOffset += (size_t) bytesWritten;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;    // the rest is written once the socket is writable again.
+		} else if (errno != EINTR) {
+			return false;
+		}
+	}
+	outgoing.clear();
+	outgoingOffset = 0;
+	return true;
+}
+
+/*
+ * Description: Sends a request to the server without waiting for its reply: the request is
+ *              tagged with a new id, and its result is printed once the reply with the same
+ *              id arrives, so many requests may be in flight at once.
+ * Returns false iff the request is too long to be sent.
+*/
+bool sendRequest(const CommandView& command) {
+	uint64_t requestId = nextRequestId++;
+	FrameRef request = encodeRequest(command, requestId);
+	if (!request) {
+		return false;
+	}
+	outgoing.append(request->data(), request->size());
+	if (command.type != EXIT) {     // the server does not reply to "exit".
+		pendingRequests[requestId] = {command.type, string(command.name),
+		                              string(command.message), {}};
+	}
+	return true;
+}
+
+/*
+ * Description: Sends the batched "send" commands as a single request - or as a plain "send"
+ *              if there is only one of them.
+*/
+void sendBatch() {
+	vector<SentMessage> messages;
+	messages.swap(batch);
+	batchLength = 0;
+	if (messages.size() == 1) {
+		CommandView command;
+		command.type = SEND;
+		command.name = messages[0].name;
+		command.message = messages[0].message;
+		sendRequest(command);
+	} else if (messages.size() > 1) {
+		uint64_t requestId = nextRequestId++;
+		string payload = beginPayload(OP_SEND_BATCH, requestId);
+		for (const SentMessage &message : messages) {
+			appendBatchedMessage(payload, message.name, message.message);
+		}
+		FrameRef request = Frame::fromPayload(payload);
+		outgoing.append(request->data(), request->size());
+		pendingRequests[requestId] = {SEND_BATCH, "", "", std::move(messages)};
+	}
+}
+
+/*
+ * Description: Adds a "send" command to the batch. The batch is sent once it is full, or
+ *              once a command that is not "send" (or the end of the input that was read)
+ *              is reached - so the order of the commands is kept.
+ * Returns false iff the message is too long to be sent.
+*/
+bool batchMessage(const CommandView& command) {
+	size_t length = command.name.size() + command.message.size() + BATCHED_MESSAGE_OVERHEAD;
+	if (length + BATCH_HEADER_LENGTH > MAX_V2_PAYLOAD_LENGTH) {
+		return false;
+	}
+	if (batch.size() == MAX_MESSAGES_PER_BATCH ||
+	    batchLength + length + BATCH_HEADER_LENGTH > MAX_V2_PAYLOAD_LENGTH) {
+		sendBatch();
+	}
+	batch.push_back({string(command.name), string(command.message)});
+	batchLength += length;
+	return true;
+}
+
+void createGroupCommand(const CommandView& command) {
+	if (!isGroupValid(command)) {
+		print_create_group(false, false, clientName, command.name);
+		return;
+	}
+	sendRequest(command);
+}
+
+void sendCommand(const CommandView& command) {
+	if ((!nameIsAlphaNumeric(command.name)) || (command.name == clientName)) {
+		print_send(false, true, false, clientName, command.name, command.message);
+		return;
+	}
+	if (!batchMessage(command)) {
+		print_send(false, true, false, clientName, command.name, command.message);
+	}
+}
+
+void whoCommand(const CommandView& command) {
+	sendRequest(command);
+}
+
+void exitCommand(const CommandView& command) {
+	// The client exits once the replies to its earlier requests have arrived.
+	sendRequest(command);
+	isExiting = true;
+}
+
+/*
+ * Description: Prints the result of a request whose reply has arrived.
+*/
+void handleReply(const ServerMessage& reply) {
+	auto requestIt = pendingRequests.find(reply.requestId);
+	if (requestIt == pendingRequests.end()) {
+		return;
+	}
+	const PendingRequest& request = requestIt->second;
+	// Only the fields of the reply's own opcode are decoded (see ServerMessage).
+	bool isAck = reply.opcode == OP_ACK;
+	bool isSuccess = isAck && reply.status == STATUS_SUCCESS;
+	if (request.type == SEND_BATCH) {
+		const char* cursor = reply.statuses.data();
+		const char* end = cursor + reply.statuses.size();
+		for (const SentMessage &message : request.batch) {
+			uint64_t status = STATUS_FAILURE;
+			isSuccess = reply.opcode == OP_BATCH_ACK && readVarint(cursor, end, status) &&
+			            status == STATUS_SUCCESS;
+			if (status == STATUS_THROTTLED) {
+				print_send_throttled(false, clientName, message.name);
+			} else {
+				print_send(false, true, isSuccess, clientName, message.name, message.message);
+			}
+		}
+	} else if (request.type == CREATE_GROUP) {
+		print_create_group(false, isSuccess, clientName, request.name);
+	} else if (request.type == SEND && isAck && reply.status == STATUS_THROTTLED) {
+		print_send_throttled(false, clientName, request.name);
+	} else if (request.type == SEND) {
+		print_send(false, true, isSuccess, clientName, request.name, request.message);
+	} else if (request.type == WHO && reply.opcode == OP_WHO_REPLY) {
+		print_who_client(reply.message);
+	}
+	pendingRequests.erase(requestIt);
+}
+
+/*
+ * Description: Handles a single line of the standard input.
+*/
+void handleInputLine(string_view clientInput) {
+	CommandView command;
+	if (clientInput.empty()) {
+		return;
+	}
+	parse_command(clientInput, command);
+	if (command.type == WHO && !parse_who_page(clientInput, command)) {
+		command.type = INVALID;
+	}
+	if (command.type != SEND) {
+		sendBatch();    // the batched commands precede this one.
+	}
+	if (command.type == CREATE_GROUP) {
+		createGroupCommand(command);
+	} else if (command.type == SEND) {
+		sendCommand(command);
+	} else if (command.type == WHO) {
+		whoCommand(command);
+	} else if (command.type == EXIT) {
+		exitCommand(command);
+	} else if (command.type == INVALID) {
+		print_invalid_input();
+	}
+}
+
+/*
+ * Description: Reads what is available on the standard input, and sends a request for every
+ *              complete line - a script that pipes many commands does not wait for a round
+ *              trip per command, and consecutive "send" commands are batched. The lines that
+ *              follow "exit" are ignored.
+ * Returns false iff the connection to the server has failed.
+*/
+bool sendCommandsToServer() {
+	char chunk[STDIN_CHUNK_SIZE];
+	ssize_t bytesRead = read(STDIN_FILENO, chunk, sizeof(chunk));
+	if (bytesRead < 0 && errno == EINTR) {
+		return true;
+	}
+	if (bytesRead <= 0) {
+		// A last line that is not terminated by a newline is still a command.
+		isStdinOpen = false;
+		stdinLines.push_back('\n');
+	} else {
+		stdinLines.append(chunk, (size_t) bytesRead);
+	}
+
+	string_view lines = stdinLines;
+	size_t lineEnd;
+	while (!isExiting && (lineEnd = lines.find('\n')) != string_view::npos) {
+		handleInputLine(lines.substr(0, lineEnd));
+		lines.remove_prefix(lineEnd + 1);
+	}
+	stdinLines.erase(0, stdinLines.size() - lines.size());
+	// Everything that was read is written together.
+	sendBatch();
+	return flushOutgoing();
+}
+
+/*
+ * Description: Reads what the server has sent, and handles every complete frame: replies
+ *              are matched with the requests they answer by their ids, and messages of other
+ *              clients are printed as they arrive.
+ * Returns true iff the server has shut down (or the connection to it was lost).
+*/
+bool handleInputFromServer() {
+	receive_status status = RECEIVE_BUFFER_FULL;
+	while (status == RECEIVE_BUFFER_FULL) {
+		status = serverReader.readFrom(communicationSocketFD);
+		string_view frame;
+		while (serverReader.nextFrame(frame)) {
+			ServerMessage serverMessage = {};
+			if (!decodeServerMessage(frame, serverMessage)) {
+				continue;
+			}
+			if (serverMessage.opcode == OP_SERVER_EXIT) {
+				freeResources();
+				return true;
+			} else if (serverMessage.opcode == OP_DELIVER) {
+				// "" is given as the (destination) 'name' arg, which is irrelevant for this print.
+				print_send(false, false, true, serverMessage.sender, "", serverMessage.message);
+			} else {
+				handleReply(serverMessage);
+			}
+		}
+		if (status == RECEIVE_CLOSED || serverReader.isCorrupted()) {
+			freeResources();
+			return true;
+		}
+	}
+	return false;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	clientName = argv[CLIENT_NAME_INDEX];
+
+	if (argc != CLIENT_NUM_OF_ARGS ||
+		(!is_valid_name(clientName = argv[CLIENT_NAME_INDEX]))) {
+		print_client_usage();
+		return FAILURE;
+	}
+
+	struct sockaddr_in clientSocketAddress = {0};
+	struct hostent *hostEntry;
+	bool toExit;
+	fd_set readyToReadFdSet, readyToWriteFdSet;
+
+	hostEntry = gethostbyname(argv[SERVER_ADDRESS_INDEX]);
+	if (hostEntry == nullptr) {
+		print_error("gethostbyname", h_errno);
+		return FAILURE;
+	}
+	auto portNum = (unsigned short) strtol(argv[PORT_NUM_INDEX], nullptr, DECIMAL_BASE);
+
+	memset(&clientSocketAddress, 0, sizeof(clientSocketAddress));
+	memcpy(&clientSocketAddress.sin_addr, hostEntry->h_addr,
+		   (unsigned short) hostEntry->h_length);
+	clientSocketAddress.sin_family = (unsigned short) hostEntry->h_addrtype;
+	clientSocketAddress.sin_port = htons(portNum);
+
+	// A server that disconnects while we write to it fails the write, rather than kill us.
+	signal(SIGPIPE, SIG_IGN);
+
+	// We use TCP, and therefore we use SOCK_STREAM
+	communicationSocketFD = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
+	if (communicationSocketFD < 0) {
+		print_error("socket", errno);
+		return FAILURE;
+	}
+
+	if ( connect(communicationSocketFD, (struct sockaddr*) &clientSocketAddress,
+				 sizeof(clientSocketAddress)) < 0) {
+		close(communicationSocketFD);
+		print_fail_connection();
+		print_error("connect", errno);
+		return FAILURE;
+	}
+
+	toExit = sendClientNameToServer(clientName);
+	if (toExit) {
+		return FAILURE; // when client name is already in use.
+	}
+
+	// From now on requests are pipelined: the socket is never blocked on, in either direction.
+	int flags = fcntl(communicationSocketFD, F_GETFL, 0);
+	if (fcntl(communicationSocketFD, F_SETFL, flags | O_NONBLOCK) < 0) {
+		print_error("fcntl", errno);
+		freeResources();
+		return FAILURE;
+	}
+
+	while (!toExit) {
+		if (isExiting && pendingRequests.empty() && outgoing.empty()) {
+			freeResources();
+			print_exit(false, clientName);
+			return SUCCESS; // when client exited before server.
+		}
+		FD_ZERO(&readyToReadFdSet);
+		FD_ZERO(&readyToWriteFdSet);
+		FD_SET(communicationSocketFD, &readyToReadFdSet);
+		// The input is not read while too many requests are waiting for the server.
+		if (isStdinOpen && !isExiting && pendingRequests.size() < MAX_REQUESTS_IN_FLIGHT &&
+		    outgoing.size() < MAX_BUFFERED_OUTPUT) {
+			FD_SET(STDIN_FILENO, &readyToReadFdSet);
+		}
+		if (!outgoing.empty()) {
+			FD_SET(communicationSocketFD, &readyToWriteFdSet);
+		}
+		// Whatever was printed is shown before waiting (stdout may be a pipe, not a terminal).
+		fflush(stdout);
+
+		if ( select(communicationSocketFD + 1,
+					&readyToReadFdSet, &readyToWriteFdSet, nullptr, nullptr) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			print_error("select", errno);
+			freeResources();
+			return FAILURE;
+
+		}
+		// A request that cannot be written means the connection is lost, as a failed read does
+		// - but what the server sent before that (e.g. its serverEXIT) is handled first.
+		bool isWriteFailed =
+				(FD_ISSET(STDIN_FILENO, &readyToReadFdSet) && !sendCommandsToServer()) ||
+				(FD_ISSET(communicationSocketFD, &readyToWriteFdSet) && !flushOutgoing());
+		if (FD_ISSET(communicationSocketFD, &readyToReadFdSet) || isWriteFailed) {
+			toExit = handleInputFromServer();
+			if (toExit) {
+				return FAILURE; // when server exited before client.
+			}
+		}
+		if (isWriteFailed) {
+			freeResources();
+			return FAILURE;
+		}
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,157 @@
+#include "whatsappConnection.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/uio.h>
+
+
+OutboundQueue::OutboundQueue(size_t capacity) : headOffset(0), queuedBytes(0), framesSending(0),
+                                                sendingBytes(0), receiptsWritten(0),
+                                                capacity(capacity) {
+}
+
+bool OutboundQueue::push(const FrameRef& frame, bool isReceipted) {
+	if (queuedBytes + frame->size() > capacity) {
+		return false;
+	}
+	queuedBytes += frame->size();
+	frames.push_back({frame, isReceipted});
+	return true;
+}
+
+flush_status OutboundQueue::flushTo(int fd) {
+	struct iovec iovecs[MAX_IOVECS_PER_FLUSH];
+	while (!frames.empty()) {
+		int numOfIovecs = 0;
+		for (auto it = frames.begin();
+		     it != frames.end() && numOfIovecs < MAX_IOVECS_PER_FLUSH; ++it) {
+			size_t offset = (numOfIovecs == 0) ? headOffset : 0;
+			iovecs[numOfIovecs].iov_base = (void*) (it->frame->data() + offset);
+			iovecs[numOfIovecs].iov_len = it->frame->size() - offset;
+			numOfIovecs++;
+		}
+
+		ssize_t bytesWritten = writev(fd, iovecs, numOfIovecs);
+		if (bytesWritten < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return FLUSH_PARTIAL;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return FLUSH_FAILED;
+		}
+
+		consume((size_t) bytesWritten);
+	}
+	return FLUSH_COMPLETE;
+}
+
+void OutboundQueue::consume(size_t bytesWritten) {
+	// Drops the frames that were written entirely, and remembers how much of the first
+	// remaining frame was written.
+	queuedBytes -= bytesWritten;
+	size_t bytesLeft = bytesWritten;
+	while (bytesLeft > 0) {
+		size_t frameRemainder = frames.front().frame->size() - headOffset;
+		if (bytesLeft < frameRemainder) {
+			headOffset += bytesLeft;
+			break;
+		}
+		bytesLeft -= frameRemainder;
+		receiptsWritten += frames.front().isReceipted;
+		frames.pop_front();
+		headOffset = 0;
+		if (framesSending > 0) {
+			framesSending--;
+		}
+	}
+}
+
+size_t OutboundQueue::startSend(struct iovec* iovecs, FrameRef* frameRefs, size_t maxIovecs) {
+	size_t numOfIovecs = 0;
+	// A send always ends at the end of a frame, so the next one starts with a whole frame.
+	for (size_t i = framesSending; i < frames.size() && numOfIovecs < maxIovecs; i++) {
+		size_t offset = (i == 0) ? headOffset : 0;
+		iovecs[numOfIovecs].iov_base = (void*) (frames[i].frame->data() + offset);
+		iovecs[numOfIovecs].iov_len = frames[i].frame->size() - offset;
+		frameRefs[numOfIovecs] = frames[i].frame;
+		sendingBytes += iovecs[numOfIovecs].iov_len;
+		numOfIovecs++;
+	}
+	framesSending += numOfIovecs;
+	return numOfIovecs;
+}
+
+void OutboundQueue::completeSend(size_t bytesStarted, size_t bytesSent) {
+	sendingBytes -= bytesStarted;
+	consume(bytesSent);
+}
+
+size_t OutboundQueue::dropOldest(size_t minBytes, size_t& bytesDropped) {
+	size_t first = std::max(framesSending, (size_t) (headOffset > 0 ? 1 : 0));
+	size_t numOfDropped = 0;
+	bytesDropped = 0;
+	// The frames that are kept are moved up over those that are dropped.
+	auto keptEnd = frames.begin() + std::min(first, frames.size());
+	for (auto it = keptEnd; it != frames.end(); ++it) {
+		if (bytesDropped < minBytes && !it->isReceipted) {
+			bytesDropped += it->frame->size();
+			numOfDropped++;
+		} else {
+			if (keptEnd != it) {
+				*keptEnd = std::move(*it);
+			}
+			++keptEnd;
+		}
+	}
+	frames.erase(keptEnd, frames.end());
+	queuedBytes -= bytesDropped;
+	return numOfDropped;
+}
+
+size_t OutboundQueue::takeReceipts() {
+	size_t receipts = receiptsWritten;
+	receiptsWritten = 0;
+	return receipts;
+}
+
+size_t OutboundQueue::bytesSending() const {
+	return sendingBytes;
+}
+
+size_t OutboundQueue::bytesQueued() const {
+	return queuedBytes;
+}
+
+size_t OutboundQueue::framesQueued() const {
+	return frames.size();
+}
+
+bool OutboundQueue::empty() const {
+	return frames.empty();
+}
+
+
+Connection::Connection(const ConnectionHandle& handle, const std::string& name,
+                       ClientId clientId, const QueueLimits& limits, const RateLimits& rates) :
+		handle(handle), name(name), clientId(clientId), isRegistered(false),
+		outbound(limits.capacity), isReadPaused(false), isPeerClosed(false),
+		isBroken(false), isFlushPending(false), isScheduled(false), hasUnreadInput(false),
+		hasOfflineMessages(false), receivedNs(0), backlogSinceNs(0),
+		isReceiveArmed(false), isReceiveCancelling(false), numOfSendsInFlight(0),
+		isSendingLast(false),
+		messageRate(rates.messagesPerSecond), fanoutRate(rates.fanoutBytesPerSecond),
+		highWatermark(limits.highWatermark), lowWatermark(limits.lowWatermark) {
+}
+
+bool Connection::isCongested() const {
+	return outbound.bytesQueued() >= highWatermark;
+}
+
+bool Connection::isDrained() const {
+	return outbound.bytesQueued() <= lowWatermark;
+}
+
+void Connection::publishCongestion() {
+	handle.isCongested->store(isCongested(), std::memory_order_relaxed);
+}
@@ -0,0 +1,233 @@
+#ifndef _WHATSAPPCONNECTION_H
+#define _WHATSAPPCONNECTION_H
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include "whatsappFrame.h"
+#include "whatsappTokenBucket.h"
+
+/**
+ * The maximal number of queued frames that are written by a single 'writev' call.
+ */
+#define MAX_IOVECS_PER_FLUSH 64
+
+/**
+ * The default number of queued bytes above which a connection is considered backed up,
+ * and the clients that send it messages are no longer read from.
+ */
+#define DEFAULT_HIGH_WATERMARK (256 * 1024)
+
+/**
+ * The default number of queued bytes below which a backed up connection is considered
+ * drained again, and the clients that were paused because of it are read from again.
+ */
+#define DEFAULT_LOW_WATERMARK (64 * 1024)
+
+/**
+ * The default maximal number of bytes that may be queued for a single connection.
+ */
+#define DEFAULT_QUEUE_CAPACITY (4 * 1024 * 1024)
+
+/*
+ * The result of flushing an outbound queue into a socket.
+ */
+enum flush_status {FLUSH_COMPLETE, FLUSH_PARTIAL, FLUSH_FAILED};
+
+/*
+ * Description: The limits of the outbound queue of every connection.
+*/
+struct QueueLimits {
+	size_t highWatermark;
+	size_t lowWatermark;
+	size_t capacity;
+};
+
+/*
+ * Description: The rates every client may send at (0 for no limit).
+ * messagesPerSecond: the messages it sends, whether to a client or to a group.
+ * fanoutBytesPerSecond: the bytes of the messages it sends, times the number of their
+ *                       recipients (the members of a group, for a message to a group).
+*/
+struct RateLimits {
+	size_t messagesPerSecond;
+	size_t fanoutBytesPerSecond;
+};
+
+/*
+ * Description: A bounded queue of encoded frames waiting to be written to a socket.
+ *              Frames are written with 'writev', so several queued frames are sent by a
+ *              single system call, and a frame may be written partially. The queue holds
+ *              references to the frames, so a frame queued to many connections is not copied.
+*/
+class OutboundQueue {
+public:
+	explicit OutboundQueue(size_t capacity);
+
+	/*
+	 * Description: Appends an encoded frame to the end of the queue.
+	 * frame: the frame to append.
+	 * isReceipted: true iff the frame is to be counted once it is written entirely (see
+	 *              takeReceipts). Such a frame is never dropped.
+	 * Returns false (and leaves the queue untouched) iff the frame does not fit in the queue.
+	*/
+	bool push(const FrameRef& frame, bool isReceipted = false);
+
+	/*
+	 * Description: Writes as much of the queue as the (non-blocking) socket accepts.
+	 * fd: the file descriptor into which we should write.
+	 * Returns FLUSH_COMPLETE if the queue is now empty, FLUSH_PARTIAL if the socket's send
+	 * buffer is full, and FLUSH_FAILED on a write error.
+	*/
+	flush_status flushTo(int fd);
+
+	/*
+	 * Description: Starts an asynchronous send (e.g. through io_uring) of the frames that
+	 *              follow those already being sent: fills 'iovecs' with them, and marks them as
+	 *              being sent. The frames stay queued until the send completes (see
+	 *              'completeSend'), and further sends may be started meanwhile.
+	 * frames: output - references to the frames, to keep them alive until the send completes
+	 *         (even if the queue is dropped).
+	 * Returns the number of iovecs that were filled (0 if every frame is already being sent).
+	*/
+	size_t startSend(struct iovec* iovecs, FrameRef* frameRefs, size_t maxIovecs);
+
+	/*
+	 * Description: Ends an asynchronous send, the oldest one that was started.
+	 * bytesStarted: the number of bytes the send was started with.
+	 * bytesSent: the number of bytes that were actually sent (less, if the send failed) -
+	 *            dropped from the head of the queue.
+	*/
+	void completeSend(size_t bytesStarted, size_t bytesSent);
+
+	/*
+	 * Description: Drops the oldest frames that are not being written - that is, all but a
+	 *              partially written frame and the frames being sent asynchronously - whole, until
+	 *              at least the given number of bytes were dropped or none is left to drop.
+	 *              Receipted frames are kept.
+	 * bytesDropped: output - the number of bytes that were dropped.
+	 * Returns the number of frames that were dropped.
+	*/
+	size_t dropOldest(size_t minBytes, size_t& bytesDropped);
+
+	/*
+	 * Description: Returns the number of receipted frames that were written entirely since the
+	 *              last call. They are written in the order they were pushed.
+	*/
+	size_t takeReceipts();
+
+	/*
+	 * Description: Returns the number of queued bytes that are being sent asynchronously.
+	*/
+	size_t bytesSending() const;
+
+	/*
+	 * Description: Returns the number of bytes that are waiting to be written.
+	*/
+	size_t bytesQueued() const;
+
+	/*
+	 * Description: Returns the number of frames that are (partially) waiting to be written.
+	*/
+	size_t framesQueued() const;
+
+	bool empty() const;
+
+private:
+	/*
+	 * Description: Drops the given number of written bytes from the head of the queue.
+	*/
+	void consume(size_t bytesWritten);
+
+	/*
+	 * Description: A queued frame.
+	*/
+	struct QueuedFrame {
+		FrameRef frame;
+		bool isReceipted;
+	};
+
+	std::deque<QueuedFrame> frames;
+	size_t headOffset;          // Number of bytes of the first frame that were already written.
+	size_t queuedBytes;
+	size_t framesSending;       // Number of frames, from the head, being sent asynchronously.
+	size_t sendingBytes;
+	size_t receiptsWritten;     // Number of receipted frames written since the last takeReceipts.
+	size_t capacity;
+};
+
+/*
+ * The ids a ClientRegistry interns the names of the clients and of the groups into.
+ */
+typedef uint32_t ClientId;
+typedef uint32_t GroupId;
+
+/*
+ * Description: Identifies a connection across the worker threads of the server.
+ *              A file-descriptor alone is not enough, since it may be reused by a newer
+ *              connection once the old one is closed - the connection id never is.
+*/
+struct ConnectionHandle {
+	int worker;             // The index of the worker thread that owns the connection.
+	int fd;
+	uint64_t id;            // Unique across the lifetime of the server.
+	protocol_version protocol;
+	std::shared_ptr<std::atomic<bool>> isCongested;     // Published by the owning worker.
+};
+
+/*
+ * Description: The state the server keeps for every client connection - from the moment it
+ *              is accepted, although it is only registered (and known to the other clients)
+ *              once its hello has arrived.
+*/
+struct Connection {
+	Connection(const ConnectionHandle& handle, const std::string& name, ClientId clientId,
+	           const QueueLimits& limits, const RateLimits& rates);
+
+	/*
+	 * Description: Returns true iff the outbound queue is above the high watermark.
+	*/
+	bool isCongested() const;
+
+	/*
+	 * Description: Returns true iff the outbound queue is at or below the low watermark.
+	*/
+	bool isDrained() const;
+
+	/*
+	 * Description: Publishes whether the connection is backed up to the other worker threads.
+	*/
+	void publishCongestion();
+
+	ConnectionHandle handle;
+	std::string name;
+	ClientId clientId;          // The id the client is registered with.
+	bool isRegistered;          // False until the client's hello was handled.
+	FrameReader reader;
+	OutboundQueue outbound;
+	std::vector<ConnectionHandle> pausedProducers;  // Clients paused until this one drains.
+	bool isReadPaused;          // True while one of the connections this client sends to is backed up.
+	bool isPeerClosed;          // True once the client has closed its side of the connection.
+	bool isBroken;              // True once writing to the client has failed.
+	bool isFlushPending;        // True while waiting to be flushed at the end of the loop turn.
+	bool isScheduled;           // True while waiting for its turn to be served.
+	bool hasUnreadInput;        // True while its socket may hold input that was not read.
+	bool hasOfflineMessages;    // True while messages stored while offline are left to replay.
+	std::deque<uint64_t> replaysInFlight;   // The stored messages queued to it, not written yet.
+	uint64_t receivedNs;        // When the requests that are being handled were read.
+	uint64_t backlogSinceNs;    // Since when the outbound queue has not been empty.
+	bool isReceiveArmed;        // True while an io_uring receive is in flight for the client.
+	bool isReceiveCancelling;   // True once that receive was asked to stop (while paused).
+	size_t numOfSendsInFlight;  // The io_uring sends to the client that have not completed.
+	bool isSendingLast;         // True once its last frames are sent, before it is closed.
+	TokenBucket messageRate;    // Limit the messages the client sends (see RateLimits).
+	TokenBucket fanoutRate;
+	size_t highWatermark;
+	size_t lowWatermark;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "whatsappEventLoop.h"
+#include <cerrno>
+#include <unistd.h>
+
+
+EventLoop::EventLoop() : epollFD(epoll_create1(EPOLL_CLOEXEC)),
+                         readyEvents(MAX_EVENTS_PER_WAIT) {
+}
+
+EventLoop::~EventLoop() {
+	if (epollFD >= 0) {
+		close(epollFD);
+	}
+}
+
+bool EventLoop::isValid() const {
+	return epollFD >= 0;
+}
+
+int EventLoop::add(int fd, uint32_t events) {
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.fd = fd;
+	return epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event);
+}
+
+int EventLoop::modify(int fd, uint32_t events) {
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.fd = fd;
+	return epoll_ctl(epollFD, EPOLL_CTL_MOD, fd, &event);
+}
+
+int EventLoop::remove(int fd) {
+	// A non-null event is passed for the sake of kernels older than 2.6.9.
+	struct epoll_event event = {0};
+	return epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, &event);
+}
+
+int EventLoop::wait(int timeoutMs) {
+	int numOfReadyEvents;
+	do {
+		numOfReadyEvents = epoll_wait(epollFD, readyEvents.data(),
+		                              (int) readyEvents.size(), timeoutMs);
+	} while (numOfReadyEvents < 0 && errno == EINTR);
+	return numOfReadyEvents;
+}
+
+const struct epoll_event& EventLoop::event(int i) const {
+	return readyEvents[i];
+}
@@ -0,0 +1,68 @@
+#ifndef _WHATSAPPEVENTLOOP_H
+#define _WHATSAPPEVENTLOOP_H
+
+#include <sys/epoll.h>
+#include <vector>
+
+/**
+ * The maximal number of ready events that are collected by a single call to 'wait'.
+ */
+#define MAX_EVENTS_PER_WAIT 1024
+
+/*
+ * Description: A thin wrapper around an epoll instance.
+ *              Unlike select(), registering a file-descriptor is done once, and the cost
+ *              of a wakeup depends only on the number of file-descriptors that are ready -
+ *              not on the number of file-descriptors being watched.
+*/
+class EventLoop {
+public:
+	EventLoop();
+	~EventLoop();
+
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	/*
+	 * Description: Returns true iff the underlying epoll instance was created successfully.
+	*/
+	bool isValid() const;
+
+	/*
+	 * Description: Starts watching the given file-descriptor.
+	 * fd: the file descriptor to watch.
+	 * events: the epoll events mask (e.g. EPOLLIN | EPOLLET).
+	 * Returns 0 on success, -1 on failure (errno is set).
+	*/
+	int add(int fd, uint32_t events);
+
+	/*
+	 * Description: Changes the events mask of an already watched file-descriptor.
+	 * Returns 0 on success, -1 on failure (errno is set).
+	*/
+	int modify(int fd, uint32_t events);
+
+	/*
+	 * Description: Stops watching the given file-descriptor.
+	 * Returns 0 on success, -1 on failure (errno is set).
+	*/
+	int remove(int fd);
+
+	/*
+	 * Description: Waits until at least one of the watched file-descriptors is ready.
+	 * timeoutMs: maximal time to wait in milliseconds (-1 to wait forever).
+	 * Returns the number of ready events (accessible through 'event'), or -1 on failure.
+	*/
+	int wait(int timeoutMs);
+
+	/*
+	 * Description: Returns the i'th ready event of the last call to 'wait'.
+	*/
+	const struct epoll_event& event(int i) const;
+
+private:
+	int epollFD;
+	std::vector<struct epoll_event> readyEvents;
+};
+
+#endif
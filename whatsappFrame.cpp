@@ -0,0 +1,249 @@
+#include "whatsappFrame.h"
+#include "whatsappBuffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+
+/**
+ * The bits of a varint byte that hold the value, and the bit that marks that more follow.
+ */
+#define VARINT_VALUE_BITS 0x7F
+#define VARINT_CONTINUATION_BIT 0x80
+
+
+void appendVarint(std::string& out, uint64_t value) {
+	while (value > VARINT_VALUE_BITS) {
+		out.push_back((char) ((value & VARINT_VALUE_BITS) | VARINT_CONTINUATION_BIT));
+		value >>= 7;
+	}
+	out.push_back((char) value);
+}
+
+bool readVarint(const char*& cursor, const char* end, uint64_t& value) {
+	value = 0;
+	for (unsigned int shift = 0; cursor < end && shift < 64; shift += 7) {
+		auto byte = (unsigned char) *cursor++;
+		value |= (uint64_t) (byte & VARINT_VALUE_BITS) << shift;
+		if ((byte & VARINT_CONTINUATION_BIT) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+FrameRef Frame::fromMessage(const std::string& message) {
+	if (message.size() > MAX_TEXT_FRAME_LENGTH) {
+		return nullptr;
+	}
+	return std::make_shared<const Frame>(encodeFrame(message));
+}
+
+FrameRef Frame::fromPayload(const std::string& payload) {
+	std::string bytes;
+	bytes.reserve(MAX_VARINT_LENGTH + payload.size());
+	appendVarint(bytes, payload.size());
+	bytes.append(payload);
+	return std::make_shared<const Frame>(std::move(bytes));
+}
+
+Frame::Frame(std::string bytes) : bytes(std::move(bytes)), bytesData(this->bytes.data()),
+                                  bytesSize(this->bytes.size()) {
+}
+
+Frame::Frame(const char* data, size_t size, std::shared_ptr<const void> owner) :
+		owner(std::move(owner)), bytesData(data), bytesSize(size) {
+}
+
+const char* Frame::data() const {
+	return bytesData;
+}
+
+size_t Frame::size() const {
+	return bytesSize;
+}
+
+
+FrameReader::FrameReader(protocol_version protocol) : frameProtocol(protocol), buffer(nullptr),
+                                                      capacity(0), begin(0), end(0),
+                                                      neededBytes(0), totalBytesRead(0),
+                                                      corrupted(false) {
+}
+
+FrameReader::~FrameReader() {
+	releaseBuffer();
+}
+
+FrameReader::FrameReader(FrameReader&& other) noexcept : frameProtocol(other.frameProtocol),
+		buffer(other.buffer), capacity(other.capacity), begin(other.begin), end(other.end),
+		neededBytes(other.neededBytes), totalBytesRead(other.totalBytesRead),
+		corrupted(other.corrupted) {
+	other.buffer = nullptr;
+	other.capacity = other.begin = other.end = other.neededBytes = 0;
+}
+
+FrameReader& FrameReader::operator=(FrameReader&& other) noexcept {
+	if (this != &other) {
+		releaseBuffer();
+		frameProtocol = other.frameProtocol;
+		buffer = other.buffer;
+		capacity = other.capacity;
+		begin = other.begin;
+		end = other.end;
+		neededBytes = other.neededBytes;
+		totalBytesRead = other.totalBytesRead;
+		corrupted = other.corrupted;
+		other.buffer = nullptr;
+		other.capacity = other.begin = other.end = other.neededBytes = 0;
+	}
+	return *this;
+}
+
+void FrameReader::releaseBuffer() {
+	if (buffer != nullptr) {
+		BufferPool::local().release(buffer, capacity);
+		buffer = nullptr;
+		capacity = 0;
+	}
+}
+
+void FrameReader::makeRoom() {
+	if (begin == end) {
+		begin = end = 0;
+	}
+	if (buffer == nullptr) {
+		buffer = BufferPool::local().acquire(neededBytes, capacity);
+		return;
+	}
+	if (neededBytes > capacity) {   // a frame larger than the buffer - switch to a larger one.
+		size_t largerCapacity;
+		char* largerBuffer = BufferPool::local().acquire(neededBytes, largerCapacity);
+		memcpy(largerBuffer, buffer + begin, end - begin);
+		BufferPool::local().release(buffer, capacity);
+		buffer = largerBuffer;
+		capacity = largerCapacity;
+		end -= begin;
+		begin = 0;
+	} else if (begin > 0) {
+		// Only the beginning of the last frame is moved - the consumed frames are dropped.
+		memmove(buffer, buffer + begin, end - begin);
+		end -= begin;
+		begin = 0;
+	}
+}
+
+receive_status FrameReader::readFrom(int fd) {
+	makeRoom();
+	while (end < capacity) {
+		ssize_t bytesRead = read(fd, buffer + end, capacity - end);
+		if (bytesRead > 0) {
+			bool isShortRead = (size_t) bytesRead < capacity - end;
+			end += (size_t) bytesRead;
+			totalBytesRead += (uint64_t) bytesRead;
+			if (isShortRead) {
+				// A short read means the socket buffer is drained - no need for another
+				// 'read' just to learn it would block.
+				return RECEIVE_DRAINED;
+			}
+		} else if (bytesRead == 0) {
+			return RECEIVE_CLOSED;      // the peer has closed the connection.
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return RECEIVE_DRAINED;
+		} else if (errno != EINTR) {
+			return RECEIVE_CLOSED;
+		}
+	}
+	return RECEIVE_BUFFER_FULL;
+}
+
+void FrameReader::append(const char* data, size_t length) {
+	size_t unconsumedBytes = end - begin;
+	if (unconsumedBytes + length > MAX_POOLED_BUFFER_SIZE) {
+		corrupted = true;
+		return;
+	}
+	// Room is made for the bytes as if they were the rest of the frame being received.
+	size_t frameBytes = neededBytes;
+	neededBytes = std::max(neededBytes, unconsumedBytes + length);
+	makeRoom();
+	neededBytes = frameBytes;
+	memcpy(buffer + end, data, length);
+	end += length;
+	totalBytesRead += length;
+}
+
+uint64_t FrameReader::bytesRead() const {
+	return totalBytesRead;
+}
+
+size_t FrameReader::parseHeader(size_t& payloadLength) {
+	const char* header = buffer + begin;
+	size_t available = end - begin;
+	if (frameProtocol == PROTOCOL_TEXT) {
+		if (available < BYTES_TO_READ_LENGTH) {
+			return 0;
+		}
+		payloadLength = 0;
+		for (size_t i = 0; i < BYTES_TO_READ_LENGTH; i++) {
+			if (header[i] < '0' || header[i] > '9') {
+				corrupted = true;
+				return 0;
+			}
+			payloadLength = payloadLength * 10 + (size_t) (header[i] - '0');
+		}
+		return BYTES_TO_READ_LENGTH;
+	}
+
+	const char* cursor = header;
+	uint64_t length;
+	if (!readVarint(cursor, header + std::min(available, (size_t) MAX_VARINT_LENGTH), length)) {
+		corrupted = available >= MAX_VARINT_LENGTH;
+		return 0;
+	}
+	if (length > MAX_V2_PAYLOAD_LENGTH) {
+		corrupted = true;
+		return 0;
+	}
+	payloadLength = (size_t) length;
+	return (size_t) (cursor - header);
+}
+
+bool FrameReader::nextFrame(std::string_view& frame) {
+	if (corrupted || begin == end) {
+		if (begin == end) {
+			releaseBuffer();    // nothing is pending - an idle connection holds no buffer.
+			begin = end = neededBytes = 0;
+		}
+		return false;
+	}
+	if (frameProtocol == PROTOCOL_UNKNOWN) {
+		if (buffer[begin] == WA_V2_PREFACE) {
+			frameProtocol = PROTOCOL_V2;
+			begin++;
+			return nextFrame(frame);
+		}
+		frameProtocol = PROTOCOL_TEXT;
+	}
+
+	size_t payloadLength;
+	size_t headerLength = parseHeader(payloadLength);
+	if (headerLength == 0) {
+		return false;
+	}
+	if (end - begin < headerLength + payloadLength) {
+		neededBytes = headerLength + payloadLength;     // the frame is not complete yet.
+		return false;
+	}
+	frame = std::string_view(buffer + begin + headerLength, payloadLength);
+	begin += headerLength + payloadLength;
+	neededBytes = 0;
+	return true;
+}
+
+bool FrameReader::isCorrupted() const {
+	return corrupted;
+}
+
+protocol_version FrameReader::protocol() const {
+	return frameProtocol;
+}
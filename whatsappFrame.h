@@ -0,0 +1,203 @@
+#ifndef _WHATSAPPFRAME_H
+#define _WHATSAPPFRAME_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "whatsappio.h"
+
+/**
+ * The maximal length of a text frame - its length must fit in BYTES_TO_READ_LENGTH digits.
+ */
+#define MAX_TEXT_FRAME_LENGTH 9999
+
+/**
+ * The byte a client that speaks protocol v2 sends once, before its first frame.
+ * A text client always starts with a digit of the length of its first frame, so the first
+ * byte of a connection tells the server which protocol the client speaks.
+ */
+#define WA_V2_PREFACE ((char) 0xA2)
+
+/**
+ * The maximal length of the payload of a v2 frame.
+ */
+#define MAX_V2_PAYLOAD_LENGTH (1 << 20)
+
+/**
+ * The maximal number of bytes of the varint length header of a v2 frame.
+ */
+#define MAX_VARINT_LENGTH 5
+
+/*
+ * The protocols a client may speak:
+ * PROTOCOL_TEXT: frames of a 4 digits decimal length followed by a text command.
+ * PROTOCOL_V2: frames of a varint length followed by a binary payload (see whatsappProtocol.h).
+ */
+enum protocol_version {PROTOCOL_UNKNOWN, PROTOCOL_TEXT, PROTOCOL_V2};
+
+/*
+ * Description: Appends the given number, encoded as a varint (7 bits per byte, least
+ *              significant first, the high bit set on every byte but the last), to 'out'.
+*/
+void appendVarint(std::string& out, uint64_t value);
+
+/*
+ * Description: Decodes a varint that starts at 'cursor', and advances 'cursor' past it.
+ * Returns false iff the varint is incomplete (reaches 'end') or longer than 64 bits.
+*/
+bool readVarint(const char*& cursor, const char* end, uint64_t& value);
+
+class Frame;
+
+/*
+ * A reference to an immutable encoded frame. A frame sent to many clients (e.g. a group
+ * message) is encoded once, and every outbound queue holds a reference to the same bytes.
+ */
+typedef std::shared_ptr<const Frame> FrameRef;
+
+/*
+ * Description: An immutable frame, as it is written to a socket: the length header followed
+ *              by the message (or the payload).
+*/
+class Frame {
+public:
+	/*
+	 * Description: Encodes a message as a text frame (see encodeFrame).
+	 * message: the message to encode.
+	 * Returns a reference to the new frame, or nullptr if the message is too long for
+	 * the text protocol.
+	*/
+	static FrameRef fromMessage(const std::string& message);
+
+	/*
+	 * Description: Encodes a payload as a v2 frame.
+	 * payload: the payload to encode.
+	 * Returns a reference to the new frame.
+	*/
+	static FrameRef fromPayload(const std::string& payload);
+
+	explicit Frame(std::string bytes);
+
+	/*
+	 * Description: A frame whose bytes are owned by another object (e.g. a memory-mapped
+	 *              file), which the frame keeps alive. The bytes are not copied.
+	*/
+	Frame(const char* data, size_t size, std::shared_ptr<const void> owner);
+
+	const char* data() const;
+
+	size_t size() const;
+
+private:
+	const std::string bytes;
+	const std::shared_ptr<const void> owner;
+	const char* const bytesData;
+	const size_t bytesSize;
+};
+
+/*
+ * The result of reading from a socket into a FrameReader:
+ * RECEIVE_DRAINED: everything available was read - the socket would block.
+ * RECEIVE_BUFFER_FULL: the receive buffer is full - the frames in it must be consumed
+ *                      (see 'nextFrame') before the rest can be read.
+ * RECEIVE_CLOSED: the peer closed the connection, or a read error occurred.
+ */
+enum receive_status {RECEIVE_DRAINED, RECEIVE_BUFFER_FULL, RECEIVE_CLOSED};
+
+/*
+ * Description: An incremental decoder of the frames of both protocols. Unlike readData it
+ *              never blocks: it reads whatever bytes are available into its receive buffer,
+ *              and keeps a partially received frame there until the rest of it arrives, so a
+ *              frame may arrive in any number of pieces.
+ *              Frames are decoded in place - 'nextFrame' returns a view into the receive
+ *              buffer - and the buffer is taken from the thread's BufferPool and given back to
+ *              it whenever it holds no partial frame, so receiving allocates nothing in the
+ *              steady state, and an idle connection holds no buffer at all.
+*/
+class FrameReader {
+public:
+	/*
+	 * protocol: the protocol of the frames, or PROTOCOL_UNKNOWN to learn it from the first
+	 * byte (see WA_V2_PREFACE).
+	*/
+	explicit FrameReader(protocol_version protocol = PROTOCOL_UNKNOWN);
+	~FrameReader();
+
+	FrameReader(FrameReader&& other) noexcept;
+	FrameReader& operator=(FrameReader&& other) noexcept;
+	FrameReader(const FrameReader&) = delete;
+	FrameReader& operator=(const FrameReader&) = delete;
+
+	/*
+	 * Description: Reads what is currently available on the given non-blocking
+	 *              file-descriptor into the receive buffer, as long as there is room.
+	 * fd: the (non-blocking) file descriptor of which we should read.
+	 * Returns RECEIVE_DRAINED, RECEIVE_BUFFER_FULL or RECEIVE_CLOSED (see receive_status).
+	*/
+	receive_status readFrom(int fd);
+
+	/*
+	 * Description: Appends bytes that were already received (e.g. by an io_uring receive) to
+	 *              the receive buffer. The receive buffer grows to hold them - up to the largest
+	 *              pooled buffer, beyond which the reader is considered corrupted.
+	*/
+	void append(const char* data, size_t length);
+
+	/*
+	 * Description: Decodes the next complete frame in the receive buffer.
+	 * frame: output - a view of the frame's payload (without its length header). The view is
+	 *        valid until the next call to 'readFrom', 'append' or 'nextFrame'.
+	 * Returns false iff there is no complete frame in the buffer, or the peer violated the
+	 * framing protocol (see 'isCorrupted').
+	*/
+	bool nextFrame(std::string_view& frame);
+
+	/*
+	 * Description: Returns true iff the peer violated the framing protocol.
+	*/
+	bool isCorrupted() const;
+
+	/*
+	 * Description: Returns the protocol of the frames (PROTOCOL_UNKNOWN until the first byte).
+	*/
+	protocol_version protocol() const;
+
+	/*
+	 * Description: Returns the number of bytes read from the file-descriptor so far.
+	*/
+	uint64_t bytesRead() const;
+
+private:
+	/*
+	 * Description: Parses the length header of the frame at the start of the unconsumed
+	 *              bytes.
+	 * Returns the length of the header (and sets 'payloadLength'), or 0 if the header is
+	 * incomplete or invalid (in which case 'corrupted' is set).
+	*/
+	size_t parseHeader(size_t& payloadLength);
+
+	/*
+	 * Description: Makes room at the end of the receive buffer: moves the unconsumed bytes
+	 *              to its start, and replaces it with a larger buffer if the frame being
+	 *              received does not fit in it.
+	*/
+	void makeRoom();
+
+	/*
+	 * Description: Gives the receive buffer back to the pool.
+	*/
+	void releaseBuffer();
+
+	protocol_version frameProtocol;
+	char* buffer;
+	size_t capacity;
+	size_t begin;               // Offset of the first unconsumed byte.
+	size_t end;                 // Offset past the last received byte.
+	size_t neededBytes;         // Size of the frame being received, once its header is known.
+	uint64_t totalBytesRead;
+	bool corrupted;
+};
+
+#endif
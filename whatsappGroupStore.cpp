@@ -0,0 +1,516 @@
+#include "whatsappGroupStore.h"
+#include <algorithm>
+#include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "whatsappProtocol.h"
+
+
+/**
+ * The names of the files of the store: the snapshot, the snapshot while it is being written,
+ * and the logs (their number, in hexadecimal, and the suffix).
+ */
+#define SNAPSHOT_NAME "groups.snapshot"
+#define SNAPSHOT_TEMP_NAME "groups.snapshot.tmp"
+#define LOG_NAME_FORMAT "%016llx.wal"
+#define LOG_NAME_SUFFIX ".wal"
+#define HEX_BASE 16
+
+/**
+ * Identifies a snapshot file, and the version of its format.
+ */
+#define SNAPSHOT_MAGIC "WAGS"
+#define SNAPSHOT_FORMAT_VERSION 1
+
+/**
+ * The kinds of the records of a log.
+ * LOG_CREATE_GROUP: the name of the group, followed by the names of its members.
+ * LOG_CLIENT_EXIT: the name of a client that has exited, and left its groups.
+ */
+#define LOG_CREATE_GROUP 1
+#define LOG_CLIENT_EXIT 2
+
+/**
+ * How long a failed log waits before it is recovered by a snapshot, again.
+ */
+#define LOG_RECOVERY_INTERVAL std::chrono::seconds(1)
+
+namespace {
+
+/*
+ * Description: The header of a snapshot, followed by its groups: each is the name of the group
+ *              (a length-prefixed field), the number of its members (a varint), and their names.
+*/
+struct SnapshotHeader {
+	char magic[4];
+	uint32_t formatVersion;
+	uint64_t firstLogNumber;    // The logs that follow the snapshot start with this one.
+	uint64_t numOfGroups;
+};
+
+/*
+ * Description: A file mapped (read-only) into memory for as long as the object lives.
+*/
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path) : data(nullptr), size(0), isMissing(false) {
+		int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat status = {};
+		if (fd < 0) {
+			isMissing = errno == ENOENT;
+			return;
+		}
+		if (fstat(fd, &status) == 0 && status.st_size == 0) {
+			data = "";
+		} else if (status.st_size > 0) {
+			void* mapping = mmap(nullptr, (size_t) status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping != MAP_FAILED) {
+				data = (const char*) mapping;
+				size = (size_t) status.st_size;
+				// The file is read once, from start to end.
+				madvise(mapping, size, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+	}
+
+	~MappedFile() {
+		if (size > 0) {
+			munmap((void*) data, size);
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const char* data;       // nullptr if the file could not be mapped.
+	size_t size;
+	bool isMissing;
+};
+
+/*
+ * Description: Locks a set of the stripes of a GroupStore for as long as the object lives.
+ *              The stripes are always locked in the order of their indexes, so two sets that
+ *              overlap never deadlock.
+*/
+class StripeLock {
+public:
+	StripeLock(std::mutex* stripes, const std::bitset<GROUP_LOG_STRIPES>& locked) :
+			stripes(stripes), locked(locked) {
+		for (size_t i = 0; i < GROUP_LOG_STRIPES; i++) {
+			if (locked[i]) {
+				stripes[i].lock();
+			}
+		}
+	}
+
+	~StripeLock() {
+		for (size_t i = GROUP_LOG_STRIPES; i-- > 0; ) {
+			if (locked[i]) {
+				stripes[i].unlock();
+			}
+		}
+	}
+
+	StripeLock(const StripeLock&) = delete;
+	StripeLock& operator=(const StripeLock&) = delete;
+
+private:
+	std::mutex* stripes;
+	std::bitset<GROUP_LOG_STRIPES> locked;
+};
+
+/*
+ * Description: Makes the creation (or renaming) of the files of a directory durable.
+*/
+void syncDirectory(const std::string& directory) {
+	int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fsync(fd) < 0) {
+		print_error("fsync", errno);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+}
+
+
+GroupStore::GroupStore(ClientRegistry& registry) : registry(registry),
+		snapshotSize(GROUP_LOG_SNAPSHOT_SIZE), recordsAppended(0), recordsCommitted(0),
+		isLogFailed(false), isSnapshotRequested(false), toStop(false), logFD(-1), logNumber(0), oldestLogNumber(0),
+		bytesLogged(0) {
+}
+
+GroupStore::~GroupStore() {
+	close();
+	if (logFD >= 0) {
+		::close(logFD);
+	}
+}
+
+std::string GroupStore::logPath(uint64_t number) const {
+	char name[sizeof(LOG_NAME_FORMAT) + 2 * sizeof(uint64_t)];
+	snprintf(name, sizeof(name), LOG_NAME_FORMAT, (unsigned long long) number);
+	return directory + "/" + name;
+}
+
+size_t GroupStore::stripeOf(std::string_view name) {
+	return std::hash<std::string_view>()(name) % GROUP_LOG_STRIPES;
+}
+
+bool GroupStore::open(const std::string& directory, size_t snapshotSize) {
+	this->directory = directory;
+	this->snapshotSize = snapshotSize;
+	if (mkdir(directory.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+		print_error("mkdir", errno);
+		return false;
+	}
+	uint64_t firstLogNumber = 0;
+	if (!loadSnapshot(firstLogNumber)) {
+		return false;
+	}
+
+	DIR* directoryStream = opendir(directory.c_str());
+	if (directoryStream == nullptr) {
+		print_error("opendir", errno);
+		return false;
+	}
+	std::vector<uint64_t> logNumbers;
+	struct dirent* entry;
+	while ((entry = readdir(directoryStream)) != nullptr) {
+		char* end;
+		uint64_t number = strtoull(entry->d_name, &end, HEX_BASE);
+		if (end != entry->d_name && strcmp(end, LOG_NAME_SUFFIX) == 0) {
+			logNumbers.push_back(number);
+		}
+	}
+	closedir(directoryStream);
+
+	std::sort(logNumbers.begin(), logNumbers.end());
+	logNumber = firstLogNumber;
+	oldestLogNumber = firstLogNumber;
+	bool isAnyLogReplayed = false;
+	for (uint64_t number : logNumbers) {
+		struct stat status;
+		if (number < firstLogNumber) {
+			unlink(logPath(number).c_str());    // left behind by a snapshot that was cut short.
+		} else if (stat(logPath(number).c_str(), &status) == 0 && status.st_size == 0) {
+			unlink(logPath(number).c_str());    // nothing was logged before the server stopped.
+			logNumber = number + 1;
+		} else if (!replayLog(logPath(number))) {
+			return false;
+		} else {
+			logNumber = number + 1;
+			isAnyLogReplayed = true;
+		}
+	}
+
+	// The replayed logs are folded into a snapshot as soon as possible.
+	isSnapshotRequested = isAnyLogReplayed;
+	// A new log, so a record cut short at the end of the last one is never followed by another.
+	if (!openLog()) {
+		return false;
+	}
+	logThread = std::thread([this]() { runLog(); });
+	return true;
+}
+
+bool GroupStore::loadSnapshot(uint64_t& firstLogNumber) {
+	MappedFile snapshot(directory + "/" SNAPSHOT_NAME);
+	if (snapshot.isMissing) {
+		return true;
+	}
+	SnapshotHeader header;
+	if (snapshot.data == nullptr || snapshot.size < sizeof(header)) {
+		print_error("mmap", errno);
+		return false;
+	}
+	memcpy(&header, snapshot.data, sizeof(header));
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.formatVersion != SNAPSHOT_FORMAT_VERSION) {
+		print_error("snapshot", EINVAL);
+		return false;
+	}
+
+	const char* cursor = snapshot.data + sizeof(header);
+	const char* end = snapshot.data + snapshot.size;
+	std::vector<std::string_view> members;
+	for (uint64_t i = 0; i < header.numOfGroups; i++) {
+		std::string_view groupName;
+		uint64_t numOfMembers;
+		if (!readField(cursor, end, groupName) || !readVarint(cursor, end, numOfMembers)) {
+			print_error("snapshot", EINVAL);
+			return false;
+		}
+		members.resize(numOfMembers);
+		for (std::string_view &member : members) {
+			if (!readField(cursor, end, member)) {
+				print_error("snapshot", EINVAL);
+				return false;
+			}
+		}
+		if (!registry.restoreGroup(groupName, members.data(), members.size())) {
+			print_group_not_restored(groupName);
+		}
+	}
+	firstLogNumber = header.firstLogNumber;
+	return true;
+}
+
+bool GroupStore::replayLog(const std::string& path) {
+	MappedFile log(path);
+	if (log.data == nullptr) {
+		print_error("mmap", errno);
+		return false;
+	}
+	const char* cursor = log.data;
+	const char* end = log.data + log.size;
+	std::vector<std::string_view> members;
+	uint64_t recordLength;
+	while (cursor < end && readVarint(cursor, end, recordLength) && recordLength > 0 &&
+	       recordLength <= (uint64_t) (end - cursor)) {
+		const char* recordEnd = cursor + recordLength;
+		auto type = (uint8_t) *cursor++;
+		std::string_view name;
+		if (!readField(cursor, recordEnd, name)) {
+			break;
+		}
+		if (type == LOG_CREATE_GROUP) {
+			members.clear();
+			std::string_view member;
+			while (cursor < recordEnd && readField(cursor, recordEnd, member)) {
+				members.push_back(member);
+			}
+			if (!registry.restoreGroup(name, members.data(), members.size())) {
+				print_group_not_restored(name);
+			}
+		} else if (type == LOG_CLIENT_EXIT) {
+			registry.restoreExit(name);
+		}
+		cursor = recordEnd;
+	}
+	return true;
+}
+
+bool GroupStore::openLog() {
+	int fd = ::open(logPath(logNumber).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+	                S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		print_error("open", errno);
+		return false;
+	}
+	syncDirectory(directory);
+	if (logFD >= 0) {
+		::close(logFD);
+	}
+	logFD = fd;
+	logNumber++;
+	bytesLogged = 0;
+	return true;
+}
+
+void GroupStore::appendRecord(const std::string& record) {
+	std::lock_guard<std::mutex> lock(logMutex);
+	appendVarint(pendingRecords, record.size());
+	pendingRecords.append(record);
+	recordsAppended++;
+	workToDo.notify_one();
+}
+
+void GroupStore::writeRecords(const std::string& records, uint64_t recordsUpTo) {
+	// A single write per commit: only its last record may be cut short, if the server dies
+	// while writing.
+	if (!records.empty() &&
+	    (writeBytes(logFD, records.data(), records.size()) == WRITE_FAILURE ||
+	     fdatasync(logFD) < 0)) {
+		print_error("write", errno);
+		// The log may end with a partial record now, so nothing is appended to it anymore.
+		std::lock_guard<std::mutex> lock(logMutex);
+		isLogFailed = true;
+		isSnapshotRequested = true;
+		recordsCommittedChanged.notify_all();
+		return;
+	}
+	bytesLogged += records.size();
+	commitRecords(recordsUpTo);
+}
+
+void GroupStore::commitRecords(uint64_t recordsUpTo) {
+	std::lock_guard<std::mutex> lock(logMutex);
+	recordsCommitted = std::max(recordsCommitted, recordsUpTo);
+	if (bytesLogged >= snapshotSize) {
+		isSnapshotRequested = true;
+	}
+	recordsCommittedChanged.notify_all();
+}
+
+bool GroupStore::createGroup(std::string_view groupName, ClientId creator,
+                             std::string_view creatorName, const std::string_view* members,
+                             size_t numOfMembers) {
+	std::bitset<GROUP_LOG_STRIPES> involved;
+	involved.set(stripeOf(groupName));
+	involved.set(stripeOf(creatorName));
+	for (size_t i = 0; i < numOfMembers; i++) {
+		involved.set(stripeOf(members[i]));
+	}
+	StripeLock lock(stripes, involved);
+	if (isLogFailed || !registry.createGroup(groupName, creator, members, numOfMembers)) {
+		return false;
+	}
+	std::string record(1, (char) LOG_CREATE_GROUP);
+	appendField(record, groupName);
+	appendField(record, creatorName);
+	for (size_t i = 0; i < numOfMembers; i++) {
+		appendField(record, members[i]);
+	}
+	appendRecord(record);
+	return true;
+}
+
+void GroupStore::unregisterClient(ClientId id, uint64_t connectionId, std::string_view name) {
+	std::bitset<GROUP_LOG_STRIPES> involved;
+	involved.set(stripeOf(name));
+	StripeLock lock(stripes, involved);
+	// A client that was not a member of any group is not restored, so its exit is not logged.
+	if (registry.unregisterClient(id, connectionId) > 0) {
+		std::string record(1, (char) LOG_CLIENT_EXIT);
+		appendField(record, name);
+		appendRecord(record);
+	}
+}
+
+bool GroupStore::commit() {
+	std::unique_lock<std::mutex> lock(logMutex);
+	uint64_t recordsUpTo = recordsAppended;
+	recordsCommittedChanged.wait(lock, [&]() {
+		return recordsCommitted >= recordsUpTo || isLogFailed;
+	});
+	return recordsCommitted >= recordsUpTo;
+}
+
+void GroupStore::takeSnapshot() {
+	std::string tail;
+	uint64_t tailRecordsUpTo;
+	SnapshotHeader header;
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.formatVersion = SNAPSHOT_FORMAT_VERSION;
+	header.numOfGroups = 0;
+	std::string snapshot((const char*) &header, sizeof(header));
+	{
+		// The cut: no change is made while the groups are copied, and the changes that were
+		// buffered until then end the current log - the changes after it go to the next one.
+		StripeLock lock(stripes, std::bitset<GROUP_LOG_STRIPES>().set());
+		{
+			std::lock_guard<std::mutex> bufferLock(logMutex);
+			tail.swap(pendingRecords);
+			tailRecordsUpTo = recordsAppended;
+		}
+		registry.forEachGroup([&](std::string_view groupName,
+		                          const std::vector<std::string_view>& members) {
+			appendField(snapshot, groupName);
+			appendVarint(snapshot, members.size());
+			for (std::string_view member : members) {
+				appendField(snapshot, member);
+			}
+			header.numOfGroups++;
+		});
+	}
+	// A failed log is not written anymore: the snapshot holds the tail's changes anyway.
+	if (!isLogFailed) {
+		writeRecords(tail, tailRecordsUpTo);
+	}
+	if (!openLog()) {
+		return;
+	}
+	{
+		// The tail may have requested the snapshot that is being taken.
+		std::lock_guard<std::mutex> bufferLock(logMutex);
+		isSnapshotRequested = false;
+	}
+	uint64_t firstLogNumber = logNumber - 1;
+	header.firstLogNumber = firstLogNumber;
+	memcpy(&snapshot[0], &header, sizeof(header));
+
+	std::string tempPath = directory + "/" SNAPSHOT_TEMP_NAME;
+	int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	                S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		print_error("open", errno);
+		return;
+	}
+	bool isWritten = writeBytes(fd, snapshot.data(), snapshot.size()) != WRITE_FAILURE &&
+	                 fsync(fd) == 0;
+	if (!isWritten) {
+		print_error("write", errno);
+	}
+	::close(fd);
+	// The snapshot replaces the previous one only once it is complete.
+	if (!isWritten || rename(tempPath.c_str(), (directory + "/" SNAPSHOT_NAME).c_str()) < 0) {
+		unlink(tempPath.c_str());
+		return;
+	}
+	syncDirectory(directory);
+	for (; oldestLogNumber < firstLogNumber; oldestLogNumber++) {
+		unlink(logPath(oldestLogNumber).c_str());
+	}
+	// The changes until the cut are durable, and the changes after it go to the new log.
+	isLogFailed = false;
+	commitRecords(tailRecordsUpTo);
+}
+
+void GroupStore::runLog() {
+	std::unique_lock<std::mutex> lock(logMutex);
+	auto recoveryTime = std::chrono::steady_clock::now();
+	while (true) {
+		if (!pendingRecords.empty() && !isLogFailed) {
+			// Everything that was buffered meanwhile is committed together.
+			std::string records;
+			records.swap(pendingRecords);
+			uint64_t recordsUpTo = recordsAppended;
+			lock.unlock();
+			writeRecords(records, recordsUpTo);
+			lock.lock();
+		} else if (isSnapshotRequested) {
+			isSnapshotRequested = false;
+			lock.unlock();
+			takeSnapshot();
+			lock.lock();
+			recoveryTime = std::chrono::steady_clock::now() + LOG_RECOVERY_INTERVAL;
+		} else if (toStop) {
+			return;
+		} else if (isLogFailed) {
+			// The snapshot that should have recovered the log has failed too: it is retried.
+			if (workToDo.wait_until(lock, recoveryTime) == std::cv_status::timeout) {
+				isSnapshotRequested = true;
+			}
+		} else {
+			workToDo.wait(lock);
+		}
+	}
+}
+
+void GroupStore::close() {
+	{
+		std::lock_guard<std::mutex> lock(logMutex);
+		if (!logThread.joinable()) {
+			return;
+		}
+		toStop = true;
+	}
+	workToDo.notify_one();
+	// The thread writes what is buffered before it stops.
+	logThread.join();
+	if (bytesLogged > 0 || isSnapshotRequested || isLogFailed) {
+		takeSnapshot();
+	}
+}
@@ -0,0 +1,164 @@
+#ifndef _WHATSAPPGROUPSTORE_H
+#define _WHATSAPPGROUPSTORE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "whatsappRegistry.h"
+
+/**
+ * The number of bytes logged since the last snapshot above which a new snapshot is taken.
+ */
+#define GROUP_LOG_SNAPSHOT_SIZE (16 * 1024 * 1024)
+
+/**
+ * The number of locks that order the changes to the groups (by the names they involve).
+ */
+#define GROUP_LOG_STRIPES 64
+
+/*
+ * Description: Keeps the groups of a registry across restarts of the server. Every change to
+ *              the groups (the creation of a group, and the exit of a client that leaves its
+ *              groups) is appended to a write-ahead log, and a background thread periodically
+ *              writes a snapshot of all the groups, after which the older logs are deleted.
+ *              A snapshot is a compact binary file: when the server starts it is mapped into
+ *              memory and its groups are restored straight from the mapping, and only then are
+ *              the (short) logs that follow it replayed. Members of restored groups are
+ *              registered offline until they reconnect.
+ *              The changes to the groups pass through the store, which applies them to the
+ *              registry and logs them in the same order. Changes that involve the same names
+ *              (a group, its creator and its members, or an exiting client) are ordered by a
+ *              striped set of locks, so unrelated changes are made in parallel. A change is
+ *              only appended to a buffer in memory: the background thread writes whatever was
+ *              buffered in a single write, followed by a single fdatasync (group commit). So
+ *              a change is acknowledged before it is durable, and a crash of the machine may
+ *              lose the changes of the last commit.
+ *              A snapshot is taken at a consistent cut: no change is made while the groups are
+ *              copied, and the changes that were buffered until then end the log the snapshot
+ *              replaces - so the logs that follow it hold exactly the changes it does not.
+ *              If the log cannot be written, no group is created until a snapshot (retried
+ *              periodically) has saved the changes that were not written, and a new log has
+ *              been started.
+*/
+class GroupStore {
+public:
+	explicit GroupStore(ClientRegistry& registry);
+	~GroupStore();
+
+	GroupStore(const GroupStore&) = delete;
+	GroupStore& operator=(const GroupStore&) = delete;
+
+	/*
+	 * Description: Opens the store in the given directory (created if missing), restores the
+	 *              groups it holds into the registry, and starts logging.
+	 * snapshotSize: the number of bytes logged since the last snapshot above which a new
+	 *               snapshot is taken.
+	 * Returns false on failure.
+	*/
+	bool open(const std::string& directory, size_t snapshotSize = GROUP_LOG_SNAPSHOT_SIZE);
+
+	/*
+	 * Description: Creates a group in the registry (see ClientRegistry::createGroup), and logs it.
+	 * Returns false iff the group was not created (or the log cannot be written).
+	*/
+	bool createGroup(std::string_view groupName, ClientId creator, std::string_view creatorName,
+	                 const std::string_view* members, size_t numOfMembers);
+
+	/*
+	 * Description: Unregisters a client that has exited (see ClientRegistry::unregisterClient),
+	 *              and logs that it has left its groups.
+	*/
+	void unregisterClient(ClientId id, uint64_t connectionId, std::string_view name);
+
+	/*
+	 * Description: Waits until the changes that were made so far are written to the log.
+	 * Returns false iff they could not be written.
+	*/
+	bool commit();
+
+	/*
+	 * Description: Takes a final snapshot (if anything was logged since the last one), so the
+	 *              next start does not replay any log, and stops the snapshot thread.
+	*/
+	void close();
+
+private:
+	/*
+	 * Description: Restores the groups of the snapshot, if there is one.
+	 * firstLogNumber: output - the number of the first log that follows the snapshot.
+	 * Returns false iff the snapshot exists but could not be read.
+	*/
+	bool loadSnapshot(uint64_t& firstLogNumber);
+
+	/*
+	 * Description: Replays the changes recorded in a log. A record that was cut short ends it.
+	 * Returns false iff the log could not be read.
+	*/
+	bool replayLog(const std::string& path);
+
+	/*
+	 * Description: Starts a new log; the changes from now on are written to it.
+	 * Returns false on failure (in which case the current log is kept).
+	*/
+	bool openLog();
+
+	/*
+	 * Description: Appends a record to the buffer of the records to log. Must be called with
+	 *              the stripes of the names the change involves locked.
+	*/
+	void appendRecord(const std::string& record);
+
+	/*
+	 * Description: Writes buffered records to the log, and waits until they are durable. If
+	 *              they cannot be written, the log is failed, and a snapshot is requested.
+	 * recordsUpTo: the number of records appended until the last of them.
+	*/
+	void writeRecords(const std::string& records, uint64_t recordsUpTo);
+
+	/*
+	 * Description: Marks the records up to the given one as durable, and wakes their waiters.
+	*/
+	void commitRecords(uint64_t recordsUpTo);
+
+	/*
+	 * Description: Writes a snapshot of the groups of the registry, and deletes the logs that
+	 *              precede it. The changes the snapshot holds are durable once it is written,
+	 *              even if they were not logged, which recovers a failed log.
+	*/
+	void takeSnapshot();
+
+	/*
+	 * Description: The log thread: writes the buffered records, and takes a snapshot whenever
+	 *              one is requested.
+	*/
+	void runLog();
+
+	std::string logPath(uint64_t logNumber) const;
+
+	static size_t stripeOf(std::string_view name);
+
+	ClientRegistry& registry;
+	std::string directory;
+	size_t snapshotSize;
+	std::mutex stripes[GROUP_LOG_STRIPES];  // Order the changes in the registry and in the log.
+	std::mutex logMutex;                // Guards the buffered records and the flags below.
+	std::string pendingRecords;         // Appended, but not written yet.
+	uint64_t recordsAppended;
+	uint64_t recordsCommitted;          // Written to the log, or to a snapshot.
+	std::atomic<bool> isLogFailed;      // Set once the log could not be written, until a snapshot.
+	bool isSnapshotRequested;
+	bool toStop;
+	std::condition_variable workToDo;   // Guarded by logMutex.
+	std::condition_variable recordsCommittedChanged;
+	int logFD;                          // The following are used by the log thread only.
+	uint64_t logNumber;                 // The number of the next log (the current one's + 1).
+	uint64_t oldestLogNumber;           // The oldest log that was not deleted yet.
+	size_t bytesLogged;                 // Since the last snapshot.
+	std::thread logThread;
+};
+
+#endif
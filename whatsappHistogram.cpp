@@ -0,0 +1,97 @@
+#include "whatsappHistogram.h"
+#include <algorithm>
+
+
+LatencyHistogram::LatencyHistogram() :
+		buckets(new std::atomic<uint64_t>[HISTOGRAM_NUM_OF_BUCKETS]()), totalCount(0),
+		totalSum(0), maxValue(0) {
+}
+
+void LatencyHistogram::add(std::atomic<uint64_t>& counter, uint64_t amount) {
+	counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t value) {
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return (size_t) value;
+	}
+	// The highest bits of the value pick its bucket within its power of two.
+	auto shift = (size_t) (63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS);
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t) (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+uint64_t LatencyHistogram::highestValueOf(size_t bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) {
+		return bucket;
+	}
+	size_t shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	uint64_t lowestValue = (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS)
+	                       << shift;
+	return lowestValue + ((uint64_t) 1 << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value) {
+	add(buckets[bucketOf(value)], 1);
+	add(totalCount, 1);
+	add(totalSum, value);
+	if (value > maxValue.load(std::memory_order_relaxed)) {
+		maxValue.store(value, std::memory_order_relaxed);
+	}
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+	for (size_t i = 0; i < HISTOGRAM_NUM_OF_BUCKETS; i++) {
+		add(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+	}
+	add(totalCount, other.totalCount.load(std::memory_order_relaxed));
+	add(totalSum, other.totalSum.load(std::memory_order_relaxed));
+	maxValue.store(std::max(maxValue.load(std::memory_order_relaxed),
+	                        other.maxValue.load(std::memory_order_relaxed)),
+	               std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset() {
+	for (size_t i = 0; i < HISTOGRAM_NUM_OF_BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+	totalCount.store(0, std::memory_order_relaxed);
+	totalSum.store(0, std::memory_order_relaxed);
+	maxValue.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const {
+	// The buckets are counted again, in case values were recorded while they are read.
+	uint64_t bucketsCount = 0;
+	for (size_t bucket = 0; bucket < HISTOGRAM_NUM_OF_BUCKETS; bucket++) {
+		bucketsCount += buckets[bucket].load(std::memory_order_relaxed);
+	}
+	if (bucketsCount == 0) {
+		return 0;
+	}
+	// The rank of the value, counting from 1: the smallest value is the 0th percentile.
+	auto rank = (uint64_t) (percentile / 100 * (double) bucketsCount + 0.5);
+	rank = std::max(rank, (uint64_t) 1);
+	uint64_t seen = 0;
+	uint64_t highest = maxValue.load(std::memory_order_relaxed);
+	for (size_t bucket = 0; bucket < HISTOGRAM_NUM_OF_BUCKETS; bucket++) {
+		seen += buckets[bucket].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			return std::min(highestValueOf(bucket), highest);
+		}
+	}
+	return highest;
+}
+
+uint64_t LatencyHistogram::count() const {
+	return totalCount.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const {
+	return maxValue.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+	uint64_t numOfValues = count();
+	return numOfValues == 0 ? 0 : (double) totalSum.load(std::memory_order_relaxed) /
+	                              (double) numOfValues;
+}
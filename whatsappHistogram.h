@@ -0,0 +1,90 @@
+#ifndef _WHATSAPPHISTOGRAM_H
+#define _WHATSAPPHISTOGRAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Every power of two is divided into 2^HISTOGRAM_SUB_BUCKET_BITS buckets, so a recorded value
+ * is known to within 1/64 of it (values below 64 are known exactly).
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/**
+ * The number of buckets that cover all the 64 bit values.
+ */
+#define HISTOGRAM_NUM_OF_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * Description: A histogram of latencies (or of any non-negative values) in the style of an
+ *              HDR histogram: the buckets are log-linear, so the relative error of every
+ *              percentile is bounded, whatever the range of the values - from nanoseconds to
+ *              minutes - with a fixed number of buckets and no allocation per value.
+ *              Recording a value is a few instructions, and histograms that were recorded
+ *              separately (e.g. by different threads) can be merged.
+ *              A histogram is recorded by a single thread, but other threads may read it (e.g.
+ *              merge it into their own) at the same time, without a lock: every value is
+ *              then either fully read or not at all.
+*/
+class LatencyHistogram {
+public:
+	LatencyHistogram();
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	/*
+	 * Description: Records a single value.
+	*/
+	void record(uint64_t value);
+
+	/*
+	 * Description: Adds the values recorded by another histogram to this one.
+	*/
+	void merge(const LatencyHistogram& other);
+
+	/*
+	 * Description: Forgets all the recorded values. Must not be called while it is read.
+	*/
+	void reset();
+
+	/*
+	 * Description: Returns the value that the given percentage of the recorded values are at
+	 *              most (to within the precision of the buckets), or 0 if nothing was recorded.
+	 * percentile: between 0 and 100, e.g. 99.9.
+	*/
+	uint64_t percentile(double percentile) const;
+
+	uint64_t count() const;
+
+	uint64_t max() const;
+
+	double mean() const;
+
+private:
+	/*
+	 * Description: Returns the index of the bucket of the given value.
+	*/
+	static size_t bucketOf(uint64_t value);
+
+	/*
+	 * Description: Returns the largest value that falls in the given bucket.
+	*/
+	static uint64_t highestValueOf(size_t bucket);
+
+	/*
+	 * Description: Adds to a counter that only the recording thread writes - an atomic
+	 *              read-modify-write (and its locked instruction) is not needed.
+	*/
+	static void add(std::atomic<uint64_t>& counter, uint64_t amount);
+
+	std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+	std::atomic<uint64_t> totalCount;
+	std::atomic<uint64_t> totalSum;
+	std::atomic<uint64_t> maxValue;
+};
+
+#endif
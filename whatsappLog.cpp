@@ -0,0 +1,322 @@
+#include "whatsappLog.h"
+#include "whatsappio.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/**
+ * The number of bytes of text a slot of the ring buffer holds. A longer text takes several
+ * consecutive slots.
+ */
+#define LOG_SLOT_SIZE 256
+
+/**
+ * The number of slots in the ring buffer (a power of two).
+ */
+#define LOG_NUM_OF_SLOTS 8192
+
+/**
+ * The maximal number of slots a single text may take - a longer text is truncated.
+ */
+#define LOG_MAX_SLOTS_PER_TEXT (LOG_NUM_OF_SLOTS / 8)
+
+/**
+ * The maximal length of a formatted line (a longer line is truncated).
+ */
+#define LOG_MAX_LINE 1024
+
+/**
+ * The number of bytes the background thread collects before it writes them.
+ */
+#define LOG_WRITE_SIZE 65536
+
+/**
+ * How long the background thread waits for more lines, once it has written all of them, before
+ * it sleeps until it is woken up (in milliseconds).
+ */
+#define LOG_LINGER_MS 5
+
+/**
+ * The length of a timestamp and a level: "2026-01-31 23:59:59.123456 NOTICE ".
+ */
+#define LOG_MAX_PREFIX 40
+
+/*
+ * Description: A slot of the ring buffer. Slot i holds the positions i, i + LOG_NUM_OF_SLOTS,
+ *              and so on. Its sequence tells the state of the slot for position p:
+ *              p - the slot is free, p + 1 - the text of position p was written to it, and
+ *              anything less than p - it still holds the text of a previous position.
+*/
+struct LogSlot {
+	std::atomic<uint64_t> sequence;
+	uint32_t length;
+	char text[LOG_SLOT_SIZE];
+};
+
+static const char* const LEVEL_NAMES[] = {"DEBUG", "INFO", "ERROR", "NOTICE"};
+
+// The state of the log:
+static LogConfig logConfig = {LOG_DEBUG, true, false, false};
+static std::atomic<bool> isAsync(false);
+static std::unique_ptr<LogSlot[]> slots;
+static std::atomic<uint64_t> nextPosition(0);   // The next position a text is written to.
+static uint64_t nextPositionToWrite = 0;        // Used by the background thread only.
+static std::atomic<uint64_t> numOfDroppedLines(0);
+static std::atomic<bool> isWriterSleeping(false);
+static std::atomic<bool> toStop(false);
+static int wakeupFD = -1;
+static std::thread writerThread;
+
+
+/*
+ * Description: Signals the eventfd the background thread waits on.
+*/
+static void signalWriter() {
+	uint64_t one = 1;
+	ssize_t ignored = write(wakeupFD, &one, sizeof(one));
+	(void) ignored;
+}
+
+
+/*
+ * Description: Wakes the background thread up, if it is sleeping until texts are written.
+*/
+static void wakeWriter() {
+	// Pairs with the fence of the writer: either it sees the new text, or we see it sleeping.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (isWriterSleeping.load(std::memory_order_relaxed) && isWriterSleeping.exchange(false)) {
+		signalWriter();
+	}
+}
+
+
+/*
+ * Description: Copies a text into consecutive slots of the ring buffer. Any number of threads
+ *              may do it at once: a thread claims its slots by advancing nextPosition past
+ *              them, provided the last of them is free (the slots are freed in order, so all
+ *              the others are free too).
+*/
+static void appendText(std::string_view text) {
+	size_t numOfSlots = std::max((text.size() + LOG_SLOT_SIZE - 1) / LOG_SLOT_SIZE, (size_t) 1);
+	if (numOfSlots > LOG_MAX_SLOTS_PER_TEXT) {
+		numOfSlots = LOG_MAX_SLOTS_PER_TEXT;
+		text = text.substr(0, numOfSlots * LOG_SLOT_SIZE);
+	}
+	uint64_t position = nextPosition.load(std::memory_order_relaxed);
+	while (true) {
+		uint64_t lastPosition = position + numOfSlots - 1;
+		uint64_t sequence = slots[lastPosition % LOG_NUM_OF_SLOTS].sequence.load(
+				std::memory_order_acquire);
+		if (sequence == lastPosition) {
+			if (nextPosition.compare_exchange_weak(position, position + numOfSlots,
+			                                       std::memory_order_relaxed)) {
+				break;
+			}
+		} else if (sequence < lastPosition) {  // i.e. the buffer is full.
+			if (logConfig.isLossy) {
+				numOfDroppedLines.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			signalWriter();
+			std::this_thread::yield();
+			position = nextPosition.load(std::memory_order_relaxed);
+		} else {    // another thread has claimed the slot since we read nextPosition.
+			position = nextPosition.load(std::memory_order_relaxed);
+		}
+	}
+	for (size_t i = 0; i < numOfSlots; i++) {
+		LogSlot& slot = slots[(position + i) % LOG_NUM_OF_SLOTS];
+		std::string_view chunk = text.substr(i * LOG_SLOT_SIZE, LOG_SLOT_SIZE);
+		memcpy(slot.text, chunk.data(), chunk.size());
+		slot.length = (uint32_t) chunk.size();
+		slot.sequence.store(position + i + 1, std::memory_order_release);
+	}
+	wakeWriter();
+}
+
+
+/*
+ * Description: Moves the texts that were written to the ring buffer, in order, to 'output' -
+ *              until a slot that is not written yet, or until output holds LOG_WRITE_SIZE.
+ * Returns true iff anything was taken.
+*/
+static bool takeTexts(std::string& output) {
+	bool isTaken = false;
+	while (output.size() < LOG_WRITE_SIZE) {
+		LogSlot& slot = slots[nextPositionToWrite % LOG_NUM_OF_SLOTS];
+		if (slot.sequence.load(std::memory_order_acquire) != nextPositionToWrite + 1) {
+			break;
+		}
+		output.append(slot.text, slot.length);
+		slot.sequence.store(nextPositionToWrite + LOG_NUM_OF_SLOTS, std::memory_order_release);
+		nextPositionToWrite++;
+		isTaken = true;
+	}
+	return isTaken;
+}
+
+
+/*
+ * Description: The background thread: writes the texts of the ring buffer to the standard
+ *              output, and sleeps on an eventfd while there are none. Once it has written
+ *              all of them, it lingers for LOG_LINGER_MS before it sleeps, so the lines of a
+ *              busy server are collected in batches, rather than each wake it up.
+*/
+static void runWriter() {
+	std::string output;
+	output.reserve(LOG_WRITE_SIZE + LOG_SLOT_SIZE);
+	bool hasLingered = false;
+	while (true) {
+		if (takeTexts(output)) {
+			hasLingered = false;
+			continue;
+		}
+		uint64_t numOfDropped = numOfDroppedLines.exchange(0, std::memory_order_relaxed);
+		if (numOfDropped > 0) {
+			output += "WARNING: " + std::to_string(numOfDropped) + " log lines were dropped.\n";
+		}
+		if (!output.empty()) {
+			writeBytes(STDOUT_FILENO, output.data(), output.size());
+			output.clear();
+			continue;
+		}
+		if (toStop.load()) {
+			return;
+		}
+		if (!hasLingered) {
+			struct pollfd wakeup = {wakeupFD, POLLIN, 0};
+			poll(&wakeup, 1, LOG_LINGER_MS);
+			hasLingered = true;
+			continue;
+		}
+		isWriterSleeping.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		LogSlot& slot = slots[nextPositionToWrite % LOG_NUM_OF_SLOTS];
+		if (slot.sequence.load(std::memory_order_acquire) == nextPositionToWrite + 1 ||
+		    toStop.load()) {
+			isWriterSleeping.store(false);
+			continue;
+		}
+		uint64_t counter;
+		ssize_t ignored = read(wakeupFD, &counter, sizeof(counter));
+		(void) ignored;
+	}
+}
+
+
+/*
+ * Description: Writes the timestamp and the level of a line (if the lines are timestamped)
+ *              into 'prefix'.
+ * Returns the length of the prefix.
+*/
+static size_t formatPrefix(log_level level, char* prefix, size_t size) {
+	if (!logConfig.hasTimestamps) {
+		return 0;
+	}
+	struct timespec now;
+	struct tm time;
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &time);
+	size_t length = strftime(prefix, size, "%Y-%m-%d %H:%M:%S", &time);
+	int suffixLength = snprintf(prefix + length, size - length, ".%06ld %s ",
+	                            now.tv_nsec / 1000, LEVEL_NAMES[level]);
+	return std::min(length + (size_t) std::max(suffixLength, 0), size - 1);
+}
+
+
+bool startAsyncLog(const LogConfig& config) {
+	logConfig = config;
+	slots.reset(new LogSlot[LOG_NUM_OF_SLOTS]);
+	for (uint64_t i = 0; i < LOG_NUM_OF_SLOTS; i++) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	wakeupFD = eventfd(0, EFD_CLOEXEC);
+	if (wakeupFD < 0) {
+		print_error("eventfd", errno);
+		return false;
+	}
+	// What was printed synchronously precedes what the background thread writes.
+	fflush(stdout);
+	writerThread = std::thread(runWriter);
+	isAsync.store(true, std::memory_order_release);
+	return true;
+}
+
+
+void stopAsyncLog() {
+	if (!isAsync.exchange(false)) {
+		return;
+	}
+	toStop.store(true);
+	uint64_t one = 1;
+	ssize_t ignored = write(wakeupFD, &one, sizeof(one));
+	(void) ignored;
+	writerThread.join();
+	close(wakeupFD);
+	slots.reset();
+}
+
+
+bool isLogged(log_level level) {
+	return level >= logConfig.level;
+}
+
+
+bool isLoggingBodies() {
+	return logConfig.hasBodies;
+}
+
+
+void logLine(log_level level, const char* format, ...) {
+	if (!isLogged(level)) {
+		return;
+	}
+	va_list arguments;
+	va_start(arguments, format);
+	if (!isAsync.load(std::memory_order_acquire)) {
+		vprintf(format, arguments);
+		va_end(arguments);
+		return;
+	}
+	char line[LOG_MAX_LINE];
+	size_t length = formatPrefix(level, line, LOG_MAX_PREFIX);
+	int textLength = vsnprintf(line + length, sizeof(line) - length, format, arguments);
+	va_end(arguments);
+	if (textLength < 0) {
+		return;
+	}
+	if (length + (size_t) textLength >= sizeof(line)) {     // i.e. the line was truncated.
+		length = sizeof(line) - 1;
+		line[length - 1] = '\n';
+	} else {
+		length += (size_t) textLength;
+	}
+	appendText(std::string_view(line, length));
+}
+
+
+void logText(log_level level, std::string_view text) {
+	if (!isLogged(level)) {
+		return;
+	}
+	if (!isAsync.load(std::memory_order_acquire)) {
+		fwrite(text.data(), 1, text.size(), stdout);
+		return;
+	}
+	char prefix[LOG_MAX_PREFIX];
+	size_t prefixLength = formatPrefix(level, prefix, sizeof(prefix));
+	if (prefixLength == 0) {
+		appendText(text);
+	} else {
+		appendText(std::string(prefix, prefixLength).append(text));
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef _WHATSAPPLOG_H
+#define _WHATSAPPLOG_H
+
+#include <cstddef>
+#include <string_view>
+
+/*
+ * The levels of the lines that are logged, from the least to the most important.
+ * LOG_DEBUG: diagnostics beyond the lines that make up the server's output.
+ * LOG_INFO: the server's output - a line per client, group or request (e.g. a client that
+ *           connects, or a message that is sent).
+ * LOG_ERROR: a failed system call.
+ * LOG_NOTICE: what the user of the program has asked for (e.g. a usage message or a report),
+ *             logged whatever the level.
+ */
+enum log_level {LOG_DEBUG, LOG_INFO, LOG_ERROR, LOG_NOTICE};
+
+/*
+ * Description: How the lines are logged, once the asynchronous log is started.
+ * level: the lines of a lower level are dropped, before they are even formatted.
+ * hasBodies: false if the bodies of the messages are not logged, only their sizes.
+ * hasTimestamps: true if every line starts with the time it was logged (UTC) and its level.
+ *                Otherwise the lines are exactly as the synchronous log prints them.
+ * isLossy: true if lines are dropped (and counted) while the log's buffer is full. Otherwise
+ *          the threads that log wait for room.
+ */
+struct LogConfig {
+	log_level level;
+	bool hasBodies;
+	bool hasTimestamps;
+	bool isLossy;
+};
+
+/*
+ * Description: Starts logging asynchronously: the lines are copied into a bounded lock-free
+ *              ring buffer, which a background thread writes to the standard output in large
+ *              writes, so a slow standard output delays the threads that log only once the
+ *              buffer is full. Until it is started, every line is printed synchronously, with
+ *              printf, whatever its level. Must be called before the threads that log start.
+ * Returns false iff the background thread could not be started.
+*/
+bool startAsyncLog(const LogConfig& config);
+
+/*
+ * Description: Writes the lines that are still buffered and stops the background thread. The
+ *              lines logged afterwards are printed synchronously. Must be called once the
+ *              other threads have stopped logging.
+*/
+void stopAsyncLog();
+
+/*
+ * Description: Returns true iff lines of the given level are logged.
+*/
+bool isLogged(log_level level);
+
+/*
+ * Description: Returns true iff the bodies of the messages are logged.
+*/
+bool isLoggingBodies();
+
+/*
+ * Description: Logs a printf-style formatted text (normally a line, with its '\n').
+*/
+void logLine(log_level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Description: Logs a text (one or more lines) as it is. The text is never interleaved with
+ *              the lines of other threads.
+*/
+void logText(log_level level, std::string_view text);
+
+#endif
@@ -0,0 +1,58 @@
+#include "whatsappMailbox.h"
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+Mailbox::Mailbox() : head(nullptr), eventFD(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+}
+
+Mailbox::~Mailbox() {
+	MailboxMessage* message = collect();
+	while (message != nullptr) {
+		MailboxMessage* next = message->next;
+		delete message;
+		message = next;
+	}
+	if (eventFD >= 0) {
+		close(eventFD);
+	}
+}
+
+bool Mailbox::isValid() const {
+	return eventFD >= 0;
+}
+
+int Mailbox::wakeupFD() const {
+	return eventFD;
+}
+
+void Mailbox::post(MailboxMessage* message) {
+	message->next = head.load(std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(message->next, message,
+	                                   std::memory_order_release, std::memory_order_relaxed)) {
+	}
+	if (message->next == nullptr) {     // the owner may be asleep - wake it up.
+		uint64_t one = 1;
+		ssize_t ignored = write(eventFD, &one, sizeof(one));
+		(void) ignored;
+	}
+}
+
+MailboxMessage* Mailbox::collect() {
+	// The wakeup is consumed before the messages are taken, so a message posted in between
+	// is either taken now or signals the eventfd again - it is never left unnoticed.
+	uint64_t counter;
+	ssize_t ignored = read(eventFD, &counter, sizeof(counter));
+	(void) ignored;
+
+	MailboxMessage* message = head.exchange(nullptr, std::memory_order_acquire);
+	MailboxMessage* inOrder = nullptr;
+	while (message != nullptr) {    // the messages were pushed as a stack - reverse them.
+		MailboxMessage* next = message->next;
+		message->next = inOrder;
+		inOrder = message;
+		message = next;
+	}
+	return inOrder;
+}
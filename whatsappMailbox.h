@@ -0,0 +1,72 @@
+#ifndef _WHATSAPPMAILBOX_H
+#define _WHATSAPPMAILBOX_H
+
+#include <atomic>
+#include <string>
+#include "whatsappConnection.h"
+
+/*
+ * The kinds of messages one worker thread hands off to another.
+ * DELIVER: queue 'frame' to the 'target' connection ('delivery' is the message as a v2 frame,
+ *          to store instead if the target is a slow consumer - see --slow-consumer=spill).
+ * WATCH: resume 'producer' once the 'target' connection is no longer backed up.
+ * RESUME: read again from the 'target' connection, which was paused.
+ * REPLAY: deliver the messages that were stored for the 'target' client while it was offline.
+ * SHUTDOWN: send serverEXIT to every connection and stop.
+ */
+enum mailbox_message_type {DELIVER, WATCH, RESUME, REPLAY, SHUTDOWN};
+
+/*
+ * Description: A message posted to the mailbox of a worker thread.
+*/
+struct MailboxMessage {
+	mailbox_message_type type;
+	ConnectionHandle target;
+	ConnectionHandle producer;
+	FrameRef frame;
+	FrameRef delivery;
+	MailboxMessage* next;
+};
+
+/*
+ * Description: A lock-free multiple-producers single-consumer queue of messages addressed to
+ *              a worker thread. Any thread may post a message; only the owning worker collects
+ *              them. Posting to an empty mailbox signals an eventfd the owner's event loop
+ *              watches, so a busy mailbox costs a single wakeup for any number of messages.
+*/
+class Mailbox {
+public:
+	Mailbox();
+	~Mailbox();
+
+	Mailbox(const Mailbox&) = delete;
+	Mailbox& operator=(const Mailbox&) = delete;
+
+	/*
+	 * Description: Returns true iff the mailbox's eventfd was created successfully.
+	*/
+	bool isValid() const;
+
+	/*
+	 * Description: Returns the file-descriptor that becomes readable when messages are posted.
+	*/
+	int wakeupFD() const;
+
+	/*
+	 * Description: Posts a message to the mailbox. May be called from any thread.
+	 * message: a heap allocated message - the mailbox's owner takes ownership of it.
+	*/
+	void post(MailboxMessage* message);
+
+	/*
+	 * Description: Takes all the messages that were posted so far. Called by the owner only.
+	 * Returns a list (linked through 'next') of the messages, in the order they were posted.
+	*/
+	MailboxMessage* collect();
+
+private:
+	std::atomic<MailboxMessage*> head;      // The most recently posted message.
+	int eventFD;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include "whatsappMetrics.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <sys/resource.h>
+
+
+/**
+ * The names of the request types, indexed by command_type.
+ */
+static const char* const COMMAND_NAMES[NUM_OF_COMMAND_TYPES] = {"create_group", "send", "who",
+                                                                 "exit", "send_batch",
+                                                                 "invalid"};
+
+/**
+ * The percentiles of the latencies that are reported.
+ */
+static const double REPORTED_PERCENTILES[] = {50, 90, 99, 99.9};
+
+#define NS_PER_SECOND 1e9
+#define NS_PER_MICROSECOND 1e3
+
+/**
+ * The file the kernel counts the process's input and output in.
+ */
+#define PROCESS_IO_PATH "/proc/self/io"
+
+
+uint64_t monotonicNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+
+WorkerMetrics::WorkerMetrics() {
+	for (std::atomic<uint64_t> &counter : counters) {
+		counter.store(0, std::memory_order_relaxed);
+	}
+}
+
+void WorkerMetrics::recordRequest(command_type type, uint64_t latencyNs) {
+	add((metric_counter) (METRIC_REQUESTS + type));
+	latencies[type].record(latencyNs);
+}
+
+uint64_t WorkerMetrics::counter(metric_counter counter) const {
+	return counters[counter].load(std::memory_order_relaxed);
+}
+
+const LatencyHistogram& WorkerMetrics::latencyOf(command_type type) const {
+	return latencies[type];
+}
+
+
+/*
+ * Description: Reads the resources the process has used so far. Whatever cannot be read is
+ *              left zero.
+*/
+static void readProcessUsage(ProcessUsage& usage) {
+	struct rusage resources;
+	if (getrusage(RUSAGE_SELF, &resources) == 0) {
+		usage.userNs = (uint64_t) resources.ru_utime.tv_sec * 1000000000 +
+		               (uint64_t) resources.ru_utime.tv_usec * 1000;
+		usage.systemNs = (uint64_t) resources.ru_stime.tv_sec * 1000000000 +
+		                 (uint64_t) resources.ru_stime.tv_usec * 1000;
+	}
+	FILE* ioFile = fopen(PROCESS_IO_PATH, "r");
+	if (ioFile == nullptr) {
+		return;
+	}
+	char name[32];
+	unsigned long long value;
+	while (fscanf(ioFile, "%31[^:]: %llu\n", name, &value) == 2) {
+		if (strcmp(name, "syscr") == 0) {
+			usage.readCalls = value;
+		} else if (strcmp(name, "syscw") == 0) {
+			usage.writeCalls = value;
+		}
+	}
+	fclose(ioFile);
+}
+
+
+MetricsSnapshot::MetricsSnapshot(uint64_t startNs, size_t numOfGroups) :
+		startNs(startNs), numOfGroups(numOfGroups), counts(), usage() {
+	counts.takenNs = monotonicNs();
+	readProcessUsage(usage);
+}
+
+void MetricsSnapshot::add(const WorkerMetrics& metrics) {
+	for (int counter = 0; counter < NUM_OF_METRICS; counter++) {
+		counts.values[counter] += metrics.counter((metric_counter) counter);
+	}
+	for (int type = 0; type < NUM_OF_COMMAND_TYPES; type++) {
+		latencies[type].merge(metrics.latencyOf((command_type) type));
+	}
+}
+
+
+/*
+ * Description: Returns the current value of a gauge: what was added minus what was removed
+ *              (which, read from workers that are running, may briefly be more).
+*/
+static uint64_t gaugeOf(uint64_t added, uint64_t removed) {
+	return added > removed ? added - removed : 0;
+}
+
+static uint64_t connectedClientsOf(const MetricCounts& counts) {
+	return gaugeOf(counts.values[METRIC_CLIENTS_CONNECTED],
+	               counts.values[METRIC_CLIENTS_DISCONNECTED]);
+}
+
+static uint64_t queuedBytesOf(const MetricCounts& counts) {
+	return gaugeOf(counts.values[METRIC_BYTES_QUEUED],
+	               counts.values[METRIC_BYTES_OUT] + counts.values[METRIC_BYTES_DISCARDED]);
+}
+
+/*
+ * Description: Appends printf-style formatted text to a string.
+*/
+static void appendFormatted(std::string& text, const char* format, ...)
+		__attribute__((format(printf, 2, 3)));
+
+static void appendFormatted(std::string& text, const char* format, ...) {
+	char line[256];
+	va_list arguments;
+	va_start(arguments, format);
+	int length = vsnprintf(line, sizeof(line), format, arguments);
+	va_end(arguments);
+	if (length > 0) {
+		text.append(line, std::min((size_t) length, sizeof(line) - 1));
+	}
+}
+
+
+std::string formatMetricsReport(const MetricsSnapshot& snapshot, const MetricCounts& previous) {
+	const uint64_t* values = snapshot.counts.values;
+	double seconds = (double) (snapshot.counts.takenNs - previous.takenNs) / NS_PER_SECOND;
+	auto rateOf = [&](int counter) {
+		return seconds > 0 ? (double) (values[counter] - previous.values[counter]) / seconds : 0;
+	};
+	std::string report;
+	appendFormatted(report, "uptime %.1f s, %llu clients connected, %zu groups\n",
+	                (double) (snapshot.counts.takenNs - snapshot.startNs) / NS_PER_SECOND,
+	                (unsigned long long) connectedClientsOf(snapshot.counts),
+	                snapshot.numOfGroups);
+	appendFormatted(report, "rates over the last %.1f s\n", seconds);
+	appendFormatted(report, "connections: %llu (%.1f/s), %llu handshakes timed out\n",
+	                (unsigned long long) values[METRIC_CLIENTS_CONNECTED],
+	                rateOf(METRIC_CLIENTS_CONNECTED),
+	                (unsigned long long) values[METRIC_HANDSHAKES_TIMED_OUT]);
+	for (int type = 0; type < NUM_OF_COMMAND_TYPES; type++) {
+		appendFormatted(report, "requests %s: %llu (%.1f/s)\n", COMMAND_NAMES[type],
+		                (unsigned long long) values[METRIC_REQUESTS + type],
+		                rateOf(METRIC_REQUESTS + type));
+	}
+	appendFormatted(report, "messages: %llu sent (%.1f/s), %llu failed, %llu throttled, "
+	                "%llu deliveries (%.1f/s), %llu stored, %llu refused by the offline store\n",
+	                (unsigned long long) values[METRIC_MESSAGES_SENT],
+	                rateOf(METRIC_MESSAGES_SENT),
+	                (unsigned long long) values[METRIC_MESSAGES_FAILED],
+	                (unsigned long long) values[METRIC_MESSAGES_THROTTLED],
+	                (unsigned long long) values[METRIC_DELIVERIES], rateOf(METRIC_DELIVERIES),
+	                (unsigned long long) values[METRIC_MESSAGES_STORED],
+	                (unsigned long long) values[METRIC_MESSAGES_REFUSED]);
+	appendFormatted(report, "bytes: %llu in (%.0f/s), %llu out (%.0f/s), %llu queued, "
+	                "%llu discarded\n",
+	                (unsigned long long) values[METRIC_BYTES_IN], rateOf(METRIC_BYTES_IN),
+	                (unsigned long long) values[METRIC_BYTES_OUT], rateOf(METRIC_BYTES_OUT),
+	                (unsigned long long) queuedBytesOf(snapshot.counts),
+	                (unsigned long long) values[METRIC_BYTES_DISCARDED]);
+	appendFormatted(report, "reads paused: %llu, budgets exhausted: %llu\n",
+	                (unsigned long long) values[METRIC_READS_PAUSED],
+	                (unsigned long long) values[METRIC_BUDGETS_EXHAUSTED]);
+	appendFormatted(report, "slow consumers: %llu frames dropped, %llu messages spilled, "
+	                "%llu evicted\n",
+	                (unsigned long long) values[METRIC_FRAMES_DROPPED],
+	                (unsigned long long) values[METRIC_MESSAGES_SPILLED],
+	                (unsigned long long) values[METRIC_SLOW_CONSUMERS_EVICTED]);
+	appendFormatted(report, "cpu: %.2f s user, %.2f s system; system calls: %llu loop turns, "
+	                "%llu reads, %llu writes\n",
+	                (double) snapshot.usage.userNs / NS_PER_SECOND,
+	                (double) snapshot.usage.systemNs / NS_PER_SECOND,
+	                (unsigned long long) values[METRIC_LOOP_TURNS],
+	                (unsigned long long) snapshot.usage.readCalls,
+	                (unsigned long long) snapshot.usage.writeCalls);
+	for (int type = 0; type < NUM_OF_COMMAND_TYPES; type++) {
+		const LatencyHistogram& latencies = snapshot.latencies[type];
+		if (latencies.count() == 0) {
+			continue;
+		}
+		appendFormatted(report, "latency %s (us):", COMMAND_NAMES[type]);
+		for (double percentile : REPORTED_PERCENTILES) {
+			appendFormatted(report, " p%g %.1f", percentile,
+			                (double) latencies.percentile(percentile) / NS_PER_MICROSECOND);
+		}
+		appendFormatted(report, " max %.1f\n", (double) latencies.max() / NS_PER_MICROSECOND);
+	}
+	return report;
+}
+
+
+std::string formatMetricsExposition(const MetricsSnapshot& snapshot) {
+	const uint64_t* values = snapshot.counts.values;
+	std::string text;
+	auto appendCounter = [&](const char* name, uint64_t value) {
+		appendFormatted(text, "whatsapp_%s %llu\n", name, (unsigned long long) value);
+	};
+	appendFormatted(text, "whatsapp_uptime_seconds %.3f\n",
+	                (double) (snapshot.counts.takenNs - snapshot.startNs) / NS_PER_SECOND);
+	appendCounter("clients_connected", connectedClientsOf(snapshot.counts));
+	appendCounter("groups", snapshot.numOfGroups);
+	appendCounter("connections_total", values[METRIC_CLIENTS_CONNECTED]);
+	appendCounter("handshake_timeouts_total", values[METRIC_HANDSHAKES_TIMED_OUT]);
+	for (int type = 0; type < NUM_OF_COMMAND_TYPES; type++) {
+		appendFormatted(text, "whatsapp_requests_total{type=\"%s\"} %llu\n", COMMAND_NAMES[type],
+		                (unsigned long long) values[METRIC_REQUESTS + type]);
+	}
+	appendCounter("messages_sent_total", values[METRIC_MESSAGES_SENT]);
+	appendCounter("messages_failed_total", values[METRIC_MESSAGES_FAILED]);
+	appendCounter("messages_throttled_total", values[METRIC_MESSAGES_THROTTLED]);
+	appendCounter("deliveries_total", values[METRIC_DELIVERIES]);
+	appendCounter("messages_stored_total", values[METRIC_MESSAGES_STORED]);
+	appendCounter("messages_refused_total", values[METRIC_MESSAGES_REFUSED]);
+	appendCounter("received_bytes_total", values[METRIC_BYTES_IN]);
+	appendCounter("sent_bytes_total", values[METRIC_BYTES_OUT]);
+	appendCounter("queued_bytes", queuedBytesOf(snapshot.counts));
+	appendCounter("discarded_bytes_total", values[METRIC_BYTES_DISCARDED]);
+	appendCounter("paused_reads_total", values[METRIC_READS_PAUSED]);
+	appendCounter("dropped_frames_total", values[METRIC_FRAMES_DROPPED]);
+	appendCounter("spilled_messages_total", values[METRIC_MESSAGES_SPILLED]);
+	appendCounter("evicted_slow_consumers_total", values[METRIC_SLOW_CONSUMERS_EVICTED]);
+	appendCounter("exhausted_budgets_total", values[METRIC_BUDGETS_EXHAUSTED]);
+	appendCounter("loop_turns_total", values[METRIC_LOOP_TURNS]);
+	appendFormatted(text, "whatsapp_cpu_seconds_total{mode=\"user\"} %.6f\n",
+	                (double) snapshot.usage.userNs / NS_PER_SECOND);
+	appendFormatted(text, "whatsapp_cpu_seconds_total{mode=\"system\"} %.6f\n",
+	                (double) snapshot.usage.systemNs / NS_PER_SECOND);
+	appendCounter("read_calls_total", snapshot.usage.readCalls);
+	appendCounter("write_calls_total", snapshot.usage.writeCalls);
+	for (int type = 0; type < NUM_OF_COMMAND_TYPES; type++) {
+		const LatencyHistogram& latencies = snapshot.latencies[type];
+		for (double percentile : REPORTED_PERCENTILES) {
+			appendFormatted(text, "whatsapp_request_latency_seconds{type=\"%s\",quantile=\"%g\"} "
+			                "%.9f\n", COMMAND_NAMES[type], percentile / 100,
+			                (double) latencies.percentile(percentile) / NS_PER_SECOND);
+		}
+		appendFormatted(text, "whatsapp_request_latency_seconds_max{type=\"%s\"} %.9f\n",
+		                COMMAND_NAMES[type], (double) latencies.max() / NS_PER_SECOND);
+		appendFormatted(text, "whatsapp_request_latency_seconds_count{type=\"%s\"} %llu\n",
+		                COMMAND_NAMES[type], (unsigned long long) latencies.count());
+	}
+	return text;
+}
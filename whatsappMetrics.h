@@ -0,0 +1,146 @@
+#ifndef _WHATSAPPMETRICS_H
+#define _WHATSAPPMETRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "whatsappio.h"
+#include "whatsappHistogram.h"
+
+/**
+ * The number of request types (an invalid request included).
+ */
+#define NUM_OF_COMMAND_TYPES (INVALID + 1)
+
+/*
+ * The counters every worker keeps. They only ever grow, so that the counters of all the
+ * workers can be summed at any time: the current number of connected clients, for example, is
+ * the number of clients that connected minus the number that disconnected, and the number of
+ * bytes queued is the number queued minus the number written and discarded.
+ * METRIC_REQUESTS: the first of NUM_OF_COMMAND_TYPES counters, one per request type.
+ * METRIC_DELIVERIES: the messages queued to connected recipients (one per group member).
+ * METRIC_MESSAGES_STORED: the messages stored for offline recipients.
+ * METRIC_MESSAGES_REFUSED: the messages the offline store refused, since their recipient's
+ *                          quota (or the store's capacity) was used up.
+ * METRIC_MESSAGES_THROTTLED: the messages that were not sent, since their senders have sent
+ *                            faster than their rate limits allow.
+ * METRIC_BYTES_DISCARDED: queued bytes that were dropped with a lost connection (or by the
+ *                         slow consumer policy).
+ * METRIC_READS_PAUSED: the times a client was paused because a recipient was backed up.
+ * METRIC_FRAMES_DROPPED: the queued frames a slow consumer was not sent, to make room for
+ *                        newer ones (--slow-consumer=drop-oldest).
+ * METRIC_MESSAGES_SPILLED: the messages to slow consumers that were stored in the offline
+ *                          store rather than queued (--slow-consumer=spill).
+ * METRIC_SLOW_CONSUMERS_EVICTED: the slow consumers that were disconnected
+ *                                (--slow-consumer=disconnect).
+ * METRIC_BUDGETS_EXHAUSTED: the times a client used up its frame budget of a loop turn, and
+ *                          the rest of its requests were left to the next turn.
+ * METRIC_HANDSHAKES_TIMED_OUT: the clients that were disconnected since their hello did not
+ *                             arrive in time.
+ * METRIC_LOOP_TURNS: the turns of the event loops - each waits in a single system call
+ *                    (epoll_wait or io_uring_enter).
+ */
+enum metric_counter {METRIC_CLIENTS_CONNECTED, METRIC_CLIENTS_DISCONNECTED, METRIC_REQUESTS,
+                     METRIC_MESSAGES_SENT = METRIC_REQUESTS + NUM_OF_COMMAND_TYPES,
+                     METRIC_MESSAGES_FAILED, METRIC_DELIVERIES, METRIC_MESSAGES_STORED,
+                     METRIC_MESSAGES_REFUSED, METRIC_MESSAGES_THROTTLED, METRIC_BYTES_IN,
+                     METRIC_BYTES_OUT, METRIC_BYTES_QUEUED, METRIC_BYTES_DISCARDED, METRIC_READS_PAUSED,
+                     METRIC_FRAMES_DROPPED, METRIC_MESSAGES_SPILLED, METRIC_SLOW_CONSUMERS_EVICTED,
+                     METRIC_BUDGETS_EXHAUSTED, METRIC_HANDSHAKES_TIMED_OUT, METRIC_LOOP_TURNS,
+                     NUM_OF_METRICS};
+
+/*
+ * Description: Returns the time of a monotonic clock, in nanoseconds.
+*/
+uint64_t monotonicNs();
+
+/*
+ * Description: The metrics of a single worker thread. Only the worker updates them, so an
+ *              update is a plain (relaxed) store to a counter of its own - no locked
+ *              instruction, and no cache line bouncing between the workers. Any thread may
+ *              read them at the same time.
+*/
+class WorkerMetrics {
+public:
+	WorkerMetrics();
+
+	WorkerMetrics(const WorkerMetrics&) = delete;
+	WorkerMetrics& operator=(const WorkerMetrics&) = delete;
+
+	void add(metric_counter counter, uint64_t amount = 1) {
+		counters[counter].store(counters[counter].load(std::memory_order_relaxed) + amount,
+		                        std::memory_order_relaxed);
+	}
+
+	/*
+	 * Description: Counts a request that was handled, and records its latency.
+	 * latencyNs: the time from the arrival of the request until it was handled - that is,
+	 *            until its replies and messages were queued to all their recipients.
+	*/
+	void recordRequest(command_type type, uint64_t latencyNs);
+
+	uint64_t counter(metric_counter counter) const;
+
+	const LatencyHistogram& latencyOf(command_type type) const;
+
+private:
+	std::atomic<uint64_t> counters[NUM_OF_METRICS];
+	LatencyHistogram latencies[NUM_OF_COMMAND_TYPES];
+};
+
+/*
+ * Description: The values of the counters at a point in time.
+*/
+struct MetricCounts {
+	uint64_t takenNs;
+	uint64_t values[NUM_OF_METRICS];
+};
+
+/*
+ * Description: The resources the server's process has used, as the kernel counts them.
+ * readCalls, writeCalls: the read-like and write-like system calls (read, readv, write,
+ *                        writev...) - those that io_uring performs on the process's behalf
+ *                        are not counted.
+*/
+struct ProcessUsage {
+	uint64_t userNs;
+	uint64_t systemNs;
+	uint64_t readCalls;
+	uint64_t writeCalls;
+};
+
+/*
+ * Description: The metrics of all the workers, summed, and the resources of the process.
+*/
+struct MetricsSnapshot {
+	MetricsSnapshot(uint64_t startNs, size_t numOfGroups);
+
+	MetricsSnapshot(const MetricsSnapshot&) = delete;
+	MetricsSnapshot& operator=(const MetricsSnapshot&) = delete;
+
+	/*
+	 * Description: Adds the metrics of a worker to the snapshot.
+	*/
+	void add(const WorkerMetrics& metrics);
+
+	uint64_t startNs;               // When the server started.
+	size_t numOfGroups;
+	MetricCounts counts;
+	LatencyHistogram latencies[NUM_OF_COMMAND_TYPES];
+	ProcessUsage usage;
+};
+
+/*
+ * Description: Formats a snapshot for a person to read: the totals, the rates since the
+ *              previous report and the latency percentiles of every request type.
+ * previous: the counts of the previous report (or zeros taken when the server started).
+*/
+std::string formatMetricsReport(const MetricsSnapshot& snapshot, const MetricCounts& previous);
+
+/*
+ * Description: Formats a snapshot for a program to read, in the text format of Prometheus:
+ *              a "name{labels} value" line per metric. Latencies are in seconds.
+*/
+std::string formatMetricsExposition(const MetricsSnapshot& snapshot);
+
+#endif
@@ -0,0 +1,380 @@
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include "whatsappio.h"
+#include "whatsappFrame.h"
+
+using namespace std;
+
+
+/**
+ * Every benchmark is run with more and more iterations, until it is measured for this long.
+ */
+#define MIN_MEASURED_NS (200 * 1000 * 1000ull)
+
+/**
+ * The factor the number of iterations grows by between runs of a benchmark.
+ */
+#define ITERATIONS_GROWTH 4
+
+#define NS_PER_SECOND 1000000000ull
+
+/**
+ * The size of the socket buffers of the socketpairs. The frames of a batch are written at
+ * once, before they are read, so a batch takes at most half of it.
+ */
+#define SOCKET_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * An upper bound of what a socket buffer is charged for every write besides its bytes - a
+ * Unix socket puts every write in its own buffer.
+ */
+#define WRITE_OVERHEAD 2048
+
+/**
+ * The sizes of the messages the framing benchmarks use - up to the largest text frame.
+ */
+#define MESSAGE_SIZES {0, 16, 256, 4096, MAX_TEXT_FRAME_LENGTH}
+
+/**
+ * The exit code in case of a success.
+ */
+#define SUCCESS 0
+
+/**
+ * The exit code in case of a failure.
+ */
+#define FAILURE 1
+
+
+// What is counted while a benchmark is measured (see resumeMeasuring and pauseMeasuring).
+static bool isMeasuring = false;
+static uint64_t numOfAllocations = 0;
+static uint64_t numOfSyscalls = 0;
+static uint64_t measuredNs = 0;
+static uint64_t resumedAtNs = 0;
+
+
+/*
+ * The allocations are counted by replacing the global operator new. The system calls are
+ * counted by wrapping those the framing layer makes: the benchmark is linked with
+ * -Wl,--wrap=read (and so on), which sends the calls to 'read' from the other objects to
+ * __wrap_read, which calls the real 'read' (__real_read).
+ */
+void* operator new(size_t size) {
+	numOfAllocations += isMeasuring;
+	void* pointer = malloc(size == 0 ? 1 : size);
+	if (pointer == nullptr) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+	free(pointer);
+}
+
+extern "C" {
+ssize_t __real_read(int fd, void* buffer, size_t count);
+ssize_t __real_write(int fd, const void* buffer, size_t count);
+int __real_poll(struct pollfd* fds, nfds_t numOfFDs, int timeout);
+
+ssize_t __wrap_read(int fd, void* buffer, size_t count) {
+	numOfSyscalls += isMeasuring;
+	return __real_read(fd, buffer, count);
+}
+
+ssize_t __wrap_write(int fd, const void* buffer, size_t count) {
+	numOfSyscalls += isMeasuring;
+	return __real_write(fd, buffer, count);
+}
+
+int __wrap_poll(struct pollfd* fds, nfds_t numOfFDs, int timeout) {
+	numOfSyscalls += isMeasuring;
+	return __real_poll(fds, numOfFDs, timeout);
+}
+}
+
+
+uint64_t nowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * NS_PER_SECOND + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * Description: Starts (or continues) measuring: the time, the allocations and the system
+ *              calls from now on are counted, until pauseMeasuring.
+*/
+void resumeMeasuring() {
+	isMeasuring = true;
+	resumedAtNs = nowNs();
+}
+
+void pauseMeasuring() {
+	measuredNs += nowNs() - resumedAtNs;
+	isMeasuring = false;
+}
+
+/*
+ * Description: Runs a benchmark with more and more iterations until it is measured for long
+ *              enough, and prints what a single iteration costs.
+ * benchmark: runs the given number of iterations, and measures only the iterations (not
+ *            their setup) with resumeMeasuring and pauseMeasuring.
+*/
+void runBenchmark(const string& name, const function<void(size_t)>& benchmark) {
+	size_t iterations = 1;
+	while (true) {
+		numOfAllocations = 0;
+		numOfSyscalls = 0;
+		measuredNs = 0;
+		benchmark(iterations);
+		if (measuredNs >= MIN_MEASURED_NS) {
+			break;
+		}
+		iterations *= ITERATIONS_GROWTH;
+	}
+	printf("%-40s %12.1f %12.2f %12.2f\n", name.c_str(), (double) measuredNs / (double) iterations,
+	       (double) numOfAllocations / (double) iterations,
+	       (double) numOfSyscalls / (double) iterations);
+}
+
+/*
+ * Description: Creates a connected pair of sockets with large buffers.
+ * Returns false on failure.
+*/
+bool createSocketPair(int fds[2]) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		print_error("socketpair", errno);
+		return false;
+	}
+	int bufferSize = SOCKET_BUFFER_SIZE;
+	for (int i = 0; i < 2; i++) {
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	}
+	return true;
+}
+
+/*
+ * Description: Returns the number of frames of the given size that are written (or read)
+ *              at once - as many as fit in half the buffer of a socket, even if every one of
+ *              them is written separately.
+*/
+size_t framesPerBatch(int fd, size_t frameSize) {
+	int bufferSize = 0;
+	socklen_t length = sizeof(bufferSize);
+	getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, &length);
+	return max((size_t) 1, (size_t) bufferSize / 2 / (frameSize + WRITE_OVERHEAD));
+}
+
+/*
+ * Description: Reads and drops the given number of bytes.
+*/
+void drain(int fd, size_t numOfBytes) {
+	vector<char> sink(SOCKET_BUFFER_SIZE);
+	while (numOfBytes > 0) {
+		ssize_t bytesRead = read(fd, sink.data(), min(sink.size(), numOfBytes));
+		if (bytesRead <= 0) {
+			print_error("read", errno);
+			exit(FAILURE);
+		}
+		numOfBytes -= (size_t) bytesRead;
+	}
+}
+
+/*
+ * Description: readData of a frame of the given size, that is already in the socket buffer.
+*/
+void benchmarkReadData(size_t iterations, size_t messageSize) {
+	int fds[2];
+	if (!createSocketPair(fds)) {
+		exit(FAILURE);
+	}
+	string frame = encodeFrame(string(messageSize, 'x'));
+	size_t batchSize = framesPerBatch(fds[0], frame.size());
+	string batch;
+	for (size_t i = 0; i < batchSize; i++) {
+		batch += frame;
+	}
+	string message;
+	for (size_t done = 0; done < iterations; ) {
+		size_t numOfFrames = min(batchSize, iterations - done);
+		writeBytes(fds[0], batch.data(), numOfFrames * frame.size());
+		resumeMeasuring();
+		for (size_t i = 0; i < numOfFrames; i++) {
+			if (!readData(fds[1], message) || message.size() != messageSize) {
+				exit(FAILURE);
+			}
+		}
+		pauseMeasuring();
+		done += numOfFrames;
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ * Description: writeData of a message of the given size into a socket buffer with room.
+*/
+void benchmarkWriteData(size_t iterations, size_t messageSize) {
+	int fds[2];
+	if (!createSocketPair(fds)) {
+		exit(FAILURE);
+	}
+	string message(messageSize, 'x');
+	size_t frameSize = BYTES_TO_READ_LENGTH + messageSize;
+	size_t batchSize = framesPerBatch(fds[0], frameSize);
+	for (size_t done = 0; done < iterations; ) {
+		size_t numOfFrames = min(batchSize, iterations - done);
+		resumeMeasuring();
+		for (size_t i = 0; i < numOfFrames; i++) {
+			writeData(fds[0], message);
+		}
+		pauseMeasuring();
+		drain(fds[1], numOfFrames * frameSize);
+		done += numOfFrames;
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ * Description: The same frames as benchmarkReadData, decoded by a FrameReader - the reader
+ *              the server uses - for comparison.
+*/
+void benchmarkFrameReader(size_t iterations, size_t messageSize) {
+	int fds[2];
+	if (!createSocketPair(fds)) {
+		exit(FAILURE);
+	}
+	string frame = encodeFrame(string(messageSize, 'x'));
+	size_t batchSize = framesPerBatch(fds[0], frame.size());
+	string batch;
+	for (size_t i = 0; i < batchSize; i++) {
+		batch += frame;
+	}
+	FrameReader reader(PROTOCOL_TEXT);
+	for (size_t done = 0; done < iterations; ) {
+		size_t numOfFrames = min(batchSize, iterations - done);
+		writeBytes(fds[0], batch.data(), numOfFrames * frame.size());
+		resumeMeasuring();
+		size_t numOfDecoded = 0;
+		while (numOfDecoded < numOfFrames) {
+			reader.readFrom(fds[1]);
+			string_view payload;
+			while (reader.nextFrame(payload)) {
+				numOfDecoded++;
+			}
+		}
+		pauseMeasuring();
+		done += numOfFrames;
+	}
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/*
+ * Description: encodeFrame of a message of the given size, in memory.
+*/
+void benchmarkEncodeFrame(size_t iterations, size_t messageSize) {
+	string message(messageSize, 'x');
+	size_t totalSize = 0;
+	resumeMeasuring();
+	for (size_t i = 0; i < iterations; i++) {
+		totalSize += encodeFrame(message).size();
+	}
+	pauseMeasuring();
+	if (totalSize != iterations * (BYTES_TO_READ_LENGTH + messageSize)) {
+		exit(FAILURE);
+	}
+}
+
+/*
+ * Description: parse_command of the given commands, in turn.
+*/
+void benchmarkParseCommand(size_t iterations, const vector<string>& commands) {
+	size_t numOfInvalid = 0;
+	CommandView parsed;
+	resumeMeasuring();
+	for (size_t i = 0; i < iterations; i++) {
+		parse_command(commands[i % commands.size()], parsed);
+		numOfInvalid += parsed.type == INVALID;
+	}
+	pauseMeasuring();
+	if (numOfInvalid > iterations) {
+		exit(FAILURE);
+	}
+}
+
+/*
+ * Description: A "create_group" command with the given number of members.
+*/
+string createGroupCommand(size_t numOfMembers) {
+	string command = "create_group friends ";
+	for (size_t i = 0; i < numOfMembers; i++) {
+		command += (i == 0 ? "member" : ",member") + to_string(i);
+	}
+	return command;
+}
+
+
+int main() {
+	printf("%-40s %12s %12s %12s\n", "benchmark", "ns/op", "allocs/op", "syscalls/op");
+	for (size_t messageSize : MESSAGE_SIZES) {
+		string suffix = "/" + to_string(messageSize) + "B";
+		runBenchmark("readData/socketpair" + suffix,
+		             [messageSize](size_t n) { benchmarkReadData(n, messageSize); });
+		runBenchmark("FrameReader/socketpair" + suffix,
+		             [messageSize](size_t n) { benchmarkFrameReader(n, messageSize); });
+		runBenchmark("writeData/socketpair" + suffix,
+		             [messageSize](size_t n) { benchmarkWriteData(n, messageSize); });
+		runBenchmark("encodeFrame/memory" + suffix,
+		             [messageSize](size_t n) { benchmarkEncodeFrame(n, messageSize); });
+	}
+
+	string shortSend = "send Avi hey, what's up?";
+	string longSend = "send family " + string(WA_MAX_MESSAGE, 'x');
+	string smallGroup = createGroupCommand(3);
+	string largeGroup = createGroupCommand(WA_MAX_GROUP);
+	const vector<pair<string, vector<string>>> mixes = {
+		{"send", {shortSend}},
+		{"send-long", {longSend}},
+		{"create_group/3", {smallGroup}},
+		{"create_group/50", {largeGroup}},
+		{"who", {"who"}},
+		{"invalid", {"sned Avi hey"}},
+		// Mostly messages, as in a busy server.
+		{"mixed", {shortSend, shortSend, longSend, shortSend, "who", smallGroup, shortSend,
+		           "who", "sned Avi hey", "exit"}}
+	};
+	for (const auto &mix : mixes) {
+		const vector<string>& commands = mix.second;
+		runBenchmark("parse_command/" + mix.first,
+		             [&commands](size_t n) { benchmarkParseCommand(n, commands); });
+	}
+	return SUCCESS;
+}
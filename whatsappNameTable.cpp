@@ -0,0 +1,97 @@
+#include "whatsappNameTable.h"
+#include <functional>
+
+/**
+ * The table grows once more than 3/4 of its slots are in use, which keeps probes short.
+ */
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+
+/**
+ * Multiplying a hash by this (2^64 / the golden ratio) and keeping the middle bits spreads
+ * hashes that differ only in some of their bits over the whole table.
+ */
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+#define HASH_MIX_SHIFT 32
+
+
+NameTable::NameTable() : slots(NAME_TABLE_INITIAL_CAPACITY),
+                         mask(NAME_TABLE_INITIAL_CAPACITY - 1), count(0) {
+}
+
+size_t NameTable::homeOf(size_t hash) const {
+	return (size_t) (((uint64_t) hash * HASH_MULTIPLIER) >> HASH_MIX_SHIFT) & mask;
+}
+
+size_t NameTable::probe(std::string_view name, size_t hash) const {
+	size_t index = homeOf(hash);
+	while (slots[index].isUsed && (slots[index].hash != hash || slots[index].name != name)) {
+		index = (index + 1) & mask;
+	}
+	return index;
+}
+
+bool NameTable::find(std::string_view name, uint32_t& value) const {
+	const Slot& slot = slots[probe(name, std::hash<std::string_view>()(name))];
+	if (!slot.isUsed) {
+		return false;
+	}
+	value = slot.value;
+	return true;
+}
+
+bool NameTable::insert(std::string_view name, uint32_t value) {
+	if ((count + 1) * MAX_LOAD_DENOMINATOR > slots.size() * MAX_LOAD_NUMERATOR) {
+		grow();
+	}
+	size_t hash = std::hash<std::string_view>()(name);
+	Slot& slot = slots[probe(name, hash)];
+	if (slot.isUsed) {
+		return false;
+	}
+	slot.hash = hash;
+	slot.value = value;
+	slot.isUsed = true;
+	slot.name.assign(name.data(), name.size());
+	count++;
+	return true;
+}
+
+bool NameTable::erase(std::string_view name) {
+	size_t index = probe(name, std::hash<std::string_view>()(name));
+	if (!slots[index].isUsed) {
+		return false;
+	}
+	slots[index].isUsed = false;
+	count--;
+
+	// Shifts back the entries that follow in the same run, so that no entry is left
+	// unreachable behind the emptied slot.
+	size_t emptied = index;
+	for (size_t next = (index + 1) & mask; slots[next].isUsed; next = (next + 1) & mask) {
+		size_t home = homeOf(slots[next].hash);
+		// The entry may move to the emptied slot iff its home is not in (emptied, next].
+		bool isHomeBetween = (emptied <= next) ? (emptied < home && home <= next)
+		                                       : (emptied < home || home <= next);
+		if (!isHomeBetween) {
+			std::swap(slots[emptied], slots[next]);
+			emptied = next;
+		}
+	}
+	return true;
+}
+
+size_t NameTable::size() const {
+	return count;
+}
+
+void NameTable::grow() {
+	std::vector<Slot> oldSlots(slots.size() * 2);
+	oldSlots.swap(slots);
+	mask = slots.size() - 1;
+	for (Slot &oldSlot : oldSlots) {
+		if (oldSlot.isUsed) {
+			slots[probe(oldSlot.name, oldSlot.hash)] = std::move(oldSlot);
+		}
+	}
+}
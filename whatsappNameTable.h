@@ -0,0 +1,78 @@
+#ifndef _WHATSAPPNAMETABLE_H
+#define _WHATSAPPNAMETABLE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * The initial number of slots of a NameTable (must be a power of 2).
+ */
+#define NAME_TABLE_INITIAL_CAPACITY 64
+
+/*
+ * Description: A hash table from names to 32-bit values, with open addressing and linear
+ *              probing: all the entries live in one contiguous array, so a lookup is a hash and
+ *              usually a single cache line, and it never allocates (names are looked up by
+ *              string_view). Every slot caches the hash of its name, so a probe compares
+ *              strings only when the hashes match. Erasing shifts the following entries back,
+ *              so there are no tombstones. The table is not thread-safe.
+*/
+class NameTable {
+public:
+	NameTable();
+
+	/*
+	 * Description: Looks up a name.
+	 * value: output - the value of the name, if it is found.
+	 * Returns false iff the name is not in the table.
+	*/
+	bool find(std::string_view name, uint32_t& value) const;
+
+	/*
+	 * Description: Adds a name to the table.
+	 * Returns false (and leaves the table untouched) iff the name is already in the table.
+	*/
+	bool insert(std::string_view name, uint32_t value);
+
+	/*
+	 * Description: Removes a name from the table.
+	 * Returns false iff the name is not in the table.
+	*/
+	bool erase(std::string_view name);
+
+	size_t size() const;
+
+private:
+	struct Slot {
+		size_t hash;
+		uint32_t value;
+		bool isUsed;
+		std::string name;
+	};
+
+	/*
+	 * Description: Returns the index of the slot of the given name, or of the empty slot in
+	 *              which it should be inserted.
+	*/
+	size_t probe(std::string_view name, size_t hash) const;
+
+	/*
+	 * Description: Returns the slot a name with the given hash should be in. The hash is mixed
+	 *              first: the names of a registry shard all share the hash bits that chose the
+	 *              shard, and would otherwise crowd into a fraction of the slots.
+	*/
+	size_t homeOf(size_t hash) const;
+
+	/*
+	 * Description: Doubles the number of slots, and re-inserts all the entries.
+	*/
+	void grow();
+
+	std::vector<Slot> slots;
+	size_t mask;                // slots.size() - 1.
+	size_t count;
+};
+
+#endif
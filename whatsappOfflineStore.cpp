@@ -0,0 +1,432 @@
+#include "whatsappOfflineStore.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/**
+ * The names of the segment files: their number, in hexadecimal, and the suffix.
+ */
+#define SEGMENT_NAME_FORMAT "%016llx.log"
+#define SEGMENT_NAME_SUFFIX ".log"
+#define HEX_BASE 16
+
+/**
+ * The state of a record in a segment.
+ */
+#define RECORD_LIVE 1
+#define RECORD_DELIVERED 2
+
+/**
+ * Records start at multiples of this many bytes, so their headers are aligned.
+ */
+#define RECORD_ALIGNMENT 8
+
+/**
+ * The size of a record: its header, the name of its recipient and its frame, padded.
+ */
+#define RECORD_SIZE(recipientLength, frameLength) \
+	((sizeof(RecordHeader) + (recipientLength) + (frameLength) + RECORD_ALIGNMENT - 1) & \
+	 ~(size_t) (RECORD_ALIGNMENT - 1))
+
+
+namespace {
+
+/*
+ * Description: The header of a record of a segment, followed by the name of the recipient and
+ *              by the frame that delivers the message. The rest of a segment is zeros, which
+ *              is where its records end.
+*/
+struct RecordHeader {
+	uint64_t sequence;
+	uint32_t frameLength;       // 0 marks the end of the records.
+	uint16_t recipientLength;
+	uint8_t state;
+	uint8_t reserved;
+};
+
+RecordHeader readHeader(const char* record) {
+	RecordHeader header;
+	memcpy(&header, record, sizeof(header));
+	return header;
+}
+
+}
+
+
+OfflineStore::Segment::~Segment() {
+	if (base != nullptr) {
+		munmap(base, size);
+	}
+}
+
+bool OfflineStore::open(const std::string& directory, const OfflineLimits& limits) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->directory = directory;
+	this->limits = limits;
+	if (mkdir(directory.c_str(), S_IRWXU) < 0 && errno != EEXIST) {
+		print_error("mkdir", errno);
+		return false;
+	}
+	DIR* directoryStream = opendir(directory.c_str());
+	if (directoryStream == nullptr) {
+		print_error("opendir", errno);
+		return false;
+	}
+	std::vector<std::pair<uint64_t, std::string>> segmentFiles;
+	struct dirent* entry;
+	while ((entry = readdir(directoryStream)) != nullptr) {
+		char* end;
+		uint64_t number = strtoull(entry->d_name, &end, HEX_BASE);
+		if (end != entry->d_name && strcmp(end, SEGMENT_NAME_SUFFIX) == 0) {
+			segmentFiles.emplace_back(number, directory + "/" + entry->d_name);
+		}
+	}
+	closedir(directoryStream);
+
+	std::sort(segmentFiles.begin(), segmentFiles.end());
+	for (const auto &segmentFile : segmentFiles) {
+		nextSegmentNumber = segmentFile.first + 1;
+		if (!recoverSegment(segmentFile.second)) {
+			return false;
+		}
+	}
+	// Compacted records are in later segments than the records stored after them.
+	for (auto &recipient : index) {
+		std::sort(recipient.second.records.begin(), recipient.second.records.end(),
+		          [](const RecordRef& a, const RecordRef& b) { return a.sequence < b.sequence; });
+	}
+	for (auto &recipient : index) {
+		std::deque<RecordRef>& records = recipient.second.records;
+		// A compaction that was interrupted leaves a record in both its old and new places.
+		for (size_t i = 1; i < records.size(); i++) {
+			if (records[i].sequence == records[i - 1].sequence) {
+				RecordRef duplicate = records[i];
+				records.erase(records.begin() + i--);
+				recipient.second.bytes -= markDelivered(duplicate);
+			}
+		}
+	}
+	return true;
+}
+
+bool OfflineStore::recoverSegment(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	struct stat status;
+	if (fd < 0 || fstat(fd, &status) < 0) {
+		print_error("open", errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	if (status.st_size < (off_t) sizeof(RecordHeader)) {
+		close(fd);
+		unlink(path.c_str());
+		return true;
+	}
+	auto size = (size_t) status.st_size;
+	void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		print_error("mmap", errno);
+		return false;
+	}
+	auto segment = std::make_shared<Segment>();
+	segment->path = path;
+	segment->base = (char*) base;
+	segment->size = size;
+	segment->liveRecords = 0;
+	segment->liveBytes = 0;
+
+	size_t offset = 0;
+	while (offset + sizeof(RecordHeader) <= size) {
+		RecordHeader header = readHeader(segment->base + offset);
+		size_t recordSize = RECORD_SIZE(header.recipientLength, header.frameLength);
+		if (header.frameLength == 0 || offset + recordSize > size) {
+			break;
+		}
+		if (header.state == RECORD_LIVE) {
+			std::string recipient(segment->base + offset + sizeof(RecordHeader),
+			                      header.recipientLength);
+			RecipientRecords& recipientRecords = index[recipient];
+			recipientRecords.records.push_back({segment, offset, header.sequence});
+			recipientRecords.bytes += recordSize;
+			storedBytes += recordSize;
+			segment->liveRecords++;
+			segment->liveBytes += recordSize;
+		}
+		nextSequence = std::max(nextSequence, header.sequence + 1);
+		offset += recordSize;
+	}
+	// Recovered segments are sealed: new records go to a new segment.
+	segment->writeOffset = offset;
+	if (segment->liveRecords == 0) {
+		unlink(path.c_str());
+	}
+	return true;
+}
+
+bool OfflineStore::openActiveSegment() {
+	char name[sizeof(SEGMENT_NAME_FORMAT) + 2 * sizeof(uint64_t)];
+	snprintf(name, sizeof(name), SEGMENT_NAME_FORMAT, (unsigned long long) nextSegmentNumber++);
+	std::string path = directory + "/" + name;
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		print_error("open", errno);
+		return false;
+	}
+	// The file is sparse: only the pages the records are written to take space.
+	void* base = MAP_FAILED;
+	if (ftruncate(fd, OFFLINE_SEGMENT_SIZE) < 0) {
+		print_error("ftruncate", errno);
+	} else {
+		base = mmap(nullptr, OFFLINE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			print_error("mmap", errno);
+		}
+	}
+	close(fd);
+	if (base == MAP_FAILED) {
+		unlink(path.c_str());
+		return false;
+	}
+
+	std::shared_ptr<Segment> sealedSegment = std::move(activeSegment);
+	activeSegment = std::make_shared<Segment>();
+	activeSegment->path = path;
+	activeSegment->base = (char*) base;
+	activeSegment->size = OFFLINE_SEGMENT_SIZE;
+	activeSegment->writeOffset = 0;
+	activeSegment->liveRecords = 0;
+	activeSegment->liveBytes = 0;
+	if (sealedSegment && sealedSegment->liveRecords == 0) {
+		unlink(sealedSegment->path.c_str());
+	}
+	return true;
+}
+
+bool OfflineStore::writeRecord(std::string_view recipient, const char* frame,
+                               size_t frameLength, uint64_t sequence, RecordRef& record) {
+	size_t recordSize = RECORD_SIZE(recipient.size(), frameLength);
+	if (recipient.size() > UINT16_MAX || frameLength == 0 || recordSize > OFFLINE_SEGMENT_SIZE) {
+		return false;
+	}
+	if ((!activeSegment || activeSegment->writeOffset + recordSize > activeSegment->size) &&
+	    !openActiveSegment()) {
+		return false;
+	}
+	Segment& segment = *activeSegment;
+	char* destination = segment.base + segment.writeOffset;
+	memcpy(destination + sizeof(RecordHeader), recipient.data(), recipient.size());
+	memcpy(destination + sizeof(RecordHeader) + recipient.size(), frame, frameLength);
+	// The header is written last, so a record that was cut short is not part of the log.
+	RecordHeader header = {sequence, (uint32_t) frameLength, (uint16_t) recipient.size(),
+	                       RECORD_LIVE, 0};
+	memcpy(destination, &header, sizeof(header));
+
+	record.segment = activeSegment;
+	record.offset = segment.writeOffset;
+	record.sequence = sequence;
+	segment.writeOffset += recordSize;
+	segment.liveRecords++;
+	segment.liveBytes += recordSize;
+	return true;
+}
+
+store_status OfflineStore::append(std::string_view recipient, const Frame& delivery) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::string name(recipient);
+	auto entry = index.find(name);
+	size_t recipientBytes = entry == index.end() ? 0 : entry->second.bytes;
+	size_t recordSize = RECORD_SIZE(recipient.size(), delivery.size());
+	if ((limits.recipientQuota != 0 && recipientBytes + recordSize > limits.recipientQuota) ||
+	    (limits.capacity != 0 && storedBytes + recordSize > limits.capacity)) {
+		return STORE_OVER_QUOTA;
+	}
+	RecordRef record;
+	if (!writeRecord(recipient, delivery.data(), delivery.size(), nextSequence, record)) {
+		return STORE_FAILED;
+	}
+	nextSequence++;
+	RecipientRecords& recipientRecords = entry == index.end() ? index[name] : entry->second;
+	recipientRecords.records.push_back(std::move(record));
+	recipientRecords.bytes += recordSize;
+	storedBytes += recordSize;
+	return STORE_OK;
+}
+
+bool OfflineStore::takeMessages(std::string_view recipient, size_t maxBytes,
+                                std::vector<OfflineMessage>& messages) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = index.find(std::string(recipient));
+	if (entry == index.end()) {
+		return true;
+	}
+	std::deque<RecordRef>& records = entry->second.records;
+	size_t bytesTaken = 0;
+	bool isFirst = true;
+	while (!records.empty()) {
+		RecordRef& record = records.front();
+		const char* recordStart = record.segment->base + record.offset;
+		RecordHeader header = readHeader(recordStart);
+		if (!isFirst && bytesTaken + header.frameLength > maxBytes) {
+			break;
+		}
+		messages.push_back({std::make_shared<const Frame>(
+				recordStart + sizeof(RecordHeader) + header.recipientLength, header.frameLength,
+				record.segment), record.sequence});
+		bytesTaken += header.frameLength;
+		isFirst = false;
+		entry->second.takenRecords.push_back(std::move(record));
+		records.pop_front();
+	}
+	return records.empty();
+}
+
+void OfflineStore::confirmDelivered(std::string_view recipient, uint64_t sequence) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = index.find(std::string(recipient));
+	if (entry == index.end()) {
+		return;
+	}
+	std::deque<RecordRef>& takenRecords = entry->second.takenRecords;
+	auto recordIt = seekRecord(takenRecords, sequence);
+	if (recordIt == takenRecords.end() || recordIt->sequence != sequence) {
+		return;
+	}
+	RecordRef record = std::move(*recordIt);
+	takenRecords.erase(recordIt);
+	// Compaction only moves records within the lists, so 'entry' stays valid.
+	entry->second.bytes -= markDelivered(record);
+	if (entry->second.records.empty() && takenRecords.empty()) {
+		index.erase(entry);
+	}
+}
+
+void OfflineStore::returnMessage(std::string_view recipient, uint64_t sequence) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = index.find(std::string(recipient));
+	if (entry == index.end()) {
+		return;
+	}
+	std::deque<RecordRef>& takenRecords = entry->second.takenRecords;
+	auto recordIt = seekRecord(takenRecords, sequence);
+	if (recordIt == takenRecords.end() || recordIt->sequence != sequence) {
+		return;
+	}
+	std::deque<RecordRef>& records = entry->second.records;
+	records.insert(seekRecord(records, sequence), std::move(*recordIt));
+	takenRecords.erase(recordIt);
+}
+
+void OfflineStore::dropMessages(std::string_view recipient) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = index.find(std::string(recipient));
+	if (entry == index.end()) {
+		return;
+	}
+	// A record is removed from its list before it is marked, so a compaction that this
+	// causes only moves the records that are left.
+	for (std::deque<RecordRef>* records : {&entry->second.takenRecords, &entry->second.records}) {
+		while (!records->empty()) {
+			RecordRef record = std::move(records->front());
+			records->pop_front();
+			markDelivered(record);
+		}
+	}
+	index.erase(entry);
+}
+
+std::deque<OfflineStore::RecordRef>::iterator OfflineStore::seekRecord(
+		std::deque<RecordRef>& records, uint64_t sequence) {
+	return std::lower_bound(records.begin(), records.end(), sequence,
+	                        [](const RecordRef& record, uint64_t sequence) {
+		                        return record.sequence < sequence;
+	                        });
+}
+
+void OfflineStore::sync() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Segment*> segments;
+	if (activeSegment) {
+		segments.push_back(activeSegment.get());
+	}
+	for (const auto &recipient : index) {
+		for (const RecordRef &record : recipient.second.records) {
+			segments.push_back(record.segment.get());
+		}
+		for (const RecordRef &record : recipient.second.takenRecords) {
+			segments.push_back(record.segment.get());
+		}
+	}
+	std::sort(segments.begin(), segments.end());
+	segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+	for (Segment* segment : segments) {
+		if (segment->writeOffset > 0 && msync(segment->base, segment->writeOffset, MS_SYNC) < 0) {
+			print_error("msync", errno);
+		}
+	}
+}
+
+size_t OfflineStore::markDelivered(const RecordRef& record) {
+	Segment& segment = *record.segment;
+	char* recordStart = segment.base + record.offset;
+	RecordHeader header = readHeader(recordStart);
+	size_t recordSize = RECORD_SIZE(header.recipientLength, header.frameLength);
+	recordStart[offsetof(RecordHeader, state)] = RECORD_DELIVERED;
+	segment.liveRecords--;
+	segment.liveBytes -= recordSize;
+	storedBytes -= recordSize;
+	if (record.segment == activeSegment) {
+		return recordSize;
+	}
+	if (segment.liveRecords == 0) {
+		unlink(segment.path.c_str());
+	} else if (segment.liveBytes * OFFLINE_COMPACTION_RATIO < segment.writeOffset) {
+		compactSegment(record.segment);
+	}
+	return recordSize;
+}
+
+void OfflineStore::compactSegment(const std::shared_ptr<Segment>& segment) {
+	size_t offset = 0;
+	while (offset < segment->writeOffset) {
+		char* recordStart = segment->base + offset;
+		RecordHeader header = readHeader(recordStart);
+		size_t recordSize = RECORD_SIZE(header.recipientLength, header.frameLength);
+		if (header.state == RECORD_LIVE) {
+			std::string recipient(recordStart + sizeof(RecordHeader), header.recipientLength);
+			auto entry = index.find(recipient);
+			if (entry != index.end()) {
+				// The record is either left to take, or taken and not confirmed yet.
+				std::deque<RecordRef>* records = &entry->second.records;
+				auto recordIt = seekRecord(*records, header.sequence);
+				if (recordIt == records->end() || recordIt->sequence != header.sequence) {
+					records = &entry->second.takenRecords;
+					recordIt = seekRecord(*records, header.sequence);
+				}
+				if (recordIt != records->end() && recordIt->sequence == header.sequence &&
+				    !writeRecord(recipient, recordStart + sizeof(RecordHeader) + recipient.size(),
+				                 header.frameLength, header.sequence, *recordIt)) {
+					return;     // the segment is kept as it is.
+				}
+			}
+			// The record is marked as moved only once its copy is complete.
+			recordStart[offsetof(RecordHeader, state)] = RECORD_DELIVERED;
+			segment->liveRecords--;
+			segment->liveBytes -= recordSize;
+		}
+		offset += recordSize;
+	}
+	unlink(segment->path.c_str());
+}
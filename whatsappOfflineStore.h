@@ -0,0 +1,221 @@
+#ifndef _WHATSAPPOFFLINESTORE_H
+#define _WHATSAPPOFFLINESTORE_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "whatsappFrame.h"
+
+/**
+ * The size of a segment file of the offline store. A message is never split between segments.
+ */
+#define OFFLINE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/**
+ * A sealed segment is compacted once less than 1 / OFFLINE_COMPACTION_RATIO of it is live.
+ */
+#define OFFLINE_COMPACTION_RATIO 4
+
+/**
+ * The default number of bytes of undelivered messages the store keeps for a single recipient.
+ */
+#define DEFAULT_OFFLINE_QUOTA (16 * 1024 * 1024)
+
+/**
+ * The default number of bytes of undelivered messages the store keeps for all the recipients.
+ */
+#define DEFAULT_OFFLINE_CAPACITY (1024 * 1024 * 1024)
+
+/*
+ * Description: The bounds of the undelivered messages of an offline store, in bytes (the
+ *              size of their records in the log). 0 for no limit.
+ * recipientQuota: the messages to a single recipient.
+ * capacity: the messages to all the recipients.
+*/
+struct OfflineLimits {
+	size_t recipientQuota;
+	size_t capacity;
+};
+
+/*
+ * The result of storing a message:
+ * STORE_OK: the message was stored.
+ * STORE_OVER_QUOTA: the message was not stored, since its recipient's quota (or the store's
+ *                   capacity) is used up.
+ * STORE_FAILED: the message could not be written.
+ */
+enum store_status {STORE_OK, STORE_OVER_QUOTA, STORE_FAILED};
+
+/*
+ * Description: A message taken from an offline store, to deliver.
+ * delivery: the v2 frame that delivers the message.
+ * sequence: identifies the message to the store (see OfflineStore::confirmDelivered).
+*/
+struct OfflineMessage {
+	FrameRef delivery;
+	uint64_t sequence;
+};
+
+/*
+ * Description: The messages that were sent to offline clients, kept until they reconnect.
+ *              Messages are appended to a log of fixed-size segment files, which are mapped
+ *              into memory: a message is stored as the encoded (v2) frame that delivers it, so
+ *              replaying it writes straight from the mapping, without copying or re-encoding.
+ *              An in-memory index lists the undelivered messages of every recipient, in order.
+ *              A message that is taken to be delivered stays stored until its delivery is
+ *              confirmed, so it is delivered again if it never reaches its recipient (at least
+ *              once, that is). A delivered message is only marked as such in its segment. A segment none of
+ *              whose messages is undelivered is deleted, and a sealed segment that is mostly
+ *              delivered has its undelivered messages moved to the end of the log, so the
+ *              log does not grow because of a few recipients that never reconnect. Nor do
+ *              their messages: a recipient has a quota, and the store a capacity, beyond which
+ *              new messages are refused.
+ *              The log survives a restart of the server: the index is rebuilt from it. A
+ *              message is in the (shared) page cache once it is stored, so it survives a
+ *              crash of the server, but it is on disk only once the kernel writes the page
+ *              back - or once 'sync' is called, when the server shuts down. A crash of the
+ *              machine may lose the messages stored since.
+ *              The store is thread-safe.
+*/
+class OfflineStore {
+public:
+	/*
+	 * Description: Opens the store in the given directory (created if missing), and indexes
+	 *              the undelivered messages that are already in it.
+	 * limits: the bounds of the undelivered messages (those already stored are kept, even
+	 *         beyond them).
+	 * Returns false on failure.
+	*/
+	bool open(const std::string& directory, const OfflineLimits& limits);
+
+	/*
+	 * Description: Stores a message for an offline client.
+	 * recipient: the name of the client.
+	 * delivery: the v2 frame that delivers the message.
+	 * Returns STORE_OK, STORE_OVER_QUOTA or STORE_FAILED (see store_status).
+	*/
+	store_status append(std::string_view recipient, const Frame& delivery);
+
+	/*
+	 * Description: Takes the oldest undelivered messages of a client, that were not taken
+	 *              yet: at least one of them (if any), and as many more as fit in maxBytes.
+	 *              They stay stored until they are confirmed as delivered, or returned. The
+	 *              frames refer to the mapped log, which they keep alive.
+	 * messages: output - the messages, in the order they were stored.
+	 * Returns true iff no messages of the client are left to take.
+	*/
+	bool takeMessages(std::string_view recipient, size_t maxBytes,
+	                  std::vector<OfflineMessage>& messages);
+
+	/*
+	 * Description: Deletes a message that was taken, once it was delivered.
+	*/
+	void confirmDelivered(std::string_view recipient, uint64_t sequence);
+
+	/*
+	 * Description: Returns a message that was taken but not delivered, to be taken again
+	 *              (before the messages stored after it).
+	*/
+	void returnMessage(std::string_view recipient, uint64_t sequence);
+
+	/*
+	 * Description: Deletes all the messages of a client (taken or not) - once it has exited,
+	 *              so they are never delivered to another client that registers its name.
+	*/
+	void dropMessages(std::string_view recipient);
+
+	/*
+	 * Description: Writes the stored messages to disk, and waits until they are written.
+	*/
+	void sync();
+
+private:
+	/*
+	 * Description: A mapped segment file. It is unmapped once the last frame (or index
+	 *              entry) that refers to it is gone, even after its file has been deleted.
+	*/
+	struct Segment {
+		~Segment();
+
+		std::string path;
+		char* base;
+		size_t size;
+		size_t writeOffset;     // The end of the records written so far.
+		size_t liveRecords;     // The number of undelivered records.
+		size_t liveBytes;       // The size of the undelivered records.
+	};
+
+	/*
+	 * Description: The location of an undelivered message.
+	*/
+	struct RecordRef {
+		std::shared_ptr<Segment> segment;
+		size_t offset;
+		uint64_t sequence;
+	};
+
+	/*
+	 * Description: The undelivered messages of a recipient, oldest first: those left to take,
+	 *              and those that were taken but not confirmed yet. And the size of them all.
+	*/
+	struct RecipientRecords {
+		std::deque<RecordRef> records;
+		std::deque<RecordRef> takenRecords;
+		size_t bytes = 0;
+	};
+
+	/*
+	 * Description: Returns the first of the given records (sorted by sequence) whose sequence
+	 *              is not less than the given one - that of the message, if it is there.
+	*/
+	static std::deque<RecordRef>::iterator seekRecord(std::deque<RecordRef>& records,
+	                                                   uint64_t sequence);
+
+	/*
+	 * Description: Maps an existing segment file and indexes its undelivered records.
+	 * Returns false on failure.
+	*/
+	bool recoverSegment(const std::string& path);
+
+	/*
+	 * Description: Seals the active segment, and creates a new empty one.
+	 * Returns false on failure.
+	*/
+	bool openActiveSegment();
+
+	/*
+	 * Description: Writes a record to the active segment (opening a new one if it is full).
+	 * Returns false on failure.
+	*/
+	bool writeRecord(std::string_view recipient, const char* frame, size_t frameLength,
+	                 uint64_t sequence, RecordRef& record);
+
+	/*
+	 * Description: Marks a record as delivered, and reclaims its segment if it is sealed and
+	 *              no longer worth keeping.
+	 * Returns the size of the record.
+	*/
+	size_t markDelivered(const RecordRef& record);
+
+	/*
+	 * Description: Moves the undelivered records of a sealed segment to the active segment,
+	 *              and deletes it.
+	*/
+	void compactSegment(const std::shared_ptr<Segment>& segment);
+
+	std::mutex mutex;
+	std::string directory;
+	OfflineLimits limits = {0, 0};
+	std::shared_ptr<Segment> activeSegment;
+	uint64_t nextSegmentNumber = 0;
+	uint64_t nextSequence = 0;      // Orders the messages, even after they are compacted.
+	size_t storedBytes = 0;         // The size of all the undelivered records.
+	std::unordered_map<std::string, RecipientRecords> index;   // By recipient.
+};
+
+#endif
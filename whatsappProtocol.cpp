@@ -0,0 +1,284 @@
+#include "whatsappProtocol.h"
+
+/**
+ * The reply that is sent to a text client who tries to connect with a name that is already
+ * in use in the server.
+ */
+#define DUP_CONNECTION "dupConnection"
+
+/**
+ * The exit message that is sent from the server to a text client.
+ */
+#define SERVER_EXIT "serverEXIT"
+
+
+bool decodeHello(protocol_version protocol, std::string_view payload, Request& request) {
+	request.type = INVALID;
+	request.requestId = 0;
+	request.numOfClients = 0;
+	if (protocol == PROTOCOL_TEXT) {
+		request.name = payload;
+		return true;
+	}
+	const char* cursor = payload.data();
+	const char* end = cursor + payload.size();
+	if (cursor == end || (uint8_t) *cursor++ != OP_HELLO) {
+		return false;
+	}
+	return readVarint(cursor, end, request.requestId) && readField(cursor, end, request.name);
+}
+
+void decodeRequest(protocol_version protocol, std::string_view payload, Request& request) {
+	request.requestId = 0;
+	if (protocol == PROTOCOL_TEXT) {
+		parse_command(payload, request);
+		return;
+	}
+
+	request.type = INVALID;
+	request.name = std::string_view();
+	request.message = std::string_view();
+	request.numOfClients = 0;
+	request.limit = 0;
+	request.offset = 0;
+	const char* cursor = payload.data();
+	const char* end = cursor + payload.size();
+	if (cursor == end) {
+		return;
+	}
+	auto opcode = (uint8_t) *cursor++;
+	if (!readVarint(cursor, end, request.requestId)) {
+		return;
+	}
+	if (opcode == OP_CREATE_GROUP) {
+		if (!readField(cursor, end, request.name)) {
+			return;
+		}
+		while (cursor < end) {
+			if (request.numOfClients == WA_MAX_GROUP ||
+			    !readField(cursor, end, request.clients[request.numOfClients++])) {
+				return;
+			}
+		}
+		request.type = CREATE_GROUP;
+	} else if (opcode == OP_SEND) {
+		if (readField(cursor, end, request.name) && readField(cursor, end, request.message)) {
+			request.type = SEND;
+		}
+	} else if (opcode == OP_WHO) {
+		// All of the fields are optional.
+		uint64_t limit = 0;
+		uint64_t offset = 0;
+		if ((cursor == end || readField(cursor, end, request.name)) &&
+		    (cursor == end || readVarint(cursor, end, limit)) &&
+		    (cursor == end || readVarint(cursor, end, offset)) && cursor == end) {
+			request.type = WHO;
+			request.limit = (size_t) limit;
+			request.offset = (size_t) offset;
+		}
+	} else if (opcode == OP_EXIT) {
+		request.type = EXIT;
+	} else if (opcode == OP_SEND_BATCH) {
+		// The messages are read one by one when the batch is handled - they are only
+		// checked to be well-formed here.
+		request.message = std::string_view(cursor, (size_t) (end - cursor));
+		std::string_view name;
+		std::string_view message;
+		while (cursor < end) {
+			if (!readField(cursor, end, name) || !readField(cursor, end, message)) {
+				return;
+			}
+		}
+		request.type = SEND_BATCH;
+	}
+}
+
+std::string beginPayload(v2_opcode opcode, uint64_t requestId) {
+	std::string payload(1, (char) opcode);
+	appendVarint(payload, requestId);
+	return payload;
+}
+
+void appendField(std::string& payload, std::string_view field) {
+	appendVarint(payload, field.size());
+	payload.append(field);
+}
+
+bool readField(const char*& cursor, const char* end, std::string_view& field) {
+	uint64_t length;
+	if (!readVarint(cursor, end, length) || length > (uint64_t) (end - cursor)) {
+		return false;
+	}
+	field = std::string_view(cursor, (size_t) length);
+	cursor += length;
+	return true;
+}
+
+FrameRef encodeReply(protocol_version protocol, uint64_t requestId, reply_status status) {
+	if (protocol == PROTOCOL_TEXT) {
+		// The replies of the text protocol carry no request id - they are encoded once.
+		static const FrameRef success = Frame::fromMessage(std::to_string(STATUS_SUCCESS));
+		static const FrameRef failure = Frame::fromMessage(std::to_string(STATUS_FAILURE));
+		static const FrameRef nameInUse = Frame::fromMessage(DUP_CONNECTION);
+		static const FrameRef throttled = Frame::fromMessage(std::to_string(STATUS_THROTTLED));
+		return (status == STATUS_SUCCESS) ? success :
+		       (status == STATUS_NAME_IN_USE) ? nameInUse :
+		       (status == STATUS_THROTTLED) ? throttled : failure;
+	}
+	std::string payload = beginPayload(OP_ACK, requestId);
+	appendVarint(payload, status);
+	return Frame::fromPayload(payload);
+}
+
+FrameRef encodeWhoReply(protocol_version protocol, uint64_t requestId,
+                        std::string_view connectedClients, size_t numOfMatches) {
+	if (protocol == PROTOCOL_TEXT) {
+		if (connectedClients.size() > MAX_TEXT_FRAME_LENGTH) {
+			// Lists the names that fit in a frame - the rest can be listed a page at a time.
+			size_t lastComma = connectedClients.rfind(',', MAX_TEXT_FRAME_LENGTH);
+			connectedClients = connectedClients.substr(0, lastComma == std::string_view::npos ?
+			                                              0 : lastComma);
+		}
+		return Frame::fromMessage(std::string(connectedClients));
+	}
+	std::string payload = beginPayload(OP_WHO_REPLY, requestId);
+	appendField(payload, connectedClients);
+	appendVarint(payload, numOfMatches);
+	return Frame::fromPayload(payload);
+}
+
+FrameRef encodeHello(std::string_view name, uint64_t requestId) {
+	std::string payload = beginPayload(OP_HELLO, requestId);
+	appendField(payload, name);
+	return Frame::fromPayload(payload);
+}
+
+FrameRef encodeRequest(const CommandView& command, uint64_t requestId) {
+	std::string payload;
+	if (command.type == CREATE_GROUP) {
+		payload = beginPayload(OP_CREATE_GROUP, requestId);
+		appendField(payload, command.name);
+		for (size_t i = 0; i < command.numOfClients; i++) {
+			appendField(payload, command.clients[i]);
+		}
+	} else if (command.type == SEND) {
+		payload = beginPayload(OP_SEND, requestId);
+		appendField(payload, command.name);
+		appendField(payload, command.message);
+	} else if (command.type == WHO) {
+		payload = beginPayload(OP_WHO, requestId);
+		appendField(payload, command.name);
+		appendVarint(payload, command.limit);
+		appendVarint(payload, command.offset);
+	} else {
+		payload = beginPayload(OP_EXIT, requestId);
+	}
+	if (payload.size() > MAX_V2_PAYLOAD_LENGTH) {
+		return nullptr;
+	}
+	return Frame::fromPayload(payload);
+}
+
+void appendBatchedMessage(std::string& payload, std::string_view name, std::string_view message) {
+	appendField(payload, name);
+	appendField(payload, message);
+}
+
+bool nextBatchedMessage(std::string_view& batch, std::string_view& name,
+                        std::string_view& message) {
+	const char* cursor = batch.data();
+	const char* end = cursor + batch.size();
+	if (cursor == end || !readField(cursor, end, name) || !readField(cursor, end, message)) {
+		return false;
+	}
+	batch = std::string_view(cursor, (size_t) (end - cursor));
+	return true;
+}
+
+bool decodeServerMessage(std::string_view payload, ServerMessage& message) {
+	const char* cursor = payload.data();
+	const char* end = cursor + payload.size();
+	if (cursor == end) {
+		return false;
+	}
+	message.opcode = (v2_opcode) (uint8_t) *cursor++;
+	if (!readVarint(cursor, end, message.requestId)) {
+		return false;
+	}
+	if (message.opcode == OP_ACK) {
+		uint64_t status;
+		if (!readVarint(cursor, end, status)) {
+			return false;
+		}
+		message.status = (reply_status) status;
+		return true;
+	} else if (message.opcode == OP_WHO_REPLY) {
+		return readField(cursor, end, message.message) &&
+		       readVarint(cursor, end, message.numOfMatches);
+	} else if (message.opcode == OP_DELIVER) {
+		return readField(cursor, end, message.sender) && readField(cursor, end, message.message);
+	} else if (message.opcode == OP_BATCH_ACK) {
+		message.statuses = std::string_view(cursor, (size_t) (end - cursor));
+		return true;
+	}
+	return message.opcode == OP_SERVER_EXIT;
+}
+
+FrameRef encodeBatchReply(uint64_t requestId, const std::vector<reply_status>& statuses) {
+	std::string payload = beginPayload(OP_BATCH_ACK, requestId);
+	for (reply_status status : statuses) {
+		appendVarint(payload, status);
+	}
+	return Frame::fromPayload(payload);
+}
+
+FrameRef encodeServerExit(protocol_version protocol) {
+	if (protocol == PROTOCOL_TEXT) {
+		return Frame::fromMessage(SERVER_EXIT);
+	}
+	return Frame::fromPayload(beginPayload(OP_SERVER_EXIT, 0));
+}
+
+
+DeliveryEncoder::DeliveryEncoder(std::string_view sender, std::string_view message) :
+		sender(sender), message(message), isTextEncoded(false), isV2Encoded(false) {
+}
+
+const FrameRef& DeliveryEncoder::frameFor(protocol_version protocol) {
+	if (protocol == PROTOCOL_TEXT) {
+		if (!isTextEncoded) {
+			std::string delivery = "send ";
+			delivery.append(sender).append(" ").append(message);
+			textFrame = Frame::fromMessage(delivery);
+			isTextEncoded = true;
+		}
+		return textFrame;
+	}
+	if (!isV2Encoded) {
+		std::string payload = beginPayload(OP_DELIVER, 0);
+		appendField(payload, sender);
+		appendField(payload, message);
+		// The sender's name makes the delivery longer than the request that carried it.
+		if (payload.size() <= MAX_V2_PAYLOAD_LENGTH) {
+			v2Frame = Frame::fromPayload(payload);
+		}
+		isV2Encoded = true;
+	}
+	return v2Frame;
+}
+
+FrameRef transcodeDelivery(const FrameRef& delivery, protocol_version protocol) {
+	if (protocol == PROTOCOL_V2) {
+		return delivery;
+	}
+	const char* cursor = delivery->data();
+	const char* end = cursor + delivery->size();
+	uint64_t payloadLength;
+	ServerMessage message;
+	if (!readVarint(cursor, end, payloadLength) || payloadLength != (uint64_t) (end - cursor) ||
+	    !decodeServerMessage(std::string_view(cursor, payloadLength), message) ||
+	    message.opcode != OP_DELIVER) {
+		return nullptr;
+	}
+	return DeliveryEncoder(message.sender, message.message).frameFor(protocol);
+}
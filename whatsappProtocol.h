@@ -0,0 +1,208 @@
+#ifndef _WHATSAPPPROTOCOL_H
+#define _WHATSAPPPROTOCOL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "whatsappio.h"
+#include "whatsappFrame.h"
+
+/*
+ * Protocol v2
+ * -----------
+ * A client opts in to protocol v2 by sending WA_V2_PREFACE before its first frame.
+ * From then on, every frame in both directions is:
+ *
+ *     varint payload-length | opcode (1 byte) | varint request-id | fields...
+ *
+ * where every field is a varint length followed by that many bytes. The request id is
+ * chosen by the client, and is echoed by the server in the reply to that request, so a
+ * client may have many requests in flight. Nothing has to be tokenized or converted from
+ * decimal text, and a message is limited only by MAX_V2_PAYLOAD_LENGTH.
+ *
+ * Client to server:                        Server to client:
+ *   OP_HELLO          [name]                 OP_ACK         varint status (no fields)
+ *   OP_CREATE_GROUP   [group][member]...     OP_WHO_REPLY   [comma separated names]
+ *   OP_SEND           [name][message]                       varint number of matches
+ *   OP_WHO            ([prefix]              OP_DELIVER     [sender][message] (request id 0)
+ *                      (varint limit         OP_SERVER_EXIT (request id 0)
+ *                       (varint offset)))
+ *   OP_EXIT
+ *   OP_SEND_BATCH     ([name][message])...   OP_BATCH_ACK   varint status per message
+ *
+ * OP_WHO lists the connected clients whose names start with the prefix (all of them if it
+ * is empty or missing), skipping the first 'offset' of them and listing at most 'limit' of
+ * them (all of them if it is 0 or missing). The number of matches in the reply counts all
+ * the clients that match the prefix, so a client knows how many pages there are.
+ *
+ * The name in OP_HELLO follows the rules of the text protocol (see is_valid_name), or the
+ * hello is acknowledged with STATUS_FAILURE and the connection is closed.
+ *
+ * OP_SEND_BATCH carries many messages (each to its own client or group) in one frame, and
+ * is acknowledged by a single OP_BATCH_ACK with the status of every message, in order.
+ */
+enum v2_opcode : uint8_t {
+	OP_HELLO = 0x01,
+	OP_CREATE_GROUP = 0x02,
+	OP_SEND = 0x03,
+	OP_WHO = 0x04,
+	OP_EXIT = 0x05,
+	OP_SEND_BATCH = 0x06,
+	OP_ACK = 0x81,
+	OP_WHO_REPLY = 0x82,
+	OP_DELIVER = 0x83,
+	OP_SERVER_EXIT = 0x84,
+	OP_BATCH_ACK = 0x85
+};
+
+/*
+ * The status a request is acknowledged with. The text protocol sends the status as the
+ * decimal number, except for STATUS_NAME_IN_USE which it sends as "dupConnection".
+ * STATUS_THROTTLED: a message was not sent, since its sender has sent faster than it may.
+ */
+enum reply_status {STATUS_SUCCESS = 0, STATUS_FAILURE = 1, STATUS_NAME_IN_USE = 2,
+                   STATUS_THROTTLED = 3};
+
+/*
+ * Description: A request of a client, decoded from either protocol. Like the CommandView it
+ *              extends, its fields are views into the frame it was decoded from. The name is
+ *              the client's own name in a hello, and the group/recipient name otherwise.
+ *              The message of a SEND_BATCH request holds all of its messages (see
+ *              nextBatchedMessage).
+*/
+struct Request : CommandView {
+	uint64_t requestId;                 // Always 0 in the text protocol.
+};
+
+/*
+ * Description: Decodes the first frame of a connection, which holds the client's name.
+ * Returns false iff the frame is not a valid hello.
+*/
+bool decodeHello(protocol_version protocol, std::string_view payload, Request& request);
+
+/*
+ * Description: Decodes a request frame of a registered client, without copying it.
+ *              Text requests are parsed with parse_command; v2 requests are read field by
+ *              field. A malformed request (or one with more than WA_MAX_GROUP clients) is
+ *              decoded as INVALID.
+*/
+void decodeRequest(protocol_version protocol, std::string_view payload, Request& request);
+
+/*
+ * Description: A frame the server sends to a v2 client, decoded. Like a Request, its fields
+ *              are views into the frame it was decoded from.
+*/
+struct ServerMessage {
+	v2_opcode opcode;
+	uint64_t requestId;
+	reply_status status;                // OP_ACK.
+	std::string_view sender;            // OP_DELIVER.
+	std::string_view message;           // OP_DELIVER, or the listed names of OP_WHO_REPLY.
+	uint64_t numOfMatches;              // OP_WHO_REPLY.
+	std::string_view statuses;          // OP_BATCH_ACK: a varint status per message.
+};
+
+/*
+ * Description: Encodes the hello of a v2 client (which follows WA_V2_PREFACE).
+*/
+FrameRef encodeHello(std::string_view name, uint64_t requestId);
+
+/*
+ * Description: Encodes a request of a v2 client.
+ * Returns nullptr if the request is longer than MAX_V2_PAYLOAD_LENGTH.
+*/
+FrameRef encodeRequest(const CommandView& command, uint64_t requestId);
+
+/*
+ * Description: Appends a message to the payload of an OP_SEND_BATCH request.
+*/
+void appendBatchedMessage(std::string& payload, std::string_view name, std::string_view message);
+
+/*
+ * Description: Reads the next message of a batch, and advances 'batch' past it.
+ * batch: the message of a decoded SEND_BATCH request.
+ * Returns false iff no messages are left.
+*/
+bool nextBatchedMessage(std::string_view& batch, std::string_view& name,
+                        std::string_view& message);
+
+/*
+ * Description: Decodes a frame the server has sent to a v2 client, without copying it.
+ * Returns false iff the frame is malformed.
+*/
+bool decodeServerMessage(std::string_view payload, ServerMessage& message);
+
+/*
+ * Description: Starts a v2 payload with the given opcode and request id.
+*/
+std::string beginPayload(v2_opcode opcode, uint64_t requestId);
+
+/*
+ * Description: Appends a length-prefixed field to a v2 payload.
+*/
+void appendField(std::string& payload, std::string_view field);
+
+/*
+ * Description: Reads a length-prefixed field of a v2 payload that starts at 'cursor', and
+ *              advances 'cursor' past it.
+ * Returns false iff the field is truncated.
+*/
+bool readField(const char*& cursor, const char* end, std::string_view& field);
+
+/*
+ * Description: Encodes the acknowledgement of a request.
+*/
+FrameRef encodeReply(protocol_version protocol, uint64_t requestId, reply_status status);
+
+/*
+ * Description: Encodes the reply to a "who" request.
+ * connectedClients: the names of the listed clients, separated by commas. A text frame lists
+ *                   only as many of them as fit in it.
+ * numOfMatches: the number of clients that match the request, listed or not (v2 only).
+*/
+FrameRef encodeWhoReply(protocol_version protocol, uint64_t requestId,
+                        std::string_view connectedClients, size_t numOfMatches);
+
+/*
+ * Description: Encodes the acknowledgement of a SEND_BATCH request (v2 only).
+ * statuses: the status of every message of the batch, in order.
+*/
+FrameRef encodeBatchReply(uint64_t requestId, const std::vector<reply_status>& statuses);
+
+/*
+ * Description: Encodes the notice the server sends its clients before it shuts down.
+*/
+FrameRef encodeServerExit(protocol_version protocol);
+
+/*
+ * Description: Encodes a message for delivery to its recipients, at most once per protocol
+ *              of the recipients - so a group message is encoded at most twice however many
+ *              members the group has.
+*/
+class DeliveryEncoder {
+public:
+	DeliveryEncoder(std::string_view sender, std::string_view message);
+
+	/*
+	 * Description: Returns the delivery encoded for the given protocol, or nullptr if the
+	 *              message is too long for that protocol.
+	*/
+	const FrameRef& frameFor(protocol_version protocol);
+
+private:
+	std::string_view sender;
+	std::string_view message;
+	FrameRef textFrame;
+	FrameRef v2Frame;
+	bool isTextEncoded;
+	bool isV2Encoded;
+};
+
+/*
+ * Description: Re-encodes a v2 delivery (as encoded by DeliveryEncoder) for the given protocol.
+ * Returns the delivery itself if the protocol is v2, or nullptr if the delivery is malformed
+ * or the message is too long for the protocol.
+*/
+FrameRef transcodeDelivery(const FrameRef& delivery, protocol_version protocol);
+
+#endif
@@ -0,0 +1,432 @@
+#include "whatsappRegistry.h"
+#include <algorithm>
+#include <functional>
+
+
+/**
+ * Splits an id into the shard it belongs to and its index in that shard.
+ */
+#define SHARD_OF_ID(id) ((id) % REGISTRY_SHARDS)
+#define INDEX_OF_ID(id) ((id) / REGISTRY_SHARDS)
+
+
+size_t ClientRegistry::shardIndexOf(std::string_view name) const {
+	return std::hash<std::string_view>()(name) % REGISTRY_SHARDS;
+}
+
+template <typename Group>
+auto ClientRegistry::findMember(Group& group, ClientId client) -> decltype(group.members.data()) {
+	auto memberIt = std::lower_bound(group.members.begin(), group.members.end(), client,
+	                                 [](const GroupMember& entry, ClientId id) {
+		                                 return entry.client < id;
+	                                 });
+	if (memberIt == group.members.end() || memberIt->client != client) {
+		return nullptr;
+	}
+	return &*memberIt;
+}
+
+void ClientRegistry::publishRecipients(GroupSlot& group) {
+	auto recipients = std::make_shared<GroupSnapshot>();
+	recipients->connected.reserve(group.members.size());
+	for (const GroupMember &member : group.members) {
+		if (member.isOnline) {
+			recipients->connected.push_back({member.client, member.handle});
+		} else if (member.version != 0) {    // i.e. its state has reached the group.
+			recipients->offline.push_back(member.name);
+		}
+	}
+	group.recipients = std::move(recipients);
+}
+
+void ClientRegistry::updateMember(GroupId group, ClientId member, uint64_t version,
+                                  bool isOnline, const std::string& name,
+                                  const ConnectionHandle& handle) {
+	Shard& shard = shards[SHARD_OF_ID(group)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	GroupSlot& groupSlot = shard.groups[INDEX_OF_ID(group)];
+	GroupMember* entry = findMember(groupSlot, member);
+	if (entry == nullptr || entry->version >= version) {
+		return;
+	}
+	entry->version = version;
+	entry->isOnline = isOnline;
+	entry->name = name;
+	entry->handle = handle;
+	publishRecipients(groupSlot);
+}
+
+void ClientRegistry::updateGroupsOf(ClientId id) {
+	std::vector<GroupId> groups;
+	uint64_t version;
+	bool isOnline;
+	std::string name;
+	ConnectionHandle handle;
+	{
+		Shard& shard = shards[SHARD_OF_ID(id)];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		const ClientSlot& slot = shard.clients[INDEX_OF_ID(id)];
+		groups = slot.groups;
+		version = slot.version;
+		isOnline = slot.state == CLIENT_ONLINE;
+		name = slot.name;
+		handle = slot.handle;
+	}
+	for (GroupId group : groups) {
+		updateMember(group, id, version, isOnline, name, handle);
+	}
+}
+
+void ClientRegistry::removeMember(GroupId group, ClientId member) {
+	Shard& shard = shards[SHARD_OF_ID(group)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	GroupSlot& groupSlot = shard.groups[INDEX_OF_ID(group)];
+	GroupMember* entry = findMember(groupSlot, member);
+	if (entry != nullptr) {
+		groupSlot.members.erase(groupSlot.members.begin() + (entry - groupSlot.members.data()));
+		publishRecipients(groupSlot);
+	}
+}
+
+ClientId ClientRegistry::addClient(Shard& shard, size_t shardIndex, std::string_view name,
+                                   client_state state, const ConnectionHandle& handle) {
+	uint32_t slotIndex;
+	if (!shard.freeClientSlots.empty()) {
+		slotIndex = shard.freeClientSlots.back();
+		shard.freeClientSlots.pop_back();
+	} else {
+		slotIndex = (uint32_t) shard.clients.size();
+		shard.clients.emplace_back();
+	}
+	ClientSlot& slot = shard.clients[slotIndex];
+	slot.state = state;
+	slot.version++;
+	slot.name.assign(name.data(), name.size());
+	slot.handle = handle;
+	ClientId id = slotIndex * REGISTRY_SHARDS + (uint32_t) shardIndex;
+	shard.names.insert(name, id);
+	return id;
+}
+
+bool ClientRegistry::registerClient(std::string_view name, const ConnectionHandle& handle,
+                                    ClientId& id) {
+	size_t shardIndex = shardIndexOf(name);
+	Shard& shard = shards[shardIndex];
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (shard.names.find(name, id)) {
+			if ((id & GROUP_NAME_FLAG) != 0 ||
+			    shard.clients[INDEX_OF_ID(id)].state != CLIENT_OFFLINE) {
+				return false;
+			}
+			// An offline client reconnects.
+			ClientSlot& slot = shard.clients[INDEX_OF_ID(id)];
+			slot.state = CLIENT_ONLINE;
+			slot.version++;
+			slot.handle = handle;
+			rosterVersion++;
+		} else {
+			id = addClient(shard, shardIndex, name, CLIENT_ONLINE, handle);
+			rosterVersion++;
+			return true;    // a new client is not a member of any group yet.
+		}
+	}
+	updateGroupsOf(id);
+	return true;
+}
+
+size_t ClientRegistry::unregisterClient(ClientId id, uint64_t connectionId) {
+	return removeClient(id, CLIENT_ONLINE, connectionId);
+}
+
+void ClientRegistry::restoreExit(std::string_view name) {
+	ClientId id;
+	if (findClientId(name, id)) {
+		removeClient(id, CLIENT_OFFLINE, ConnectionHandle().id);
+	}
+}
+
+size_t ClientRegistry::removeClient(ClientId id, client_state state, uint64_t connectionId) {
+	Shard& clientShard = shards[SHARD_OF_ID(id)];
+	std::vector<GroupId> groups;
+	{
+		std::lock_guard<std::mutex> lock(clientShard.mutex);
+		ClientSlot& slot = clientShard.clients[INDEX_OF_ID(id)];
+		if (slot.state != state || slot.handle.id != connectionId) {
+			return 0;
+		}
+		clientShard.names.erase(slot.name);
+		slot.state = CLIENT_FREE;
+		slot.version++;
+		slot.handle = ConnectionHandle();
+		if (state == CLIENT_ONLINE) {
+			rosterVersion++;
+		}
+		groups.swap(slot.groups);
+	}
+	// Only the groups the client is a member of are touched, however many groups there are.
+	for (GroupId group : groups) {
+		removeMember(group, id);
+	}
+	// The id is given away only once no group refers to it anymore.
+	std::lock_guard<std::mutex> lock(clientShard.mutex);
+	clientShard.freeClientSlots.push_back(INDEX_OF_ID(id));
+	return groups.size();
+}
+
+void ClientRegistry::disconnectClient(ClientId id, uint64_t connectionId) {
+	{
+		Shard& shard = shards[SHARD_OF_ID(id)];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		ClientSlot& slot = shard.clients[INDEX_OF_ID(id)];
+		if (slot.state != CLIENT_ONLINE || slot.handle.id != connectionId) {
+			return;
+		}
+		slot.state = CLIENT_OFFLINE;
+		slot.version++;
+		slot.handle = ConnectionHandle();
+		rosterVersion++;
+	}
+	updateGroupsOf(id);
+}
+
+bool ClientRegistry::findClientId(std::string_view name, ClientId& id) const {
+	const Shard& shard = shards[shardIndexOf(name)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.names.find(name, id) && (id & GROUP_NAME_FLAG) == 0;
+}
+
+client_lookup ClientRegistry::findClient(std::string_view name,
+                                         ConnectionHandle& handle) const {
+	const Shard& shard = shards[shardIndexOf(name)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	ClientId id;
+	if (!shard.names.find(name, id) || (id & GROUP_NAME_FLAG) != 0) {
+		return CLIENT_NOT_FOUND;
+	}
+	const ClientSlot& slot = shard.clients[INDEX_OF_ID(id)];
+	if (slot.state != CLIENT_ONLINE) {
+		return CLIENT_FOUND_OFFLINE;
+	}
+	handle = slot.handle;
+	return CLIENT_FOUND;
+}
+
+bool ClientRegistry::createGroup(std::string_view groupName, ClientId creator,
+                                 const std::string_view* members, size_t numOfMembers) {
+	std::vector<ClientId> uniqueMembers;
+	uniqueMembers.reserve(numOfMembers + 1);
+	for (size_t i = 0; i < numOfMembers; i++) {
+		ClientId member;
+		if (!findClientId(members[i], member)) {
+			// which means there is no client with that name.
+			return false;
+		}
+		uniqueMembers.push_back(member);
+	}
+	uniqueMembers.push_back(creator);
+	std::sort(uniqueMembers.begin(), uniqueMembers.end());
+	uniqueMembers.erase(std::unique(uniqueMembers.begin(), uniqueMembers.end()),
+	                    uniqueMembers.end());
+
+	size_t shardIndex = shardIndexOf(groupName);
+	Shard& shard = shards[shardIndex];
+	GroupId id;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		id = (uint32_t) shard.groups.size() * REGISTRY_SHARDS + (uint32_t) shardIndex;
+		if (!shard.names.insert(groupName, id | GROUP_NAME_FLAG)) {
+			// which means the group name is already in use by another group or a client.
+			return false;
+		}
+		shard.groups.emplace_back();
+		GroupSlot& group = shard.groups.back();
+		group.name.assign(groupName.data(), groupName.size());
+		for (ClientId member : uniqueMembers) {
+			// The members are offline until their current state reaches the group, below.
+			group.members.push_back({member, 0, false, std::string(), ConnectionHandle()});
+		}
+		publishRecipients(group);
+	}
+
+	// Updates the reverse index of every member, and tells the group its state.
+	for (ClientId member : uniqueMembers) {
+		Shard& memberShard = shards[SHARD_OF_ID(member)];
+		std::unique_lock<std::mutex> lock(memberShard.mutex);
+		ClientSlot& slot = memberShard.clients[INDEX_OF_ID(member)];
+		if (slot.state == CLIENT_FREE) {
+			// The member has exited since it was looked up, without knowing of the group.
+			lock.unlock();
+			removeMember(id, member);
+			continue;
+		}
+		slot.groups.push_back(id);
+		uint64_t version = slot.version;
+		bool isOnline = slot.state == CLIENT_ONLINE;
+		std::string name = slot.name;
+		ConnectionHandle handle = slot.handle;
+		lock.unlock();
+		updateMember(id, member, version, isOnline, name, handle);
+	}
+	return true;
+}
+
+group_lookup ClientRegistry::findGroupRecipients(std::string_view groupName, ClientId sender,
+                                                 GroupRecipients& recipients) const {
+	const Shard& shard = shards[shardIndexOf(groupName)];
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	GroupId id;
+	if (!shard.names.find(groupName, id) || (id & GROUP_NAME_FLAG) == 0) {
+		return GROUP_NOT_FOUND;
+	}
+	const GroupSlot& group = shard.groups[INDEX_OF_ID(id & ~GROUP_NAME_FLAG)];
+	if (findMember(group, sender) == nullptr) {
+		return GROUP_NOT_MEMBER;
+	}
+	recipients = group.recipients;
+	return GROUP_FOUND;
+}
+
+bool ClientRegistry::restoreGroup(std::string_view groupName, const std::string_view* members,
+                                  size_t numOfMembers) {
+	size_t groupShardIndex = shardIndexOf(groupName);
+	Shard& groupShard = shards[groupShardIndex];
+	GroupId id = (uint32_t) groupShard.groups.size() * REGISTRY_SHARDS + (uint32_t) groupShardIndex;
+	ClientId existingId;
+	if (groupShard.names.find(groupName, existingId)) {
+		return false;
+	}
+
+	GroupSlot group;
+	group.name.assign(groupName.data(), groupName.size());
+	group.members.reserve(numOfMembers);
+	for (size_t i = 0; i < numOfMembers; i++) {
+		size_t shardIndex = shardIndexOf(members[i]);
+		Shard& shard = shards[shardIndex];
+		ClientId member;
+		if (!shard.names.find(members[i], member)) {
+			member = addClient(shard, shardIndex, members[i], CLIENT_OFFLINE, ConnectionHandle());
+		} else if ((member & GROUP_NAME_FLAG) != 0) {
+			return false;
+		}
+		const ClientSlot& slot = shard.clients[INDEX_OF_ID(member)];
+		group.members.push_back({member, slot.version, false, slot.name, ConnectionHandle()});
+	}
+	std::sort(group.members.begin(), group.members.end(),
+	          [](const GroupMember& a, const GroupMember& b) { return a.client < b.client; });
+	group.members.erase(std::unique(group.members.begin(), group.members.end(),
+	                                [](const GroupMember& a, const GroupMember& b) {
+		                                return a.client == b.client;
+	                                }),
+	                    group.members.end());
+	if (!groupShard.names.insert(groupName, id | GROUP_NAME_FLAG)) {
+		// which means a member has the group's name.
+		return false;
+	}
+	for (const GroupMember &member : group.members) {
+		shards[SHARD_OF_ID(member.client)].clients[INDEX_OF_ID(member.client)].groups.push_back(id);
+	}
+	publishRecipients(group);
+	groupShard.groups.push_back(std::move(group));
+	return true;
+}
+
+void ClientRegistry::forEachGroup(
+		const std::function<void(std::string_view groupName,
+		                         const std::vector<std::string_view>& members)>& visit) const {
+	std::vector<std::string_view> members;
+	for (const Shard &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (const GroupSlot &group : shard.groups) {
+			members.clear();
+			for (const GroupMember &member : group.members) {
+				if (!member.name.empty()) {     // i.e. its state has reached the group.
+					members.push_back(member.name);
+				}
+			}
+			visit(group.name, members);
+		}
+	}
+}
+
+size_t ClientRegistry::numOfGroups() const {
+	size_t numOfGroups = 0;
+	for (const Shard &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		numOfGroups += shard.groups.size();
+	}
+	return numOfGroups;
+}
+
+std::shared_ptr<const Roster> ClientRegistry::roster() const {
+	// The current roster is read without taking any lock.
+	uint64_t version = rosterVersion.load();
+	std::shared_ptr<const Roster> current = std::atomic_load(&cachedRoster);
+	if (current && current->version == version) {
+		return current;
+	}
+	// Concurrent requests for a stale roster wait for a single rebuild.
+	std::lock_guard<std::mutex> rosterLock(rosterMutex);
+	version = rosterVersion.load();
+	current = std::atomic_load(&cachedRoster);
+	if (current && current->version == version) {
+		return current;
+	}
+
+	std::vector<std::string> names;
+	for (const Shard &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (const ClientSlot &slot : shard.clients) {
+			if (slot.state == CLIENT_ONLINE) {
+				names.push_back(slot.name);
+			}
+		}
+	}
+	std::sort(names.begin(), names.end());
+
+	auto roster = std::make_shared<Roster>();
+	// A client that (dis)connects while the names are collected makes the version stale,
+	// so the next request rebuilds the roster again.
+	roster->version = version;
+	size_t length = names.size();       // the commas, and one to spare.
+	for (const std::string &name : names) {
+		length += name.size();
+	}
+	roster->names.reserve(length);
+	std::vector<size_t> starts;
+	starts.reserve(names.size());
+	for (const std::string &name : names) {
+		if (!roster->names.empty()) {
+			roster->names.push_back(',');
+		}
+		starts.push_back(roster->names.size());
+		roster->names.append(name);
+	}
+	// The views are taken only once 'names' is complete, and will never move again.
+	roster->sortedNames.reserve(names.size());
+	for (size_t i = 0; i < names.size(); i++) {
+		roster->sortedNames.emplace_back(roster->names.data() + starts[i], names[i].size());
+	}
+	std::atomic_store(&cachedRoster, std::shared_ptr<const Roster>(roster));
+	return roster;
+}
+
+
+std::string_view Roster::select(std::string_view prefix, size_t offset, size_t limit,
+                                size_t& numOfMatches) const {
+	auto first = std::lower_bound(sortedNames.begin(), sortedNames.end(), prefix);
+	auto last = std::partition_point(first, sortedNames.end(), [prefix](std::string_view name) {
+		return name.substr(0, prefix.size()) == prefix;
+	});
+	numOfMatches = (size_t) (last - first);
+	first += std::min(offset, numOfMatches);
+	if (limit != 0 && limit < (size_t) (last - first)) {
+		last = first + limit;
+	}
+	if (first == last) {
+		return std::string_view();
+	}
+	const char* begin = first->data();
+	const char* end = (last - 1)->data() + (last - 1)->size();
+	return std::string_view(begin, end - begin);
+}
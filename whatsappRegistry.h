@@ -0,0 +1,278 @@
+#ifndef _WHATSAPPREGISTRY_H
+#define _WHATSAPPREGISTRY_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "whatsappConnection.h"
+#include "whatsappNameTable.h"
+
+/**
+ * The number of independently locked shards of the registry.
+ */
+#define REGISTRY_SHARDS 64
+
+/**
+ * Marks the values of the name tables that are group ids rather than client ids.
+ */
+#define GROUP_NAME_FLAG 0x80000000u
+
+/*
+ * The result of looking up the recipients of a group message.
+ */
+enum group_lookup {GROUP_FOUND, GROUP_NOT_FOUND, GROUP_NOT_MEMBER};
+
+/*
+ * The result of looking up a client: connected, registered but offline, or not registered.
+ */
+enum client_lookup {CLIENT_FOUND, CLIENT_FOUND_OFFLINE, CLIENT_NOT_FOUND};
+
+/*
+ * Description: A connected member of a group.
+*/
+struct GroupRecipient {
+	ClientId client;
+	ConnectionHandle handle;
+};
+
+/*
+ * Description: The members of a group, as a message to it should reach them.
+*/
+struct GroupSnapshot {
+	std::vector<GroupRecipient> connected;
+	std::vector<std::string> offline;       // The names of the offline members.
+};
+
+/*
+ * An immutable snapshot of the members of a group. A group replaces its snapshot whenever one
+ * of its members connects or disconnects, so a sender iterates it without holding any lock,
+ * and without copying it.
+ */
+typedef std::shared_ptr<const GroupSnapshot> GroupRecipients;
+
+/*
+ * Description: A snapshot of the names of the connected clients, serialized once for all the
+ *              "who" requests that arrive until a client connects or disconnects. The names
+ *              are sorted, so the names that match a prefix, and any page of them, are a
+ *              contiguous part of the serialized list.
+*/
+struct Roster {
+	Roster() = default;
+	Roster(const Roster&) = delete;             // sortedNames point into names.
+	Roster& operator=(const Roster&) = delete;
+
+	/*
+	 * Description: Returns the names (separated by commas) that start with the given prefix,
+	 *              skipping the first 'offset' of them, and listing at most 'limit' of them
+	 *              (all of them if it is 0). The returned view points into the roster.
+	 * numOfMatches: output - the number of names that start with the prefix.
+	*/
+	std::string_view select(std::string_view prefix, size_t offset, size_t limit,
+	                        size_t& numOfMatches) const;
+
+	uint64_t version;
+	std::string names;                          // All the names, separated by commas.
+	std::vector<std::string_view> sortedNames;  // Views into 'names'.
+};
+
+/*
+ * Description: The clients and the groups, shared by all the worker threads.
+ *              Names are interned into integer ids when a client connects or a group is
+ *              created: each shard maps its names to ids with an open-addressing NameTable,
+ *              and keeps the clients and the groups in contiguous arrays indexed by id, so
+ *              routing a message is a hash probe and a few array lookups. Names are spread
+ *              by their hash over independently locked shards, so lookups of different names
+ *              rarely contend. A client and a group with the same name always fall in the
+ *              same shard, which makes checking that a name is not in use by either of them
+ *              a single-shard operation.
+ *              A client that disconnects without exiting stays registered, offline, and keeps
+ *              its groups: reconnecting with the same name brings it back online.
+*/
+class ClientRegistry {
+public:
+	/*
+	 * Description: Registers a newly connected client, or brings an offline client with the
+	 *              same name back online.
+	 * id: output - the id the client is registered with.
+	 * Returns false iff the name is already in use by a connected client or a group.
+	*/
+	bool registerClient(std::string_view name, const ConnectionHandle& handle, ClientId& id);
+
+	/*
+	 * Description: Unregisters a client that has exited (if it is still registered by the
+	 *              given connection), and removes it from the groups it is a member of.
+	 *              Its id may then be given to a new client.
+	 * Returns the number of groups the client has left.
+	*/
+	size_t unregisterClient(ClientId id, uint64_t connectionId);
+
+	/*
+	 * Description: Marks a client whose connection was lost as offline (if it is still
+	 *              registered by the given connection). It stays a member of its groups.
+	*/
+	void disconnectClient(ClientId id, uint64_t connectionId);
+
+	/*
+	 * Description: Looks up the connection of a client.
+	 * handle: output - the connection of the client, if it is connected.
+	 * Returns CLIENT_FOUND if the client is connected, CLIENT_FOUND_OFFLINE if it is registered
+	 * but its connection was lost, and CLIENT_NOT_FOUND if there is no client with that name.
+	*/
+	client_lookup findClient(std::string_view name, ConnectionHandle& handle) const;
+
+	/*
+	 * Description: Creates a group of the given members (an array of numOfMembers names)
+	 *              and its creator.
+	 * Returns false iff the group name is in use, or one of the members is not registered.
+	*/
+	bool createGroup(std::string_view groupName, ClientId creator,
+	                 const std::string_view* members, size_t numOfMembers);
+
+	/*
+	 * Description: Looks up the members of a group (the sender included).
+	 * recipients: output - the members the message should be sent to.
+	 * Returns GROUP_NOT_FOUND if there is no such group, GROUP_NOT_MEMBER if the sender
+	 * is not a member of it, and GROUP_FOUND otherwise.
+	*/
+	group_lookup findGroupRecipients(std::string_view groupName, ClientId sender,
+	                                 GroupRecipients& recipients) const;
+
+	/*
+	 * Description: Recreates a group that existed before the server was restarted. Its members
+	 *              that are not registered are registered offline, until they reconnect.
+	 *              A group all of whose members have exited is restored empty, so its name stays
+	 *              taken, as it was before the restart.
+	 *              Groups are restored in bulk while the server starts, so this takes no locks:
+	 *              it must be called before the registry is shared with other threads.
+	 * Returns false iff the group name is in use, or one of the members' names is a group's.
+	*/
+	bool restoreGroup(std::string_view groupName, const std::string_view* members,
+	                  size_t numOfMembers);
+
+	/*
+	 * Description: Replays the exit of a client from before the server was restarted: the
+	 *              client (registered offline since) is unregistered, and leaves its groups.
+	*/
+	void restoreExit(std::string_view name);
+
+	/*
+	 * Description: Calls 'visit' with the name and the member names of every group. A shard is
+	 *              locked while its groups are visited, so 'visit' must not use the registry.
+	*/
+	void forEachGroup(const std::function<void(std::string_view groupName,
+	                                           const std::vector<std::string_view>& members)>&
+	                  visit) const;
+
+	/*
+	 * Description: Returns a snapshot of the names of the connected clients. The snapshot is
+	 *              rebuilt only if a client has connected or disconnected since the last one.
+	*/
+	std::shared_ptr<const Roster> roster() const;
+
+	/*
+	 * Description: Returns the number of groups.
+	*/
+	size_t numOfGroups() const;
+
+private:
+	enum client_state {CLIENT_FREE, CLIENT_OFFLINE, CLIENT_ONLINE};
+
+	struct ClientSlot {
+		client_state state;
+		uint64_t version;                   // Incremented whenever the state or handle change.
+		std::string name;
+		ConnectionHandle handle;
+		std::vector<GroupId> groups;        // The groups the client is a member of.
+	};
+
+	struct GroupMember {
+		ClientId client;
+		uint64_t version;                   // The version of the client this entry reflects.
+		bool isOnline;
+		std::string name;                   // Known once the client's state reaches the group.
+		ConnectionHandle handle;
+	};
+
+	struct GroupSlot {
+		std::string name;
+		std::vector<GroupMember> members;   // Sorted by client id.
+		GroupRecipients recipients;
+	};
+
+	/*
+	 * An id is a dense index into the slots of the shard of its name:
+	 * id = index in the shard * REGISTRY_SHARDS + shard.
+	 */
+	struct Shard {
+		mutable std::mutex mutex;
+		NameTable names;                    // Maps names to client ids, or to flagged group ids.
+		std::vector<ClientSlot> clients;    // Indexed by id / REGISTRY_SHARDS.
+		std::vector<uint32_t> freeClientSlots;
+		std::vector<GroupSlot> groups;      // Indexed by id / REGISTRY_SHARDS.
+	};
+
+	size_t shardIndexOf(std::string_view name) const;
+
+	/*
+	 * Description: Registers a new client in the given (locked) shard.
+	 * Returns the id of the client.
+	*/
+	static ClientId addClient(Shard& shard, size_t shardIndex, std::string_view name,
+	                          client_state state, const ConnectionHandle& handle);
+
+	/*
+	 * Description: Unregisters a client that is in the given state (and, if it is online,
+	 *              connected through the given connection), and removes it from its groups.
+	 * Returns the number of groups the client has left.
+	*/
+	size_t removeClient(ClientId id, client_state state, uint64_t connectionId);
+
+	/*
+	 * Description: Looks up the id of a registered (connected or offline) client.
+	 * Returns false iff there is no registered client with that name.
+	*/
+	bool findClientId(std::string_view name, ClientId& id) const;
+
+	/*
+	 * Description: Tells a group that one of its members has connected or disconnected. The
+	 *              change is applied only if it is newer than what the group already knows,
+	 *              since the changes of a client may reach its groups out of order.
+	*/
+	void updateMember(GroupId group, ClientId member, uint64_t version, bool isOnline,
+	                  const std::string& name, const ConnectionHandle& handle);
+
+	/*
+	 * Description: Sends the current state of a client to all of its groups.
+	 *              Must be called without holding any lock.
+	*/
+	void updateGroupsOf(ClientId id);
+
+	/*
+	 * Description: Removes a client from the members of a group.
+	*/
+	void removeMember(GroupId group, ClientId member);
+
+	/*
+	 * Description: Returns the entry of a client in the members of a (const or mutable)
+	 *              group, or nullptr if it is not a member.
+	*/
+	template <typename Group>
+	static auto findMember(Group& group, ClientId client) -> decltype(group.members.data());
+
+	/*
+	 * Description: Replaces the snapshot of the members of a group.
+	*/
+	static void publishRecipients(GroupSlot& group);
+
+	Shard shards[REGISTRY_SHARDS];
+	std::atomic<uint64_t> rosterVersion{1};     // Incremented whenever a client (dis)connects.
+	mutable std::mutex rosterMutex;             // Held while cachedRoster is rebuilt.
+	mutable std::shared_ptr<const Roster> cachedRoster; // Accessed with std::atomic_load/store.
+};
+
+#endif
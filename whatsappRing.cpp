@@ -0,0 +1,301 @@
+#include "whatsappRing.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * The id of the ring's only buffer group.
+ */
+#define BUFFER_GROUP_ID 0
+
+/**
+ * The completion queue is this many times the size of the submission queue, since multishot
+ * requests complete many times per submission.
+ */
+#define COMPLETIONS_PER_ENTRY 4
+
+/**
+ * The size of the signal mask io_uring_enter is given (in bytes) - the kernel's, not glibc's.
+ */
+#define KERNEL_SIGNAL_SET_SIZE (_NSIG / 8)
+
+/**
+ * The setup flags of a ring: only the thread that created the ring submits to it, and the
+ * completions are run when it waits for them rather than by interrupting it.
+ */
+#define RING_SETUP_FLAGS (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | \
+                          IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE)
+
+
+/*
+ * Description: The reads and writes of the indexes the kernel shares with the ring.
+*/
+static unsigned loadAcquire(const unsigned* index) {
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned* index, unsigned value) {
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+}
+
+
+IoRing::IoRing() : ringFD(-1), queuesMemory(MAP_FAILED), queuesSize(0), entries(nullptr),
+                   entriesSize(0), submitHead(nullptr), submitTail(nullptr), submitMask(0),
+                   numOfSubmitEntries(0), nextSubmitTail(0), completeHead(nullptr),
+                   completeTail(nullptr), completeMask(0), completions(nullptr),
+                   bufferRing(nullptr), bufferRingSize(0), numOfBuffers(0), bufferSize(0),
+                   bufferTail(0), failedErrno(0) {
+}
+
+IoRing::~IoRing() {
+	// Closing the ring cancels the requests that are still in flight.
+	if (ringFD >= 0) {
+		close(ringFD);
+	}
+	if (bufferRing != nullptr) {
+		munmap(bufferRing, bufferRingSize);
+	}
+	if (entries != nullptr) {
+		munmap(entries, entriesSize);
+	}
+	if (queuesMemory != MAP_FAILED) {
+		munmap(queuesMemory, queuesSize);
+	}
+}
+
+bool IoRing::isSupported() {
+	IoRing ring;
+	return ring.open(8, 8, 64);
+}
+
+bool IoRing::open(unsigned numOfEntries, unsigned numOfBuffers, unsigned bufferSize) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = RING_SETUP_FLAGS;
+	params.cq_entries = numOfEntries * COMPLETIONS_PER_ENTRY;
+	ringFD = (int) syscall(__NR_io_uring_setup, numOfEntries, &params);
+	if (ringFD < 0) {
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		return false;
+	}
+
+	// The submission and the completion queues share a single mapping.
+	queuesSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+	                      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	queuesMemory = mmap(nullptr, queuesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ringFD, IORING_OFF_SQ_RING);
+	if (queuesMemory == MAP_FAILED) {
+		return false;
+	}
+	entriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* entriesMemory = mmap(nullptr, entriesSize, PROT_READ | PROT_WRITE,
+	                           MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES);
+	if (entriesMemory == MAP_FAILED) {
+		return false;
+	}
+	entries = (struct io_uring_sqe*) entriesMemory;
+
+	char* queues = (char*) queuesMemory;
+	submitHead = (unsigned*) (queues + params.sq_off.head);
+	submitTail = (unsigned*) (queues + params.sq_off.tail);
+	submitMask = *(unsigned*) (queues + params.sq_off.ring_mask);
+	numOfSubmitEntries = params.sq_entries;
+	nextSubmitTail = *submitTail;
+	// The n'th queued entry is always entries[n & mask], so the indirection array is fixed.
+	auto submitArray = (unsigned*) (queues + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++) {
+		submitArray[i] = i;
+	}
+	completeHead = (unsigned*) (queues + params.cq_off.head);
+	completeTail = (unsigned*) (queues + params.cq_off.tail);
+	completeMask = *(unsigned*) (queues + params.cq_off.ring_mask);
+	completions = (struct io_uring_cqe*) (queues + params.cq_off.cqes);
+
+	// The provided buffers, and the ring through which they are handed to the kernel.
+	this->numOfBuffers = numOfBuffers;
+	this->bufferSize = bufferSize;
+	bufferRingSize = numOfBuffers * sizeof(struct io_uring_buf);
+	void* bufferRingMemory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE,
+	                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufferRingMemory == MAP_FAILED) {
+		return false;
+	}
+	bufferRing = (struct io_uring_buf_ring*) bufferRingMemory;
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (uint64_t) bufferRing;
+	registration.ring_entries = numOfBuffers;
+	registration.bgid = BUFFER_GROUP_ID;
+	if (syscall(__NR_io_uring_register, ringFD, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+		return false;
+	}
+	buffers.reset(new char[(size_t) numOfBuffers * bufferSize]);
+	for (unsigned bufferId = 0; bufferId < numOfBuffers; bufferId++) {
+		RingCompletion completion = {0, 0, bufferId << IORING_CQE_BUFFER_SHIFT};
+		returnBuffer(completion);
+	}
+	return true;
+}
+
+struct io_uring_sqe* IoRing::nextEntry() {
+	while (nextSubmitTail - loadAcquire(submitHead) >= numOfSubmitEntries) {
+		// The kernel takes no entries while the completion queue overflows (io_uring_enter
+		// fails with EBUSY), so the completions are moved aside - 'nextCompletion' returns them
+		// first - until the submission makes room.
+		RingCompletion completion;
+		while (takeCompletion(completion)) {
+			pendingCompletions.push_back(completion);
+		}
+		if (!enter(nextSubmitTail - loadAcquire(submitHead), 0, -1)) {
+			// The ring is unusable: the request is dropped, and the next wait fails.
+			failedErrno = errno;
+			memset(&discardedEntry, 0, sizeof(discardedEntry));
+			return &discardedEntry;
+		}
+	}
+	struct io_uring_sqe* entry = &entries[nextSubmitTail & submitMask];
+	memset(entry, 0, sizeof(*entry));
+	nextSubmitTail++;
+	return entry;
+}
+
+void IoRing::pollReadable(int fd, uint64_t userData, bool isMultishot) {
+	struct io_uring_sqe* entry = nextEntry();
+	entry->opcode = IORING_OP_POLL_ADD;
+	entry->fd = fd;
+	entry->poll32_events = POLLIN;
+	entry->len = isMultishot ? IORING_POLL_ADD_MULTI : 0;
+	entry->user_data = userData;
+}
+
+void IoRing::acceptMultishot(int fd, int flags, uint64_t userData) {
+	struct io_uring_sqe* entry = nextEntry();
+	entry->opcode = IORING_OP_ACCEPT;
+	entry->fd = fd;
+	entry->ioprio = IORING_ACCEPT_MULTISHOT;
+	entry->accept_flags = (uint32_t) flags;
+	entry->user_data = userData;
+}
+
+void IoRing::receiveMultishot(int fd, uint64_t userData) {
+	struct io_uring_sqe* entry = nextEntry();
+	entry->opcode = IORING_OP_RECV;
+	entry->fd = fd;
+	entry->ioprio = IORING_RECV_MULTISHOT;
+	entry->flags = IOSQE_BUFFER_SELECT;
+	entry->buf_group = BUFFER_GROUP_ID;
+	entry->user_data = userData;
+}
+
+void IoRing::sendMessage(int fd, const struct msghdr* message, int flags, uint64_t userData,
+                         bool isLinked) {
+	struct io_uring_sqe* entry = nextEntry();
+	entry->opcode = IORING_OP_SENDMSG;
+	entry->fd = fd;
+	entry->addr = (uint64_t) message;
+	entry->len = 1;
+	entry->msg_flags = (uint32_t) flags;
+	entry->flags = isLinked ? IOSQE_IO_LINK : 0;
+	entry->user_data = userData;
+}
+
+void IoRing::cancel(uint64_t userData) {
+	struct io_uring_sqe* entry = nextEntry();
+	entry->opcode = IORING_OP_ASYNC_CANCEL;
+	entry->fd = -1;
+	entry->addr = userData;
+	entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+	entry->user_data = RING_CANCEL_USER_DATA;
+}
+
+bool IoRing::enter(unsigned numToSubmit, unsigned minCompletions, int timeoutMs) {
+	storeRelease(submitTail, nextSubmitTail);
+	unsigned flags = minCompletions > 0 ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec timeout = {timeoutMs / 1000,
+	                                    (long long) (timeoutMs % 1000) * 1000000};
+	struct io_uring_getevents_arg waitArgument;
+	memset(&waitArgument, 0, sizeof(waitArgument));
+	waitArgument.sigmask_sz = KERNEL_SIGNAL_SET_SIZE;
+	waitArgument.ts = (uint64_t) &timeout;
+	const void* argument = nullptr;
+	size_t argumentSize = 0;
+	if (minCompletions > 0 && timeoutMs >= 0) {
+		flags |= IORING_ENTER_EXT_ARG;
+		argument = &waitArgument;
+		argumentSize = sizeof(waitArgument);
+	}
+	while (syscall(__NR_io_uring_enter, ringFD, numToSubmit, minCompletions, flags,
+	               argument, argumentSize) < 0) {
+		if (errno == EBUSY || errno == EAGAIN) {
+			// The completion queue has overflowed - its completions are taken first.
+			return true;
+		}
+		if (errno == ETIME) {
+			return true;
+		}
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool IoRing::submitAndWait(unsigned minCompletions, int timeoutMs) {
+	if (failedErrno != 0) {
+		errno = failedErrno;
+		return false;
+	}
+	// Completions that were moved aside are already available.
+	if (!pendingCompletions.empty()) {
+		minCompletions = 0;
+	}
+	return enter(nextSubmitTail - loadAcquire(submitHead), minCompletions, timeoutMs);
+}
+
+bool IoRing::nextCompletion(RingCompletion& completion) {
+	if (!pendingCompletions.empty()) {
+		completion = pendingCompletions.front();
+		pendingCompletions.pop_front();
+		return true;
+	}
+	return takeCompletion(completion);
+}
+
+bool IoRing::takeCompletion(RingCompletion& completion) {
+	unsigned head = *completeHead;
+	if (head == loadAcquire(completeTail)) {
+		return false;
+	}
+	const struct io_uring_cqe& entry = completions[head & completeMask];
+	completion.userData = entry.user_data;
+	completion.result = entry.res;
+	completion.flags = entry.flags;
+	storeRelease(completeHead, head + 1);
+	return true;
+}
+
+const char* IoRing::bufferOf(const RingCompletion& completion) const {
+	size_t bufferId = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+	return buffers.get() + bufferId * bufferSize;
+}
+
+void IoRing::returnBuffer(const RingCompletion& completion) {
+	uint16_t bufferId = (uint16_t) (completion.flags >> IORING_CQE_BUFFER_SHIFT);
+	// Not bufferRing->bufs: in C++ the header's flexible array member is not at offset 0.
+	auto bufferEntries = (struct io_uring_buf*) bufferRing;
+	struct io_uring_buf& entry = bufferEntries[bufferTail & (numOfBuffers - 1)];
+	entry.addr = (uint64_t) (buffers.get() + (size_t) bufferId * bufferSize);
+	entry.len = bufferSize;
+	entry.bid = bufferId;
+	bufferTail++;
+	__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,172 @@
+#ifndef _WHATSAPPRING_H
+#define _WHATSAPPRING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+/**
+ * The user data of the completion of a cancellation (which is reported only if it fails).
+ * No other request may be submitted with it.
+ */
+#define RING_CANCEL_USER_DATA 0
+
+/*
+ * Description: A completion that was taken from the completion queue of an IoRing.
+ * userData: the value the request was submitted with.
+ * result: the result of the request - as the result of the matching system call, or -errno.
+ * flags: IORING_CQE_F_MORE if a multishot request goes on, IORING_CQE_F_BUFFER if a buffer
+ *        of the ring's buffer group holds the data (see 'bufferOf').
+*/
+struct RingCompletion {
+	uint64_t userData;
+	int32_t result;
+	uint32_t flags;
+};
+
+/*
+ * Description: An io_uring instance, driven by raw system calls (there is no liburing).
+ *              Requests are queued to the submission queue and submitted together by
+ *              'submitAndWait', which also waits for completions - a single system call per
+ *              turn of the event loop, however many requests were queued and completed.
+ *              The ring owns a group of provided buffers that multishot receives fill in:
+ *              the kernel picks a buffer for every chunk of data it receives, so no buffer
+ *              is held by a connection that receives nothing. A buffer must be given back
+ *              (see 'returnBuffer') once its data is consumed.
+ *              A ring is used by the thread that opened it only.
+*/
+class IoRing {
+public:
+	IoRing();
+	~IoRing();
+
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(const IoRing&) = delete;
+
+	/*
+	 * Description: Returns true iff the kernel supports what the ring needs: a single issuer
+	 *              ring with deferred task running, waits with a timeout, provided buffer
+	 *              rings, multishot accepts and multishot receives (Linux 6.1 or later).
+	*/
+	static bool isSupported();
+
+	/*
+	 * Description: Creates the ring and its buffer group.
+	 * numOfEntries: the size of the submission queue (the completion queue is larger).
+	 * numOfBuffers: the number of provided buffers (a power of two).
+	 * bufferSize: the size of every provided buffer.
+	 * Returns false on failure (errno is set).
+	*/
+	bool open(unsigned numOfEntries, unsigned numOfBuffers, unsigned bufferSize);
+
+	/*
+	 * Description: Queues a poll: a completion once the file-descriptor is readable.
+	 * isMultishot: true for a completion whenever it becomes readable again (until the poll
+	 *              is cancelled), false for a single completion.
+	*/
+	void pollReadable(int fd, uint64_t userData, bool isMultishot);
+
+	/*
+	 * Description: Queues a multishot accept: a completion with the file-descriptor of every
+	 *              client that connects to the listening socket.
+	 * flags: the flags of 'accept4' the clients' sockets are created with (e.g. SOCK_NONBLOCK).
+	*/
+	void acceptMultishot(int fd, int flags, uint64_t userData);
+
+	/*
+	 * Description: Queues a multishot receive: a completion, with a provided buffer, whenever
+	 *              data arrives on the socket.
+	*/
+	void receiveMultishot(int fd, uint64_t userData);
+
+	/*
+	 * Description: Queues a 'sendmsg'. The message (and what it points to) must stay valid
+	 *              until the request completes.
+	 * flags: the flags of 'sendmsg' (e.g. MSG_WAITALL, to send all of the message).
+	 * isLinked: true if the next request that is queued must only start once this one has
+	 *           completed - and is cancelled if this one fails.
+	*/
+	void sendMessage(int fd, const struct msghdr* message, int flags, uint64_t userData,
+	                 bool isLinked);
+
+	/*
+	 * Description: Queues the cancellation of the request that was submitted with the given
+	 *              user data. Its own completion is reported only if it fails (e.g. if the
+	 *              request has already completed), with RING_CANCEL_USER_DATA.
+	*/
+	void cancel(uint64_t userData);
+
+	/*
+	 * Description: Submits the queued requests, and waits until at least the given number of
+	 *              completions are available.
+	 * timeoutMs: maximal time to wait in milliseconds (-1 to wait forever) - it is not an error
+	 *            if fewer completions are available by then.
+	 * Returns false on failure (errno is set).
+	*/
+	bool submitAndWait(unsigned minCompletions, int timeoutMs = -1);
+
+	/*
+	 * Description: Takes the next available completion.
+	 * Returns false iff there is none.
+	*/
+	bool nextCompletion(RingCompletion& completion);
+
+	/*
+	 * Description: Returns the provided buffer a completion's data was received into.
+	*/
+	const char* bufferOf(const RingCompletion& completion) const;
+
+	/*
+	 * Description: Gives a buffer back to the buffer group once its data was consumed.
+	*/
+	void returnBuffer(const RingCompletion& completion);
+
+private:
+	/*
+	 * Description: Returns a cleared entry of the submission queue, submitting the queued
+	 *              entries first if it is full. The queued entries are never overwritten: if
+	 *              the ring fails, the entry is a scratch one, and the next wait fails.
+	*/
+	struct io_uring_sqe* nextEntry();
+
+	/*
+	 * Description: Takes the next completion from the completion queue.
+	 * Returns false iff there is none.
+	*/
+	bool takeCompletion(RingCompletion& completion);
+
+	/*
+	 * Description: Calls io_uring_enter, retrying if interrupted.
+	 * Returns false on failure (errno is set).
+	*/
+	bool enter(unsigned numToSubmit, unsigned minCompletions, int timeoutMs);
+
+	int ringFD;
+	void* queuesMemory;         // The submission and completion queues (a single mapping).
+	size_t queuesSize;
+	struct io_uring_sqe* entries;
+	size_t entriesSize;
+	unsigned* submitHead;
+	unsigned* submitTail;
+	unsigned submitMask;
+	unsigned numOfSubmitEntries;
+	unsigned nextSubmitTail;    // The tail of the queued entries, published on submission.
+	unsigned* completeHead;
+	unsigned* completeTail;
+	unsigned completeMask;
+	struct io_uring_cqe* completions;
+	struct io_uring_buf_ring* bufferRing;
+	size_t bufferRingSize;
+	std::unique_ptr<char[]> buffers;
+	unsigned numOfBuffers;
+	unsigned bufferSize;
+	uint16_t bufferTail;
+	std::deque<RingCompletion> pendingCompletions;  // Taken to make room for submissions.
+	struct io_uring_sqe discardedEntry;
+	int failedErrno;            // Set once the ring has failed to submit.
+};
+
+#endif
@@ -1,340 +1,2193 @@
-#include <iostream>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <set>
-#include <map>
-#include "whatsappio.h"
-
-using namespace std;
-
-
-/**
- * The program's valid number of arguments.
- */
-#define SERVER_NUM_OF_ARGS 2
-
-/**
- * The exit command from the standard input, telling the server it should terminate.
- */
-#define EXIT_COMMAND "EXIT"
-
-
-/**
- * The exit code in case of a success.
- * Also used as a success message that is sent to a client after a successful read.
- */
-#define SUCCESS 0
-
-/**
- * The exit code in case of a failure.
- */
-#define FAILURE 1
-
-/**
- * The index of the port number in 'argv'.
- */
-#define PORT_NUM_INDEX 1
-
-/**
- * The base that is normally used to represent a number - used in 'strtol' function.
- */
-#define DECIMAL_BASE 10
-
-/**
- * The maximal length of a host name.
- */
-#define MAX_HOST_NAME_LENGTH 256
-
-/**
- * When this constant is used as the third argument of socket, the default protocol
- * will be chosen - which in our case will be TCP, since we use SOCK_STREAM.
- */
-#define DEFAULT_PROTOCOL 0
-
-/**
- * The maximal number of pending connections in the socket's listen queue.
- */
-#define MAX_NUM_OF_CLIENTS 10
-
-/**
- * The string that is sent to a client who tries to connect
- * with a name that is already in use in the server.
- */
-#define DUP_CONNECTION "dupConnection"
-
-/**
- * The exit message that is sent from the server to a client - which informs
- * the client it should exit (with exit code 1 (FAILURE) ).
- */
-#define SERVER_EXIT "serverEXIT"
-
-
-
-// global Variables:
-static map<int, string> fdToClientName;         // Maps clientFDs to their name
-static map<string, int> clientNameToFd;         // Maps client names to their fd.
-static map<string, set<string>> groups;         // Maps group names to their participants
-static set<int> clientsFileDescriptors;
-static set<int> allFileDescriptors;
-static set<string> clientNames;
-fd_set allFDsSet, readyToReadFdSet;
-int listeningSocketFD;
-
-
-
-void connectNewClient(int clientSocketFD) {
-	string clientName = readData(clientSocketFD);
-	if ((clientNames.count(clientName) > 0) ||
-			(groups.find(clientName) != groups.end())) {  //i.e. if clientName is already in use:
-		string response = DUP_CONNECTION;
-		writeData(clientSocketFD, response);
-	} else {
-		FD_SET(clientSocketFD, &allFDsSet);
-		clientsFileDescriptors.insert(clientSocketFD);
-		allFileDescriptors.insert(clientSocketFD);
-		clientNames.insert(clientName);
-		fdToClientName[clientSocketFD] = clientName;
-		clientNameToFd[clientName] = clientSocketFD;
-		string response = to_string(SUCCESS);
-		writeData(clientSocketFD, response);
-		print_connection_server(clientName);
-	}
-}
-
-
-bool serverStdInput() {
-	bool toExit = false;
-	string userInput;
-	getline(cin, userInput);
-	if (userInput == EXIT_COMMAND) {
-		toExit = true;
-		print_exit();
-		close(listeningSocketFD);
-		for (const int &clientFileDescriptor: clientsFileDescriptors) {
-			string serverExit(SERVER_EXIT);
-			writeData(clientFileDescriptor, serverExit);
-			close(clientFileDescriptor);
-		}
-	}
-	return toExit;
-
-}
-
-bool isGroupValid(string& groupName, vector<string>& clients) {
-	if ((clientNames.count(groupName) > 0) || (groups.find(groupName) != groups.end())) {
-		// which means the group name is already in use by another group or a client.
-		return false;
-	}
-	for (const string &client : clients) {
-		if (clientNames.count(client) == 0) {
-			// which means there is no client with that name.
-			return false;
-		}
-	}
-	return true;
-}
-
-
-void handleCreateGroupRequest(int clientSocketFD, string& groupName, vector<string>& clients) {
-    string response;
-    string clientName = fdToClientName[clientSocketFD];
-    if (!isGroupValid(groupName, clients)) {
-        print_create_group(true, false, clientName, groupName);
-        response = to_string(FAILURE);
-    } else {
-        set<string> uniqueClients;
-        for (const string &client : clients) {
-            uniqueClients.insert(client);   // makes duplicate members appear once in group.
-            uniqueClients.insert(clientName);
-        }
-		groups[groupName] = uniqueClients;
-        print_create_group(true, true, clientName, groupName);
-        response = to_string(SUCCESS);
-    }
-    writeData(clientSocketFD, response);
-}
-
-
-void handleSendRequest(int senderClientFD, string& name, string& message) {
-	string responseToSenderClient;
-	string senderClientName = fdToClientName[senderClientFD];
-
-	if (clientNames.count(name) > 0) {
-		print_send(true, true, true, senderClientName, name, message);
-		responseToSenderClient = to_string(SUCCESS);
-
-		int receiverClientFD = clientNameToFd[name];
-		string messageToReceiverClient = "send " + senderClientName + " " + message;
-		writeData(receiverClientFD, messageToReceiverClient);
-	}
-	else if (groups.find(name) != groups.end()) {
-		set<string> clientsInGroup = groups[name];
-		if(clientsInGroup.count(senderClientName) == 0) { // sender is not a member of this group
-			print_send(true, true, false, senderClientName, name, message);
-			responseToSenderClient = to_string(FAILURE);
-		}
-		else {  // if sender is a member of this group:
-			print_send(true, true, true, senderClientName, name, message);
-			responseToSenderClient = to_string(SUCCESS);
-
-			string messageToReceiverClient = "send " + senderClientName + " " + message;
-			for (const string &receiverClientName : clientsInGroup)
-			{
-				if (receiverClientName != senderClientName) {
-					int receiverClientFD = clientNameToFd[receiverClientName];
-					writeData(receiverClientFD, messageToReceiverClient);
-				}
-			}
-		}
-	}
-	else {      // i.e. : name is neither a client name nor a group name:
-		print_send(true, true, false, senderClientName, name, message);
-		responseToSenderClient = to_string(FAILURE);
-	}
-	writeData(senderClientFD, responseToSenderClient);
-}
-
-
-void handleWhoRequest(int clientSocketFD) {
-	string response;
-	string clientName = fdToClientName[clientSocketFD];
-
-	print_who_server(clientName);
-	for (const string &client : clientNames) {
-		response += (client + ",");
-	}
-	response.pop_back();    // deletes last redundant comma.
-	writeData(clientSocketFD, response);
-}
-
-
-void handleExitRequest(int clientSocketFD) {
-	string response;
-	string clientName = fdToClientName[clientSocketFD];
-
-	clientsFileDescriptors.erase(clientSocketFD);
-	allFileDescriptors.erase(clientSocketFD);
-	clientNames.erase(clientName);
-	fdToClientName.erase(clientSocketFD);
-	clientNameToFd.erase(clientName);
-    FD_CLR(clientSocketFD, &allFDsSet);
-    FD_CLR(clientSocketFD, &readyToReadFdSet);
-	// for group in groups: remove clientName from group.
-    for (auto &groupParticipantsPair : groups) {
-        if (groupParticipantsPair.second.count(clientName) > 0) {
-            groupParticipantsPair.second.erase(clientName);
-        }
-    }
-	close(clientSocketFD);
-	print_exit(true, clientName);
-}
-
-
-void handleClientRequest(int clientSocketFD) {
-    string clientInput, name, message;
-    command_type commandType;
-    vector<string> clients;
-	clients.clear();
-
-    clientInput = readData(clientSocketFD);
-    parse_command(clientInput, commandType, name, message, clients);
-
-    if (commandType == CREATE_GROUP) {
-        handleCreateGroupRequest(clientSocketFD, name, clients);
-    } else if (commandType == SEND) {
-		handleSendRequest(clientSocketFD, name, message);
-	} else if (commandType == WHO) {
-		handleWhoRequest(clientSocketFD);
-	} else if (commandType == EXIT) {
-		handleExitRequest(clientSocketFD);
-	}
-}
-
-
-int main(int argc, char *argv[]) {
-	if (argc != SERVER_NUM_OF_ARGS) {
-		print_server_usage();
-		return FAILURE;
-	}
-
-	auto portNum = (unsigned short) strtol(argv[PORT_NUM_INDEX], nullptr, DECIMAL_BASE);
-	char myHostName[MAX_HOST_NAME_LENGTH + 1];
-	struct sockaddr_in serverSocketAddress = {0};
-	struct sockaddr_in clientSocketAddress = {0};
-	struct hostent *hostEntry;
-	int clientSocketFD;
-	bool toExit = false;
-	FD_ZERO(&allFDsSet);
-	FD_ZERO(&readyToReadFdSet);
-
-	if ( gethostname(myHostName, MAX_HOST_NAME_LENGTH) < 0) {
-		print_error("gethostname", errno);
-	}
-	hostEntry = gethostbyname(myHostName);
-	if (hostEntry == nullptr) {
-		print_error("gethostbyname", h_errno);
-		return FAILURE;
-	}
-
-	memset( &serverSocketAddress, 0, sizeof(serverSocketAddress));
-	serverSocketAddress.sin_family = (unsigned short) hostEntry->h_addrtype;
-	serverSocketAddress.sin_addr.s_addr = htons(INADDR_ANY);
-	serverSocketAddress.sin_port = htons(portNum);
-
-	// We use TCP, and therefore we use SOCK_STREAM
-	listeningSocketFD = socket(AF_INET, SOCK_STREAM, DEFAULT_PROTOCOL);
-	if (listeningSocketFD < 0) {
-		print_error("socket", errno);
-		return FAILURE;
-	}
-
-	if ( bind( listeningSocketFD, (struct sockaddr*) &serverSocketAddress,
-	           sizeof(struct sockaddr_in)) < 0) {
-		print_error("bind", errno);
-		return FAILURE;
-	}
-
-	if ( listen( listeningSocketFD, MAX_NUM_OF_CLIENTS) < 0) {
-		print_error("listen", errno);
-		return FAILURE;
-	}
-
-	socklen_t clientSocketAddressLength = sizeof(clientSocketAddress);
-	FD_SET(listeningSocketFD, &allFDsSet);
-	FD_SET(STDIN_FILENO, &allFDsSet);
-	allFileDescriptors.insert(listeningSocketFD);
-	allFileDescriptors.insert(STDIN_FILENO);
-
-	while (!toExit) {
-		readyToReadFdSet = allFDsSet;
-
-		if ( select(*allFileDescriptors.rbegin() + 1,
-		            &readyToReadFdSet, nullptr, nullptr, nullptr) < 0) {
-			print_error("select", errno);
-			return FAILURE;
-		}
-		if (FD_ISSET(listeningSocketFD, &readyToReadFdSet)) {
-			clientSocketFD = accept(listeningSocketFD,
-			                        (struct sockaddr *) &clientSocketAddress,
-			                        &clientSocketAddressLength);
-			if (clientSocketFD < 0)
-			{
-				print_error("accept", errno);
-				return FAILURE;
-			}
-			connectNewClient(clientSocketFD);
-		}
-		if (FD_ISSET(STDIN_FILENO, &readyToReadFdSet)) {
-			toExit = serverStdInput();
-		}
-		for (const int &clientFileDescriptor: clientsFileDescriptors) {
-			if (FD_ISSET(clientFileDescriptor, &readyToReadFdSet)) {
-				handleClientRequest(clientFileDescriptor);
-                break;
-			}
-		}
-	}
-	return SUCCESS;
-}
\ No newline at end of file
+#include <iostream>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <climits>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include "whatsappio.h"
+#include "whatsappEventLoop.h"
+#include "whatsappConnection.h"
+#include "whatsappMailbox.h"
+#include "whatsappRegistry.h"
+#include "whatsappProtocol.h"
+#include "whatsappOfflineStore.h"
+#include "whatsappGroupStore.h"
+#include "whatsappMetrics.h"
+#include "whatsappLog.h"
+#include "whatsappRing.h"
+
+using namespace std;
+
+
+/**
+ * The program's minimal number of arguments (the options that follow the port are optional).
+ */
+#define SERVER_NUM_OF_ARGS 2
+
+/**
+ * The index of the first option in 'argv'.
+ */
+#define FIRST_OPTION_INDEX 2
+
+/**
+ * The exit command from the standard input, telling the server it should terminate.
+ */
+#define EXIT_COMMAND "EXIT"
+
+/**
+ * The command from the standard input that prints the server's metrics.
+ */
+#define STATS_COMMAND "STATS"
+
+
+/**
+ * The exit code in case of a success.
+ * Also used as a success message that is sent to a client after a successful read.
+ */
+#define SUCCESS 0
+
+/**
+ * The exit code in case of a failure.
+ */
+#define FAILURE 1
+
+/**
+ * The index of the port number in 'argv'.
+ */
+#define PORT_NUM_INDEX 1
+
+/**
+ * The base that is normally used to represent a number - used in 'strtol' function.
+ */
+#define DECIMAL_BASE 10
+
+/**
+ * The maximal length of a host name.
+ */
+#define MAX_HOST_NAME_LENGTH 256
+
+/**
+ * When this constant is used as the third argument of socket, the default protocol
+ * will be chosen - which in our case will be TCP, since we use SOCK_STREAM.
+ */
+#define DEFAULT_PROTOCOL 0
+
+/**
+ * The default number of pending connections in the listening socket's queue (the kernel caps
+ * it at net.core.somaxconn).
+ */
+#define DEFAULT_LISTEN_BACKLOG 4096
+
+/**
+ * The default time a new client has to send its hello, before it is disconnected.
+ */
+#define DEFAULT_HANDSHAKE_TIMEOUT_MS 10000
+
+/**
+ * The default number of frames a client's requests may take per turn of its worker's event
+ * loop - the rest wait for the next turn, after the other ready clients had theirs.
+ */
+#define DEFAULT_FRAME_BUDGET 64
+
+/**
+ * The default time a slow consumer's outbound queue may go without draining, in milliseconds.
+ */
+#define DEFAULT_SLOW_CONSUMER_LAG_MS 10000
+
+/**
+ * The flags the sockets of the accepted clients are created with.
+ */
+#define ACCEPT_FLAGS (SOCK_NONBLOCK | SOCK_CLOEXEC)
+
+/**
+ * The maximal number of pending connections to the metrics socket.
+ */
+#define MAX_NUM_OF_STATS_CLIENTS 16
+
+/**
+ * The default number of worker threads, each running its own event loop.
+ */
+#define DEFAULT_NUM_OF_WORKERS 1
+
+/**
+ * The option that corks the client sockets during long flushes.
+ */
+#define CORK_OPTION "--cork"
+
+/**
+ * The options of the log: the messages' bodies are not logged, every line is timestamped, and
+ * lines are dropped rather than wait while the log is backed up.
+ */
+#define NO_LOG_BODIES_OPTION "--no-log-bodies"
+#define LOG_TIMESTAMPS_OPTION "--log-timestamps"
+#define LOG_DROP_OPTION "--log-drop"
+
+/**
+ * The default directories of the offline store and of the group store.
+ */
+#define DEFAULT_OFFLINE_DIRECTORY "whatsappOffline"
+#define DEFAULT_GROUPS_DIRECTORY "whatsappGroups"
+
+/**
+ * The index of the worker thread that also reads the server's standard input.
+ */
+#define MAIN_WORKER 0
+
+/**
+ * The sizes of the io_uring of every worker: its submission queue, and its provided buffers
+ * (a power of two), which hold the data a receive completes with until it is consumed.
+ */
+#define RING_NUM_OF_ENTRIES 4096
+#define RING_NUM_OF_BUFFERS 512
+#define RING_BUFFER_SIZE 8192
+
+/**
+ * The maximal number of linked 'sendmsg' requests (each of up to MAX_IOVECS_PER_FLUSH frames)
+ * in flight to a single client.
+ */
+#define MAX_SENDS_PER_CHAIN 16
+
+/**
+ * How long an io_uring worker that shuts down waits for each completion of the last sends to
+ * its clients, before it closes their sockets anyway.
+ */
+#define LAST_SENDS_TIMEOUT_MS 1000
+
+/**
+ * The user data of an io_uring request holds the kind of the request in its top byte, and
+ * what identifies its target in the rest (see ring_request_kind).
+ */
+#define RING_KIND_SHIFT 56
+#define RING_TARGET_MASK ((1ull << RING_KIND_SHIFT) - 1)
+
+/**
+ * The user data of a receive holds the client's file-descriptor above the low 32 bits of its
+ * connection id.
+ */
+#define RECEIVE_FD_SHIFT 32
+#define RECEIVE_ID_MASK 0xFFFFFFFFull
+
+
+/**
+ * The events a connected client is watched for. The client sockets are edge-triggered,
+ * so every wakeup must consume all the requests that are already buffered, and EPOLLOUT
+ * is reported only when a full send buffer has room again.
+ */
+#define CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+/**
+ * The events the listening socket, the standard input and the mailbox are watched for
+ * (level-triggered).
+ */
+#define LISTENER_EVENTS (EPOLLIN)
+
+
+/*
+ * The I/O engines a worker may run:
+ * IO_EPOLL: waits for readiness events with epoll, and reads and writes the sockets itself.
+ * IO_URING: submits the reads and writes to an io_uring, and waits for their completions
+ *           (see runUringWorker).
+ */
+enum io_engine {IO_EPOLL, IO_URING};
+
+/*
+ * What is done about a slow consumer - a client that reads its messages slower than they are
+ * sent to it, so that a frame no longer fits in its queue (see --max-queue), or its queue has
+ * not drained for longer than the slow consumer lag:
+ * SLOW_CONSUMER_PAUSE: nothing more - the clients that send it messages are paused at its high
+ *                      watermark anyway, and a frame that does not fit is not queued.
+ * With the other policies, the clients that send it messages are never paused because of it,
+ * and it pays for its slowness itself:
+ * SLOW_CONSUMER_DROP_OLDEST: the oldest frames of its queue are dropped - as many as the new
+ *                            frame needs, or all of them if it lags.
+ * SLOW_CONSUMER_SPILL: the messages to it are stored in the offline store, and replayed to it
+ *                      as it drains (like those stored while it was offline).
+ * SLOW_CONSUMER_DISCONNECT: its queue is dropped, and it is sent serverEXIT and disconnected.
+ */
+enum slow_consumer_policy {SLOW_CONSUMER_PAUSE, SLOW_CONSUMER_DROP_OLDEST, SLOW_CONSUMER_SPILL,
+                           SLOW_CONSUMER_DISCONNECT};
+
+/*
+ * The kinds of the requests a worker submits to its io_uring, and what their user data holds
+ * besides the kind:
+ * RING_ACCEPT: a multishot accept on the worker's listening socket - nothing.
+ * RING_POLL: a poll of the standard input, the mailbox or the metrics socket - the fd.
+ * RING_RECEIVE: a multishot receive from a client - its fd and connection id.
+ * RING_SEND: a 'sendmsg' to a client - the address of its SendRequest.
+ * The kind is never 0, which is the user data of a failed cancellation (RING_CANCEL_USER_DATA).
+ */
+enum ring_request_kind {RING_ACCEPT = 1, RING_POLL, RING_RECEIVE, RING_SEND};
+
+
+
+/*
+ * Description: The configuration of the server, as given by the command-line options.
+*/
+struct ServerConfig {
+	QueueLimits queueLimits;
+	RateLimits rateLimits;
+	size_t numOfWorkers;
+	bool isCorked;          // Cork the client sockets while a flush takes several writes.
+	string offlineDirectory;    // Where the messages to offline clients are kept.
+	OfflineLimits offlineLimits;
+	string groupsDirectory;     // Where the groups are kept across restarts.
+	string statsSocketPath;     // The Unix socket the metrics are served on (none if empty).
+	LogConfig logConfig;
+	io_engine ioEngine;
+	size_t listenBacklog;
+	size_t handshakeTimeoutMs;  // 0 if a new client may take forever to send its hello.
+	size_t frameBudget;         // The frames of a client handled per loop turn.
+	slow_consumer_policy slowConsumerPolicy;
+	size_t slowConsumerLagMs;   // 0 if only a full queue makes a slow consumer.
+};
+
+/*
+ * Description: A client that was accepted, and has until 'deadlineNs' to send its hello.
+*/
+struct PendingHandshake {
+	int fd;
+	uint64_t connectionId;
+	uint64_t deadlineNs;
+};
+
+/*
+ * Description: A 'sendmsg' an io_uring worker has in flight. It holds references to the frames
+ *              it sends, so they stay valid even if the connection is closed meanwhile.
+*/
+struct SendRequest {
+	int fd;
+	uint64_t connectionId;
+	size_t bytes;               // The number of bytes the send was started with.
+	struct msghdr message;
+	struct iovec iovecs[MAX_IOVECS_PER_FLUSH];
+	FrameRef frames[MAX_IOVECS_PER_FLUSH];
+};
+
+/*
+ * Description: The socket of a closed client of an io_uring worker, which is held open until
+ *              the last sends to the client complete (see flushBeforeClose) - so its
+ *              file-descriptor is not reused by a new client while they are being issued.
+*/
+struct ClosingSocket {
+	int fd;
+	size_t numOfSends;          // The sends that have not completed.
+};
+
+/*
+ * Description: A worker thread. Every worker accepts clients on its own listening socket
+ *              (all bound to the same port with SO_REUSEPORT, so the kernel spreads the
+ *              clients between them), and serves them in its own event loop. A message to a
+ *              client of another worker is handed off to that worker through its mailbox.
+*/
+struct Worker {
+	explicit Worker(int index) : index(index), listeningSocketFD(-1), isWatchingInput(false),
+	                             isInputFile(false), toExit(false) {
+	}
+
+	int index;
+	EventLoop eventLoop;
+	IoRing ring;                                // Opened by the worker, with --io=uring only.
+	Mailbox mailbox;
+	int listeningSocketFD;
+	vector<unique_ptr<Connection>> connections; // Indexed by clientFD (nullptr if unused).
+	vector<ConnectionHandle> producersToResume; // Paused clients whose targets have drained.
+	vector<int> brokenConnections;              // Clients that could not be written to.
+	vector<ConnectionHandle> connectionsToFlush; // Clients with output queued this loop turn.
+	deque<PendingHandshake> pendingHandshakes;  // By deadline (the clients may have registered).
+	deque<ConnectionHandle> scheduledClients;   // Clients with input to handle, round-robin.
+	shared_ptr<const Roster> whoRoster;         // The roster whoTextReply was encoded from.
+	FrameRef whoTextReply;                      // The reply to a plain text "who".
+	vector<unique_ptr<SendRequest>> idleSendRequests; // Reused by the sends to come.
+	unordered_map<uint64_t, ClosingSocket> closingSockets; // By connection id.
+	WorkerMetrics metrics;
+	bool isWatchingInput;                       // True while the standard input is read.
+	bool isInputFile;                           // True if it is read a line per loop turn.
+	bool toExit;
+	thread workerThread;
+};
+
+
+// global Variables:
+static ClientRegistry registry;
+static vector<unique_ptr<Worker>> workers;
+static ServerConfig serverConfig;
+static OfflineStore offlineStore;
+static GroupStore groupStore(registry);
+static atomic<uint64_t> nextConnectionId(1);
+static uint64_t serverStartNs;
+static MetricCounts lastReportCounts;       // The counts the last STATS report was made of.
+static int statsSocketFD = -1;
+static atomic<bool> hasWorkerFailed(false);
+
+
+
+/*
+ * Description: Returns the connection of the given client socket, or nullptr if it is not
+ *              connected to the given worker.
+*/
+Connection* connectionOf(Worker& worker, int clientSocketFD) {
+	if (clientSocketFD < 0 || (size_t) clientSocketFD >= worker.connections.size()) {
+		return nullptr;
+	}
+	return worker.connections[clientSocketFD].get();
+}
+
+
+/*
+ * Description: Returns the connection the given handle refers to, if it is still connected
+ *              to the given worker, or nullptr otherwise.
+*/
+Connection* findConnection(Worker& worker, const ConnectionHandle& handle) {
+	Connection* connection = connectionOf(worker, handle.fd);
+	if (connection == nullptr || connection->handle.id != handle.id) {
+		return nullptr;
+	}
+	return connection;
+}
+
+
+/*
+ * Description: Posts a message to the mailbox of the worker that owns 'target'.
+*/
+void postToWorker(mailbox_message_type type, const ConnectionHandle& target,
+                  const ConnectionHandle& producer, const FrameRef& frame,
+                  const FrameRef& delivery = nullptr) {
+	auto message = new MailboxMessage();
+	message->type = type;
+	message->target = target;
+	message->producer = producer;
+	message->frame = frame;
+	message->delivery = delivery;
+	workers[target.worker]->mailbox.post(message);
+}
+
+
+/*
+ * Description: Resumes reading from a producer that was paused because of a backed up
+ *              connection - directly if it belongs to this worker, or through the mailbox
+ *              of the worker it belongs to.
+*/
+void resumeProducer(Worker& worker, const ConnectionHandle& producer) {
+	if (producer.worker == worker.index) {
+		worker.producersToResume.push_back(producer);
+	} else {
+		postToWorker(RESUME, producer, producer, nullptr);
+	}
+}
+
+
+void replayOfflineMessages(Worker& worker, Connection& connection);
+
+
+/*
+ * Description: Confirms the delivery of the stored messages that were written to a client,
+ *              which deletes them from the offline store.
+*/
+void confirmReplays(Connection& connection) {
+	for (size_t numOfWritten = connection.outbound.takeReceipts(); numOfWritten > 0;
+	     numOfWritten--) {
+		offlineStore.confirmDelivered(connection.name, connection.replaysInFlight.front());
+		connection.replaysInFlight.pop_front();
+	}
+}
+
+
+/*
+ * Description: Settles the stored messages of a client that is closed: confirms those that
+ *              were written, and returns the rest to the offline store, to be replayed when it
+ *              reconnects.
+*/
+void settleReplays(Connection& connection) {
+	confirmReplays(connection);
+	for (uint64_t sequence : connection.replaysInFlight) {
+		offlineStore.returnMessage(connection.name, sequence);
+	}
+	connection.replaysInFlight.clear();
+}
+
+
+/*
+ * Description: Marks a client that could not be written to, to be disconnected at the end of
+ *              the loop turn.
+*/
+void markBroken(Worker& worker, Connection& connection) {
+	if (!connection.isBroken) {
+		connection.isBroken = true;
+		worker.brokenConnections.push_back(connection.handle.fd);
+	}
+}
+
+
+/*
+ * Description: Handles a client some of whose outbound queue was written. Once the queue
+ *              drains below the low watermark, the clients that were paused because of it are
+ *              resumed, and more of the messages that were stored while the client was offline
+ *              are queued.
+*/
+void handleFlushed(Worker& worker, Connection& connection) {
+	confirmReplays(connection);
+	connection.publishCongestion();
+	if (connection.isDrained() && !connection.pausedProducers.empty()) {
+		for (const ConnectionHandle &producer : connection.pausedProducers) {
+			resumeProducer(worker, producer);
+		}
+		connection.pausedProducers.clear();
+	}
+	if (connection.isDrained() && connection.hasOfflineMessages) {
+		replayOfflineMessages(worker, connection);
+	}
+}
+
+
+/*
+ * Description: Returns the user data of an io_uring request of the given kind.
+*/
+uint64_t ringUserData(ring_request_kind kind, uint64_t target) {
+	return (uint64_t) kind << RING_KIND_SHIFT | (target & RING_TARGET_MASK);
+}
+
+
+/*
+ * Description: Takes a SendRequest to reuse, or a new one if there is none.
+*/
+SendRequest* takeSendRequest(Worker& worker) {
+	if (worker.idleSendRequests.empty()) {
+		return new SendRequest();
+	}
+	SendRequest* request = worker.idleSendRequests.back().release();
+	worker.idleSendRequests.pop_back();
+	return request;
+}
+
+
+/*
+ * Description: Keeps a SendRequest whose send has completed, to be reused.
+*/
+void releaseSendRequest(Worker& worker, SendRequest* request, size_t numOfFrames) {
+	for (size_t i = 0; i < numOfFrames; i++) {
+		request->frames[i].reset();
+	}
+	worker.idleSendRequests.emplace_back(request);
+}
+
+
+/*
+ * Description: Sends the frames queued to a client of an io_uring worker, that are not being
+ *              sent yet, as a chain of linked 'sendmsg' requests: each one starts only once
+ *              the previous one has sent all of its bytes, so the frames arrive in order, and
+ *              a failure cancels the rest of the chain. A client has a single chain in flight -
+ *              the frames queued meanwhile are sent once it completes (see handleSendCompletion).
+ * sendFlags: more flags of the sends - MSG_DONTWAIT for sends that fail, rather than wait,
+ *            if the socket's buffer has no room for all of their bytes.
+*/
+void startSends(Worker& worker, Connection& connection, int sendFlags = 0) {
+	if (connection.numOfSendsInFlight > 0 || connection.isBroken) {
+		return;
+	}
+	SendRequest* chain[MAX_SENDS_PER_CHAIN];
+	size_t chainLength = 0;
+	while (chainLength < MAX_SENDS_PER_CHAIN &&
+	       connection.outbound.bytesSending() < connection.outbound.bytesQueued()) {
+		SendRequest* request = takeSendRequest(worker);
+		size_t bytesSending = connection.outbound.bytesSending();
+		size_t numOfIovecs = connection.outbound.startSend(request->iovecs, request->frames,
+		                                                   MAX_IOVECS_PER_FLUSH);
+		request->fd = connection.handle.fd;
+		request->connectionId = connection.handle.id;
+		request->bytes = connection.outbound.bytesSending() - bytesSending;
+		memset(&request->message, 0, sizeof(request->message));
+		request->message.msg_iov = request->iovecs;
+		request->message.msg_iovlen = numOfIovecs;
+		chain[chainLength++] = request;
+	}
+	for (size_t i = 0; i < chainLength; i++) {
+		bool isLinked = i + 1 < chainLength;
+		// A send returns once all of its bytes are sent. With --cork, the segments of a send
+		// that is followed by another are held until they are full.
+		int flags = MSG_WAITALL | MSG_NOSIGNAL | sendFlags |
+		            (isLinked && serverConfig.isCorked ? MSG_MORE : 0);
+		worker.ring.sendMessage(connection.handle.fd, &chain[i]->message, flags,
+		                        ringUserData(RING_SEND, (uint64_t) chain[i]), isLinked);
+	}
+	connection.numOfSendsInFlight = chainLength;
+}
+
+
+/*
+ * Description: Handles the completion of a send of an io_uring worker: drops the frames that
+ *              were sent from the client's queue, and sends the frames queued meanwhile.
+*/
+void handleSendCompletion(Worker& worker, SendRequest* request, int32_t result) {
+	size_t bytesSent = result > 0 ? (size_t) result : 0;
+	size_t numOfFrames = request->message.msg_iovlen;
+	worker.metrics.add(METRIC_BYTES_OUT, bytesSent);
+	Connection* connection = connectionOf(worker, request->fd);
+	if (connection == nullptr || connection->handle.id != request->connectionId) {
+		// The client was disconnected while the bytes were in flight.
+		worker.metrics.add(METRIC_BYTES_DISCARDED, request->bytes - bytesSent);
+		auto closingIt = worker.closingSockets.find(request->connectionId);
+		if (closingIt != worker.closingSockets.end() && --closingIt->second.numOfSends == 0) {
+			close(closingIt->second.fd);
+			worker.closingSockets.erase(closingIt);
+		}
+	} else {
+		connection->outbound.completeSend(request->bytes, bytesSent);
+		connection->numOfSendsInFlight--;
+		if (bytesSent < request->bytes) {
+			markBroken(worker, *connection);
+		} else if (connection->numOfSendsInFlight == 0) {
+			startSends(worker, *connection);
+			handleFlushed(worker, *connection);
+		}
+	}
+	releaseSendRequest(worker, request, numOfFrames);
+}
+
+
+/*
+ * Description: Writes as much of the given client's outbound queue as its socket accepts (or,
+ *              with io_uring, starts sending it - see startSends), and handles what was
+ *              written (see handleFlushed).
+*/
+void flushClient(Worker& worker, Connection& connection) {
+	if (serverConfig.ioEngine == IO_URING) {
+		startSends(worker, connection);
+		return;
+	}
+	int fd = connection.handle.fd;
+	int cork = 1;
+	// A flush that takes several 'writev' calls is corked, so it is sent as full segments.
+	bool isCorked = serverConfig.isCorked &&
+	                connection.outbound.framesQueued() > MAX_IOVECS_PER_FLUSH &&
+	                setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == 0;
+	size_t bytesQueued = connection.outbound.bytesQueued();
+	flush_status status = connection.outbound.flushTo(fd);
+	worker.metrics.add(METRIC_BYTES_OUT, bytesQueued - connection.outbound.bytesQueued());
+	if (isCorked) {
+		cork = 0;
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+	if (status == FLUSH_FAILED) {
+		markBroken(worker, connection);
+		return;
+	}
+	handleFlushed(worker, connection);
+}
+
+
+/*
+ * Description: Sends the frames queued to a client that is about to be closed - best effort:
+ *              what does not fit in its socket's buffer right now is dropped (as are the
+ *              frames of a client that io_uring is still sending to, whose sends may wait for
+ *              room forever). With io_uring, they are sent by linked 'sendmsg' requests that
+ *              fail rather than wait (see startSends), and the socket is held open until they
+ *              complete (see closeSocket).
+*/
+void flushBeforeClose(Worker& worker, Connection& connection) {
+	if (connection.numOfSendsInFlight > 0) {
+		return;
+	}
+	if (serverConfig.ioEngine == IO_URING) {
+		startSends(worker, connection, MSG_DONTWAIT);
+		connection.isSendingLast = connection.numOfSendsInFlight > 0;
+		return;
+	}
+	size_t bytesQueued = connection.outbound.bytesQueued();
+	connection.outbound.flushTo(connection.handle.fd);
+	worker.metrics.add(METRIC_BYTES_OUT, bytesQueued - connection.outbound.bytesQueued());
+}
+
+
+/*
+ * Description: Stops reading from a producer until the given connection drains.
+*/
+void pauseProducer(Worker& worker, Connection& producer, Connection& connection) {
+	if (!producer.isReadPaused) {
+		producer.isReadPaused = true;
+		worker.metrics.add(METRIC_READS_PAUSED);
+		connection.pausedProducers.push_back(producer.handle);
+	}
+}
+
+
+/*
+ * Description: Returns true iff the given connection is a slow consumer (see
+ *              slow_consumer_policy): the frame does not fit in its queue, or the queue has not
+ *              drained for longer than the slow consumer lag.
+ * isLagging: output - true iff the queue has not drained for too long.
+*/
+bool isSlowConsumer(const Connection& connection, const FrameRef& frame, bool& isLagging) {
+	isLagging = serverConfig.slowConsumerLagMs > 0 && !connection.outbound.empty() &&
+	            monotonicNs() - connection.backlogSinceNs > serverConfig.slowConsumerLagMs * 1000000;
+	return isLagging ||
+	       connection.outbound.bytesQueued() + frame->size() > serverConfig.queueLimits.capacity;
+}
+
+
+/*
+ * Description: Disconnects a slow consumer: drops what it was not sent yet, and sends it
+ *              serverEXIT instead - best effort, as in shutdownWorker (its socket's buffer is
+ *              likely full). It is closed at the end of the loop turn, and stays registered -
+ *              offline - so the messages to it are stored until it reconnects.
+*/
+void evictSlowConsumer(Worker& worker, Connection& connection) {
+	size_t bytesDropped;
+	connection.outbound.dropOldest(connection.outbound.bytesQueued(), bytesDropped);
+	worker.metrics.add(METRIC_BYTES_DISCARDED, bytesDropped);
+	worker.metrics.add(METRIC_SLOW_CONSUMERS_EVICTED);
+	// Offline right away, so the messages sent to it until it is closed are stored.
+	registry.disconnectClient(connection.clientId, connection.handle.id);
+	FrameRef notice = encodeServerExit(connection.handle.protocol);
+	if (connection.numOfSendsInFlight == 0 && connection.outbound.push(notice)) {
+		worker.metrics.add(METRIC_BYTES_QUEUED, notice->size());
+		flushBeforeClose(worker, connection);
+	}
+	markBroken(worker, connection);
+}
+
+
+/*
+ * Description: Applies the slow consumer policy to a frame for a slow consumer.
+ * delivery: the v2 frame of the message the frame delivers (nullptr if it is not a message,
+ *           or the policy is not SLOW_CONSUMER_SPILL).
+ * Returns true iff the frame was taken care of (i.e. the message was stored), and false if
+ * the frame should be queued as usual - unless the consumer was disconnected.
+*/
+bool handleSlowConsumer(Worker& worker, Connection& connection, const FrameRef& frame,
+                        const FrameRef& delivery, bool isLagging) {
+	if (serverConfig.slowConsumerPolicy == SLOW_CONSUMER_DROP_OLDEST) {
+		// A lagging consumer skips to the newest frame, and no longer lags.
+		size_t bytesToDrop = isLagging ? connection.outbound.bytesQueued() :
+		                     connection.outbound.bytesQueued() + frame->size() -
+		                     serverConfig.queueLimits.capacity;
+		size_t bytesDropped;
+		worker.metrics.add(METRIC_FRAMES_DROPPED,
+		                   connection.outbound.dropOldest(bytesToDrop, bytesDropped));
+		worker.metrics.add(METRIC_BYTES_DISCARDED, bytesDropped);
+		connection.backlogSinceNs = monotonicNs();
+	} else if (serverConfig.slowConsumerPolicy == SLOW_CONSUMER_SPILL && delivery) {
+		store_status status = offlineStore.append(connection.name, *delivery);
+		if (status != STORE_OK) {
+			worker.metrics.add(METRIC_MESSAGES_REFUSED, status == STORE_OVER_QUOTA);
+			return false;
+		}
+		worker.metrics.add(METRIC_MESSAGES_SPILLED);
+		connection.hasOfflineMessages = true;
+		return true;
+	} else if (serverConfig.slowConsumerPolicy == SLOW_CONSUMER_DISCONNECT) {
+		evictSlowConsumer(worker, connection);
+	}
+	return false;
+}
+
+
+/*
+ * Description: Queues an encoded frame to a connection of this worker. The frames queued to
+ *              a connection during a loop turn are written together at the end of the turn
+ *              (see flushPendingClients), with as few system calls as possible - unless
+ *              they already exceed the high watermark, in which case they are written now,
+ *              rather than pause the clients that send them.
+ *              A frame to a slow consumer is subject to the slow consumer policy first.
+ * delivery: the v2 frame of the message the frame delivers, to store instead if the policy
+ *           is SLOW_CONSUMER_SPILL (nullptr if it is not a message).
+ * isReplay: true iff the frame replays a stored message, whose delivery is confirmed once the
+ *           frame is written (see confirmReplays).
+ * Returns false iff the frame could not be queued (or stored).
+*/
+bool queueLocalFrame(Worker& worker, Connection& connection, const FrameRef& frame,
+                     const FrameRef& delivery, bool isReplay = false) {
+	if (serverConfig.slowConsumerPolicy != SLOW_CONSUMER_PAUSE) {
+		bool isLagging;
+		if (connection.isBroken) {
+			return false;
+		}
+		// Once a message was spilled, those that follow it are too, to keep their order.
+		if (delivery && connection.hasOfflineMessages &&
+		    serverConfig.slowConsumerPolicy == SLOW_CONSUMER_SPILL) {
+			return handleSlowConsumer(worker, connection, frame, delivery, false);
+		}
+		if (isSlowConsumer(connection, frame, isLagging)) {
+			if (handleSlowConsumer(worker, connection, frame, delivery, isLagging)) {
+				return true;
+			}
+			if (connection.isBroken) {  // i.e. it was disconnected.
+				return false;
+			}
+		}
+		if (connection.outbound.empty()) {
+			connection.backlogSinceNs = monotonicNs();
+		}
+	}
+	if (!connection.outbound.push(frame, isReplay)) {
+		return false;
+	}
+	worker.metrics.add(METRIC_BYTES_QUEUED, frame->size());
+	if (connection.isCongested()) {
+		flushClient(worker, connection);
+	} else {
+		connection.publishCongestion();
+		if (!connection.isFlushPending) {
+			connection.isFlushPending = true;
+			worker.connectionsToFlush.push_back(connection.handle);
+		}
+	}
+	return true;
+}
+
+
+/*
+ * Description: Queues the messages that were stored for a client while it was offline - as
+ *              many as fit below its high watermark. The rest are queued whenever the client
+ *              drains (see flushClient), so a long backlog is streamed rather than queued at
+ *              once. The frames are written straight from the store's mapped log, and the
+ *              messages stay stored until they are written (see settleReplays).
+*/
+void replayOfflineMessages(Worker& worker, Connection& connection) {
+	if (connection.isBroken) {
+		return;     // Its messages stay stored until it reconnects.
+	}
+	if (!connection.isDrained()) {
+		connection.hasOfflineMessages = true;
+		return;
+	}
+	vector<OfflineMessage> messages;
+	size_t budget = connection.highWatermark - connection.outbound.bytesQueued();
+	connection.hasOfflineMessages = !offlineStore.takeMessages(connection.name, budget,
+	                                                           messages);
+	for (const OfflineMessage &message : messages) {
+		FrameRef frame = transcodeDelivery(message.delivery, connection.handle.protocol);
+		if (!frame) {   // i.e. the client's protocol cannot carry the message.
+			offlineStore.confirmDelivered(connection.name, message.sequence);
+		} else if (queueLocalFrame(worker, connection, frame, nullptr, true)) {
+			connection.replaysInFlight.push_back(message.sequence);
+		} else {
+			offlineStore.returnMessage(connection.name, message.sequence);
+			connection.hasOfflineMessages = true;
+		}
+	}
+}
+
+
+/*
+ * Description: Writes the frames that were queued during the loop turn.
+*/
+void flushPendingClients(Worker& worker) {
+	vector<ConnectionHandle> pending;
+	pending.swap(worker.connectionsToFlush);
+	for (const ConnectionHandle &handle : pending) {
+		Connection* connection = findConnection(worker, handle);
+		if (connection != nullptr && connection->isFlushPending) {
+			connection->isFlushPending = false;
+			flushClient(worker, *connection);
+		}
+	}
+}
+
+
+/*
+ * Description: Queues a frame to the given client. If the client's queue is backed up,
+ *              we stop reading from the client that produced the frame until it drains -
+ *              unless a slow consumer policy deals with the client instead (a client is still
+ *              paused by its own replies, though).
+ * target: the client the frame is sent to (possibly owned by another worker).
+ * frame: the encoded frame to send - shared by all the clients it is sent to.
+ * producer: the client of this worker whose request produced the frame.
+ * delivery: the v2 frame of the message the frame delivers (see queueLocalFrame).
+ * Returns false iff the frame is missing (i.e. the target's protocol cannot carry the message).
+ * Otherwise the frame is accepted for delivery: whether the target can still take it (it may be
+ * gone, or be a slow consumer) is up to the target's worker, so the producer is told the same
+ * whichever worker its target is on.
+*/
+bool queueMessage(Worker& worker, const ConnectionHandle& target, const FrameRef& frame,
+                  Connection& producer, const FrameRef& delivery) {
+	bool isPausing = serverConfig.slowConsumerPolicy == SLOW_CONSUMER_PAUSE;
+	if (!frame) {
+		return false;
+	}
+	if (target.worker != worker.index) {
+		postToWorker(DELIVER, target, producer.handle, frame, delivery);
+		if (isPausing && target.isCongested->load(std::memory_order_relaxed) &&
+		    !producer.isReadPaused) {
+			// The target's worker resumes the producer once the target drains.
+			producer.isReadPaused = true;
+			worker.metrics.add(METRIC_READS_PAUSED);
+			postToWorker(WATCH, target, producer.handle, nullptr);
+		}
+		return true;
+	}
+
+	Connection* connection = findConnection(worker, target);
+	if (connection != nullptr && queueLocalFrame(worker, *connection, frame, delivery) &&
+	    (isPausing || connection == &producer) && connection->isCongested()) {
+		pauseProducer(worker, producer, *connection);
+	}
+	return true;
+}
+
+
+/*
+ * Description: Queues a reply to the client whose request is being handled.
+*/
+void replyToClient(Worker& worker, Connection& connection, const FrameRef& frame) {
+	queueMessage(worker, connection.handle, frame, connection, nullptr);
+}
+
+
+/*
+ * Description: Acknowledges the request of a client with the given status.
+*/
+void replyToClient(Worker& worker, Connection& connection, const Request& request,
+                   reply_status status) {
+	replyToClient(worker, connection,
+	              encodeReply(connection.handle.protocol, request.requestId, status));
+}
+
+
+void scheduleClient(Worker& worker, Connection& connection);
+void closeClient(Worker& worker, int clientSocketFD, bool hasExited);
+
+
+/*
+ * Description: Returns the user data of the io_uring receive from the given client.
+*/
+uint64_t receiveUserData(const Connection& connection) {
+	return ringUserData(RING_RECEIVE, (uint64_t) connection.handle.fd << RECEIVE_FD_SHIFT |
+	                                  (connection.handle.id & RECEIVE_ID_MASK));
+}
+
+
+/*
+ * Description: Starts receiving from a client of an io_uring worker: a multishot receive
+ *              completes whenever data arrives, until it is cancelled (see stopReceiving) or
+ *              the kernel ends it.
+*/
+void startReceiving(Worker& worker, Connection& connection) {
+	if (!connection.isReceiveArmed && !connection.isReadPaused && !connection.isPeerClosed) {
+		worker.ring.receiveMultishot(connection.handle.fd, receiveUserData(connection));
+		connection.isReceiveArmed = true;
+		connection.isReceiveCancelling = false;
+	}
+}
+
+
+/*
+ * Description: Cancels the receive from a client of an io_uring worker. Data that has already
+ *              been received is still completed (and kept by the client's FrameReader).
+*/
+void stopReceiving(Worker& worker, Connection& connection) {
+	if (connection.isReceiveArmed && !connection.isReceiveCancelling) {
+		worker.ring.cancel(receiveUserData(connection));
+		connection.isReceiveCancelling = true;
+	}
+}
+
+
+/*
+ * Description: Closes the socket of a client that was removed from its worker. With io_uring,
+ *              the requests in flight hold the socket open: the receive is cancelled, the last
+ *              sends (see flushBeforeClose) complete by themselves - the socket is closed once
+ *              they do - and other sends (which may wait for room in the socket's buffer
+ *              forever) fail once it is shut down.
+*/
+void closeSocket(Worker& worker, Connection& connection) {
+	int fd = connection.handle.fd;
+	if (serverConfig.ioEngine != IO_URING) {
+		worker.eventLoop.remove(fd);
+	} else {
+		stopReceiving(worker, connection);
+		if (connection.isSendingLast && connection.numOfSendsInFlight > 0) {
+			worker.closingSockets[connection.handle.id] = {fd, connection.numOfSendsInFlight};
+			return;
+		}
+		if (connection.numOfSendsInFlight > 0) {
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+	close(fd);
+}
+
+
+/*
+ * Description: Handles the completion of a receive of an io_uring worker: the data, in a
+ *              provided buffer, is appended to the client's FrameReader (the buffer is given
+ *              back right away), and the client is scheduled to handle the requests it
+ *              completes (see readClient).
+*/
+void handleReceiveCompletion(Worker& worker, const RingCompletion& completion) {
+	auto fd = (int) ((completion.userData & RING_TARGET_MASK) >> RECEIVE_FD_SHIFT);
+	Connection* connection = connectionOf(worker, fd);
+	if (connection != nullptr &&
+	    (connection->handle.id & RECEIVE_ID_MASK) != (completion.userData & RECEIVE_ID_MASK)) {
+		connection = nullptr;   // i.e. the receive of a closed connection, whose fd was reused.
+	}
+	if (completion.flags & IORING_CQE_F_BUFFER) {
+		if (connection != nullptr && completion.result > 0) {
+			connection->reader.append(worker.ring.bufferOf(completion), (size_t) completion.result);
+			connection->receivedNs = monotonicNs();
+			worker.metrics.add(METRIC_BYTES_IN, (uint64_t) completion.result);
+		}
+		worker.ring.returnBuffer(completion);
+	}
+	if (connection == nullptr) {
+		return;
+	}
+	if (!(completion.flags & IORING_CQE_F_MORE)) {
+		connection->isReceiveArmed = false;
+	}
+	// The receive also ends when it runs out of buffers, or is cancelled - it is started again.
+	if (completion.result == 0 ||
+	    (completion.result < 0 && completion.result != -ENOBUFS &&
+	     completion.result != -ECANCELED)) {
+		connection->isPeerClosed = true;
+	}
+	scheduleClient(worker, *connection);
+}
+
+
+/*
+ * Description: Starts serving a client that has just connected. Until its hello arrives, it
+ *              is read like any other client, without blocking the worker - but it is not
+ *              registered, so no other client knows of it (see completeHandshake).
+*/
+void connectNewClient(Worker& worker, int clientSocketFD) {
+	// Its output is coalesced by the server, so the kernel should not delay it any further.
+	int noDelay = 1;
+	setsockopt(clientSocketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	if (serverConfig.ioEngine == IO_EPOLL && worker.eventLoop.add(clientSocketFD, CLIENT_EVENTS) < 0) {
+		print_error("epoll_ctl", errno);
+		close(clientSocketFD);
+		return;
+	}
+	ConnectionHandle handle;
+	handle.worker = worker.index;
+	handle.fd = clientSocketFD;
+	handle.id = nextConnectionId++;
+	handle.protocol = PROTOCOL_UNKNOWN;
+	handle.isCongested = make_shared<atomic<bool>>(false);
+	if ((size_t) clientSocketFD >= worker.connections.size()) {
+		worker.connections.resize(clientSocketFD + 1);
+	}
+	worker.connections[clientSocketFD].reset(new Connection(handle, "", 0, serverConfig.queueLimits,
+	                                                        serverConfig.rateLimits));
+	if (serverConfig.handshakeTimeoutMs > 0) {
+		worker.pendingHandshakes.push_back(
+				{clientSocketFD, handle.id, monotonicNs() + serverConfig.handshakeTimeoutMs * 1000000});
+	}
+	if (serverConfig.ioEngine == IO_URING) {
+		startReceiving(worker, *worker.connections[clientSocketFD]);
+	}
+}
+
+
+/*
+ * Description: Registers a new client once its hello has arrived: replies to it, and replays
+ *              the messages that were stored while it was offline.
+ * Returns false iff the client was disconnected (its hello is invalid or its name is in use).
+*/
+bool completeHandshake(Worker& worker, Connection& connection) {
+	string_view helloFrame;
+	Request hello;
+	if (!connection.reader.nextFrame(helloFrame)) {
+		return true;
+	}
+	int clientSocketFD = connection.handle.fd;
+	connection.handle.protocol = connection.reader.protocol();
+	if (!decodeHello(connection.handle.protocol, helloFrame, hello)) {
+		closeClient(worker, clientSocketFD, false);
+		return false;
+	}
+	// The names of v2 clients follow the rules of the text protocol, so that every client can
+	// name every other one in its commands.
+	bool isNameValid = is_valid_name(hello.name);
+	if (!isNameValid ||
+	    !registry.registerClient(hello.name, connection.handle, connection.clientId)) {
+		FrameRef response = encodeReply(connection.handle.protocol, hello.requestId,
+		                                isNameValid ? STATUS_NAME_IN_USE : STATUS_FAILURE);
+		if (write(clientSocketFD, response->data(), response->size()) < 0) {
+			print_error("write", errno);
+		}
+		closeClient(worker, clientSocketFD, false);
+		return false;
+	}
+	connection.name = string(hello.name);
+	connection.isRegistered = true;
+	worker.metrics.add(METRIC_CLIENTS_CONNECTED);
+	replyToClient(worker, connection, hello, STATUS_SUCCESS);
+	print_connection_server(connection.name);
+	replayOfflineMessages(worker, connection);
+	return true;
+}
+
+
+/*
+ * Description: Disconnects the new clients whose hello has not arrived in time.
+*/
+void expireHandshakes(Worker& worker) {
+	uint64_t now = monotonicNs();
+	while (!worker.pendingHandshakes.empty() && worker.pendingHandshakes.front().deadlineNs <= now) {
+		const PendingHandshake& pending = worker.pendingHandshakes.front();
+		Connection* connection = connectionOf(worker, pending.fd);
+		if (connection != nullptr && connection->handle.id == pending.connectionId &&
+		    !connection->isRegistered) {
+			worker.metrics.add(METRIC_HANDSHAKES_TIMED_OUT);
+			closeClient(worker, pending.fd, false);
+		}
+		worker.pendingHandshakes.pop_front();
+	}
+}
+
+
+/*
+ * Description: Returns how long the worker may wait for events before the next handshake
+ *              expires, in milliseconds (-1 if there is no handshake to expire).
+*/
+int nextHandshakeTimeoutMs(Worker& worker) {
+	// The clients that have registered (or left) meanwhile are no longer waited for.
+	while (!worker.pendingHandshakes.empty()) {
+		const PendingHandshake& pending = worker.pendingHandshakes.front();
+		Connection* connection = connectionOf(worker, pending.fd);
+		if (connection != nullptr && connection->handle.id == pending.connectionId &&
+		    !connection->isRegistered) {
+			uint64_t now = monotonicNs();
+			if (pending.deadlineNs <= now) {
+				return 0;
+			}
+			// Rounded up, so the wait does not end just before the deadline.
+			return (int) min((pending.deadlineNs - now + 999999) / 1000000, (uint64_t) INT_MAX);
+		}
+		worker.pendingHandshakes.pop_front();
+	}
+	return -1;
+}
+
+
+/*
+ * Description: Waits for the last sends to the clients of an io_uring worker that is shutting
+ *              down (see flushBeforeClose), ignoring the other completions, and closes the
+ *              sockets of the clients whose sends did not complete in time.
+*/
+void drainLastSends(Worker& worker) {
+	RingCompletion completion;
+	bool hasCompleted = true;
+	while (!worker.closingSockets.empty() && hasCompleted &&
+	       worker.ring.submitAndWait(1, LAST_SENDS_TIMEOUT_MS)) {
+		hasCompleted = false;
+		while (worker.ring.nextCompletion(completion)) {
+			if ((ring_request_kind) (completion.userData >> RING_KIND_SHIFT) == RING_SEND) {
+				handleSendCompletion(worker, (SendRequest*) (completion.userData & RING_TARGET_MASK),
+				                     completion.result);
+				hasCompleted = true;
+			}
+		}
+	}
+	for (const auto &closing : worker.closingSockets) {
+		close(closing.second.fd);
+	}
+	worker.closingSockets.clear();
+}
+
+
+/*
+ * Description: Tells every client of the worker that the server is shutting down,
+ *              disconnects them, and stops the worker.
+*/
+void shutdownWorker(Worker& worker) {
+	if (worker.toExit) {
+		return;
+	}
+	worker.toExit = true;
+	close(worker.listeningSocketFD);
+	for (unique_ptr<Connection> &connection : worker.connections) {
+		if (!connection) {
+			continue;
+		}
+		if (connection->isRegistered && connection->numOfSendsInFlight == 0) {
+			connection->outbound.push(encodeServerExit(connection->handle.protocol));
+			flushBeforeClose(worker, *connection);
+		}
+		settleReplays(*connection);
+		closeSocket(worker, *connection);
+	}
+	worker.connections.clear();
+	if (serverConfig.ioEngine == IO_URING) {
+		drainLastSends(worker);
+	}
+}
+
+
+/*
+ * Description: Shuts down all the workers but the given one.
+*/
+void shutdownOtherWorkers(Worker& worker) {
+	for (unique_ptr<Worker> &otherWorker : workers) {
+		if (otherWorker->index != worker.index) {
+			ConnectionHandle workerHandle = {otherWorker->index, -1, 0, PROTOCOL_UNKNOWN, nullptr};
+			postToWorker(SHUTDOWN, workerHandle, workerHandle, nullptr);
+		}
+	}
+}
+
+
+/*
+ * Description: Adds up the metrics of all the workers into the given snapshot.
+*/
+void collectMetrics(MetricsSnapshot& snapshot) {
+	for (unique_ptr<Worker> &worker : workers) {
+		snapshot.add(worker->metrics);
+	}
+}
+
+
+/*
+ * Description: Serves a client of the metrics socket: writes it a snapshot of the metrics in
+ *              a machine-readable format, and closes the connection. The snapshot is small
+ *              enough to fit in the socket's buffer, so this does not block.
+*/
+void serveStatsClient() {
+	int statsClientFD = accept(statsSocketFD, nullptr, nullptr);
+	if (statsClientFD < 0) {
+		print_error("accept", errno);
+		return;
+	}
+	MetricsSnapshot snapshot(serverStartNs, registry.numOfGroups());
+	collectMetrics(snapshot);
+	string exposition = formatMetricsExposition(snapshot);
+	if (writeBytes(statsClientFD, exposition.data(), exposition.size()) == WRITE_FAILURE) {
+		print_error("write", errno);
+	}
+	close(statsClientFD);
+}
+
+
+void serverStdInput(Worker& worker) {
+	string userInput;
+	getline(cin, userInput);
+	if (cin.eof()) {
+		// Nothing more will ever be typed - stop watching the (always readable) input.
+		worker.isWatchingInput = false;
+		if (serverConfig.ioEngine == IO_EPOLL && !worker.isInputFile) {
+			worker.eventLoop.remove(STDIN_FILENO);
+		}
+	}
+	if (userInput == EXIT_COMMAND) {
+		print_exit();
+		shutdownOtherWorkers(worker);
+		shutdownWorker(worker);
+	} else if (userInput == STATS_COMMAND) {
+		MetricsSnapshot snapshot(serverStartNs, registry.numOfGroups());
+		collectMetrics(snapshot);
+		print_stats(formatMetricsReport(snapshot, lastReportCounts));
+		lastReportCounts = snapshot.counts;
+	}
+}
+
+
+void handleCreateGroupRequest(Worker& worker, Connection& connection, const Request& request) {
+    const string& clientName = connection.name;
+    if (!groupStore.createGroup(request.name, connection.clientId, clientName, request.clients,
+                                request.numOfClients)) {
+        print_create_group(true, false, clientName, request.name);
+        replyToClient(worker, connection, request, STATUS_FAILURE);
+    } else {
+        print_create_group(true, true, clientName, request.name);
+        replyToClient(worker, connection, request, STATUS_SUCCESS);
+    }
+}
+
+
+/*
+ * Description: Stores a message to a client that is offline, to be delivered once it
+ *              reconnects.
+ * delivery: the v2 frame that delivers the message.
+ * Returns false iff the message could not be stored.
+*/
+bool storeOfflineMessage(Worker& worker, string_view name, const FrameRef& delivery) {
+	if (!delivery) {
+		return false;
+	}
+	store_status status = offlineStore.append(name, *delivery);
+	if (status != STORE_OK) {
+		worker.metrics.add(METRIC_MESSAGES_REFUSED, status == STORE_OVER_QUOTA);
+		return false;
+	}
+	worker.metrics.add(METRIC_MESSAGES_STORED);
+	// A client that has reconnected since it was looked up may have been replayed its stored
+	// messages already - without this one.
+	ConnectionHandle receiverClient;
+	if (registry.findClient(name, receiverClient) == CLIENT_FOUND) {
+		if (receiverClient.worker != worker.index) {
+			postToWorker(REPLAY, receiverClient, receiverClient, nullptr);
+		} else if (Connection* connection = findConnection(worker, receiverClient)) {
+			replayOfflineMessages(worker, *connection);
+		}
+	}
+	return true;
+}
+
+
+/*
+ * Description: Takes the tokens of a message from the rate limits of its sender, before it is
+ *              sent to any of its recipients.
+ * numOfRecipients: the number of clients the message is sent to.
+ * Returns false (and takes nothing) iff the sender has sent faster than it may.
+*/
+bool admitMessage(Connection& connection, string_view message, size_t numOfRecipients) {
+	// The time the message was read is good enough, and costs no system call.
+	uint64_t nowNs = connection.receivedNs;
+	uint64_t fanoutBytes = (uint64_t) message.size() * numOfRecipients;
+	if (!connection.messageRate.canTake(1, nowNs) ||
+	    !connection.fanoutRate.canTake(fanoutBytes, nowNs)) {
+		return false;
+	}
+	connection.messageRate.take(1, nowNs);
+	connection.fanoutRate.take(fanoutBytes, nowNs);
+	return true;
+}
+
+
+/*
+ * Description: Sends a message of the given client to a client or a group. A message to an
+ *              offline client (or group member) is stored until it reconnects. The recipients
+ *              are looked up first, so that the sender's rate limits are checked before the
+ *              message is sent to any of them.
+ * Returns STATUS_SUCCESS iff the message was sent, STATUS_THROTTLED if the sender has sent
+ * too fast, and STATUS_FAILURE otherwise.
+*/
+reply_status sendMessage(Worker& worker, Connection& connection, string_view name,
+                         string_view message) {
+	bool isSent;
+	const string& senderClientName = connection.name;
+	ConnectionHandle receiverClient;
+	GroupRecipients receiverClients;
+	// The message is encoded at most once per protocol, and shared by the queues of all
+	// the recipients that speak it.
+	DeliveryEncoder messageToReceiverClient(senderClientName, message);
+
+	client_lookup receiverLookup = registry.findClient(name, receiverClient);
+	group_lookup groupLookup = GROUP_NOT_FOUND;
+	size_t numOfRecipients = 1;
+	if (receiverLookup == CLIENT_NOT_FOUND) {
+		groupLookup = registry.findGroupRecipients(name, connection.clientId, receiverClients);
+		// The sender is a member of the group, but is not sent the message.
+		numOfRecipients = (groupLookup == GROUP_FOUND) ?
+		                  receiverClients->connected.size() + receiverClients->offline.size() - 1 : 0;
+	}
+	if (!admitMessage(connection, message, numOfRecipients)) {
+		worker.metrics.add(METRIC_MESSAGES_THROTTLED);
+		print_send_throttled(true, senderClientName, name);
+		return STATUS_THROTTLED;
+	}
+	// What a slow consumer is sent instead, to be stored (see SLOW_CONSUMER_SPILL).
+	FrameRef spillableDelivery = (serverConfig.slowConsumerPolicy == SLOW_CONSUMER_SPILL) ?
+	                             messageToReceiverClient.frameFor(PROTOCOL_V2) : nullptr;
+
+	if (receiverLookup == CLIENT_FOUND) {
+		// The message fails only if the receiver's protocol cannot carry it: once it is accepted
+		// for delivery, what becomes of it is up to the receiver (see queueMessage).
+		isSent = queueMessage(worker, receiverClient,
+		                      messageToReceiverClient.frameFor(receiverClient.protocol),
+		                      connection, spillableDelivery);
+		worker.metrics.add(METRIC_DELIVERIES, isSent ? 1 : 0);
+	}
+	else if (receiverLookup == CLIENT_FOUND_OFFLINE) {
+		isSent = storeOfflineMessage(worker, name,
+		                             messageToReceiverClient.frameFor(PROTOCOL_V2));
+	}
+	else if (groupLookup == GROUP_FOUND) {
+		isSent = true;
+		for (const GroupRecipient &receiver : receiverClients->connected) {
+			if (receiver.client != connection.clientId &&
+			    queueMessage(worker, receiver.handle,
+			                 messageToReceiverClient.frameFor(receiver.handle.protocol),
+			                 connection, spillableDelivery)) {
+				worker.metrics.add(METRIC_DELIVERIES);
+			}
+		}
+		for (const string &offlineMember : receiverClients->offline) {
+			// The sender may have reconnected before its group has heard of it.
+			if (offlineMember != senderClientName) {
+				storeOfflineMessage(worker, offlineMember,
+				                    messageToReceiverClient.frameFor(PROTOCOL_V2));
+			}
+		}
+	}
+	else {  // i.e. : name is neither a client name nor a group the sender is a member of:
+		isSent = false;
+	}
+	worker.metrics.add(isSent ? METRIC_MESSAGES_SENT : METRIC_MESSAGES_FAILED);
+	print_send(true, true, isSent, senderClientName, name, message);
+	return isSent ? STATUS_SUCCESS : STATUS_FAILURE;
+}
+
+
+void handleSendRequest(Worker& worker, Connection& connection, const Request& request) {
+	replyToClient(worker, connection, request,
+	              sendMessage(worker, connection, request.name, request.message));
+}
+
+
+void handleSendBatchRequest(Worker& worker, Connection& connection, const Request& request) {
+	vector<reply_status> statuses;
+	string_view batch = request.message;
+	string_view name;
+	string_view message;
+	while (nextBatchedMessage(batch, name, message)) {
+		statuses.push_back(sendMessage(worker, connection, name, message));
+	}
+	replyToClient(worker, connection, encodeBatchReply(request.requestId, statuses));
+}
+
+
+void handleWhoRequest(Worker& worker, Connection& connection, const Request& request) {
+	print_who_server(connection.name);
+	shared_ptr<const Roster> roster = registry.roster();
+	protocol_version protocol = connection.handle.protocol;
+	if (protocol == PROTOCOL_TEXT) {
+		// The text protocol has no pages, and its reply carries no request id - it is encoded
+		// once per roster.
+		if (worker.whoRoster != roster) {
+			worker.whoRoster = roster;
+			worker.whoTextReply = encodeWhoReply(protocol, 0, roster->names, 0);
+		}
+		replyToClient(worker, connection, worker.whoTextReply);
+		return;
+	}
+	size_t numOfMatches;
+	string_view names = roster->select(request.name, request.offset, request.limit,
+	                                   numOfMatches);
+	replyToClient(worker, connection,
+	              encodeWhoReply(protocol, request.requestId, names, numOfMatches));
+}
+
+
+/*
+ * Description: Closes the connection of a client.
+ * hasExited: true iff the client has asked to exit, in which case it is unregistered and
+ *            leaves its groups. Otherwise the connection was lost, and the client stays a
+ *            member of its groups (offline) until it reconnects.
+ *            A client that has not registered yet is just disconnected.
+*/
+void closeClient(Worker& worker, int clientSocketFD, bool hasExited) {
+	unique_ptr<Connection> exitingConnection = std::move(worker.connections[clientSocketFD]);
+	Connection& connection = *exitingConnection;
+	string clientName = connection.name;
+
+	// Best effort: the replies that were queued during this loop turn precede the exit. The
+	// bytes io_uring is sending are counted once their sends complete.
+	if (hasExited) {
+		flushBeforeClose(worker, connection);
+	}
+	// Before the client is offline, and its messages are replayed to its next connection.
+	settleReplays(connection);
+	if (!connection.isRegistered) {
+		// Nothing was queued to it, and no other client knows of it.
+	} else if (hasExited) {
+		// Before its name is free for another client to register.
+		offlineStore.dropMessages(clientName);
+		groupStore.unregisterClient(connection.clientId, connection.handle.id, clientName);
+	} else {
+		registry.disconnectClient(connection.clientId, connection.handle.id);
+	}
+	// The clients that were paused because of this one would never be resumed otherwise.
+	for (const ConnectionHandle &producer : connection.pausedProducers) {
+		resumeProducer(worker, producer);
+	}
+	worker.metrics.add(METRIC_BYTES_DISCARDED,
+	                   connection.outbound.bytesQueued() - connection.outbound.bytesSending());
+	if (connection.isRegistered) {
+		worker.metrics.add(METRIC_CLIENTS_DISCONNECTED);
+	}
+	closeSocket(worker, connection);
+	if (connection.isRegistered) {
+		print_exit(true, clientName);
+	}
+}
+
+
+void handleExitRequest(Worker& worker, int clientSocketFD) {
+	closeClient(worker, clientSocketFD, true);
+}
+
+
+/*
+ * Description: Handles a single request of the given client.
+ * clientInput: a complete frame that was received from the client.
+ * Returns false iff the client is no longer connected after the request.
+*/
+bool handleClientRequest(Worker& worker, Connection& connection, string_view clientInput) {
+	Request request;
+	decodeRequest(connection.handle.protocol, clientInput, request);
+	// The connection of a client that exits is gone once the request is handled.
+	if (request.type == EXIT) {
+		worker.metrics.recordRequest(EXIT, monotonicNs() - connection.receivedNs);
+	}
+
+    if (request.type == CREATE_GROUP) {
+        handleCreateGroupRequest(worker, connection, request);
+    } else if (request.type == SEND) {
+		handleSendRequest(worker, connection, request);
+	} else if (request.type == SEND_BATCH) {
+		handleSendBatchRequest(worker, connection, request);
+	} else if (request.type == WHO) {
+		handleWhoRequest(worker, connection, request);
+	} else if (request.type == EXIT) {
+		handleExitRequest(worker, connection.handle.fd);
+		return false;
+	}
+	worker.metrics.recordRequest(request.type, monotonicNs() - connection.receivedNs);
+	return true;
+}
+
+
+/*
+ * Description: Handles the requests of the given client that were read but not yet handled,
+ *              until either none are left, the client has used up its budget, or the client is
+ *              paused because one of the connections it sends to is backed up. The first frame
+ *              of a new client is its hello (see completeHandshake).
+ * budget: the number of requests that may still be handled - decreased by those that were.
+ * Returns false iff the client is no longer connected.
+*/
+bool serveClient(Worker& worker, Connection& connection, size_t& budget) {
+	if (!connection.isRegistered && !completeHandshake(worker, connection)) {
+		return false;
+	}
+	string_view request;
+	while (budget > 0 && connection.isRegistered && !connection.isReadPaused &&
+	       connection.reader.nextFrame(request)) {
+		budget--;
+		if (!handleClientRequest(worker, connection, request)) {
+			return false;
+		}
+	}
+	// A client that has closed its side is disconnected once its last request was handled.
+	if (connection.reader.isCorrupted() ||
+	    (!connection.isReadPaused && connection.isPeerClosed && budget > 0)) {
+		closeClient(worker, connection.handle.fd, false);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Schedules a client whose input is to be handled: it is served in the worker's
+ *              next pass over its scheduled clients (see runScheduledClients), after the
+ *              clients that were scheduled before it.
+*/
+void scheduleClient(Worker& worker, Connection& connection) {
+	if (!connection.isScheduled) {
+		connection.isScheduled = true;
+		worker.scheduledClients.push_back(connection.handle);
+	}
+}
+
+
+/*
+ * Description: Reads the requests that have arrived on the given client socket and handles
+ *              them, up to the frame budget of a loop turn. A request that has arrived only
+ *              partially is kept by the client's FrameReader until the rest of it arrives, so
+ *              a slow client never blocks the server. Since client sockets are edge-triggered,
+ *              a client whose budget runs out before all its input is read and handled is
+ *              scheduled again, for the next turn - so a busy client never holds up the others.
+ *              A paused client is not read from until it is resumed.
+ *              An io_uring worker does not read - its receives append to the FrameReader (see
+ *              handleReceiveCompletion). It stops receiving from a client that is paused or
+ *              out of budget, and starts again once the client's requests are handled.
+*/
+void readClient(Worker& worker, Connection& connection) {
+	size_t budget = serverConfig.frameBudget;
+	while (true) {
+		if (!serveClient(worker, connection, budget) || connection.isReadPaused) {
+			if (connection.isReadPaused && serverConfig.ioEngine == IO_URING) {
+				stopReceiving(worker, connection);
+			}
+			return;
+		}
+		if (budget == 0) {
+			worker.metrics.add(METRIC_BUDGETS_EXHAUSTED);
+			scheduleClient(worker, connection);
+			if (serverConfig.ioEngine == IO_URING) {
+				stopReceiving(worker, connection);
+			}
+			return;
+		}
+		if (serverConfig.ioEngine == IO_URING) {
+			startReceiving(worker, connection);
+			return;
+		}
+		if (!connection.hasUnreadInput) {
+			return;
+		}
+		uint64_t bytesRead = connection.reader.bytesRead();
+		receive_status status = connection.reader.readFrom(connection.handle.fd);
+		connection.receivedNs = monotonicNs();
+		worker.metrics.add(METRIC_BYTES_IN, connection.reader.bytesRead() - bytesRead);
+		if (status == RECEIVE_CLOSED) {
+			connection.isPeerClosed = true;
+		}
+		if (status != RECEIVE_BUFFER_FULL) {
+			connection.hasUnreadInput = false;
+		}
+	}
+}
+
+
+/*
+ * Description: Serves the clients that were scheduled by the time the pass starts, in the
+ *              order they were scheduled, each up to its frame budget. The clients that are
+ *              scheduled during the pass (again) are served in the next one.
+*/
+void runScheduledClients(Worker& worker) {
+	size_t numOfScheduled = worker.scheduledClients.size();
+	for (size_t i = 0; i < numOfScheduled && !worker.toExit; i++) {
+		ConnectionHandle handle = std::move(worker.scheduledClients.front());
+		worker.scheduledClients.pop_front();
+		Connection* connection = findConnection(worker, handle);
+		if (connection != nullptr) {
+			connection->isScheduled = false;
+			readClient(worker, *connection);
+		}
+	}
+}
+
+
+/*
+ * Description: Handles the readiness events of a client socket: its input is read and
+ *              handled once the client's turn comes (see runScheduledClients).
+*/
+void handleClientEvent(Worker& worker, int clientSocketFD, uint32_t events) {
+	Connection* connection = connectionOf(worker, clientSocketFD);
+	if (connection == nullptr) {
+		return;
+	}
+	if (events & EPOLLOUT) {
+		flushClient(worker, *connection);
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		connection->hasUnreadInput = true;
+		scheduleClient(worker, *connection);
+	}
+}
+
+
+/*
+ * Description: Handles the messages other workers have posted to this worker's mailbox.
+*/
+void handleMailbox(Worker& worker) {
+	MailboxMessage* message = worker.mailbox.collect();
+	while (message != nullptr) {
+		Connection* connection = findConnection(worker, message->target);
+		if (message->type == SHUTDOWN) {
+			shutdownWorker(worker);
+		} else if (connection == nullptr) {
+			// The connection is already gone - a paused producer must not wait for it forever.
+			if (message->type == WATCH) {
+				resumeProducer(worker, message->producer);
+			}
+		} else if (message->type == DELIVER) {
+			queueLocalFrame(worker, *connection, message->frame, message->delivery);
+		} else if (message->type == WATCH) {
+			if (connection->isDrained()) {
+				resumeProducer(worker, message->producer);
+			} else {
+				connection->pausedProducers.push_back(message->producer);
+			}
+		} else if (message->type == REPLAY) {
+			replayOfflineMessages(worker, *connection);
+		} else if (message->type == RESUME && connection->isReadPaused) {
+			worker.producersToResume.push_back(message->target);
+		}
+		MailboxMessage* next = message->next;
+		delete message;
+		message = next;
+	}
+}
+
+
+/*
+ * Description: Handles what the handling of the last events has left behind: writes the
+ *              frames that were queued, resumes the clients whose targets have drained, and
+ *              disconnects the clients that could not be written to.
+*/
+void handleDeferredWork(Worker& worker) {
+	while (!worker.connectionsToFlush.empty() || !worker.producersToResume.empty() ||
+	       !worker.brokenConnections.empty()) {
+		flushPendingClients(worker);
+		vector<ConnectionHandle> resumed;
+		resumed.swap(worker.producersToResume);
+		for (const ConnectionHandle &producerHandle : resumed) {
+			Connection* producer = findConnection(worker, producerHandle);
+			if (producer != nullptr && producer->isReadPaused) {
+				producer->isReadPaused = false;
+				// Input that arrived while paused has not been reported again (edge-triggered).
+				scheduleClient(worker, *producer);
+			}
+		}
+		vector<int> broken;
+		broken.swap(worker.brokenConnections);
+		for (const int &brokenFD : broken) {
+			if (connectionOf(worker, brokenFD) != nullptr) {
+				closeClient(worker, brokenFD, false);
+			}
+		}
+	}
+}
+
+
+/*
+ * Description: Returns how long the worker may wait for events, in milliseconds (-1 to wait
+ *              forever): not at all while clients are scheduled to be served, or while an
+ *              input file has lines left.
+*/
+int nextWaitTimeoutMs(Worker& worker) {
+	bool isInputReady = worker.isInputFile && worker.isWatchingInput;
+	return worker.scheduledClients.empty() && !isInputReady ? nextHandshakeTimeoutMs(worker) : 0;
+}
+
+
+/*
+ * Description: Reads the next line of the standard input, if it is a file. A file is always
+ *              readable, but cannot be watched (epoll refuses it with EPERM), so it is read a
+ *              line per loop turn - as epoll would report an always readable input.
+*/
+void readInputFile(Worker& worker) {
+	if (worker.isInputFile && worker.isWatchingInput && !worker.toExit) {
+		serverStdInput(worker);
+	}
+}
+
+
+/*
+ * Description: Accepts all the clients that are waiting in the (non-blocking) listening
+ *              socket's queue, rather than one per loop turn, so a storm of connections is
+ *              drained as fast as it arrives.
+*/
+void acceptClients(Worker& worker) {
+	while (true) {
+		int clientSocketFD = accept4(worker.listeningSocketFD, nullptr, nullptr, ACCEPT_FLAGS);
+		if (clientSocketFD >= 0) {
+			connectNewClient(worker, clientSocketFD);
+		} else if (errno != EINTR && errno != ECONNABORTED) {
+			// Out of file-descriptors or memory, the rest are accepted on the next loop turn.
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				print_error("accept", errno);
+			}
+			return;
+		}
+	}
+}
+
+
+/*
+ * Description: The event loop of a worker thread.
+ * Returns SUCCESS when the server is shut down, FAILURE on an unrecoverable error.
+*/
+int runWorker(Worker& worker) {
+	while (!worker.toExit) {
+		int numOfReadyEvents = worker.eventLoop.wait(nextWaitTimeoutMs(worker));
+		if (numOfReadyEvents < 0) {
+			print_error("epoll_wait", errno);
+			return FAILURE;
+		}
+		worker.metrics.add(METRIC_LOOP_TURNS);
+		for (int i = 0; i < numOfReadyEvents && !worker.toExit; i++) {
+			int readyFD = worker.eventLoop.event(i).data.fd;
+			if (readyFD == worker.listeningSocketFD) {
+				acceptClients(worker);
+			} else if (readyFD == STDIN_FILENO && worker.index == MAIN_WORKER) {
+				serverStdInput(worker);
+			} else if (readyFD == statsSocketFD && worker.index == MAIN_WORKER) {
+				serveStatsClient();
+			} else if (readyFD == worker.mailbox.wakeupFD()) {
+				handleMailbox(worker);
+			} else {
+				handleClientEvent(worker, readyFD, worker.eventLoop.event(i).events);
+			}
+		}
+		readInputFile(worker);
+		if (!worker.toExit) {
+			runScheduledClients(worker);
+			expireHandshakes(worker);
+			handleDeferredWork(worker);
+		}
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Description: Handles the completion of a poll of an io_uring worker, and polls again.
+*/
+void handlePollCompletion(Worker& worker, const RingCompletion& completion) {
+	auto fd = (int) (completion.userData & RING_TARGET_MASK);
+	if (fd == worker.mailbox.wakeupFD()) {
+		handleMailbox(worker);
+		if (!(completion.flags & IORING_CQE_F_MORE)) {
+			worker.ring.pollReadable(fd, completion.userData, true);
+		}
+	} else if (fd == STDIN_FILENO && worker.isWatchingInput) {
+		// A single-shot poll, polled again after every line, as epoll reports the input.
+		serverStdInput(worker);
+		if (worker.isWatchingInput && !worker.toExit) {
+			worker.ring.pollReadable(fd, completion.userData, false);
+		}
+	} else if (fd == statsSocketFD) {
+		serveStatsClient();
+		worker.ring.pollReadable(fd, completion.userData, false);
+	}
+}
+
+
+/*
+ * Description: Handles a completion of an io_uring worker.
+*/
+void handleRingCompletion(Worker& worker, const RingCompletion& completion) {
+	auto kind = (ring_request_kind) (completion.userData >> RING_KIND_SHIFT);
+	if (kind == RING_ACCEPT) {
+		if (completion.result >= 0) {
+			connectNewClient(worker, completion.result);
+		} else {
+			print_error("accept", -completion.result);
+		}
+		if (!(completion.flags & IORING_CQE_F_MORE) && !worker.toExit) {
+			worker.ring.acceptMultishot(worker.listeningSocketFD, ACCEPT_FLAGS, completion.userData);
+		}
+	} else if (kind == RING_POLL) {
+		handlePollCompletion(worker, completion);
+	} else if (kind == RING_RECEIVE) {
+		handleReceiveCompletion(worker, completion);
+	} else if (kind == RING_SEND) {
+		handleSendCompletion(worker, (SendRequest*) (completion.userData & RING_TARGET_MASK),
+		                     completion.result);
+	}
+	// Otherwise a cancellation has failed, since its request had already completed.
+}
+
+
+/*
+ * Description: The event loop of a worker thread that runs on io_uring. Rather than wait for
+ *              the sockets to be ready and then read and write them, the worker submits the
+ *              reads and writes themselves, and waits for them to complete: the listening
+ *              socket is accepted from and every client is received from by a single multishot
+ *              request each, into buffers the kernel picks from the ring's buffer group, and
+ *              the frames queued to a client are sent by linked 'sendmsg' requests. All the
+ *              requests of a loop turn are submitted, and its completions waited for, by a
+ *              single system call.
+ * Returns SUCCESS when the server is shut down, FAILURE on an unrecoverable error.
+*/
+int runUringWorker(Worker& worker) {
+	// The ring is used only by the thread that created it.
+	if (!worker.ring.open(RING_NUM_OF_ENTRIES, RING_NUM_OF_BUFFERS, RING_BUFFER_SIZE)) {
+		print_error("io_uring_setup", errno);
+		return FAILURE;
+	}
+	worker.ring.acceptMultishot(worker.listeningSocketFD, ACCEPT_FLAGS, ringUserData(RING_ACCEPT, 0));
+	worker.ring.pollReadable(worker.mailbox.wakeupFD(),
+	                         ringUserData(RING_POLL, worker.mailbox.wakeupFD()), true);
+	if (worker.isWatchingInput && !worker.isInputFile) {
+		worker.ring.pollReadable(STDIN_FILENO, ringUserData(RING_POLL, STDIN_FILENO), false);
+	}
+	if (statsSocketFD >= 0 && worker.index == MAIN_WORKER) {
+		worker.ring.pollReadable(statsSocketFD, ringUserData(RING_POLL, statsSocketFD), false);
+	}
+
+	RingCompletion completion;
+	while (!worker.toExit) {
+		if (!worker.ring.submitAndWait(1, nextWaitTimeoutMs(worker))) {
+			print_error("io_uring_enter", errno);
+			return FAILURE;
+		}
+		worker.metrics.add(METRIC_LOOP_TURNS);
+		while (!worker.toExit && worker.ring.nextCompletion(completion)) {
+			handleRingCompletion(worker, completion);
+		}
+		readInputFile(worker);
+		if (!worker.toExit) {
+			runScheduledClients(worker);
+			expireHandshakes(worker);
+			handleDeferredWork(worker);
+		}
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Description: Runs the event loop of the I/O engine the server was configured with. If it
+ *              fails, the whole server is shut down: the worker's listening socket must not
+ *              stay open, or the clients the kernel hands it would never be accepted.
+ * Returns SUCCESS when the server is shut down, FAILURE if the worker has failed.
+*/
+int runWorkerLoop(Worker& worker) {
+	int exitCode = serverConfig.ioEngine == IO_URING ? runUringWorker(worker) : runWorker(worker);
+	if (exitCode == FAILURE) {
+		hasWorkerFailed = true;
+		shutdownWorker(worker);
+		if (worker.index != MAIN_WORKER) {
+			// The main worker shuts down the others once it stops (see main).
+			ConnectionHandle mainHandle = {MAIN_WORKER, -1, 0, PROTOCOL_UNKNOWN, nullptr};
+			postToWorker(SHUTDOWN, mainHandle, mainHandle, nullptr);
+		}
+	}
+	return exitCode;
+}
+
+
+/*
+ * Description: Creates the listening socket of a worker. All the workers bind the same port
+ *              with SO_REUSEPORT, and the kernel balances incoming clients between them.
+ * Returns false on failure.
+*/
+bool openListeningSocket(Worker& worker, const struct sockaddr_in& serverSocketAddress) {
+	int reuse = 1;
+	// We use TCP, and therefore we use SOCK_STREAM. It is non-blocking, so that its whole queue
+	// can be accepted at once (see acceptClients).
+	worker.listeningSocketFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, DEFAULT_PROTOCOL);
+	if (worker.listeningSocketFD < 0) {
+		print_error("socket", errno);
+		return false;
+	}
+
+	if (setsockopt(worker.listeningSocketFD, SOL_SOCKET, SO_REUSEPORT,
+	               &reuse, sizeof(reuse)) < 0) {
+		print_error("setsockopt", errno);
+		return false;
+	}
+
+	if ( bind( worker.listeningSocketFD, (struct sockaddr*) &serverSocketAddress,
+	           sizeof(struct sockaddr_in)) < 0) {
+		print_error("bind", errno);
+		return false;
+	}
+
+	if ( listen( worker.listeningSocketFD,
+	             (int) min(serverConfig.listenBacklog, (size_t) INT_MAX)) < 0) {
+		print_error("listen", errno);
+		return false;
+	}
+
+	if (!worker.eventLoop.isValid() || !worker.mailbox.isValid()) {
+		print_error("epoll_create1/eventfd", errno);
+		return false;
+	}
+	// An io_uring worker polls them through its ring instead (see runUringWorker).
+	if (serverConfig.ioEngine == IO_EPOLL &&
+	    (worker.eventLoop.add(worker.listeningSocketFD, LISTENER_EVENTS) < 0 ||
+	     worker.eventLoop.add(worker.mailbox.wakeupFD(), LISTENER_EVENTS) < 0)) {
+		print_error("epoll_ctl", errno);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Creates the Unix socket the metrics are served on, and watches it in the event
+ *              loop of the given worker. A file left at the path by a previous run is replaced.
+ * Returns false on failure.
+*/
+bool openStatsSocket(Worker& worker, const string& path) {
+	struct sockaddr_un statsSocketAddress = {0};
+	if (path.size() >= sizeof(statsSocketAddress.sun_path)) {
+		print_error("bind", ENAMETOOLONG);
+		return false;
+	}
+	statsSocketAddress.sun_family = AF_UNIX;
+	memcpy(statsSocketAddress.sun_path, path.c_str(), path.size() + 1);
+
+	statsSocketFD = socket(AF_UNIX, SOCK_STREAM, DEFAULT_PROTOCOL);
+	if (statsSocketFD < 0) {
+		print_error("socket", errno);
+		return false;
+	}
+	unlink(path.c_str());
+	if (bind(statsSocketFD, (struct sockaddr*) &statsSocketAddress,
+	         sizeof(statsSocketAddress)) < 0) {
+		print_error("bind", errno);
+		return false;
+	}
+	if (listen(statsSocketFD, MAX_NUM_OF_STATS_CLIENTS) < 0) {
+		print_error("listen", errno);
+		return false;
+	}
+	if (serverConfig.ioEngine == IO_EPOLL && worker.eventLoop.add(statsSocketFD, LISTENER_EVENTS) < 0) {
+		print_error("epoll_ctl", errno);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Raises the soft limit of open file-descriptors up to the hard limit,
+ *              so the server is able to hold as many connected clients as the system allows.
+*/
+void raiseFileDescriptorsLimit() {
+	struct rlimit limit = {0};
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+
+/*
+ * Description: Parses a single "--name=value" option whose value is a non-negative number.
+ * Returns false iff the option is not the given one or its value is not a number.
+*/
+bool parseNumericOption(const string& option, const string& name, size_t& value) {
+	string prefix = "--" + name + "=";
+	if (option.compare(0, prefix.size(), prefix) != 0 || option.size() == prefix.size()) {
+		return false;
+	}
+	char* end;
+	unsigned long long number = strtoull(option.c_str() + prefix.size(), &end, DECIMAL_BASE);
+	if (*end != '\0') {
+		return false;
+	}
+	value = (size_t) number;
+	return true;
+}
+
+
+/*
+ * Description: Parses a single "--name=value" option whose value is a non-empty string.
+ * Returns false iff the option is not the given one or its value is empty.
+*/
+bool parseStringOption(const string& option, const string& name, string& value) {
+	string prefix = "--" + name + "=";
+	if (option.compare(0, prefix.size(), prefix) != 0 || option.size() == prefix.size()) {
+		return false;
+	}
+	value = option.substr(prefix.size());
+	return true;
+}
+
+
+/*
+ * Description: Parses a "--log-level=debug|info|error" option.
+ * Returns false iff the option is not the log level or its value is not a level.
+*/
+bool parseLogLevelOption(const string& option, log_level& level) {
+	string name;
+	if (!parseStringOption(option, "log-level", name)) {
+		return false;
+	}
+	if (name == "debug") {
+		level = LOG_DEBUG;
+	} else if (name == "info") {
+		level = LOG_INFO;
+	} else if (name == "error") {
+		level = LOG_ERROR;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Parses a "--io=epoll|uring" option.
+ * Returns false iff the option is not the I/O engine or its value is not an engine.
+*/
+bool parseIoEngineOption(const string& option, io_engine& engine) {
+	string name;
+	if (!parseStringOption(option, "io", name)) {
+		return false;
+	}
+	if (name == "epoll") {
+		engine = IO_EPOLL;
+	} else if (name == "uring") {
+		engine = IO_URING;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Parses a "--slow-consumer=pause|drop-oldest|spill|disconnect" option.
+ * Returns false iff the option is not the slow consumer policy or its value is not a policy.
+*/
+bool parseSlowConsumerOption(const string& option, slow_consumer_policy& policy) {
+	string name;
+	if (!parseStringOption(option, "slow-consumer", name)) {
+		return false;
+	}
+	if (name == "pause") {
+		policy = SLOW_CONSUMER_PAUSE;
+	} else if (name == "drop-oldest") {
+		policy = SLOW_CONSUMER_DROP_OLDEST;
+	} else if (name == "spill") {
+		policy = SLOW_CONSUMER_SPILL;
+	} else if (name == "disconnect") {
+		policy = SLOW_CONSUMER_DISCONNECT;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Description: Parses the options that follow the port number into 'config'.
+ * Returns false iff one of the options is invalid.
+*/
+bool parseServerOptions(int argc, char *argv[], ServerConfig& config) {
+	config.queueLimits.highWatermark = DEFAULT_HIGH_WATERMARK;
+	config.queueLimits.lowWatermark = DEFAULT_LOW_WATERMARK;
+	config.queueLimits.capacity = DEFAULT_QUEUE_CAPACITY;
+	config.rateLimits.messagesPerSecond = 0;
+	config.rateLimits.fanoutBytesPerSecond = 0;
+	config.numOfWorkers = DEFAULT_NUM_OF_WORKERS;
+	config.isCorked = false;
+	config.offlineDirectory = DEFAULT_OFFLINE_DIRECTORY;
+	config.offlineLimits.recipientQuota = DEFAULT_OFFLINE_QUOTA;
+	config.offlineLimits.capacity = DEFAULT_OFFLINE_CAPACITY;
+	config.groupsDirectory = DEFAULT_GROUPS_DIRECTORY;
+	config.logConfig = {LOG_DEBUG, true, false, false};
+	config.ioEngine = IO_EPOLL;
+	config.listenBacklog = DEFAULT_LISTEN_BACKLOG;
+	config.handshakeTimeoutMs = DEFAULT_HANDSHAKE_TIMEOUT_MS;
+	config.frameBudget = DEFAULT_FRAME_BUDGET;
+	config.slowConsumerPolicy = SLOW_CONSUMER_PAUSE;
+	config.slowConsumerLagMs = DEFAULT_SLOW_CONSUMER_LAG_MS;
+
+	for (int i = FIRST_OPTION_INDEX; i < argc; i++) {
+		string option = argv[i];
+		if (option == CORK_OPTION) {
+			config.isCorked = true;
+		} else if (option == NO_LOG_BODIES_OPTION) {
+			config.logConfig.hasBodies = false;
+		} else if (option == LOG_TIMESTAMPS_OPTION) {
+			config.logConfig.hasTimestamps = true;
+		} else if (option == LOG_DROP_OPTION) {
+			config.logConfig.isLossy = true;
+		} else if (!parseNumericOption(option, "high-watermark", config.queueLimits.highWatermark) &&
+		    !parseNumericOption(option, "low-watermark", config.queueLimits.lowWatermark) &&
+		    !parseNumericOption(option, "max-queue", config.queueLimits.capacity) &&
+		    !parseNumericOption(option, "message-rate", config.rateLimits.messagesPerSecond) &&
+		    !parseNumericOption(option, "fanout-rate", config.rateLimits.fanoutBytesPerSecond) &&
+		    !parseNumericOption(option, "workers", config.numOfWorkers) &&
+		    !parseNumericOption(option, "backlog", config.listenBacklog) &&
+		    !parseNumericOption(option, "handshake-timeout", config.handshakeTimeoutMs) &&
+		    !parseNumericOption(option, "frame-budget", config.frameBudget) &&
+		    !parseNumericOption(option, "slow-consumer-lag", config.slowConsumerLagMs) &&
+		    !parseNumericOption(option, "offline-quota", config.offlineLimits.recipientQuota) &&
+		    !parseNumericOption(option, "offline-capacity", config.offlineLimits.capacity) &&
+		    !parseStringOption(option, "offline-dir", config.offlineDirectory) &&
+		    !parseStringOption(option, "groups-dir", config.groupsDirectory) &&
+		    !parseStringOption(option, "stats-socket", config.statsSocketPath) &&
+		    !parseLogLevelOption(option, config.logConfig.level) &&
+		    !parseIoEngineOption(option, config.ioEngine) &&
+		    !parseSlowConsumerOption(option, config.slowConsumerPolicy)) {
+			return false;
+		}
+	}
+	return config.queueLimits.lowWatermark <= config.queueLimits.highWatermark &&
+	       config.numOfWorkers > 0 && config.frameBudget > 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	if (argc < SERVER_NUM_OF_ARGS || !parseServerOptions(argc, argv, serverConfig)) {
+		print_server_usage();
+		return FAILURE;
+	}
+
+	auto portNum = (unsigned short) strtol(argv[PORT_NUM_INDEX], nullptr, DECIMAL_BASE);
+	char myHostName[MAX_HOST_NAME_LENGTH + 1];
+	struct sockaddr_in serverSocketAddress = {0};
+	struct hostent *hostEntry;
+
+	serverStartNs = monotonicNs();
+	lastReportCounts.takenNs = serverStartNs;
+	raiseFileDescriptorsLimit();
+	// A client that disconnects while we write to it must not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+	if (!offlineStore.open(serverConfig.offlineDirectory, serverConfig.offlineLimits) ||
+	    !groupStore.open(serverConfig.groupsDirectory)) {
+		return FAILURE;
+	}
+
+	if ( gethostname(myHostName, MAX_HOST_NAME_LENGTH) < 0) {
+		print_error("gethostname", errno);
+	}
+	hostEntry = gethostbyname(myHostName);
+	if (hostEntry == nullptr) {
+		print_error("gethostbyname", h_errno);
+		return FAILURE;
+	}
+
+	if (serverConfig.ioEngine == IO_URING && !IoRing::isSupported()) {
+		print_io_uring_fallback(errno);
+		serverConfig.ioEngine = IO_EPOLL;
+	}
+
+	memset( &serverSocketAddress, 0, sizeof(serverSocketAddress));
+	serverSocketAddress.sin_family = (unsigned short) hostEntry->h_addrtype;
+	serverSocketAddress.sin_addr.s_addr = htons(INADDR_ANY);
+	serverSocketAddress.sin_port = htons(portNum);
+
+	for (size_t i = 0; i < serverConfig.numOfWorkers; i++) {
+		workers.emplace_back(new Worker((int) i));
+		if (!openListeningSocket(*workers.back(), serverSocketAddress)) {
+			return FAILURE;
+		}
+	}
+	// epoll refuses regular files (EPERM), e.g. when the input is redirected from a file, so
+	// such an input is read a line per loop turn instead (see readInputFile) - by both engines.
+	Worker& mainWorker = *workers[MAIN_WORKER];
+	struct stat inputStatus;
+	mainWorker.isWatchingInput = true;
+	if (fstat(STDIN_FILENO, &inputStatus) == 0 && S_ISREG(inputStatus.st_mode)) {
+		mainWorker.isInputFile = true;
+	} else if (serverConfig.ioEngine == IO_EPOLL &&
+	           mainWorker.eventLoop.add(STDIN_FILENO, LISTENER_EVENTS) < 0) {
+		if (errno != EPERM) {
+			print_error("epoll_ctl", errno);
+			return FAILURE;
+		}
+		mainWorker.isInputFile = true;      // Nor does it take e.g. /dev/null.
+	}
+	if (!serverConfig.statsSocketPath.empty() &&
+	    !openStatsSocket(*workers[MAIN_WORKER], serverConfig.statsSocketPath)) {
+		return FAILURE;
+	}
+	if (!startAsyncLog(serverConfig.logConfig)) {
+		return FAILURE;
+	}
+
+	for (unique_ptr<Worker> &worker : workers) {
+		if (worker->index != MAIN_WORKER) {
+			Worker* otherWorker = worker.get();
+			worker->workerThread = thread([otherWorker]() { runWorkerLoop(*otherWorker); });
+		}
+	}
+	int exitCode = runWorkerLoop(*workers[MAIN_WORKER]);
+	shutdownOtherWorkers(*workers[MAIN_WORKER]);
+	for (unique_ptr<Worker> &worker : workers) {
+		if (worker->workerThread.joinable()) {
+			worker->workerThread.join();
+		}
+	}
+	groupStore.close();
+	offlineStore.sync();
+	if (statsSocketFD >= 0) {
+		close(statsSocketFD);
+		unlink(serverConfig.statsSocketPath.c_str());
+	}
+	stopAsyncLog();
+	return hasWorkerFailed ? FAILURE : exitCode;
+}
@@ -0,0 +1,1171 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "whatsappio.h"
+#include "whatsappFrame.h"
+#include "whatsappConnection.h"
+#include "whatsappMailbox.h"
+#include "whatsappNameTable.h"
+#include "whatsappRegistry.h"
+#include "whatsappProtocol.h"
+#include "whatsappOfflineStore.h"
+#include "whatsappGroupStore.h"
+#include "whatsappTokenBucket.h"
+
+using namespace std;
+
+
+/**
+ * The exit code in case of a success.
+ */
+#define SUCCESS 0
+
+/**
+ * The exit code in case of a failure.
+ */
+#define FAILURE 1
+
+/**
+ * Fails the running test, and returns from the function that checks, unless the condition
+ * holds.
+ */
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			failCheck(__FILE__, __LINE__, #condition); \
+			return; \
+		} \
+	} while (0)
+
+/**
+ * The number of nanoseconds in a second.
+ */
+#define NS_PER_SECOND 1000000000ull
+
+/**
+ * The number of threads, and of the changes each makes, of the concurrent group store test.
+ */
+#define GROUP_TEST_THREADS 4
+#define GROUP_TEST_ROUNDS 200
+
+/**
+ * The snapshot threshold of the group store tests - small, so snapshots are taken all along.
+ */
+#define GROUP_TEST_SNAPSHOT_SIZE 512
+
+
+/**
+ * The server the end-to-end tests run, how long they wait for it to start or to reply, and
+ * how many text clients they connect to it.
+ */
+#define SERVER_PATH "./whatsappServer"
+#define SERVER_TEST_TIMEOUT_MS 5000
+#define SERVER_TEST_RETRY_MS 10
+#define SERVER_TEST_CLIENTS 8
+
+// The state of the running test.
+static bool hasFailed = false;
+static string testDirectory;
+
+
+/*
+ * Description: Reports a check that did not hold, and fails the running test.
+*/
+void failCheck(const char* file, int line, const char* condition) {
+	fprintf(stderr, "    %s:%d: CHECK(%s) failed\n", file, line, condition);
+	hasFailed = true;
+}
+
+/*
+ * Description: Returns the path of a new empty directory, for a test to keep its files in.
+*/
+string makeDirectory(const string& name) {
+	string path = testDirectory + "/" + name;
+	mkdir(path.c_str(), S_IRWXU);
+	return path;
+}
+
+/*
+ * Description: Returns the names of the files in a directory that end with the given suffix.
+*/
+vector<string> listFiles(const string& directory, const string& suffix) {
+	vector<string> names;
+	DIR* directoryStream = opendir(directory.c_str());
+	struct dirent* entry;
+	while (directoryStream != nullptr && (entry = readdir(directoryStream)) != nullptr) {
+		string name = entry->d_name;
+		if (name.size() >= suffix.size() &&
+		    name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+			names.push_back(name);
+		}
+	}
+	if (directoryStream != nullptr) {
+		closedir(directoryStream);
+	}
+	return names;
+}
+
+/*
+ * Description: Deletes a directory, and the directories and files in it.
+*/
+void removeDirectory(const string& directory) {
+	for (const string &name : listFiles(directory, "")) {
+		string path = directory + "/" + name;
+		struct stat status;
+		if (name == "." || name == ".." || lstat(path.c_str(), &status) < 0) {
+			continue;
+		}
+		if (S_ISDIR(status.st_mode)) {
+			removeDirectory(path);
+		} else {
+			unlink(path.c_str());
+		}
+	}
+	rmdir(directory.c_str());
+}
+
+/*
+ * Description: Runs a function in a child process, which then dies without cleaning up (as a
+ *              crashed server does), and waits for it.
+ * Returns false iff the child did not exit normally.
+*/
+bool runInChild(const function<void()>& body) {
+	pid_t child = fork();
+	if (child == 0) {
+		body();
+		_exit(SUCCESS);
+	}
+	int status;
+	return child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+	       WEXITSTATUS(status) == SUCCESS;
+}
+
+
+/*
+ * Description: Erasing from a NameTable shifts the entries that follow back, so every name
+ *              that probed past an erased one is still found.
+*/
+void testNameTableErase() {
+	NameTable table;
+	const uint32_t numOfNames = 2000;   // Enough to grow the table several times.
+	for (uint32_t i = 0; i < numOfNames; i++) {
+		CHECK(table.insert("name" + to_string(i), i));
+	}
+	CHECK(!table.insert("name7", 0));
+	for (uint32_t i = 0; i < numOfNames; i += 2) {
+		CHECK(table.erase("name" + to_string(i)));
+	}
+	CHECK(!table.erase("name0"));
+	CHECK(table.size() == numOfNames / 2);
+	for (uint32_t i = 0; i < numOfNames; i++) {
+		uint32_t value = 0;
+		bool isFound = table.find("name" + to_string(i), value);
+		CHECK(isFound == (i % 2 == 1));
+		CHECK(!isFound || value == i);
+	}
+	for (uint32_t i = 0; i < numOfNames; i += 2) {
+		CHECK(table.insert("name" + to_string(i), i + numOfNames));
+	}
+	for (uint32_t i = 0; i < numOfNames; i++) {
+		uint32_t value = 0;
+		CHECK(table.find("name" + to_string(i), value));
+		CHECK(value == (i % 2 == 1 ? i : i + numOfNames));
+	}
+}
+
+/*
+ * Description: A mailbox returns the messages of every producer in the order they were
+ *              posted, however many producers post at once.
+*/
+void testMailboxOrder() {
+	Mailbox mailbox;
+	CHECK(mailbox.isValid());
+	CHECK(mailbox.collect() == nullptr);
+
+	const int numOfProducers = 4;
+	const uint64_t messagesPerProducer = 20000;
+	vector<thread> producers;
+	for (int producer = 0; producer < numOfProducers; producer++) {
+		producers.emplace_back([&mailbox, producer]() {
+			for (uint64_t i = 0; i < messagesPerProducer; i++) {
+				auto message = new MailboxMessage();
+				message->type = DELIVER;
+				message->producer.worker = producer;
+				message->producer.id = i;
+				mailbox.post(message);
+			}
+		});
+	}
+	vector<uint64_t> nextIds(numOfProducers, 0);
+	uint64_t numOfMessages = 0;
+	bool isOrdered = true;
+	while (numOfMessages < numOfProducers * messagesPerProducer) {
+		MailboxMessage* message = mailbox.collect();
+		while (message != nullptr) {
+			MailboxMessage* next = message->next;
+			isOrdered = isOrdered && message->producer.id == nextIds[message->producer.worker]++;
+			numOfMessages++;
+			delete message;
+			message = next;
+		}
+	}
+	for (thread &producer : producers) {
+		producer.join();
+	}
+	CHECK(isOrdered);
+	CHECK(mailbox.collect() == nullptr);
+}
+
+/*
+ * Description: A text "who" lists all the clients whatever follows it, and only a v2 client's
+ *              user pages it (with parse_who_page).
+*/
+void testParseWho() {
+	CommandView command;
+	parse_command("who Al 2 1 and more", command);
+	CHECK(command.type == WHO && command.name.empty() && command.limit == 0 && command.offset == 0);
+	CHECK(parse_who_page("who Al 2 1", command));
+	CHECK(command.name == "Al" && command.limit == 2 && command.offset == 1);
+	CHECK(parse_who_page("who * 5", command));
+	CHECK(command.name.empty() && command.limit == 5);
+	CHECK(!parse_who_page("who Al x", command) && !parse_who_page("who Al 2 1 more", command));
+}
+
+/*
+ * Description: Varints round-trip, and a cut short varint is not decoded.
+*/
+void testVarints() {
+	const uint64_t values[] = {0, 1, 127, 128, 300, 16383, 16384, 1ull << 32, UINT64_MAX};
+	for (uint64_t value : values) {
+		string encoded;
+		appendVarint(encoded, value);
+		const char* cursor = encoded.data();
+		uint64_t decoded = 0;
+		CHECK(readVarint(cursor, encoded.data() + encoded.size(), decoded));
+		CHECK(decoded == value);
+		CHECK(cursor == encoded.data() + encoded.size());
+		if (encoded.size() > 1) {
+			cursor = encoded.data();
+			CHECK(!readVarint(cursor, encoded.data() + encoded.size() - 1, decoded));
+		}
+	}
+}
+
+/*
+ * Description: A text frame that arrives a byte at a time - its header too - is decoded once
+ *              it is complete, and an invalid header corrupts the reader.
+*/
+void testFrameReaderText() {
+	FrameReader reader(PROTOCOL_TEXT);
+	string frames = encodeFrame("hello") + encodeFrame("") + encodeFrame("world");
+	vector<string> decoded;
+	string_view frame;
+	for (char byte : frames) {
+		reader.append(&byte, 1);
+		while (reader.nextFrame(frame)) {
+			decoded.emplace_back(frame);
+		}
+		CHECK(!reader.isCorrupted());
+	}
+	CHECK(decoded == vector<string>({"hello", "", "world"}));
+
+	FrameReader invalidReader(PROTOCOL_TEXT);
+	invalidReader.append("-100", BYTES_TO_READ_LENGTH);
+	CHECK(!invalidReader.nextFrame(frame));
+	CHECK(invalidReader.isCorrupted());
+}
+
+/*
+ * Description: A v2 client is recognized by its preface, its frames are decoded even if a
+ *              piece ends in the middle of the varint header, and a frame longer than the
+ *              protocol allows corrupts the reader.
+*/
+void testFrameReaderV2() {
+	FrameReader reader;
+	string payload(300, 'x');           // A two bytes varint.
+	FrameRef encoded = Frame::fromPayload(payload);
+	string bytes = string(1, WA_V2_PREFACE) + string(encoded->data(), encoded->size());
+	string_view frame;
+	reader.append(bytes.data(), 2);     // The preface and half of the header.
+	CHECK(!reader.nextFrame(frame));
+	CHECK(!reader.isCorrupted());
+	CHECK(reader.protocol() == PROTOCOL_V2);
+	reader.append(bytes.data() + 2, bytes.size() - 2);
+	CHECK(reader.nextFrame(frame));
+	CHECK(frame == payload);
+	CHECK(!reader.nextFrame(frame));
+
+	FrameReader longReader(PROTOCOL_V2);
+	string header;
+	appendVarint(header, MAX_V2_PAYLOAD_LENGTH + 1);
+	longReader.append(header.data(), header.size());
+	CHECK(!longReader.nextFrame(frame));
+	CHECK(longReader.isCorrupted());
+}
+
+/*
+ * Description: Dropping the oldest frames never drops a frame that is partially written, nor
+ *              the frames being sent asynchronously.
+*/
+void testDropOldestKeepsFramesBeingWritten() {
+	const size_t frameSize = 64 * 1024;
+	OutboundQueue queue(16 * frameSize);
+	for (char name = 'a'; name <= 'd'; name++) {
+		CHECK(queue.push(make_shared<const Frame>(string(frameSize, name))));
+	}
+	// The socket takes only part of the first frame.
+	int fds[2];
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+	int bufferSize = 1;
+	setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+	CHECK(queue.flushTo(fds[0]) == FLUSH_PARTIAL);
+	size_t bytesLeft = queue.bytesQueued();
+	CHECK(bytesLeft > 3 * frameSize && bytesLeft < 4 * frameSize);
+	size_t bytesDropped;
+	CHECK(queue.dropOldest(1, bytesDropped) == 1);
+	CHECK(bytesDropped == frameSize);
+	CHECK(queue.framesQueued() == 3);
+	CHECK(queue.dropOldest(SIZE_MAX, bytesDropped) == 2);
+	CHECK(queue.framesQueued() == 1);
+	CHECK(queue.bytesQueued() == bytesLeft - 3 * frameSize);
+	close(fds[0]);
+	close(fds[1]);
+
+	// Two frames are being sent asynchronously.
+	OutboundQueue sendingQueue(16 * frameSize);
+	for (char name = 'a'; name <= 'd'; name++) {
+		CHECK(sendingQueue.push(make_shared<const Frame>(string(frameSize, name))));
+	}
+	struct iovec iovecs[2];
+	FrameRef frameRefs[2];
+	CHECK(sendingQueue.startSend(iovecs, frameRefs, 2) == 2);
+	CHECK(sendingQueue.dropOldest(SIZE_MAX, bytesDropped) == 2);
+	CHECK(sendingQueue.framesQueued() == 2);
+	sendingQueue.completeSend(2 * frameSize, 2 * frameSize);
+	CHECK(sendingQueue.empty());
+}
+
+/*
+ * Description: The receipted frames are counted once they are written entirely, and are not
+ *              dropped.
+*/
+void testOutboundQueueReceipts() {
+	const size_t frameSize = 64 * 1024;
+	OutboundQueue queue(16 * frameSize);
+	for (int i = 0; i < 4; i++) {
+		CHECK(queue.push(make_shared<const Frame>(string(frameSize, 'a' + i)), i % 2 == 1));
+	}
+	size_t bytesDropped;
+	CHECK(queue.dropOldest(SIZE_MAX, bytesDropped) == 2);
+	CHECK(queue.framesQueued() == 2);
+	struct iovec iovecs[2];
+	FrameRef frameRefs[2];
+	CHECK(queue.startSend(iovecs, frameRefs, 2) == 2);
+	CHECK(*frameRefs[0]->data() == 'b' && *frameRefs[1]->data() == 'd');
+	queue.completeSend(2 * frameSize, frameSize + 1);
+	CHECK(queue.takeReceipts() == 1);
+	CHECK(queue.takeReceipts() == 0);
+}
+
+/*
+ * Description: A token bucket allows a second's worth of tokens at once, earns them back over
+ *              time, lets a single oversized take through only when full, and has no limit
+ *              at a rate of 0.
+*/
+void testTokenBucket() {
+	TokenBucket unlimited;
+	CHECK(unlimited.canTake(UINT64_MAX, 0));
+
+	const uint64_t startNs = 5 * NS_PER_SECOND;
+	TokenBucket bucket(10);
+	for (int i = 0; i < 10; i++) {
+		CHECK(bucket.canTake(1, startNs));
+		bucket.take(1, startNs);
+	}
+	CHECK(!bucket.canTake(1, startNs));
+	CHECK(!bucket.canTake(1, startNs + NS_PER_SECOND / 10 - 1));
+	CHECK(bucket.canTake(1, startNs + NS_PER_SECOND / 10));
+	CHECK(!bucket.canTake(2, startNs + NS_PER_SECOND / 10));
+	CHECK(bucket.canTake(10, startNs + NS_PER_SECOND));
+
+	// More than a second's worth, when the bucket is full - then it is empty for 3 seconds.
+	TokenBucket burstBucket(10);
+	CHECK(burstBucket.canTake(40, startNs));
+	burstBucket.take(40, startNs);
+	CHECK(!burstBucket.canTake(1, startNs + 3 * NS_PER_SECOND));
+	CHECK(burstBucket.canTake(1, startNs + 3 * NS_PER_SECOND + NS_PER_SECOND / 10));
+
+	// Huge takes do not overflow.
+	TokenBucket fastBucket(UINT64_MAX / 2);
+	CHECK(fastBucket.canTake(UINT64_MAX / 4, startNs));
+}
+
+
+/*
+ * Description: Delivers the offline messages of a recipient.
+ * Returns the frames that deliver them.
+*/
+vector<string> takeAllMessages(OfflineStore& store, const string& recipient) {
+	vector<OfflineMessage> taken;
+	store.takeMessages(recipient, SIZE_MAX, taken);
+	vector<string> messages;
+	for (const OfflineMessage &message : taken) {
+		messages.emplace_back(message.delivery->data(), message.delivery->size());
+		store.confirmDelivered(recipient, message.sequence);
+	}
+	return messages;
+}
+
+/*
+ * Description: The undelivered messages are recovered by a new store, in order, and those
+ *              that were delivered are not.
+*/
+void testOfflineStoreRecovery() {
+	string directory = makeDirectory("offline-recovery");
+	{
+		OfflineStore store;
+		CHECK(store.open(directory, {0, 0}));
+		for (int i = 0; i < 10; i++) {
+			CHECK(store.append("alice", *Frame::fromPayload("to alice " + to_string(i))) ==
+			      STORE_OK);
+			CHECK(store.append("bob", *Frame::fromPayload("to bob " + to_string(i))) ==
+			      STORE_OK);
+		}
+		CHECK(takeAllMessages(store, "bob").size() == 10);
+	}
+	OfflineStore store;
+	CHECK(store.open(directory, {0, 0}));
+	vector<string> messages = takeAllMessages(store, "alice");
+	CHECK(messages.size() == 10);
+	for (int i = 0; i < 10; i++) {
+		CHECK(messages[i].find("to alice " + to_string(i)) != string::npos);
+	}
+	CHECK(takeAllMessages(store, "bob").empty());
+}
+
+/*
+ * Description: Messages that were taken stay stored until their delivery is confirmed: those
+ *              that are returned are taken again first, and those that are neither confirmed
+ *              nor returned when the server dies are recovered.
+*/
+void testOfflineStoreRedelivery() {
+	string directory = makeDirectory("offline-redelivery");
+	{
+		OfflineStore store;
+		CHECK(store.open(directory, {0, 0}));
+		for (int i = 0; i < 10; i++) {
+			CHECK(store.append("alice", *Frame::fromPayload("to alice " + to_string(i))) ==
+			      STORE_OK);
+		}
+		vector<OfflineMessage> taken;
+		CHECK(store.takeMessages("alice", SIZE_MAX, taken));
+		CHECK(taken.size() == 10);
+		store.confirmDelivered("alice", taken[0].sequence);
+		store.confirmDelivered("alice", taken[1].sequence);
+		store.returnMessage("alice", taken[3].sequence);
+		store.returnMessage("alice", taken[2].sequence);
+		vector<OfflineMessage> retaken;
+		CHECK(store.takeMessages("alice", SIZE_MAX, retaken));
+		CHECK(retaken.size() == 2);
+		CHECK(retaken[0].sequence == taken[2].sequence);
+		CHECK(retaken[1].sequence == taken[3].sequence);
+		// The server dies before any other message is written.
+	}
+	OfflineStore store;
+	CHECK(store.open(directory, {0, 0}));
+	vector<string> messages = takeAllMessages(store, "alice");
+	CHECK(messages.size() == 8);
+	for (int i = 0; i < 8; i++) {
+		CHECK(messages[i].find("to alice " + to_string(i + 2)) != string::npos);
+	}
+}
+
+/*
+ * Description: Dropping the messages of a client that has exited deletes them all, taken or
+ *              not, and only them.
+*/
+void testOfflineStoreDrop() {
+	string directory = makeDirectory("offline-drop");
+	{
+		OfflineStore store;
+		CHECK(store.open(directory, {0, 0}));
+		for (int i = 0; i < 10; i++) {
+			CHECK(store.append("alice", *Frame::fromPayload("to alice")) == STORE_OK);
+			CHECK(store.append("bob", *Frame::fromPayload("to bob")) == STORE_OK);
+		}
+		vector<OfflineMessage> taken;
+		CHECK(!store.takeMessages("alice", 1, taken));
+		store.dropMessages("alice");
+		CHECK(takeAllMessages(store, "alice").empty());
+		CHECK(store.append("alice", *Frame::fromPayload("to the next alice")) == STORE_OK);
+	}
+	OfflineStore store;
+	CHECK(store.open(directory, {0, 0}));
+	vector<string> messages = takeAllMessages(store, "alice");
+	CHECK(messages.size() == 1);
+	CHECK(messages[0].find("to the next alice") != string::npos);
+	CHECK(takeAllMessages(store, "bob").size() == 10);
+}
+
+/*
+ * Description: A sealed segment that is mostly delivered is compacted: its undelivered
+ *              messages move to the end of the log, in order, and the segment is deleted.
+*/
+void testOfflineStoreCompaction() {
+	string directory = makeDirectory("offline-compaction");
+	const size_t messageSize = 512 * 1024;
+	const size_t numOfMessages = OFFLINE_SEGMENT_SIZE / messageSize + 8;   // Over 2 segments.
+	{
+		OfflineStore store;
+		CHECK(store.open(directory, {0, 0}));
+		for (size_t i = 0; i < numOfMessages; i++) {
+			string recipient = (i % 16 == 0) ? "keeper" : "reader";
+			string payload = to_string(i) + ":" + string(messageSize, 'x');
+			CHECK(store.append(recipient, *Frame::fromPayload(payload)) == STORE_OK);
+		}
+		CHECK(listFiles(directory, ".log").size() == 2);
+		// The keeper's messages are being delivered when the first segment is compacted into
+		// the second - and then they are not.
+		vector<OfflineMessage> taken;
+		CHECK(store.takeMessages("keeper", SIZE_MAX, taken));
+		CHECK(takeAllMessages(store, "reader").size() == numOfMessages - numOfMessages / 16 - 1);
+		CHECK(listFiles(directory, ".log").size() == 1);
+		for (const OfflineMessage &message : taken) {
+			store.returnMessage("keeper", message.sequence);
+		}
+		vector<string> messages = takeAllMessages(store, "keeper");
+		CHECK(!messages.empty());
+		for (size_t i = 0; i < messages.size(); i++) {
+			CHECK(messages[i].find(to_string(i * 16) + ":") != string::npos);
+		}
+		// Put them back, to recover them after a restart.
+		for (const string &message : messages) {
+			CHECK(store.append("keeper", Frame(message)) == STORE_OK);
+		}
+	}
+	OfflineStore store;
+	CHECK(store.open(directory, {0, 0}));
+	vector<string> messages = takeAllMessages(store, "keeper");
+	CHECK(messages.size() == (numOfMessages + 15) / 16);
+	for (size_t i = 0; i < messages.size(); i++) {
+		CHECK(messages[i].find(to_string(i * 16) + ":") != string::npos);
+	}
+}
+
+/*
+ * Description: Messages beyond a recipient's quota, or the store's capacity, are refused.
+*/
+void testOfflineStoreQuota() {
+	string directory = makeDirectory("offline-quota");
+	OfflineStore store;
+	FrameRef message = Frame::fromPayload(string(100, 'x'));
+	CHECK(store.open(directory, {1000, 1500}));
+	size_t numOfStored = 0;
+	while (store.append("alice", *message) == STORE_OK) {
+		numOfStored++;
+	}
+	CHECK(numOfStored > 0 && numOfStored < 10);
+	CHECK(store.append("alice", *message) == STORE_OVER_QUOTA);
+	CHECK(store.append("bob", *message) == STORE_OK);
+	while (store.append("bob", *message) == STORE_OK) {
+	}
+	CHECK(store.append("carol", *message) == STORE_OVER_QUOTA);   // The store is full.
+	CHECK(takeAllMessages(store, "alice").size() == numOfStored);
+	CHECK(store.append("carol", *message) == STORE_OK);
+}
+
+
+/*
+ * The groups of a registry: the sorted names of the members of every group, by name.
+ */
+typedef map<string, vector<string>> GroupMap;
+
+/**
+ * How long the group store test waits for a failed log to be recovered.
+ */
+#define GROUP_TEST_RECOVERY_MS 5000
+
+/*
+ * Description: Returns the groups of a registry.
+*/
+GroupMap groupsOf(const ClientRegistry& registry) {
+	GroupMap groups;
+	registry.forEachGroup([&groups](string_view groupName, const vector<string_view>& members) {
+		vector<string>& names = groups[string(groupName)];
+		names.assign(members.begin(), members.end());
+		sort(names.begin(), names.end());
+	});
+	return groups;
+}
+
+/*
+ * Description: Writes groups to a file, a line per group.
+*/
+void writeGroups(const GroupMap& groups, const string& path) {
+	FILE* file = fopen(path.c_str(), "w");
+	for (const auto &group : groups) {
+		fprintf(file, "%s", group.first.c_str());
+		for (const string &member : group.second) {
+			fprintf(file, " %s", member.c_str());
+		}
+		fprintf(file, "\n");
+	}
+	fclose(file);
+}
+
+/*
+ * Description: Reads groups written by writeGroups.
+*/
+GroupMap readGroups(const string& path) {
+	GroupMap groups;
+	FILE* file = fopen(path.c_str(), "r");
+	char line[WA_MAX_INPUT];
+	while (file != nullptr && fgets(line, sizeof(line), file) != nullptr) {
+		vector<string> names;
+		for (char* name = strtok(line, " \n"); name != nullptr; name = strtok(nullptr, " \n")) {
+			names.emplace_back(name);
+		}
+		if (!names.empty()) {
+			groups[names[0]].assign(names.begin() + 1, names.end());
+		}
+	}
+	if (file != nullptr) {
+		fclose(file);
+	}
+	return groups;
+}
+
+/*
+ * Description: Returns the handle of a (fake) connection.
+*/
+ConnectionHandle handleOf(uint64_t connectionId) {
+	return {0, -1, connectionId, PROTOCOL_V2, nullptr};
+}
+
+/*
+ * Description: Groups are restored from the log alone, when the server dies before any
+ *              snapshot: the exit of a client is replayed after the groups it left were
+ *              created, and before it created and joined others.
+*/
+void testGroupLogReplay() {
+	string directory = makeDirectory("groups-replay");
+	string expectedPath = directory + "/expected";
+	CHECK(runInChild([&]() {
+		ClientRegistry registry;
+		GroupStore store(registry);
+		if (!store.open(directory)) {
+			_exit(FAILURE);
+		}
+		ClientId avi, yael, mom;
+		registry.registerClient("Avi", handleOf(1), avi);
+		registry.registerClient("Yael", handleOf(2), yael);
+		registry.registerClient("Mom", handleOf(3), mom);
+		string_view family[] = {"Avi", "Mom", "Yael"};
+		store.createGroup("family", avi, "Avi", family, 3);
+		store.unregisterClient(mom, 3, "Mom");
+		registry.registerClient("Mom", handleOf(4), mom);
+		string_view parents[] = {"Mom"};
+		store.createGroup("parents", mom, "Mom", parents, 1);
+		store.commit();
+		writeGroups(groupsOf(registry), expectedPath);
+	}));
+	GroupMap expected = readGroups(expectedPath);
+	CHECK(expected.size() == 2);
+	CHECK(expected["family"] == vector<string>({"Avi", "Yael"}));
+	ClientRegistry registry;
+	GroupStore store(registry);
+	CHECK(store.open(directory));
+	CHECK(groupsOf(registry) == expected);
+	store.close();
+}
+
+/*
+ * Description: The groups survive a crash while snapshots are taken all along, concurrently
+ *              with clients that exit, reconnect and create groups: the logs that follow a
+ *              snapshot replay exactly the changes it does not hold.
+*/
+void testGroupSnapshotCut() {
+	string directory = makeDirectory("groups-snapshot");
+	string expectedPath = directory + "/expected";
+	CHECK(runInChild([&]() {
+		ClientRegistry registry;
+		GroupStore store(registry);
+		if (!store.open(directory, GROUP_TEST_SNAPSHOT_SIZE)) {
+			_exit(FAILURE);
+		}
+		vector<thread> threads;
+		for (int t = 0; t < GROUP_TEST_THREADS; t++) {
+			threads.emplace_back([&registry, &store, t]() {
+				string name = "client" + to_string(t);
+				string partner = "partner" + to_string(t);
+				uint64_t connectionId = (uint64_t) t << 32;
+				ClientId id, partnerId;
+				registry.registerClient(partner, handleOf(++connectionId), partnerId);
+				for (int round = 0; round < GROUP_TEST_ROUNDS; round++) {
+					// The client reconnects, creates a group with its partner, and exits.
+					registry.registerClient(name, handleOf(++connectionId), id);
+					string groupName = "group" + to_string(t) + "_" + to_string(round);
+					string_view members[] = {name, partner};
+					store.createGroup(groupName, id, name, members, 2);
+					if (round % 4 != 3) {
+						store.unregisterClient(id, connectionId, name);
+					} else {
+						registry.disconnectClient(id, connectionId);
+					}
+				}
+			});
+		}
+		for (thread &workload : threads) {
+			workload.join();
+		}
+		store.commit();
+		writeGroups(groupsOf(registry), expectedPath);
+	}));
+	GroupMap expected = readGroups(expectedPath);
+	CHECK(expected.size() == GROUP_TEST_THREADS * GROUP_TEST_ROUNDS);
+	ClientRegistry registry;
+	GroupStore store(registry);
+	CHECK(store.open(directory));
+	CHECK(groupsOf(registry) == expected);
+	// And once more, from the final snapshot alone.
+	store.close();
+	for (const string &name : listFiles(directory, ".wal")) {
+		struct stat status;
+		CHECK(stat((directory + "/" + name).c_str(), &status) == 0 && status.st_size == 0);
+	}
+	ClientRegistry snapshotRegistry;
+	GroupStore snapshotStore(snapshotRegistry);
+	CHECK(snapshotStore.open(directory));
+	CHECK(groupsOf(snapshotRegistry) == expected);
+	snapshotStore.close();
+}
+
+
+/*
+ * Description: A group all of whose members have exited is restored from the snapshot empty,
+ *              and its name stays taken.
+*/
+void testGroupEmptySnapshot() {
+	string directory = makeDirectory("groups-empty");
+	{
+		ClientRegistry registry;
+		GroupStore store(registry);
+		CHECK(store.open(directory));
+		ClientId avi, yael;
+		registry.registerClient("Avi", handleOf(1), avi);
+		registry.registerClient("Yael", handleOf(2), yael);
+		string_view members[] = {"Avi", "Yael"};
+		CHECK(store.createGroup("duo", avi, "Avi", members, 2));
+		store.unregisterClient(avi, 1, "Avi");
+		store.unregisterClient(yael, 2, "Yael");
+		store.close();
+	}
+	CHECK(listFiles(directory, ".snapshot").size() == 1);
+	ClientRegistry registry;
+	GroupStore store(registry);
+	CHECK(store.open(directory));
+	CHECK(groupsOf(registry) == GroupMap({{"duo", {}}}));
+	ClientId avi;
+	registry.registerClient("Avi", handleOf(3), avi);
+	string_view members[] = {"Avi"};
+	CHECK(!store.createGroup("duo", avi, "Avi", members, 1));
+	store.close();
+}
+
+/*
+ * Description: A log that cannot be written fails the commits, and no group is created until
+ *              a snapshot has saved the changes that were not logged - which survive a crash.
+*/
+void testGroupLogFailure() {
+	string directory = makeDirectory("groups-failure");
+	string expectedPath = directory + "/expected";
+	CHECK(runInChild([&]() {
+		signal(SIGXFSZ, SIG_IGN);   // Writes beyond the file size limit fail with EFBIG.
+		ClientRegistry registry;
+		GroupStore store(registry);
+		if (!store.open(directory)) {
+			_exit(FAILURE);
+		}
+		ClientId avi, yael;
+		registry.registerClient("Avi", handleOf(1), avi);
+		registry.registerClient("Yael", handleOf(2), yael);
+		string_view members[] = {"Avi", "Yael"};
+		struct rlimit fileSizeLimit;
+		getrlimit(RLIMIT_FSIZE, &fileSizeLimit);
+		struct rlimit smallLimit = fileSizeLimit;
+		smallLimit.rlim_cur = 1;
+		setrlimit(RLIMIT_FSIZE, &smallLimit);
+		if (!store.createGroup("before", avi, "Avi", members, 2) || store.commit() ||
+		    store.createGroup("during", avi, "Avi", members, 2)) {
+			_exit(FAILURE);
+		}
+		setrlimit(RLIMIT_FSIZE, &fileSizeLimit);
+		int waitedMs = 0;
+		while (!store.createGroup("after", avi, "Avi", members, 2)) {
+			if (waitedMs++ == GROUP_TEST_RECOVERY_MS) {
+				_exit(FAILURE);
+			}
+			usleep(1000);
+		}
+		if (!store.commit()) {
+			_exit(FAILURE);
+		}
+		writeGroups(groupsOf(registry), expectedPath);
+	}));
+	GroupMap expected = readGroups(expectedPath);
+	CHECK(expected.size() == 2 && expected.count("before") == 1 && expected.count("after") == 1);
+	ClientRegistry registry;
+	GroupStore store(registry);
+	CHECK(store.open(directory));
+	CHECK(groupsOf(registry) == expected);
+	store.close();
+}
+
+
+/*
+ * Description: A whatsappServer run by a test, with its standard input on a pipe so it can be
+ *              told to exit. A server that is still running when the test returns is killed.
+*/
+class ServerProcess {
+public:
+	ServerProcess() : pid(-1), inputFD(-1) {
+	}
+
+	~ServerProcess() {
+		if (inputFD >= 0) {
+			close(inputFD);
+		}
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, nullptr, 0);
+		}
+	}
+
+	/*
+	 * Description: Runs the server on the given port, with the given options.
+	 * Returns false iff it could not be run.
+	*/
+	bool start(unsigned short port, const vector<string>& options) {
+		int inputPipe[2];
+		if (pipe(inputPipe) < 0) {
+			return false;
+		}
+		pid = fork();
+		if (pid == 0) {
+			dup2(inputPipe[0], STDIN_FILENO);
+			int nullFD = open("/dev/null", O_WRONLY);
+			dup2(nullFD, STDOUT_FILENO);
+			close(nullFD);
+			close(inputPipe[0]);
+			close(inputPipe[1]);
+			string portText = to_string(port);
+			vector<char*> arguments = {(char*) SERVER_PATH, &portText[0]};
+			for (const string &option : options) {
+				arguments.push_back((char*) option.c_str());
+			}
+			arguments.push_back(nullptr);
+			execv(SERVER_PATH, arguments.data());
+			_exit(FAILURE);
+		}
+		close(inputPipe[0]);
+		inputFD = inputPipe[1];
+		return pid > 0;
+	}
+
+	/*
+	 * Description: Types EXIT into the server, and waits for it to exit.
+	 * Returns false iff it did not exit successfully.
+	*/
+	bool exit() {
+		string command = "EXIT\n";
+		bool isWritten = writeBytes(inputFD, command.data(), command.size()) ==
+		                 (int) command.size();
+		close(inputFD);
+		inputFD = -1;
+		int status;
+		bool hasExited = waitpid(pid, &status, 0) == pid;
+		pid = -1;
+		return isWritten && hasExited && WIFEXITED(status) && WEXITSTATUS(status) == SUCCESS;
+	}
+
+private:
+	pid_t pid;
+	int inputFD;
+};
+
+/*
+ * Description: A client of the server a test runs, which speaks either protocol.
+*/
+class TestClient {
+public:
+	explicit TestClient(protocol_version protocol) :
+			protocol(protocol), socketFD(-1), reader(protocol) {
+	}
+
+	~TestClient() {
+		if (socketFD >= 0) {
+			close(socketFD);
+		}
+	}
+
+	/*
+	 * Description: Connects to the server on the given port of this host, retrying while the
+	 *              server is still starting.
+	 * Returns false iff it did not connect within SERVER_TEST_TIMEOUT_MS.
+	*/
+	bool connectTo(unsigned short port) {
+		struct sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+		for (int waitedMs = 0; waitedMs < SERVER_TEST_TIMEOUT_MS; waitedMs += SERVER_TEST_RETRY_MS) {
+			socketFD = socket(AF_INET, SOCK_STREAM, 0);
+			if (socketFD >= 0 && connect(socketFD, (struct sockaddr*) &address, sizeof(address)) == 0) {
+				return fcntl(socketFD, F_SETFL, O_NONBLOCK) == 0;
+			}
+			close(socketFD);
+			socketFD = -1;
+			usleep(SERVER_TEST_RETRY_MS * 1000);
+		}
+		return false;
+	}
+
+	/*
+	 * Description: Sends the client's hello - preceded by WA_V2_PREFACE in protocol v2.
+	*/
+	bool sendHello(const string& name) {
+		if (protocol == PROTOCOL_TEXT) {
+			return send(Frame::fromMessage(name));
+		}
+		FrameRef hello = encodeHello(name, nextRequestId++);
+		string helloWithPreface(1, WA_V2_PREFACE);
+		helloWithPreface.append(hello->data(), hello->size());
+		return writeBytes(socketFD, helloWithPreface.data(), helloWithPreface.size()) ==
+		       (int) helloWithPreface.size();
+	}
+
+	/*
+	 * Description: Sends a message to a client or a group - as a text command, or as a v2
+	 *              request with the next request id.
+	*/
+	bool sendMessage(const string& name, const string& message) {
+		if (protocol == PROTOCOL_TEXT) {
+			return send(Frame::fromMessage("send " + name + " " + message));
+		}
+		CommandView command = {};
+		command.type = SEND;
+		command.name = name;
+		command.message = message;
+		return send(encodeRequest(command, nextRequestId++));
+	}
+
+	/*
+	 * Description: Waits up to SERVER_TEST_TIMEOUT_MS for the next frame of the server.
+	 * frame: output - the frame's payload.
+	 * Returns false iff no frame arrived.
+	*/
+	bool receive(string& frame) {
+		string_view view;
+		struct pollfd readable = {socketFD, POLLIN, 0};
+		while (!reader.nextFrame(view)) {
+			if (reader.isCorrupted() || poll(&readable, 1, SERVER_TEST_TIMEOUT_MS) <= 0 ||
+			    reader.readFrom(socketFD) == RECEIVE_CLOSED) {
+				return false;
+			}
+		}
+		frame.assign(view);
+		return true;
+	}
+
+	/*
+	 * Description: Waits for the next frame of the server, which must be a v2 frame.
+	 * Returns false iff no well-formed frame arrived.
+	*/
+	bool receive(ServerMessage& message) {
+		return receive(lastFrame) && decodeServerMessage(lastFrame, message);
+	}
+
+	/*
+	 * Description: Returns the request id of the last v2 request that was sent.
+	*/
+	uint64_t lastRequestId() const {
+		return nextRequestId - 1;
+	}
+
+private:
+	bool send(const FrameRef& frame) {
+		return frame && writeBytes(socketFD, frame->data(), frame->size()) == (int) frame->size();
+	}
+
+	protocol_version protocol;
+	int socketFD;
+	FrameReader reader;
+	string lastFrame;                   // The frame the last decoded ServerMessage views.
+	uint64_t nextRequestId = 1;
+};
+
+/*
+ * Description: Returns a TCP port that no socket is bound to, for a test to run a server on.
+*/
+unsigned short findFreePort() {
+	struct sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addressLength = sizeof(address);
+	int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+	bind(socketFD, (struct sockaddr*) &address, sizeof(address));
+	getsockname(socketFD, (struct sockaddr*) &address, &addressLength);
+	close(socketFD);
+	return ntohs(address.sin_port);
+}
+
+/*
+ * Description: Runs a server with two workers and a rate limit of a message per second, and
+ *              checks over its sockets that: a text and a v2 client each negotiate their own
+ *              protocol, the messages of text clients spread over both workers reach a v2
+ *              client (and back), a name is taken whatever the protocol, a name that breaks
+ *              the rules of the text protocol is refused in either, and a second message
+ *              within the second is THROTTLED in either protocol.
+ * ioOption: the --io option of the server.
+*/
+void runServerScenario(const string& ioOption) {
+	string directory = makeDirectory("server-" + ioOption.substr(ioOption.find('=') + 1));
+	ServerProcess server;
+	unsigned short port = findFreePort();
+	CHECK(server.start(port, {"--workers=2", "--message-rate=1", "--log-level=error",
+	                          "--offline-dir=" + directory + "/offline",
+	                          "--groups-dir=" + directory + "/groups", ioOption}));
+	TestClient hub(PROTOCOL_V2);
+	ServerMessage reply;
+	CHECK(hub.connectTo(port) && hub.sendHello("hub"));
+	CHECK(hub.receive(reply) && reply.opcode == OP_ACK && reply.requestId == hub.lastRequestId() &&
+	      reply.status == STATUS_SUCCESS);
+
+	vector<unique_ptr<TestClient>> senders;
+	string frame;
+	for (int i = 0; i < SERVER_TEST_CLIENTS; i++) {
+		senders.emplace_back(new TestClient(PROTOCOL_TEXT));
+		CHECK(senders.back()->connectTo(port) && senders.back()->sendHello("text" + to_string(i)));
+		CHECK(senders.back()->receive(frame) && frame == to_string(STATUS_SUCCESS));
+	}
+	TestClient duplicate(PROTOCOL_V2);
+	CHECK(duplicate.connectTo(port) && duplicate.sendHello("text0"));
+	CHECK(duplicate.receive(reply) && reply.opcode == OP_ACK && reply.status == STATUS_NAME_IN_USE);
+	for (const string &name : {string("two words"), string("a,b"), string(WA_MAX_NAME + 1, 'a')}) {
+		TestClient invalid(PROTOCOL_V2);
+		CHECK(invalid.connectTo(port) && invalid.sendHello(name));
+		CHECK(invalid.receive(reply) && reply.opcode == OP_ACK && reply.status == STATUS_FAILURE);
+	}
+	TestClient invalid(PROTOCOL_TEXT);
+	CHECK(invalid.connectTo(port) && invalid.sendHello("two words"));
+	CHECK(invalid.receive(frame) && frame == to_string(STATUS_FAILURE));
+
+	for (int i = 0; i < SERVER_TEST_CLIENTS; i++) {
+		CHECK(senders[i]->sendMessage("hub", "hi from " + to_string(i)));
+		CHECK(senders[i]->receive(frame) && frame == to_string(STATUS_SUCCESS));
+	}
+	vector<string> deliveries;
+	for (int i = 0; i < SERVER_TEST_CLIENTS; i++) {
+		CHECK(hub.receive(reply) && reply.opcode == OP_DELIVER);
+		deliveries.push_back(string(reply.sender) + ":" + string(reply.message));
+	}
+	sort(deliveries.begin(), deliveries.end());
+	for (int i = 0; i < SERVER_TEST_CLIENTS; i++) {
+		CHECK(deliveries[i] == "text" + to_string(i) + ":hi from " + to_string(i));
+	}
+	CHECK(senders[0]->sendMessage("hub", "too soon"));
+	CHECK(senders[0]->receive(frame) && frame == to_string(STATUS_THROTTLED));
+
+	CHECK(hub.sendMessage("text1", "hi back"));
+	CHECK(hub.receive(reply) && reply.opcode == OP_ACK && reply.requestId == hub.lastRequestId() &&
+	      reply.status == STATUS_SUCCESS);
+	CHECK(senders[1]->receive(frame) && frame == "send hub hi back");
+	CHECK(hub.sendMessage("text1", "too soon"));
+	CHECK(hub.receive(reply) && reply.opcode == OP_ACK && reply.requestId == hub.lastRequestId() &&
+	      reply.status == STATUS_THROTTLED);
+
+	CHECK(server.exit());
+	CHECK(hub.receive(reply) && reply.opcode == OP_SERVER_EXIT);
+}
+
+/*
+ * Description: The server, end to end, with each I/O engine (uring falls back to epoll where
+ *              the kernel does not support it).
+*/
+void testServerEpoll() {
+	runServerScenario("--io=epoll");
+}
+
+void testServerUring() {
+	runServerScenario("--io=uring");
+}
+
+
+/*
+ * Description: A unit test.
+*/
+struct Test {
+	const char* name;
+	void (*run)();
+};
+
+static const Test TESTS[] = {
+	{"NameTable erase", testNameTableErase},
+	{"Mailbox order", testMailboxOrder},
+	{"parse_command who", testParseWho},
+	{"varints", testVarints},
+	{"FrameReader text frames", testFrameReaderText},
+	{"FrameReader v2 frames", testFrameReaderV2},
+	{"OutboundQueue dropOldest", testDropOldestKeepsFramesBeingWritten},
+	{"OutboundQueue receipts", testOutboundQueueReceipts},
+	{"TokenBucket", testTokenBucket},
+	{"OfflineStore recovery", testOfflineStoreRecovery},
+	{"OfflineStore redelivery", testOfflineStoreRedelivery},
+	{"OfflineStore drop", testOfflineStoreDrop},
+	{"OfflineStore compaction", testOfflineStoreCompaction},
+	{"OfflineStore quota", testOfflineStoreQuota},
+	{"GroupStore log replay", testGroupLogReplay},
+	{"GroupStore snapshot cut", testGroupSnapshotCut},
+	{"GroupStore empty groups", testGroupEmptySnapshot},
+	{"GroupStore log failure", testGroupLogFailure},
+	{"Server end to end (epoll)", testServerEpoll},
+	{"Server end to end (uring)", testServerUring},
+};
+
+
+int main() {
+	char directoryTemplate[] = "/tmp/whatsappTests.XXXXXX";
+	if (mkdtemp(directoryTemplate) == nullptr) {
+		print_error("mkdtemp", errno);
+		return FAILURE;
+	}
+	testDirectory = directoryTemplate;
+	int numOfFailures = 0;
+	for (const Test &test : TESTS) {
+		hasFailed = false;
+		test.run();
+		printf("%s %s\n", hasFailed ? "FAIL" : "ok  ", test.name);
+		numOfFailures += hasFailed;
+	}
+	removeDirectory(testDirectory);
+	printf("%d of %zu tests failed\n", numOfFailures, sizeof(TESTS) / sizeof(TESTS[0]));
+	return numOfFailures == 0 ? SUCCESS : FAILURE;
+}
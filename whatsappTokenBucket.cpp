@@ -0,0 +1,32 @@
+#include "whatsappTokenBucket.h"
+#include <algorithm>
+
+/**
+ * The number of nanoseconds in a second, which is also the burst of a bucket: it holds a
+ * second's worth of tokens.
+ */
+#define NS_PER_SECOND 1000000000ull
+
+
+TokenBucket::TokenBucket(uint64_t tokensPerSecond) : tokensPerSecond(tokensPerSecond),
+                                                     fullAtNs(0) {
+}
+
+uint64_t TokenBucket::costNs(uint64_t tokens) const {
+	// Split, so that a large number of tokens does not overflow.
+	return tokens / tokensPerSecond * NS_PER_SECOND +
+	       tokens % tokensPerSecond * NS_PER_SECOND / tokensPerSecond;
+}
+
+bool TokenBucket::canTake(uint64_t tokens, uint64_t nowNs) const {
+	if (tokensPerSecond == 0 || fullAtNs <= nowNs) {
+		return true;
+	}
+	return fullAtNs - nowNs + costNs(tokens) <= NS_PER_SECOND;
+}
+
+void TokenBucket::take(uint64_t tokens, uint64_t nowNs) {
+	if (tokensPerSecond != 0) {
+		fullAtNs = std::max(fullAtNs, nowNs) + costNs(tokens);
+	}
+}
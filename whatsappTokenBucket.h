@@ -0,0 +1,46 @@
+#ifndef _WHATSAPPTOKENBUCKET_H
+#define _WHATSAPPTOKENBUCKET_H
+
+#include <cstdint>
+
+/*
+ * Description: A token bucket that limits a rate - of messages, of bytes... - to a number of
+ *              tokens per second, with bursts of up to a second's worth of tokens.
+ *              Rather than a number of tokens that is refilled over time, the bucket keeps the
+ *              time at which it will be full again (as in GCRA): taking tokens pushes that time
+ *              forward by their cost, and they may be taken as long as it is no more than a
+ *              second ahead. So a check is a comparison and a division, with no timer and no
+ *              floating point.
+ *              A single take that costs more than a second's worth is allowed once the bucket
+ *              is full - the bucket then stays empty until it is paid for.
+*/
+class TokenBucket {
+public:
+	/*
+	 * Description: Creates a full bucket.
+	 * tokensPerSecond: the rate the bucket allows (0 for no limit).
+	*/
+	explicit TokenBucket(uint64_t tokensPerSecond = 0);
+
+	/*
+	 * Description: Returns true iff the given number of tokens can be taken at the given time.
+	 * nowNs: the time, by a monotonic clock (see monotonicNs), in nanoseconds.
+	*/
+	bool canTake(uint64_t tokens, uint64_t nowNs) const;
+
+	/*
+	 * Description: Takes the given number of tokens (which may be more than are available).
+	*/
+	void take(uint64_t tokens, uint64_t nowNs);
+
+private:
+	/*
+	 * Description: Returns the time it takes to earn the given number of tokens, in nanoseconds.
+	*/
+	uint64_t costNs(uint64_t tokens) const;
+
+	uint64_t tokensPerSecond;
+	uint64_t fullAtNs;          // When the bucket is full again (in the past, if it is full).
+};
+
+#endif
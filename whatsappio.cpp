@@ -1,34 +1,29 @@
 #include "whatsappio.h"
+#include "whatsappLog.h"
+#include <algorithm>
+#include <charconv>
 #include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <poll.h>
 #include <unistd.h>
 
-/**
- * The return value of readData in case of a failure.
- */
-#define READ_FAILURE "-1"
-
-/**
- * The return value of writeData in case of a failure.
- */
-#define WRITE_FAILURE (-1)
-
 /**
  * The base that is normally used to represent a number - used in 'strtol' function.
  */
 #define DECIMAL_BASE 10
 
 /**
- * The length of the string that holds the content of
- * the number of bytes to read from the message.
+ * How long writeBytes waits for a full non-blocking file-descriptor to drain, before it fails.
  */
-#define BYTES_TO_READ_LENGTH 4
+#define WRITE_TIMEOUT_MS 5000
 
 /*
  * Description: Prints to the screen a message when the user terminate the
  * server
 */
 void print_exit() {
-    printf("EXIT command is typed: server is shutting down\n");
+    logLine(LOG_NOTICE, "EXIT command is typed: server is shutting down\n");
 }
 
 /*
@@ -44,8 +39,8 @@ void print_connection() {
  * connection to the server, in the server
  * client: Name of the sender
 */
-void print_connection_server(const std::string& client) {
-    printf("%s connected.\n", client.c_str());
+void print_connection_server(std::string_view client) {
+    logLine(LOG_INFO, "%.*s connected.\n", (int) client.size(), client.data());
 }
 
 
@@ -69,7 +64,14 @@ void print_fail_connection() {
  * Description: Prints to the screen the usage message of the server
 */
 void print_server_usage() {
-    printf("Usage: whatsappServer portNum\n");
+    printf("Usage: whatsappServer portNum [--high-watermark=BYTES] "
+           "[--low-watermark=BYTES] [--max-queue=BYTES] [--message-rate=N] [--fanout-rate=BYTES] "
+           "[--workers=N] [--cork] "
+           "[--backlog=N] [--handshake-timeout=MS] [--frame-budget=N] "
+           "[--slow-consumer=pause|drop-oldest|spill|disconnect] [--slow-consumer-lag=MS] "
+           "[--offline-dir=DIR] [--offline-quota=BYTES] [--offline-capacity=BYTES] "
+           "[--groups-dir=DIR] [--stats-socket=PATH] [--io=epoll|uring] "
+           "[--log-level=debug|info|error] [--no-log-bodies] [--log-timestamps] [--log-drop]\n");
 }
 
 /*
@@ -87,21 +89,21 @@ void print_client_usage() {
  * group: Group name
 */
 void print_create_group(bool server, bool success,
-                        const std::string& client, const std::string& group) {
+                        std::string_view client, std::string_view group) {
     if(server) {
         if(success) {
-            printf("%s: Group \"%s\" was created successfully.\n", 
-                   client.c_str(), group.c_str());
+            logLine(LOG_INFO, "%.*s: Group \"%.*s\" was created successfully.\n",
+                    (int) client.size(), client.data(), (int) group.size(), group.data());
         } else {
-            printf("%s: ERROR: failed to create group \"%s\"\n", 
-                   client.c_str(), group.c_str());
+            logLine(LOG_INFO, "%.*s: ERROR: failed to create group \"%.*s\"\n",
+                    (int) client.size(), client.data(), (int) group.size(), group.data());
         }
     }
     else {
         if(success) {
-            printf("Group \"%s\" was created successfully.\n", group.c_str());
+            printf("Group \"%.*s\" was created successfully.\n", (int) group.size(), group.data());
         } else {
-            printf("ERROR: failed to create group \"%s\".\n", group.c_str());
+            printf("ERROR: failed to create group \"%.*s\".\n", (int) group.size(), group.data());
         }
     }
 }
@@ -115,15 +117,28 @@ void print_create_group(bool server, bool success,
  * name: Name of the client/group destination of the message
  * message: The message
 */
-void print_send(bool server, bool sender, bool success, const std::string& client,
-                const std::string& name, const std::string& message) {
-    if(server) {
+void print_send(bool server, bool sender, bool success, std::string_view client,
+                std::string_view name, std::string_view message) {
+    if(server && !isLoggingBodies()) {
+        if(success) {
+            logLine(LOG_INFO, "%.*s: a message of %zu bytes was sent successfully to %.*s.\n",
+                    (int) client.size(), client.data(), message.size(),
+                    (int) name.size(), name.data());
+        } else {
+            logLine(LOG_INFO, "%.*s: ERROR: failed to send a message of %zu bytes to %.*s.\n",
+                    (int) client.size(), client.data(), message.size(),
+                    (int) name.size(), name.data());
+        }
+    }
+    else if(server) {
         if(success) {
-            printf("%s: \"%s\" was sent successfully to %s.\n", 
-                   client.c_str(), message.c_str(), name.c_str());
+            logLine(LOG_INFO, "%.*s: \"%.*s\" was sent successfully to %.*s.\n",
+                    (int) client.size(), client.data(), (int) message.size(), message.data(),
+                    (int) name.size(), name.data());
         } else {
-            printf("%s: ERROR: failed to send \"%s\" to %s.\n", 
-                   client.c_str(), message.c_str(), name.c_str());
+            logLine(LOG_INFO, "%.*s: ERROR: failed to send \"%.*s\" to %.*s.\n",
+                    (int) client.size(), client.data(), (int) message.size(), message.data(),
+                    (int) name.size(), name.data());
         }
     }
     else if (sender) {
@@ -134,7 +149,23 @@ void print_send(bool server, bool sender, bool success, const std::string& clien
 	    }
     }
 	else {
-		printf("%s: %s\n", client.c_str(), message.c_str());
+		printf("%.*s: %.*s\n", (int) client.size(), client.data(),
+		       (int) message.size(), message.data());
+    }
+}
+
+/*
+ * Description: Prints to the screen the messages of a "send" command that was throttled
+ * server: true for server, false for client
+ * client: Name of the sender
+ * name: Name of the client/group destination of the message
+*/
+void print_send_throttled(bool server, std::string_view client, std::string_view name) {
+    if (server) {
+        logLine(LOG_INFO, "%.*s: ERROR: a message to %.*s was throttled.\n",
+                (int) client.size(), client.data(), (int) name.size(), name.data());
+    } else {
+        printf("ERROR: failed to send - sending too fast.\n");
     }
 }
 
@@ -143,24 +174,25 @@ void print_send(bool server, bool sender, bool success, const std::string& clien
  * client: Name of the sender
  * message: The message
 */
-void print_message(const std::string& client, const std::string& message) {
-    printf("%s: %s\n", client.c_str(), message.c_str());
+void print_message(std::string_view client, std::string_view message) {
+    printf("%.*s: %.*s\n", (int) client.size(), client.data(), (int) message.size(), message.data());
 }
 
 /*
  * Description: Prints to the screen the messages of "who" command in the server
  * client: Name of the sender
 */
-void print_who_server(const std::string& client) {
-    printf("%s: Requests the currently connected client names.\n", client.c_str());
+void print_who_server(std::string_view client) {
+    logLine(LOG_INFO, "%.*s: Requests the currently connected client names.\n",
+            (int) client.size(), client.data());
 }
 
 /*
  * Description: Prints to the screen the messages of "who" command in the client
  * connectedClients: a string containing the names of all clients seperated by comma.
 */
-void print_who_client(const std::string& connectedClients) {
-	printf("%s\n", connectedClients.c_str());
+void print_who_client(std::string_view connectedClients) {
+	printf("%.*s\n", (int) connectedClients.size(), connectedClients.data());
 }
 
 /*
@@ -168,14 +200,38 @@ void print_who_client(const std::string& connectedClients) {
  * server: true for server, false for client
  * client: Client name
 */
-void print_exit(bool server, const std::string& client) {
+void print_exit(bool server, std::string_view client) {
     if(server) {
-        printf("%s: Unregistered successfully.\n", client.c_str());
+        logLine(LOG_INFO, "%.*s: Unregistered successfully.\n", (int) client.size(), client.data());
     } else {
         printf("Unregistered successfully.\n");
     }
 }
 
+/*
+ * Description: Prints to the screen the report of the "STATS" command of the server
+ * report: the report, one or more lines
+*/
+void print_stats(std::string_view report) {
+    logText(LOG_NOTICE, report);
+}
+
+/*
+ * Description: Prints to the screen a message when the server cannot use the io_uring engine
+ * it was asked for, and runs on epoll instead
+*/
+void print_io_uring_fallback(int error_number) {
+    logLine(LOG_NOTICE, "io_uring is not available (%d): using epoll.\n", error_number);
+}
+
+/*
+ * Description: Prints to the screen a message when a stored group cannot be restored
+*/
+void print_group_not_restored(std::string_view group) {
+    logLine(LOG_ERROR, "ERROR: group %.*s could not be restored.\n", (int) group.size(),
+            group.data());
+}
+
 /*
  * Description: Prints to the screen the messages of invalid command
 */
@@ -187,51 +243,69 @@ void print_invalid_input() {
  * Description: Prints to the screen the messages of system-call error
 */
 void print_error(const std::string& function_name, int error_number) {
-    printf("ERROR: %s %d.\n", function_name.c_str(), error_number);
+    logLine(LOG_ERROR, "ERROR: %s %d.\n", function_name.c_str(), error_number);
 }
 
 /*
  * Description: Reads a message from the file associated with the given file-descriptor (fd).
  *              Makes sure that the data is being read entirely.
  * fd: the file descriptor of which we should read.
- * Returns the message that was read from file associated with the given file-descriptor (fd).
+ * message: output - the message that was read (its buffer is reused).
+ * Returns false on a failure.
 */
-std::string readData(int fd) {
+bool readData(int fd, std::string& message) {
+	char lengthHeader[BYTES_TO_READ_LENGTH];
 	int bytesAlreadyRead = 0;
 	int bytesReadThisPass = 0;
-	auto bufferP = (char*) calloc(WA_MAX_INPUT, sizeof(char));
-	char* buf = bufferP;
-	if (!((bool) bufferP)) {
-		return READ_FAILURE;
-	}
 
 	// First, we parse the number of bytes we need to read from the message.
-	// This number of bytes is encoded in the first 4 (BYTES_TO_READ_LENGTH) chars
-	// of the buffer we read from.
-	if( read(fd, buf, BYTES_TO_READ_LENGTH) <= 0) {
-		free(bufferP);
-		return READ_FAILURE;
+	// This number of bytes is encoded in the first 4 (BYTES_TO_READ_LENGTH) chars.
+	while (bytesAlreadyRead < BYTES_TO_READ_LENGTH) {
+		bytesReadThisPass = (int) read(fd, lengthHeader + bytesAlreadyRead,
+		                               (unsigned int) (BYTES_TO_READ_LENGTH - bytesAlreadyRead));
+		if (bytesReadThisPass <= 0) {
+			return false;
+		}
+		bytesAlreadyRead += bytesReadThisPass;
+	}
+	// Only digits, so the length is never negative, nor longer than a text frame may be.
+	int bytesToRead = 0;
+	for (char digit : lengthHeader) {
+		if (digit < '0' || digit > '9') {
+			return false;
+		}
+		bytesToRead = bytesToRead * DECIMAL_BASE + (digit - '0');
 	}
-	auto bytesToRead = (int) strtol(buf, nullptr, DECIMAL_BASE) +
-	                   BYTES_TO_READ_LENGTH;
-
-	bytesAlreadyRead += BYTES_TO_READ_LENGTH;
-	buf += BYTES_TO_READ_LENGTH;
 
-	// Now, we read the message itself, while making sure the message is being read entirely.
+	// Now, we read the message itself directly into the given string, while making sure
+	// the message is being read entirely.
+	message.resize((size_t) bytesToRead);
+	bytesAlreadyRead = 0;
 	while (bytesAlreadyRead < bytesToRead) {
-		bytesReadThisPass = (int) read(fd, buf, (unsigned int) (bytesToRead - bytesAlreadyRead));
+		bytesReadThisPass = (int) read(fd, &message[bytesAlreadyRead],
+		                               (unsigned int) (bytesToRead - bytesAlreadyRead));
 		if (bytesReadThisPass <= 0) {
-			free(bufferP);
-			return READ_FAILURE;
+			return false;
 		}
 		bytesAlreadyRead += bytesReadThisPass;
-		buf += bytesReadThisPass;
 	}
-	std::string message(bufferP + BYTES_TO_READ_LENGTH);
-    // message now points to the beginning of the message itself.
-	free(bufferP);
-	return message;
+	return true;
+}
+
+/*
+ * Description: Encodes a message as a frame: the length of the message, wrapped with zeros
+ *              to exactly 4 (BYTES_TO_READ_LENGTH) chars, followed by the message itself.
+ * message: the message to encode.
+ * Returns the encoded frame.
+*/
+std::string encodeFrame(const std::string& message) {
+	char lengthHeader[BYTES_TO_READ_LENGTH + 1];
+	snprintf(lengthHeader, sizeof(lengthHeader), "%04d", (int) message.length());
+	std::string frame;
+	frame.reserve(BYTES_TO_READ_LENGTH + message.length());
+	frame.append(lengthHeader, BYTES_TO_READ_LENGTH);
+	frame.append(message);
+	return frame;
 }
 
 /*
@@ -242,29 +316,21 @@ std::string readData(int fd) {
  * message: the message we need to write.
 */
 int writeData(int fd, std::string& message) {
-	int bytesAlreadyWritten = 0;
-	int bytesWrittenThisPass = 0;
-	auto bytesToWrite = (int) message.length();
-	std::string bytesToWriteString;
-
-	// First we wrap the length of the message with zeros. Thus, its length is exactly 4 chars.
-	if (bytesToWrite < 10) {
-		bytesToWriteString = "000" + std::to_string(bytesToWrite);
-	}
-	else if (bytesToWrite < 100) {
-		bytesToWriteString = "00" + std::to_string(bytesToWrite);
-	}
-	else if (bytesToWrite < 1000) {
-		bytesToWriteString = "0" + std::to_string(bytesToWrite);
-	} else {
-		bytesToWriteString = std::to_string(bytesToWrite);
-	}
-
 	// We encode the length of the message in the first 4 chars of the message.
-	std::string newMessage = bytesToWriteString + message;
-	auto messageBuffer = (char*) newMessage.c_str();
+	std::string newMessage = encodeFrame(message);
+	return writeBytes(fd, newMessage.data(), newMessage.length());
+}
 
-	bytesToWrite += BYTES_TO_READ_LENGTH;
+/*
+ * Description: Writes the given bytes, as they are, into the file associated with the given
+ *              file-descriptor (fd). Makes sure that the data is written entirely.
+ * Returns the number of bytes written, or WRITE_FAILURE.
+*/
+int writeBytes(int fd, const char* data, size_t length) {
+	int bytesAlreadyWritten = 0;
+	int bytesWrittenThisPass = 0;
+	auto messageBuffer = data;
+	auto bytesToWrite = (int) length;
 
 	while (bytesAlreadyWritten < bytesToWrite) {
 		bytesWrittenThisPass = (int) write(fd, messageBuffer,
@@ -273,6 +339,22 @@ int writeData(int fd, std::string& message) {
 			bytesAlreadyWritten += bytesWrittenThisPass;
 			messageBuffer += bytesWrittenThisPass;
 		}
+		else if (bytesWrittenThisPass < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// A non-blocking socket whose send buffer is full - wait until it drains, but not
+			// for a peer that stopped reading.
+			struct pollfd writable = {fd, POLLOUT, 0};
+			int numOfReady = poll(&writable, 1, WRITE_TIMEOUT_MS);
+			if (numOfReady == 0) {
+				errno = ETIMEDOUT;
+				return WRITE_FAILURE;
+			}
+			if (numOfReady < 0 && errno != EINTR) {
+				return WRITE_FAILURE;
+			}
+		}
+		else if (bytesWrittenThisPass < 0 && errno == EINTR) {
+			continue;
+		}
 		else {
 			return WRITE_FAILURE;
 		}
@@ -281,61 +363,107 @@ int writeData(int fd, std::string& message) {
 }
 
 /*
- * Description: Parse user input from the argument "command". The other arguments
- * are used as output of this function.
+ * Description: Returns the next token of "text" that is delimited by "delimiter", and advances
+ * "text" past the token and the delimiter that follows it. Like strtok, empty tokens (i.e.
+ * consecutive delimiters) are skipped. Returns an empty view if there are no more tokens.
+*/
+static std::string_view next_token(std::string_view& text, char delimiter) {
+    size_t start = text.find_first_not_of(delimiter);
+    if (start == std::string_view::npos) {
+        text = std::string_view();
+        return text;
+    }
+    size_t end = text.find(delimiter, start);
+    if (end == std::string_view::npos) {
+        end = text.size();
+    }
+    std::string_view token = text.substr(start, end - start);
+    text.remove_prefix(std::min(end + 1, text.size()));
+    return token;
+}
+
+/*
+ * Description: Parses a token that is a non-negative decimal number.
+ * Returns false iff the token is not a number.
+*/
+static bool parse_count(std::string_view token, size_t& count) {
+    auto result = std::from_chars(token.data(), token.data() + token.size(), count);
+    return result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+/*
+ * Description: Parse user input from the argument "command" into "parsed", without copying
+ * or modifying it. A "create_group" command with more than WA_MAX_GROUP clients is invalid.
  * command: The user input
- * commandT: The command type
- * name: Name of the client/group
- * message: The message
- * clients: a vector containing the names of all clients
+ * parsed: The parsed command (output)
 */
-void parse_command(const std::string& command, command_type& commandT, 
-                   std::string& name, std::string& message, 
-                   std::vector<std::string>& clients) {
-    char c[WA_MAX_INPUT];
-    const char *s; 
-    char *saveptr;
-    name.clear();
-    message.clear();
-    clients.clear();
-    
-    strcpy(c, command.c_str());
-    s = strtok_r(c, " ", &saveptr);
-    
-    if(!strcmp(s, "create_group")) {
-        commandT = CREATE_GROUP;
-        s = strtok_r(NULL, " ", &saveptr);
-
-	    if(!s) {
-            commandT = INVALID;
+void parse_command(std::string_view command, CommandView& parsed) {
+    std::string_view rest = command;
+    parsed.name = std::string_view();
+    parsed.message = std::string_view();
+    parsed.numOfClients = 0;
+    parsed.limit = 0;
+    parsed.offset = 0;
+
+    std::string_view s = next_token(rest, ' ');
+    if(s == "create_group") {
+        parsed.type = CREATE_GROUP;
+        parsed.name = next_token(rest, ' ');
+
+        if(parsed.name.empty()) {
+            parsed.type = INVALID;
             return;
-        } else {
-            name = s;
-            while((s = strtok_r(NULL, ",", &saveptr)) != NULL) {
-                clients.emplace_back(s);
+        }
+        while(!(s = next_token(rest, ',')).empty()) {
+            if(parsed.numOfClients == WA_MAX_GROUP) {
+                parsed.type = INVALID;
+                return;
             }
+            parsed.clients[parsed.numOfClients++] = s;
         }
-    } else if(!strcmp(s, "send")) {
-        commandT = SEND;
-        s = strtok_r(NULL, " ", &saveptr);
+    } else if(s == "send") {
+        parsed.type = SEND;
+        parsed.name = next_token(rest, ' ');
 
-	    if(!s) {
-            commandT = INVALID;
+        // "rest" now starts right after the space that follows the name.
+        if(parsed.name.empty() || rest.find_first_not_of(' ') == std::string_view::npos) {
+            parsed.type = INVALID;
             return;
-        } else {
-            name = s;
-            s = strtok_r(NULL, " ", &saveptr);
-		    if(!s) {
-			    commandT = INVALID;
-			    return;
-		    }
-		    message = command.substr(name.size() + 6); // 6 = 2 spaces + "send"
         }
-    } else if(!strcmp(s, "who")) {
-        commandT = WHO;
-    } else if(!strcmp(s, "exit")) {
-        commandT = EXIT;
+        parsed.message = rest;
+    } else if(s == "who") {
+        // Whatever follows "who" is ignored, as it always was (see parse_who_page).
+        parsed.type = WHO;
+    } else if(s == "exit") {
+        parsed.type = EXIT;
     } else {
-        commandT = INVALID;
+        parsed.type = INVALID;
+    }
+}
+
+bool parse_who_page(std::string_view command, CommandView& parsed) {
+    std::string_view rest = command;
+    next_token(rest, ' ');
+    parsed.name = next_token(rest, ' ');
+    if(parsed.name == WHO_ANY_PREFIX) {
+        parsed.name = std::string_view();
+    }
+    std::string_view s = next_token(rest, ' ');
+    if(!s.empty() && !parse_count(s, parsed.limit)) {
+        return false;
+    }
+    s = next_token(rest, ' ');
+    return (s.empty() || parse_count(s, parsed.offset)) && next_token(rest, ' ').empty();
+}
+
+bool is_valid_name(std::string_view name) {
+    if(name.empty() || name.size() > WA_MAX_NAME) {
+        return false;
+    }
+    for(char ch : name) {
+        if(!isalnum((unsigned char) ch)) {
+            return false;
+        }
     }
+    return true;
 }
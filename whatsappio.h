@@ -3,6 +3,7 @@
 
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define WA_MAX_NAME 30
@@ -10,7 +11,23 @@
 #define WA_MAX_GROUP 50
 #define WA_MAX_INPUT ((WA_MAX_NAME+1)*(WA_MAX_GROUP+2))
 
-enum command_type {CREATE_GROUP, SEND, WHO, EXIT, INVALID};
+/**
+ * The length of the string that holds the content of
+ * the number of bytes to read from the message.
+ */
+#define BYTES_TO_READ_LENGTH 4
+
+/**
+ * The prefix of a "who" command that matches all the clients, for listing a page of them.
+ */
+#define WHO_ANY_PREFIX "*"
+
+/**
+ * The return value of writeData in case of a failure.
+ */
+#define WRITE_FAILURE (-1)
+
+enum command_type {CREATE_GROUP, SEND, WHO, EXIT, SEND_BATCH, INVALID};
 
 /*
  * Description: Prints to the screen a message when the user terminate the
@@ -29,7 +46,7 @@ void print_connection();
  * connection to the server, in the server
  * client: Name of the sender
 */
-void print_connection_server(const std::string& client);
+void print_connection_server(std::string_view client);
 
 /*
  * Description: Prints to the screen a message when the client tries to
@@ -60,7 +77,7 @@ void print_client_usage();
  * client: Client name
  * group: Group name
 */
-void print_create_group(bool server, bool success, const std::string& client, const std::string& group);
+void print_create_group(bool server, bool success, std::string_view client, std::string_view group);
 
 /*
  * Description: Prints to the screen the messages of "send" command
@@ -72,33 +89,62 @@ void print_create_group(bool server, bool success, const std::string& client, co
  *          If sender is false: name of the client/group source of the message.
  * message: The message
 */
-void print_send(bool server, bool sender, bool success, const std::string& client,
-                const std::string& name, const std::string& message);
+void print_send(bool server, bool sender, bool success, std::string_view client,
+                std::string_view name, std::string_view message);
+
+/*
+ * Description: Prints to the screen the messages of a "send" command that was throttled, since
+ * its sender has sent faster than the server allows
+ * server: true for server, false for client
+ * client: Name of the sender
+ * name: Name of the client/group destination of the message
+*/
+void print_send_throttled(bool server, std::string_view client, std::string_view name);
 /*
  * Description: Prints to the screen the messages recieved by the client
  * client: Name of the sender
  * message: The message
 */
-void print_message(const std::string& client, const std::string& message);
+void print_message(std::string_view client, std::string_view message);
 
 /*
  * Description: Prints to the screen the messages of "who" command in the server
  * client: Name of the sender
 */
-void print_who_server(const std::string& client);
+void print_who_server(std::string_view client);
 
 /*
  * Description: Prints to the screen the messages of "who" command in the client
  * connectedClients: a string containing the names of all clients seperated by comma.
 */
-void print_who_client(const std::string& connectedClients);
+void print_who_client(std::string_view connectedClients);
 
 /*
  * Description: Prints to the screen the messages of "exit" command
  * server: true for server, false for client
  * client: Client name
 */
-void print_exit(bool server, const std::string& client);
+void print_exit(bool server, std::string_view client);
+
+/*
+ * Description: Prints to the screen the report of the "STATS" command of the server
+ * report: the report, one or more lines
+*/
+void print_stats(std::string_view report);
+
+/*
+ * Description: Prints to the screen a message when the server cannot use the io_uring engine
+ * it was asked for, and runs on epoll instead
+ * error_number: the error of the io_uring setup
+*/
+void print_io_uring_fallback(int error_number);
+
+/*
+ * Description: Prints to the screen a message when a group of the group store cannot be
+ * restored (its name, or one of its members' names, is already in use), so it is skipped
+ * group: the name of the group
+*/
+void print_group_not_restored(std::string_view group);
 
 /*
  * Description: Prints to the screen the messages of invalid command
@@ -115,9 +161,20 @@ void print_error(const std::string& function_name, int error_number);
  * Description: Reads a message from the file associated with the given file-descriptor (fd).
  *              Makes sure that the data is being read entirely.
  * fd: the file descriptor of which we should read.
- * Returns the message that was read from file associated with the given file-descriptor (fd).
+ * message: output - the message that was read. Its buffer is reused, so reading into the same
+ *          string again allocates nothing unless the message is longer than any before it.
+ * Returns false on a failure (e.g. the peer closed the connection, or the length header is
+ * not BYTES_TO_READ_LENGTH decimal digits).
+*/
+bool readData(int fd, std::string& message);
+
+/*
+ * Description: Encodes a message as a frame: the length of the message, wrapped with zeros
+ *              to exactly 4 (BYTES_TO_READ_LENGTH) chars, followed by the message itself.
+ * message: the message to encode.
+ * Returns the encoded frame.
 */
-std::string readData(int fd);
+std::string encodeFrame(const std::string& message);
 
 /*
  * Description: Writes a message whose length is the given number of bytes into
@@ -129,14 +186,57 @@ std::string readData(int fd);
 int writeData(int fd, std::string& message);
 
 /*
- * Description: Parse user input from the argument "command". The other arguments
- * are used as output of this function.
- * command: The user input
- * commandT: The command type
+ * Description: Writes the given bytes, as they are, into the file associated with the given
+ *              file-descriptor (fd). Makes sure that the data is written entirely - waiting
+ *              for a non-blocking file-descriptor to drain, for a few seconds at most.
+ * Returns the number of bytes written, or WRITE_FAILURE (with errno ETIMEDOUT if the
+ * file-descriptor did not drain in time).
+*/
+int writeBytes(int fd, const char* data, size_t length);
+
+/*
+ * Description: A parsed command. All the fields are views into the parsed command, and are
+ * valid as long as it is.
+ * type: The command type
  * name: Name of the client/group
  * message: The message
- * clients: a vector containing the names of all clients
+ * clients: The names of the clients (of a "create_group" command)
+ * numOfClients: The number of names in clients
+*/
+struct CommandView {
+	command_type type;
+	std::string_view name;      // The prefix of the names to list, in a "who" (v2 only).
+	std::string_view message;
+	std::string_view clients[WA_MAX_GROUP];
+	size_t numOfClients;
+	size_t limit;               // "who": the number of names to list (0 lists all of them).
+	size_t offset;              // "who": the number of matching names to skip.
+};
+
+/*
+ * Description: Parse user input from the argument "command" into "parsed", without copying
+ * or modifying it. A "create_group" command with more than WA_MAX_GROUP clients is invalid.
+ * command: The user input
+ * parsed: The parsed command (output)
+*/
+void parse_command(std::string_view command, CommandView& parsed);
+
+/*
+ * Description: Parses the page of a "who" command that a v2 client's user typed - a prefix of
+ * the names to list (WHO_ANY_PREFIX for all), the number of names to list, and the number of
+ * names to skip:
+ *     who [<prefix> [<limit> [<offset>]]]
+ * Only OP_WHO carries a page: a "who" of the text protocol lists all the clients.
+ * command: The user input, which parse_command parsed as WHO
+ * parsed: The parsed command, whose name, limit and offset are set (output)
+ * Returns false iff the page is invalid.
+*/
+bool parse_who_page(std::string_view command, CommandView& parsed);
+
+/*
+ * Description: Returns true iff the given name may be the name of a client: 1 to WA_MAX_NAME
+ * letters and digits, so it is a single token of any command that names it.
 */
-void parse_command(const std::string& command, command_type& commandT, std::string& name, std::string& messsage, std::vector<std::string>& clients);
+bool is_valid_name(std::string_view name);
 
 #endif